@@ -0,0 +1,233 @@
+/*
+   ARA DQ  online data quality counters and histograms, see araDq.h
+*/
+
+#include "araDq.h"
+#include "utilLib/util.h"
+#include <stdio.h>
+#include <string.h>
+
+#define DQ_EVENT_ID_MASK 0xffff ///< The V2 event header has 16 bit eventIds and PPS counts
+#define DQ_PPS_MASK 0xffff
+#define DQ_MAX_PPS_SLIP 1 ///< Seconds the PPS count and unix time can disagree by, the read time lags the trigger
+
+
+static void addChannelBlock(AraDq_t *dq, int channel, const int16_t *samples, int fillHist)
+{
+  //The samples are 12 bits, so signed 16 bit min and max (which plain
+  //SSE2 has and the unsigned ones need SSE4.1 for) do
+  AraDqHk_t *cur=&dq->current;
+  int16_t blockMax=INT16_MIN,blockMin=INT16_MAX;
+  int range,bin,sample,numRail=0,numInBin;
+  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+    blockMax=samples[sample]>blockMax ? samples[sample] : blockMax;
+    blockMin=samples[sample]<blockMin ? samples[sample] : blockMin;
+  }
+  //Samples on the rail are only counted in blocks that get there
+  if(blockMin<=0 || blockMax>=ARA_DQ_ADC_MAX) {
+    for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+      numRail+=(samples[sample]<=0) | (samples[sample]>=ARA_DQ_ADC_MAX);
+    cur->numRailSamples[channel]+=numRail;
+  }
+  range=blockMax-blockMin;
+  //Bin n holds ranges of n significant bits
+  bin=range ? 32-__builtin_clz(range) : 0;
+  if(bin>=ARA_DQ_RANGE_BINS) bin=ARA_DQ_RANGE_BINS-1;
+  cur->rangeHist[channel][bin]++;
+  cur->numBlocks[channel]++;
+  if(range==0) cur->numStuckBlocks[channel]++;
+  dq->sumRange[channel]+=range;
+  if(!fillHist) return;
+  if(blockMin<0 || blockMax>=(ARA_DQ_ADC_BINS<<ARA_DQ_ADC_BIN_BITS)) {
+    for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+      bin=(samples[sample]&0xffff)>>ARA_DQ_ADC_BIN_BITS;
+      cur->adcHist[channel][bin<ARA_DQ_ADC_BINS ? bin : ARA_DQ_ADC_BINS-1]++;
+    }
+    return;
+  }
+  //A block only spans a bin or two, and counting a bin at a time
+  //vectorises where incrementing the bins sample by sample doesn't
+  for(bin=blockMin>>ARA_DQ_ADC_BIN_BITS;bin<=blockMax>>ARA_DQ_ADC_BIN_BITS;bin++) {
+    numInBin=0;
+    for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+      numInBin+=(samples[sample]>>ARA_DQ_ADC_BIN_BITS)==bin;
+    cur->adcHist[channel][bin]+=numInBin;
+  }
+}
+
+
+static void checkHeader(AraDq_t *dq, const AraStationEventHeader_t *header)
+{
+  AraDqHk_t *cur=&dq->current;
+  uint32_t timeStamp=grayToBinary(header->timeStamp);
+  uint32_t gap,ppsStep;
+  int64_t unixStep;
+  if(dq->haveLast) {
+    gap=(header->eventId-dq->lastEventId-1)&DQ_EVENT_ID_MASK;
+    if(gap) {
+      cur->numEventIdGaps++;
+      //A big step back is more likely a reset than most of the ids going missing
+      if(gap<=DQ_EVENT_ID_MASK/2) cur->numEventsMissed+=gap;
+    }
+    ppsStep=(header->ppsNumber-dq->lastPps)&DQ_PPS_MASK;
+    unixStep=(int64_t)header->unixTime-(int64_t)dq->lastUnixTime;
+    if(ppsStep>unixStep+DQ_MAX_PPS_SLIP || (int64_t)ppsStep+DQ_MAX_PPS_SLIP<unixStep)
+      cur->numPpsJumps++;
+    else if(ppsStep==0 && timeStamp<dq->lastTimeStamp)
+      cur->numTimeStampBackwards++;
+  }
+  dq->haveLast=1;
+  dq->lastEventId=header->eventId;
+  dq->lastPps=header->ppsNumber;
+  dq->lastTimeStamp=timeStamp;
+  dq->lastUnixTime=header->unixTime;
+}
+
+
+void araDqInit(AraDq_t *dq, const AraDqConfig_t *config, uint32_t startUnixTime)
+{
+  memset(dq,0,sizeof(AraDq_t));
+  dq->config=*config;
+  dq->current.startUnixTime=startUnixTime;
+}
+
+
+int araDqAddEvent(AraDq_t *dq, const uint8_t *event, int numBytes)
+{
+  const AraStationEventHeader_t *header=(const AraStationEventHeader_t*)event;
+  AraDqHk_t *cur=&dq->current;
+  AraStationEventBlockHeader_t blkHeader;
+  int readout[DDA_PER_ATRI]={0};
+  int lastBlock[DDA_PER_ATRI]={0};
+  int eventByte=sizeof(AraStationEventHeader_t);
+  int blk,dda,chan,block,fillHist,numReadouts=0,retVal=0;
+
+  if(numBytes<(int)sizeof(AraStationEventHeader_t)) return -1;
+  cur->numEvents++;
+  checkHeader(dq,header);
+  fillHist=dq->config.sampleHistPrescale>0 && (dq->eventCount++)%dq->config.sampleHistPrescale==0;
+  if(fillHist) cur->numHistEvents++;
+
+  for(blk=0;blk<header->numReadoutBlocks && retVal==0;blk++) {
+    if(eventByte+(int)sizeof(AraStationEventBlockHeader_t)>numBytes) {
+      retVal=-1;
+      break;
+    }
+    memcpy(&blkHeader,&event[eventByte],sizeof(blkHeader));
+    eventByte+=sizeof(AraStationEventBlockHeader_t);
+    dda=(blkHeader.channelMask>>8)&0x3;
+    block=blkHeader.irsBlockNumber&(BLOCKS_PER_DDA-1);
+    if(readout[dda]>0 && block!=((lastBlock[dda]+1)&(BLOCKS_PER_DDA-1)))
+      cur->numBlockSequenceErrors[dda]++;
+    if(cur->blockHits[dda][block]<0xffff) cur->blockHits[dda][block]++;
+    lastBlock[dda]=block;
+    readout[dda]++;
+    for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+      if(!(blkHeader.channelMask&(1<<chan))) continue;
+      if(eventByte+(int)sizeof(AraStationEventBlockChannel_t)>numBytes) {
+	retVal=-1;
+	break;
+      }
+      //The samples are uint16_t on a 2 byte boundary, so they can be read in place
+      addChannelBlock(dq,dda*RFCHAN_PER_DDA+chan,(const int16_t*)&event[eventByte],fillHist);
+      eventByte+=sizeof(AraStationEventBlockChannel_t);
+    }
+    eventByte+=ARA_BLOCK_NUM_SUMMARIES(blkHeader.channelMask)*sizeof(AraStationEventBlockChannelSummary_t);
+  }
+
+  //Every DDA that was read out should have the same number of blocks
+  for(dda=0;dda<DDA_PER_ATRI;dda++) {
+    if(readout[dda]==0) continue;
+    if(numReadouts==0) numReadouts=readout[dda];
+    else if(readout[dda]!=numReadouts) {
+      cur->numDdaMismatches++;
+      break;
+    }
+  }
+  return retVal;
+}
+
+
+void araDqAddError(AraDq_t *dq, int errorClass)
+{
+  if(errorClass<0 || errorClass>=ARA_DQ_NUM_ERROR_CLASSES) return;
+  dq->current.numErrors[errorClass]++;
+}
+
+
+uint32_t araDqPublish(AraDq_t *dq, AraDqHk_t *record, uint64_t unixTime, uint32_t unixTimeUs)
+{
+  AraDqHk_t *cur=&dq->current;
+  const AraDqConfig_t *config=&dq->config;
+  uint32_t numErrors=0,numSequence=cur->numDdaMismatches;
+  int channel,errorClass,dda;
+
+  for(channel=0;channel<ARA_DQ_NUM_CHANNELS;channel++) {
+    if(cur->numBlocks[channel]==0) continue;
+    if(config->stuckFractionAlarm>0 &&
+       cur->numStuckBlocks[channel]>config->stuckFractionAlarm*cur->numBlocks[channel])
+      cur->stuckChannelMask|=(1u<<channel);
+    if(config->deadRangeAlarm>0 &&
+       dq->sumRange[channel]<config->deadRangeAlarm*cur->numBlocks[channel])
+      cur->deadChannelMask|=(1u<<channel);
+    if(config->railFractionAlarm>0 &&
+       cur->numRailSamples[channel]>config->railFractionAlarm*cur->numBlocks[channel]*SAMPLES_PER_BLOCK)
+      cur->railChannelMask|=(1u<<channel);
+  }
+  for(errorClass=0;errorClass<ARA_DQ_NUM_ERROR_CLASSES;errorClass++)
+    numErrors+=cur->numErrors[errorClass];
+  for(dda=0;dda<DDA_PER_ATRI;dda++)
+    numSequence+=cur->numBlockSequenceErrors[dda];
+
+  if(config->errorAlarm && numErrors>=config->errorAlarm)
+    cur->alarmMask|=ARA_DQ_ALARM_ERRORS;
+  if(config->eventGapAlarm && cur->numEventsMissed>=config->eventGapAlarm)
+    cur->alarmMask|=ARA_DQ_ALARM_EVENT_GAP;
+  if(config->timeJumpAlarm && cur->numPpsJumps+cur->numTimeStampBackwards>=config->timeJumpAlarm)
+    cur->alarmMask|=ARA_DQ_ALARM_TIME_JUMP;
+  if(config->blockSequenceAlarm && numSequence>=config->blockSequenceAlarm)
+    cur->alarmMask|=ARA_DQ_ALARM_BLOCK_SEQUENCE;
+  if(cur->stuckChannelMask) cur->alarmMask|=ARA_DQ_ALARM_STUCK;
+  if(cur->deadChannelMask) cur->alarmMask|=ARA_DQ_ALARM_DEAD;
+  if(cur->railChannelMask) cur->alarmMask|=ARA_DQ_ALARM_RAIL;
+
+  cur->unixTime=unixTime;
+  cur->unixTimeUs=unixTimeUs;
+  memcpy(record,cur,sizeof(AraDqHk_t));
+
+  //The sequence checks carry on across periods
+  memset(cur,0,sizeof(AraDqHk_t));
+  memset(dq->sumRange,0,sizeof(dq->sumRange));
+  cur->startUnixTime=unixTime;
+  return record->alarmMask;
+}
+
+
+const char *araDqAlarmAsString(uint32_t alarmMask)
+{
+  static char alarmString[128];
+  static const char *names[]={"errors","eventGap","timeJump","blockSequence","stuck","dead","rail"};
+  unsigned int bit;
+  alarmString[0]='\0';
+  for(bit=0;bit<sizeof(names)/sizeof(names[0]);bit++) {
+    if(!(alarmMask&(1u<<bit))) continue;
+    if(alarmString[0]) strcat(alarmString,",");
+    strcat(alarmString,names[bit]);
+  }
+  if(!alarmString[0]) strcpy(alarmString,"none");
+  return alarmString;
+}
+
+
+const char *araDqErrorAsString(int errorClass)
+{
+  switch(errorClass) {
+  case ARA_DQ_ERR_READ: return "read";
+  case ARA_DQ_ERR_OVERRUN: return "overrun";
+  case ARA_DQ_ERR_FIRST_FRAME: return "firstFrame";
+  case ARA_DQ_ERR_FRAME_SEQUENCE: return "frameSequence";
+  case ARA_DQ_ERR_WRONG_DDA: return "wrongDda";
+  case ARA_DQ_ERR_OUTPUT_OVERFLOW: return "outputOverflow";
+  default: return "unknown";
+  }
+}
@@ -0,0 +1,81 @@
+/*
+   ARA DQ  online data quality counters and histograms.
+
+   Fed each event as it is unpacked, and each read or unpack failure, it
+   keeps an AraDqHk_t (see araAtriStructures.h) of what was seen: per
+   channel block ranges, stuck blocks, rail samples and (prescaled) sample
+   occupancy, which IRS blocks were read out and whether they followed on,
+   gaps in the eventId, jumps in the PPS count and timeStamp, and the
+   failures by class.
+
+   araDqPublish hands back the record for the period with the thresholds
+   applied and starts the next one. Everything is meant to be used from
+   the one thread that unpacks the events, so there are no locks; the
+   counters are plain increments and the per block work is a couple of
+   loops over the 64 samples that vectorise.
+*/
+
+#ifndef ARA_DQ_H
+#define ARA_DQ_H
+#include <stdint.h>
+#include "araAtriStructures.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  int sampleHistPrescale; ///< adcHist is filled for one in this many events, 0 never
+  float stuckFractionAlarm; ///< A channel is stuck above this fraction of stuck blocks
+  float deadRangeAlarm; ///< A channel is dead when its mean block range (ADC counts) is below this
+  float railFractionAlarm; ///< A channel is on the rail above this fraction of rail samples
+  uint32_t errorAlarm; ///< Read and unpack errors in a period to alarm at, 0 never
+  uint32_t eventGapAlarm; ///< Missed events in a period to alarm at, 0 never
+  uint32_t timeJumpAlarm; ///< PPS jumps plus timeStamps going backwards to alarm at, 0 never
+  uint32_t blockSequenceAlarm; ///< Out of sequence blocks plus DDA mismatches to alarm at, 0 never
+} AraDqConfig_t;
+
+typedef struct {
+  AraDqConfig_t config;
+  AraDqHk_t current; ///< The period so far
+  uint64_t sumRange[ARA_DQ_NUM_CHANNELS]; ///< Of the block ranges, for the dead channels
+  unsigned int eventCount; ///< For the sample histogram prescale
+  int haveLast;
+  uint32_t lastEventId;
+  uint32_t lastPps;
+  uint32_t lastTimeStamp; ///< Binary, the event header has it in gray code
+  uint64_t lastUnixTime;
+} AraDq_t;
+
+
+/** \brief Copies the config and starts the first period at startUnixTime. */
+void araDqInit(AraDq_t *dq, const AraDqConfig_t *config, uint32_t startUnixTime);
+
+/** \brief Adds an unpacked event, after ARAAcqd has set its unixTime.
+ *
+ * Returns 0, or -1 if the blocks ran off the end of the event (what came
+ * before is still counted).
+ */
+int araDqAddEvent(AraDq_t *dq, const uint8_t *event, int numBytes);
+
+/** \brief Counts a read or unpack failure of class ARA_DQ_ERR_*. */
+void araDqAddError(AraDq_t *dq, int errorClass);
+
+/** \brief Applies the thresholds, copies the period into record and starts the next one.
+ *
+ * The generic header of the record is left for the caller. Returns the
+ * alarm mask.
+ */
+uint32_t araDqPublish(AraDq_t *dq, AraDqHk_t *record, uint64_t unixTime, uint32_t unixTimeUs);
+
+/** \brief A human readable list of ARA_DQ_ALARM_* bits, in a static buffer. */
+const char *araDqAlarmAsString(uint32_t alarmMask);
+
+/** \brief Name of an ARA_DQ_ERR_* class. */
+const char *araDqErrorAsString(int errorClass);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_DQ_H
@@ -0,0 +1,153 @@
+/*
+   ARA Event Summary  the per event summary records, see araEventSummary.h
+*/
+
+#include "araEventSummary.h"
+#include <string.h>
+#include <math.h>
+
+#define SUMMARY_NUM_CHANNELS (DDA_PER_ATRI*RFCHAN_PER_DDA)
+
+typedef struct {
+  int64_t sum;
+  int64_t sumSq;
+  int32_t maxValue; ///< Largest sample, less the block mean without pedestals
+  int32_t minValue;
+  int maxSample;
+  int minSample;
+  int numSamples;
+} ChannelSums_t;
+
+
+static void addChannelBlock(ChannelSums_t *sums, const int32_t *values, int havePeds, int readout)
+{
+  //Separate loops over the block so each of them vectorises
+  int64_t blockSumSq=0;
+  int32_t blockSum=0,blockMax=INT32_MIN,blockMin=INT32_MAX,offset=0;
+  int sample;
+  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+    blockSum+=values[sample];
+    blockSumSq+=(int64_t)values[sample]*values[sample];
+  }
+  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+    blockMax=values[sample]>blockMax ? values[sample] : blockMax;
+    blockMin=values[sample]<blockMin ? values[sample] : blockMin;
+  }
+  if(havePeds) {
+    sums->sum+=blockSum;
+    sums->sumSq+=blockSumSq;
+  }
+  else {
+    //Only what is left once the block mean is gone
+    offset=(blockSum+SAMPLES_PER_BLOCK/2)/SAMPLES_PER_BLOCK;
+    sums->sumSq+=blockSumSq-((int64_t)blockSum*blockSum)/SAMPLES_PER_BLOCK;
+  }
+  //Where the extremes are is only looked for when they beat the channel's
+  if(blockMax-offset>sums->maxValue) {
+    for(sample=0;values[sample]!=blockMax;sample++);
+    sums->maxValue=blockMax-offset;
+    sums->maxSample=readout*SAMPLES_PER_BLOCK+sample;
+  }
+  if(blockMin-offset<sums->minValue) {
+    for(sample=0;values[sample]!=blockMin;sample++);
+    sums->minValue=blockMin-offset;
+    sums->minSample=readout*SAMPLES_PER_BLOCK+sample;
+  }
+  sums->numSamples+=SAMPLES_PER_BLOCK;
+}
+
+
+static void finishChannel(AraEventSummary_t *summary, int channel, const ChannelSums_t *sums)
+{
+  double mean,variance,maxExcursion,minExcursion;
+  if(sums->numSamples==0) {
+    summary->peakSample[channel]=ARA_EVENT_SUMMARY_NO_SAMPLE;
+    return;
+  }
+  mean=((double)sums->sum)/sums->numSamples;
+  variance=((double)sums->sumSq)/sums->numSamples-mean*mean;
+  summary->rms[channel]=variance>0 ? (uint16_t)fmin(sqrt(variance)*ARA_EVENT_SUMMARY_RMS_SCALE+0.5,0xffff) : 0;
+  maxExcursion=sums->maxValue-mean;
+  minExcursion=sums->minValue-mean;
+  if(maxExcursion>=-minExcursion) {
+    summary->peak[channel]=(int16_t)fmin(lround(maxExcursion),INT16_MAX);
+    summary->peakSample[channel]=sums->maxSample;
+  }
+  else {
+    summary->peak[channel]=(int16_t)fmax(lround(minExcursion),INT16_MIN);
+    summary->peakSample[channel]=sums->minSample;
+  }
+}
+
+
+int araEventSummaryFill(AraEventSummary_t *summary, const uint8_t *event, int numBytes, const AraPedestalSet_t *pedestals)
+{
+  const AraStationEventHeader_t *header=(const AraStationEventHeader_t*)event;
+  AraStationEventBlockHeader_t blkHeader;
+  ChannelSums_t sums[SUMMARY_NUM_CHANNELS];
+  uint16_t samples[SAMPLES_PER_BLOCK];
+  int32_t values[SAMPLES_PER_BLOCK];
+  int readout[DDA_PER_ATRI]={0};
+  int eventByte=sizeof(AraStationEventHeader_t);
+  int blk,dda,chan,block,sample,channel,trig,retVal=0;
+  const uint16_t *pedMean;
+
+  memset(summary,0,sizeof(AraEventSummary_t));
+  if(numBytes<(int)sizeof(AraStationEventHeader_t)) return -1;
+  summary->unixTime=header->unixTime;
+  summary->unixTimeUs=header->unixTimeUs;
+  summary->eventNumber=header->eventNumber;
+  summary->timeStamp=header->timeStamp;
+  summary->ppsNumber=header->ppsNumber;
+  summary->eventId=header->eventId;
+  summary->numReadoutBlocks=header->numReadoutBlocks;
+  for(trig=0;trig<MAX_TRIG_BLOCKS;trig++) {
+    if(header->triggerInfo[trig]) summary->triggerMask|=(1<<trig);
+    summary->triggerBlock[trig]=header->triggerBlock[trig];
+  }
+  if(pedestals) summary->flags|=ARA_EVENT_SUMMARY_PED_SUBTRACTED;
+
+  memset(sums,0,sizeof(sums));
+  for(channel=0;channel<SUMMARY_NUM_CHANNELS;channel++) {
+    sums[channel].maxValue=INT32_MIN;
+    sums[channel].minValue=INT32_MAX;
+  }
+  for(blk=0;blk<header->numReadoutBlocks && retVal==0;blk++) {
+    if(eventByte+(int)sizeof(AraStationEventBlockHeader_t)>numBytes) {
+      retVal=-1;
+      break;
+    }
+    memcpy(&blkHeader,&event[eventByte],sizeof(blkHeader));
+    eventByte+=sizeof(AraStationEventBlockHeader_t);
+    dda=(blkHeader.channelMask>>8)&0x3;
+    block=blkHeader.irsBlockNumber&0x1ff;
+    if(readout[dda]==0) summary->firstBlock[dda]=block;
+    for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+      if(!(blkHeader.channelMask&(1<<chan))) continue;
+      if(eventByte+(int)sizeof(AraStationEventBlockChannel_t)>numBytes) {
+	retVal=-1;
+	break;
+      }
+      //The blocks are only 2 byte aligned in the event
+      memcpy(samples,&event[eventByte],sizeof(samples));
+      if(pedestals) {
+	pedMean=&pedestals->mean[araPedestalCellIndex(dda,block,chan,0)];
+	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	  values[sample]=(int32_t)samples[sample]-((pedMean[sample]+ARA_PED_FILE_SCALE/2)>>ARA_PED_FILE_FRAC_BITS);
+      }
+      else {
+	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	  values[sample]=samples[sample];
+      }
+      addChannelBlock(&sums[dda*RFCHAN_PER_DDA+chan],values,pedestals!=NULL,readout[dda]);
+      eventByte+=sizeof(AraStationEventBlockChannel_t);
+    }
+    eventByte+=ARA_BLOCK_NUM_SUMMARIES(blkHeader.channelMask)*sizeof(AraStationEventBlockChannelSummary_t);
+    readout[dda]++;
+  }
+  if(retVal<0) summary->flags|=ARA_EVENT_SUMMARY_BAD;
+
+  for(channel=0;channel<SUMMARY_NUM_CHANNELS;channel++)
+    finishChannel(summary,channel,&sums[channel]);
+  return retVal;
+}
@@ -0,0 +1,37 @@
+/*
+   ARA Event Summary  the per event summary records.
+
+   Fills an AraEventSummary_t (see araAtriStructures.h) from an unpacked
+   event: the RMS of each channel and its largest excursion from the mean,
+   with where in the readout that is.
+
+   Everything is done in integers a channel block at a time, so the loops
+   over the 64 samples vectorise. With pedestals each sample has its
+   pedestal, rounded to a whole ADC count, taken off and the mean is that
+   of the whole readout. Without them the mean of each block is taken off
+   instead, as the filter does.
+*/
+
+#ifndef ARA_EVENT_SUMMARY_H
+#define ARA_EVENT_SUMMARY_H
+#include <stdint.h>
+#include "araAtriStructures.h"
+#include "araPedestalLib/araPedestalFile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Summarises an unpacked event, pedestals may be NULL.
+ *
+ * Fills everything but the generic header, filterFlag and the
+ * ARA_EVENT_SUMMARY_WRITTEN flag. Returns 0, or -1 if the blocks ran off
+ * the end of the event (the summary then has the channels up to there).
+ */
+int araEventSummaryFill(AraEventSummary_t *summary, const uint8_t *event, int numBytes, const AraPedestalSet_t *pedestals);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_EVENT_SUMMARY_H
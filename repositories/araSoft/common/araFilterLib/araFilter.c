@@ -0,0 +1,422 @@
+/*
+   ARA Filter  the online L5 software filter, see araFilter.h
+*/
+
+#include "araFilter.h"
+#include "araSoft.h"
+#include "atriComLib/atriCom.h"
+#include "utilLib/util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <math.h>
+#include <time.h>
+
+#define FILTER_MAX_SCRATCH_SAMPLES (ARA_FILTER_NUM_CHANNELS*ARA_FILTER_MAX_SAMPLES)
+#define FILTER_INLINE_WORKER ARA_FILTER_MAX_THREADS
+
+
+static uint32_t threadCpuUs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID,&now);
+  return now.tv_sec*1000000u+now.tv_nsec/1000;
+}
+
+
+static int unpackWaveforms(AraFilter_t *filter, const uint8_t *event, int numBytes, float *waves, int *numSamples)
+{
+  //Pedestal subtracts every channel block into waves, one
+  //ARA_FILTER_MAX_SAMPLES waveform per channel. Returns 0, or -1 if the
+  //blocks run off the end of the event.
+  const AraStationEventHeader_t *header=(const AraStationEventHeader_t*)event;
+  const AraPedestalSet_t *peds=filter->config.pedestals;
+  AraStationEventBlockHeader_t blkHeader;
+  uint16_t samples[SAMPLES_PER_BLOCK];
+  int readout[DDA_PER_ATRI]={0};
+  int eventByte=sizeof(AraStationEventHeader_t);
+  int blk,dda,chan,block,sample,channel;
+  float *wave,blockMean;
+  const uint16_t *pedMean;
+
+  memset(numSamples,0,sizeof(int)*ARA_FILTER_NUM_CHANNELS);
+  if(numBytes<(int)sizeof(AraStationEventHeader_t)) return -1;
+  for(blk=0;blk<header->numReadoutBlocks;blk++) {
+    if(eventByte+(int)sizeof(AraStationEventBlockHeader_t)>numBytes) return -1;
+    memcpy(&blkHeader,&event[eventByte],sizeof(blkHeader));
+    eventByte+=sizeof(AraStationEventBlockHeader_t);
+    dda=(blkHeader.channelMask>>8)&0x3;
+    block=blkHeader.irsBlockNumber&0x1ff;
+    for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+      if(!(blkHeader.channelMask&(1<<chan))) continue;
+      if(eventByte+(int)sizeof(AraStationEventBlockChannel_t)>numBytes) return -1;
+      if(readout[dda]<ARA_FILTER_MAX_READOUTS) {
+	//The blocks are only 2 byte aligned in the event
+	memcpy(samples,&event[eventByte],sizeof(samples));
+	channel=dda*RFCHAN_PER_DDA+chan;
+	wave=&waves[channel*ARA_FILTER_MAX_SAMPLES+readout[dda]*SAMPLES_PER_BLOCK];
+	if(peds) {
+	  pedMean=&peds->mean[araPedestalCellIndex(dda,block,chan,0)];
+	  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	    wave[sample]=samples[sample]-pedMean[sample]*(1.f/ARA_PED_FILE_SCALE);
+	}
+	else {
+	  blockMean=0;
+	  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) blockMean+=samples[sample];
+	  blockMean/=SAMPLES_PER_BLOCK;
+	  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	    wave[sample]=samples[sample]-blockMean;
+	}
+	numSamples[channel]=(readout[dda]+1)*SAMPLES_PER_BLOCK;
+      }
+      eventByte+=sizeof(AraStationEventBlockChannel_t);
+    }
+    eventByte+=ARA_BLOCK_NUM_SUMMARIES(blkHeader.channelMask)*sizeof(AraStationEventBlockChannelSummary_t);
+    readout[dda]++;
+  }
+  return 0;
+}
+
+
+static void channelFeatures(float *wave, int numSamples, AraFilterFeatures_t *features, int channel)
+{
+  //Removes what is left of the mean and finds the RMS and largest excursion
+  float mean=0,sumSq=0,maxValue=-1e9,minValue=1e9;
+  int sample,maxSample=0,minSample=0;
+  for(sample=0;sample<numSamples;sample++) mean+=wave[sample];
+  mean/=numSamples;
+  for(sample=0;sample<numSamples;sample++) {
+    wave[sample]-=mean;
+    sumSq+=wave[sample]*wave[sample];
+    if(wave[sample]>maxValue) {
+      maxValue=wave[sample];
+      maxSample=sample;
+    }
+    if(wave[sample]<minValue) {
+      minValue=wave[sample];
+      minSample=sample;
+    }
+  }
+  features->rms[channel]=sqrtf(sumSq/numSamples);
+  if(maxValue>=-minValue) features->peakSample[channel]=maxSample;
+  else features->peakSample[channel]=minSample;
+  features->snr[channel]=features->rms[channel]>0 ? fmaxf(maxValue,-minValue)/features->rms[channel] : 0;
+}
+
+
+static float cwLineFraction(const float *wave, int numSamples, float sumSq, float coeff)
+{
+  //Goertzel, 2|X(f)|^2/(N sum x^2) is 1 for a pure tone at f and about 2/N for noise
+  float s0,s1=0,s2=0,power;
+  int sample;
+  for(sample=0;sample<numSamples;sample++) {
+    s0=wave[sample]+coeff*s1-s2;
+    s2=s1;
+    s1=s0;
+  }
+  power=s1*s1+s2*s2-coeff*s1*s2;
+  return sumSq>0 ? 2*power/(numSamples*sumSq) : 0;
+}
+
+
+static int countCoincidentStrings(const int *stringPeak, int window)
+{
+  //The most strings whose peaks fit in the window together
+  int first,second,count,best=0;
+  for(first=0;first<DDA_PER_ATRI;first++) {
+    if(stringPeak[first]<0) continue;
+    count=0;
+    for(second=0;second<DDA_PER_ATRI;second++) {
+      if(stringPeak[second]>=stringPeak[first] && stringPeak[second]-stringPeak[first]<=window) count++;
+    }
+    if(count>best) best=count;
+  }
+  return best;
+}
+
+
+static void filterEvent(AraFilter_t *filter, AraFilterWorker_t *worker, const uint8_t *event, int numBytes, AraFilterFeatures_t *features)
+{
+  const AraFilterConfig_t *config=&filter->config;
+  const AraStationEventHeader_t *header=(const AraStationEventHeader_t*)event;
+  int numSamples[ARA_FILTER_NUM_CHANNELS];
+  int stringPeak[DDA_PER_ATRI];
+  float bestSnr[DDA_PER_ATRI]={0};
+  float *wave,fraction,sumSq;
+  uint32_t startUs=threadCpuUs();
+  uint16_t flags=ARA_FILTER_FLAG_FILTERED;
+  uint32_t timeStamp;
+  int channel,dda,line,priority,earliest,latest;
+
+  memset(features,0,sizeof(AraFilterFeatures_t));
+  for(dda=0;dda<DDA_PER_ATRI;dda++) stringPeak[dda]=-1;
+  if(unpackWaveforms(filter,event,numBytes,worker->scratch,numSamples)<0) flags|=ARA_FILTER_FLAG_BAD;
+
+  //The header has the timeStamp as it comes from the ATRI, gray coded
+  timeStamp=grayToBinary(header->timeStamp);
+  if(header->triggerInfo[triggerL4_CAL] ||
+     (config->calTimeStampMax>config->calTimeStampMin &&
+      timeStamp>=config->calTimeStampMin && timeStamp<=config->calTimeStampMax))
+    flags|=ARA_FILTER_FLAG_CALPULSER;
+  if(header->triggerInfo[triggerL4_CPU] &&
+     !header->triggerInfo[triggerL4_RF0] && !header->triggerInfo[triggerL4_RF1])
+    flags|=ARA_FILTER_FLAG_FORCED;
+
+  //Power and timing
+  for(channel=0;channel<ARA_FILTER_NUM_CHANNELS;channel++) {
+    features->peakSample[channel]=-1;
+    if(numSamples[channel]==0) continue;
+    channelFeatures(&worker->scratch[channel*ARA_FILTER_MAX_SAMPLES],numSamples[channel],features,channel);
+    if(features->snr[channel]<config->snrThreshold) continue;
+    features->numHitChannels++;
+    dda=channel/RFCHAN_PER_DDA;
+    if(features->snr[channel]>bestSnr[dda]) {
+      bestSnr[dda]=features->snr[channel];
+      stringPeak[dda]=features->peakSample[channel];
+    }
+  }
+  earliest=ARA_FILTER_MAX_SAMPLES;
+  latest=-1;
+  for(dda=0;dda<DDA_PER_ATRI;dda++) {
+    if(stringPeak[dda]<0) continue;
+    features->numHitStrings++;
+    if(stringPeak[dda]<earliest) earliest=stringPeak[dda];
+    if(stringPeak[dda]>latest) latest=stringPeak[dda];
+  }
+  features->coincidenceSpread=features->numHitStrings>1 ? latest-earliest : -1;
+  if(features->numHitChannels>=config->minHitChannels) flags|=ARA_FILTER_FLAG_POWER;
+  if(features->numHitStrings>=config->minHitStrings &&
+     countCoincidentStrings(stringPeak,config->coincidenceWindow)>=config->minHitStrings)
+    flags|=ARA_FILTER_FLAG_COINCIDENT;
+
+  //CW lines, the most expensive part so it goes last
+  for(channel=0;channel<ARA_FILTER_NUM_CHANNELS && config->numCwLines>0;channel++) {
+    if(numSamples[channel]==0) continue;
+    if(config->budgetUs>0 && threadCpuUs()-startUs>(uint32_t)config->budgetUs) {
+      flags|=ARA_FILTER_FLAG_OVER_BUDGET;
+      break;
+    }
+    wave=&worker->scratch[channel*ARA_FILTER_MAX_SAMPLES];
+    sumSq=features->rms[channel]*features->rms[channel]*numSamples[channel];
+    for(line=0;line<config->numCwLines;line++) {
+      fraction=cwLineFraction(wave,numSamples[channel],sumSq,filter->cwCoeff[line]);
+      if(fraction>features->cwFraction[channel]) features->cwFraction[channel]=fraction;
+    }
+    if(features->cwFraction[channel]>config->cwFraction) features->numCwChannels++;
+  }
+  if(config->numCwLines>0 && features->numCwChannels>=config->cwMinChannels) flags|=ARA_FILTER_FLAG_CW;
+
+  if(flags&ARA_FILTER_FLAG_BAD) priority=ARA_FILTER_PRIORITY_BAD;
+  else if(flags&ARA_FILTER_FLAG_CALPULSER) priority=ARA_FILTER_PRIORITY_CALPULSER;
+  else if(flags&ARA_FILTER_FLAG_COINCIDENT)
+    priority=(flags&ARA_FILTER_FLAG_CW) ? ARA_FILTER_PRIORITY_CW_COINCIDENT : ARA_FILTER_PRIORITY_COINCIDENT;
+  else if(flags&ARA_FILTER_FLAG_FORCED) priority=ARA_FILTER_PRIORITY_FORCED;
+  else if(flags&ARA_FILTER_FLAG_CW) priority=ARA_FILTER_PRIORITY_CW;
+  else if(flags&(ARA_FILTER_FLAG_POWER|ARA_FILTER_FLAG_OVER_BUDGET)) priority=ARA_FILTER_PRIORITY_POWER;
+  else priority=ARA_FILTER_PRIORITY_QUIET;
+  features->filterFlag=flags|(priority<<ARA_FILTER_PRIORITY_SHIFT);
+  features->cpuUs=threadCpuUs()-startUs;
+}
+
+
+static void filterSlot(AraFilter_t *filter, AraFilterWorker_t *worker, AraFilterSlot_t *slot)
+{
+  AtriGenericHeader_t *gHdr=(AtriGenericHeader_t*)slot->data;
+  filterEvent(filter,worker,slot->data,slot->numBytes,&slot->features);
+  //Outside the checksum, which only covers what follows the generic header
+  gHdr->reserved=slot->features.filterFlag;
+}
+
+
+static void *filterWorker(void *ptr)
+{
+  AraFilterWorker_t *worker=(AraFilterWorker_t*)ptr;
+  AraFilter_t *filter=worker->filter;
+  AraFilterSlot_t *slot;
+
+  pthread_mutex_lock(&filter->mutex);
+  while(1) {
+    while(filter->next==filter->head && !filter->stopping)
+      pthread_cond_wait(&filter->workCond,&filter->mutex);
+    if(filter->next==filter->head) break; //Stopping and nothing left
+    slot=&filter->slots[filter->next%ARA_FILTER_QUEUE_DEPTH];
+    filter->next++;
+    pthread_mutex_unlock(&filter->mutex);
+
+    filterSlot(filter,worker,slot);
+
+    pthread_mutex_lock(&filter->mutex);
+    slot->state=ARA_FILTER_SLOT_DONE;
+    pthread_cond_broadcast(&filter->doneCond);
+  }
+  pthread_mutex_unlock(&filter->mutex);
+  return NULL;
+}
+
+
+int araFilterInit(AraFilter_t *filter, const AraFilterConfig_t *config, int numThreads, int maxEventBytes)
+{
+  int slot,thread,line;
+  memset(filter,0,sizeof(AraFilter_t));
+  filter->config=*config;
+  if(filter->config.numCwLines>ARA_FILTER_MAX_CW_LINES) filter->config.numCwLines=ARA_FILTER_MAX_CW_LINES;
+  for(line=0;line<filter->config.numCwLines;line++)
+    filter->cwCoeff[line]=2*cos(2*M_PI*filter->config.cwFrequency[line]);
+  if(numThreads<0) numThreads=0;
+  if(numThreads>ARA_FILTER_MAX_THREADS) numThreads=ARA_FILTER_MAX_THREADS;
+  filter->maxEventBytes=maxEventBytes;
+  pthread_mutex_init(&filter->mutex,NULL);
+  pthread_cond_init(&filter->workCond,NULL);
+  pthread_cond_init(&filter->doneCond,NULL);
+
+  filter->workers[FILTER_INLINE_WORKER].filter=filter;
+  filter->workers[FILTER_INLINE_WORKER].scratch=malloc(FILTER_MAX_SCRATCH_SAMPLES*sizeof(float));
+  if(!filter->workers[FILTER_INLINE_WORKER].scratch) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't allocate the filter scratch space\n",__FUNCTION__);
+    return -1;
+  }
+  for(slot=0;slot<ARA_FILTER_QUEUE_DEPTH;slot++) {
+    filter->slots[slot].data=malloc(maxEventBytes);
+    if(!filter->slots[slot].data) {
+      ARA_LOG_MESSAGE(LOG_ERR,"%s: can't allocate the event queue\n",__FUNCTION__);
+      araFilterFree(filter);
+      return -1;
+    }
+  }
+  for(thread=0;thread<numThreads;thread++) {
+    filter->workers[thread].filter=filter;
+    filter->workers[thread].scratch=malloc(FILTER_MAX_SCRATCH_SAMPLES*sizeof(float));
+    if(!filter->workers[thread].scratch ||
+       pthread_create(&filter->threads[thread],NULL,filterWorker,&filter->workers[thread])) {
+      ARA_LOG_MESSAGE(LOG_ERR,"%s: can't start filter worker %d\n",__FUNCTION__,thread);
+      araFilterFree(filter);
+      return -1;
+    }
+    filter->numThreads=thread+1;
+  }
+  return 0;
+}
+
+
+void araFilterFree(AraFilter_t *filter)
+{
+  int slot,thread;
+  pthread_mutex_lock(&filter->mutex);
+  filter->stopping=1;
+  pthread_cond_broadcast(&filter->workCond);
+  pthread_mutex_unlock(&filter->mutex);
+  for(thread=0;thread<filter->numThreads;thread++)
+    pthread_join(filter->threads[thread],NULL);
+  filter->numThreads=0;
+  for(slot=0;slot<ARA_FILTER_QUEUE_DEPTH;slot++) {
+    free(filter->slots[slot].data);
+    filter->slots[slot].data=NULL;
+  }
+  for(thread=0;thread<=ARA_FILTER_MAX_THREADS;thread++) {
+    free(filter->workers[thread].scratch);
+    filter->workers[thread].scratch=NULL;
+  }
+}
+
+
+int araFilterAddEvent(AraFilter_t *filter, const uint8_t *event, int numBytes)
+{
+  AraFilterSlot_t *slot;
+  if(numBytes>filter->maxEventBytes || numBytes<(int)sizeof(AraStationEventHeader_t)) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't filter a %d byte event\n",__FUNCTION__,numBytes);
+    return -1;
+  }
+  pthread_mutex_lock(&filter->mutex);
+  while(filter->head-filter->tail>=ARA_FILTER_QUEUE_DEPTH)
+    pthread_cond_wait(&filter->doneCond,&filter->mutex);
+  slot=&filter->slots[filter->head%ARA_FILTER_QUEUE_DEPTH];
+  pthread_mutex_unlock(&filter->mutex);
+
+  //Nobody else looks at the slot until head moves past it
+  memcpy(slot->data,event,numBytes);
+  slot->numBytes=numBytes;
+  if(filter->numThreads==0) filterSlot(filter,&filter->workers[FILTER_INLINE_WORKER],slot);
+
+  pthread_mutex_lock(&filter->mutex);
+  if(filter->numThreads==0) {
+    slot->state=ARA_FILTER_SLOT_DONE;
+    filter->next++;
+  }
+  else slot->state=ARA_FILTER_SLOT_QUEUED;
+  filter->head++;
+  pthread_cond_signal(&filter->workCond);
+  pthread_mutex_unlock(&filter->mutex);
+  return 0;
+}
+
+
+int araFilterNextEvent(AraFilter_t *filter, int wait, uint8_t **event, int *numBytes, const AraFilterFeatures_t **features)
+{
+  AraFilterSlot_t *slot;
+  pthread_mutex_lock(&filter->mutex);
+  while(filter->tail==filter->head ||
+	filter->slots[filter->tail%ARA_FILTER_QUEUE_DEPTH].state!=ARA_FILTER_SLOT_DONE) {
+    if(!wait || filter->tail==filter->head) {
+      pthread_mutex_unlock(&filter->mutex);
+      return 0;
+    }
+    pthread_cond_wait(&filter->doneCond,&filter->mutex);
+  }
+  slot=&filter->slots[filter->tail%ARA_FILTER_QUEUE_DEPTH];
+  pthread_mutex_unlock(&filter->mutex);
+  *event=slot->data;
+  *numBytes=slot->numBytes;
+  if(features) *features=&slot->features;
+  return 1;
+}
+
+
+void araFilterReleaseEvent(AraFilter_t *filter)
+{
+  AraFilterSlot_t *slot;
+  pthread_mutex_lock(&filter->mutex);
+  if(filter->tail!=filter->head) {
+    slot=&filter->slots[filter->tail%ARA_FILTER_QUEUE_DEPTH];
+    filter->numEvents++;
+    filter->numPriority[araFilterPriority(slot->features.filterFlag)]++;
+    if(slot->features.filterFlag&ARA_FILTER_FLAG_OVER_BUDGET) filter->numOverBudget++;
+    filter->sumCpuUs+=slot->features.cpuUs;
+    if(slot->features.cpuUs>filter->maxCpuUs) filter->maxCpuUs=slot->features.cpuUs;
+    slot->state=ARA_FILTER_SLOT_FREE;
+    filter->tail++;
+    pthread_cond_broadcast(&filter->doneCond);
+  }
+  pthread_mutex_unlock(&filter->mutex);
+}
+
+
+int araFilterNumQueued(AraFilter_t *filter)
+{
+  int numQueued;
+  pthread_mutex_lock(&filter->mutex);
+  numQueued=filter->head-filter->tail;
+  pthread_mutex_unlock(&filter->mutex);
+  return numQueued;
+}
+
+
+void araFilterEvent(AraFilter_t *filter, const uint8_t *event, int numBytes, AraFilterFeatures_t *features)
+{
+  filterEvent(filter,&filter->workers[FILTER_INLINE_WORKER],event,numBytes,features);
+}
+
+
+const char *araFilterFlagAsString(uint16_t filterFlag)
+{
+  static char flagString[128];
+  static const char *flagNames[]={"filtered","power","coincident","calpulser","cw","forced","bad","overBudget"};
+  unsigned int bit;
+  flagString[0]='\0';
+  for(bit=1;bit<sizeof(flagNames)/sizeof(flagNames[0]);bit++) {
+    if(!(filterFlag&(1<<bit))) continue;
+    if(flagString[0]) strcat(flagString,",");
+    strcat(flagString,flagNames[bit]);
+  }
+  if(!flagString[0]) strcpy(flagString,(filterFlag&ARA_FILTER_FLAG_FILTERED) ? "none" : "unfiltered");
+  return flagString;
+}
@@ -0,0 +1,194 @@
+/*
+   ARA Filter  the online L5 software filter.
+
+   Runs on each unpacked event between readout and writing and works out a
+   few cheap features per channel: the RMS and the SNR (largest excursion
+   over the RMS) of the pedestal subtracted waveform, where the largest
+   excursion is, and how much of the power is in each configured CW line
+   (a Goertzel filter). From them the event gets a filter flag
+   (ARA_FILTER_FLAG_*) and a priority, 0 being the most interesting,
+   which are packed into the generic header's filterFlag for the writer.
+
+   A channel is hit when its SNR is over the threshold. The event is
+   coincident when hits on enough strings (DDAs) peak within the
+   coincidence window of each other. The calpulser is recognised by its
+   trigger bit or by the timeStamp window it fires in.
+
+   The features of an event depend only on the event, the configuration
+   and the pedestals, so the results don't depend on the number of
+   threads or on what else is in the queue. Events are copied into a ring
+   of slots, filtered by worker threads and handed back by
+   araFilterNextEvent in the order they were added.
+
+   Each event has a CPU budget. Once it is used up the remaining features
+   (the CW lines are last) are skipped and the event is flagged
+   ARA_FILTER_FLAG_OVER_BUDGET rather than held up.
+*/
+
+#ifndef ARA_FILTER_H
+#define ARA_FILTER_H
+#include <stdint.h>
+#include <pthread.h>
+#include "araAtriStructures.h"
+#include "araPedestalLib/araPedestalFile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARA_FILTER_NUM_CHANNELS (DDA_PER_ATRI*RFCHAN_PER_DDA)
+#define ARA_FILTER_MAX_READOUTS 64 ///< Blocks per DDA that are looked at, any more are ignored
+#define ARA_FILTER_MAX_SAMPLES (ARA_FILTER_MAX_READOUTS*SAMPLES_PER_BLOCK)
+#define ARA_FILTER_MAX_THREADS 4
+#define ARA_FILTER_QUEUE_DEPTH 32 ///< Events that can be waiting to be filtered or written
+#define ARA_FILTER_MAX_CW_LINES 4
+#define ARA_FILTER_NUM_PRIORITIES 8
+
+//The filterFlag in the generic header, flags in the low 12 bits and the priority above
+#define ARA_FILTER_FLAG_FILTERED 0x001 ///< The filter looked at this event
+#define ARA_FILTER_FLAG_POWER 0x002 ///< At least minHitChannels channels hit
+#define ARA_FILTER_FLAG_COINCIDENT 0x004 ///< Hits on at least minHitStrings strings within the window
+#define ARA_FILTER_FLAG_CALPULSER 0x008
+#define ARA_FILTER_FLAG_CW 0x010 ///< At least cwMinChannels channels dominated by a CW line
+#define ARA_FILTER_FLAG_FORCED 0x020 ///< Software trigger without an RF trigger (the header has no external trigger bit)
+#define ARA_FILTER_FLAG_BAD 0x040 ///< The blocks couldn't be parsed
+#define ARA_FILTER_FLAG_OVER_BUDGET 0x080 ///< Ran out of CPU time, the CW lines weren't checked
+#define ARA_FILTER_PRIORITY_SHIFT 12
+#define ARA_FILTER_FLAG_MASK ((1<<ARA_FILTER_PRIORITY_SHIFT)-1)
+
+//Priorities
+#define ARA_FILTER_PRIORITY_COINCIDENT 0 ///< Coincident, not the calpulser and not CW
+#define ARA_FILTER_PRIORITY_CALPULSER 1
+#define ARA_FILTER_PRIORITY_POWER 2 ///< Hits but not coincident, or over budget before the CW check
+#define ARA_FILTER_PRIORITY_FORCED 3
+#define ARA_FILTER_PRIORITY_CW_COINCIDENT 4
+#define ARA_FILTER_PRIORITY_CW 5
+#define ARA_FILTER_PRIORITY_QUIET 6 ///< Nothing of note
+#define ARA_FILTER_PRIORITY_BAD 7
+
+typedef struct {
+  float snrThreshold; ///< A channel is hit above this SNR
+  int minHitChannels;
+  int minHitStrings;
+  int coincidenceWindow; ///< Samples between the earliest and latest peak of the hit strings
+  uint32_t calTimeStampMin; ///< timeStamp window the calpulser fires in, in binary counts (the header's is gray coded), empty to only use the trigger bit
+  uint32_t calTimeStampMax;
+  int numCwLines;
+  float cwFrequency[ARA_FILTER_MAX_CW_LINES]; ///< Cycles per sample
+  float cwFraction; ///< A channel is CW when one line has more than this fraction of its power
+  int cwMinChannels;
+  int budgetUs; ///< CPU time per event, 0 for no limit
+  const AraPedestalSet_t *pedestals; ///< NULL to subtract the mean of each channel block instead
+} AraFilterConfig_t;
+
+typedef struct {
+  float rms[ARA_FILTER_NUM_CHANNELS]; ///< ADC counts, 0 if the channel wasn't read out
+  float snr[ARA_FILTER_NUM_CHANNELS];
+  int16_t peakSample[ARA_FILTER_NUM_CHANNELS]; ///< Sample of the largest excursion from the start of the readout
+  float cwFraction[ARA_FILTER_NUM_CHANNELS]; ///< Of the strongest line
+  int numHitChannels;
+  int numHitStrings;
+  int coincidenceSpread; ///< Samples between the earliest and latest peaks of the hit strings, -1 with fewer than two
+  int numCwChannels;
+  uint16_t filterFlag;
+  uint32_t cpuUs;
+} AraFilterFeatures_t;
+
+typedef struct {
+  int state; ///< ARA_FILTER_SLOT_*
+  int numBytes;
+  uint8_t *data;
+  AraFilterFeatures_t features;
+} AraFilterSlot_t;
+
+typedef struct araFilter AraFilter_t;
+
+typedef struct {
+  AraFilter_t *filter;
+  float *scratch; ///< One ARA_FILTER_MAX_SAMPLES waveform per channel
+} AraFilterWorker_t;
+
+struct araFilter {
+  AraFilterConfig_t config;
+  float cwCoeff[ARA_FILTER_MAX_CW_LINES]; ///< 2cos(2 pi f) for the Goertzel filters
+
+  //The ring, slots [tail,head) are in use and [next,head) still to be filtered
+  int numThreads;
+  int maxEventBytes;
+  int stopping;
+  unsigned int head;
+  unsigned int next;
+  unsigned int tail;
+  AraFilterSlot_t slots[ARA_FILTER_QUEUE_DEPTH];
+  pthread_t threads[ARA_FILTER_MAX_THREADS];
+  AraFilterWorker_t workers[ARA_FILTER_MAX_THREADS+1]; ///< The last is for filtering in the caller's thread
+  pthread_mutex_t mutex;
+  pthread_cond_t workCond; ///< Signalled when an event is added
+  pthread_cond_t doneCond; ///< Signalled when an event is filtered or released
+
+  //Stats, updated as events are handed back
+  unsigned int numEvents;
+  unsigned int numPriority[ARA_FILTER_NUM_PRIORITIES];
+  unsigned int numOverBudget;
+  double sumCpuUs;
+  uint32_t maxCpuUs;
+};
+
+#define ARA_FILTER_SLOT_FREE 0
+#define ARA_FILTER_SLOT_QUEUED 1
+#define ARA_FILTER_SLOT_DONE 2
+
+
+/** \brief Copies the configuration and starts numThreads workers (0 filters in araFilterAddEvent itself).
+ *
+ * The pedestals, if any, must stay loaded until araFilterFree. Returns 0,
+ * or -1 if the memory or threads can't be had.
+ */
+int araFilterInit(AraFilter_t *filter, const AraFilterConfig_t *config, int numThreads, int maxEventBytes);
+
+/** \brief Stops the workers, after they finish any queued events, and frees everything. */
+void araFilterFree(AraFilter_t *filter);
+
+/** \brief Queues an unpacked event, waiting for a free slot if need be.
+ *
+ * The event is copied so the caller's buffer can be reused straight away.
+ * Only another thread releasing events frees a slot, so a caller that
+ * also writes the events should check araFilterNumQueued first. Returns
+ * 0, or -1 if the event is too big.
+ */
+int araFilterAddEvent(AraFilter_t *filter, const uint8_t *event, int numBytes);
+
+/** \brief Gets the oldest event if it has been filtered, or with wait set as soon as it is.
+ *
+ * The event has its filterFlag set and stays valid until
+ * araFilterReleaseEvent. Returns 1, or 0 if there is no event (or with
+ * wait, none queued).
+ */
+int araFilterNextEvent(AraFilter_t *filter, int wait, uint8_t **event, int *numBytes, const AraFilterFeatures_t **features);
+
+/** \brief Frees the slot of the event from araFilterNextEvent. */
+void araFilterReleaseEvent(AraFilter_t *filter);
+
+/** \brief Events added and not yet released, ARA_FILTER_QUEUE_DEPTH when full. */
+int araFilterNumQueued(AraFilter_t *filter);
+
+/** \brief Works out the features and filterFlag of one event without touching the queue, for offline use.
+ *
+ * Shares its scratch space with araFilterAddEvent when there are no
+ * worker threads, so don't mix the two from different threads.
+ */
+void araFilterEvent(AraFilter_t *filter, const uint8_t *event, int numBytes, AraFilterFeatures_t *features);
+
+/** \brief A human readable list of the flags, in a static buffer. */
+const char *araFilterFlagAsString(uint16_t filterFlag);
+
+static inline int araFilterPriority(uint16_t filterFlag)
+{
+  return filterFlag>>ARA_FILTER_PRIORITY_SHIFT;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_FILTER_H
@@ -0,0 +1,158 @@
+/*
+   ARA ROI  region of interest block suppression, see araRoi.h
+*/
+
+#include "araRoi.h"
+#include "atriComLib/atriCom.h"
+#include <string.h>
+
+#define ROI_NUM_CHANNELS (DDA_PER_ATRI*RFCHAN_PER_DDA)
+#define ROI_NO_BLOCK -1
+
+
+static int blockRange(const uint16_t *samples)
+{
+  uint16_t blockMax=0,blockMin=0xffff;
+  int sample;
+  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+    blockMax=samples[sample]>blockMax ? samples[sample] : blockMax;
+    blockMin=samples[sample]<blockMin ? samples[sample] : blockMin;
+  }
+  return blockMax-blockMin;
+}
+
+
+static void summariseBlock(AraStationEventBlockChannelSummary_t *summary, int chan, const uint16_t *samples)
+{
+  uint16_t blockMax=0,blockMin=0xffff;
+  int32_t sum=0;
+  int sample;
+  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+    sum+=samples[sample];
+    blockMax=samples[sample]>blockMax ? samples[sample] : blockMax;
+    blockMin=samples[sample]<blockMin ? samples[sample] : blockMin;
+  }
+  summary->channel=chan;
+  summary->reserved=0;
+  summary->mean=(sum+SAMPLES_PER_BLOCK/2)/SAMPLES_PER_BLOCK;
+  summary->min=blockMin;
+  summary->max=blockMax;
+}
+
+
+static int inWindow(const AraRoiConfig_t *config, int readout, int centre)
+{
+  return centre!=ROI_NO_BLOCK && readout>=centre-config->blocksBefore && readout<=centre+config->blocksAfter;
+}
+
+
+//Finds the readout with the largest range for each channel
+static int findPeakBlocks(const uint8_t *event, int numBytes, int *peakBlock)
+{
+  const AraStationEventHeader_t *header=(const AraStationEventHeader_t*)event;
+  AraStationEventBlockHeader_t blkHeader;
+  uint16_t samples[SAMPLES_PER_BLOCK];
+  int peakRange[ROI_NUM_CHANNELS];
+  int readout[DDA_PER_ATRI]={0};
+  int eventByte=sizeof(AraStationEventHeader_t);
+  int blk,dda,chan,channel,range;
+
+  for(channel=0;channel<ROI_NUM_CHANNELS;channel++) {
+    peakBlock[channel]=ROI_NO_BLOCK;
+    peakRange[channel]=-1;
+  }
+  for(blk=0;blk<header->numReadoutBlocks;blk++) {
+    if(eventByte+(int)sizeof(AraStationEventBlockHeader_t)>numBytes) return -1;
+    memcpy(&blkHeader,&event[eventByte],sizeof(blkHeader));
+    eventByte+=sizeof(AraStationEventBlockHeader_t);
+    dda=(blkHeader.channelMask>>8)&0x3;
+    for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+      if(!(blkHeader.channelMask&(1<<chan))) continue;
+      if(eventByte+(int)sizeof(AraStationEventBlockChannel_t)>numBytes) return -1;
+      //The blocks are only 2 byte aligned in the event
+      memcpy(samples,&event[eventByte],sizeof(samples));
+      eventByte+=sizeof(AraStationEventBlockChannel_t);
+      channel=dda*RFCHAN_PER_DDA+chan;
+      range=blockRange(samples);
+      if(range>peakRange[channel]) {
+	peakRange[channel]=range;
+	peakBlock[channel]=readout[dda];
+      }
+    }
+    eventByte+=ARA_BLOCK_NUM_SUMMARIES(blkHeader.channelMask)*sizeof(AraStationEventBlockChannelSummary_t);
+    readout[dda]++;
+  }
+  return 0;
+}
+
+
+int araRoiSuppress(const AraRoiConfig_t *config, const uint8_t *event, int numBytes, uint8_t *output, int maxBytes)
+{
+  const AraStationEventHeader_t *header=(const AraStationEventHeader_t*)event;
+  AraStationEventHeader_t *outHeader=(AraStationEventHeader_t*)output;
+  AraStationEventBlockHeader_t blkHeader;
+  AraStationEventBlockChannelSummary_t summaries[RFCHAN_PER_DDA];
+  uint16_t samples[SAMPLES_PER_BLOCK];
+  int peakBlock[ROI_NUM_CHANNELS];
+  int readout[DDA_PER_ATRI]={0};
+  int eventByte=sizeof(AraStationEventHeader_t);
+  int outByte=sizeof(AraStationEventHeader_t);
+  int blk,dda,chan,channel,blkHeaderByte,numSummaries,numOld,numSuppressed=0;
+  int trigBlock=ROI_NO_BLOCK;
+  uint16_t keptMask;
+
+  if(numBytes<(int)sizeof(AraStationEventHeader_t) || maxBytes<numBytes) return -1;
+  if(header->triggerInfo[triggerL4_RF0]) trigBlock=header->triggerBlock[triggerL4_RF0];
+  else if(header->triggerInfo[triggerL4_RF1]) trigBlock=header->triggerBlock[triggerL4_RF1];
+  else if(header->triggerInfo[triggerL4_CAL]) trigBlock=header->triggerBlock[triggerL4_CAL];
+  if(trigBlock==ROI_NO_BLOCK && !config->aroundPeak) return 0;
+  if(config->aroundPeak) {
+    if(findPeakBlocks(event,numBytes,peakBlock)<0) return -1;
+  }
+
+  memcpy(output,event,sizeof(AraStationEventHeader_t));
+  for(blk=0;blk<header->numReadoutBlocks;blk++) {
+    if(eventByte+(int)sizeof(AraStationEventBlockHeader_t)>numBytes) return -1;
+    memcpy(&blkHeader,&event[eventByte],sizeof(blkHeader));
+    eventByte+=sizeof(AraStationEventBlockHeader_t);
+    blkHeaderByte=outByte;
+    outByte+=sizeof(AraStationEventBlockHeader_t);
+    dda=(blkHeader.channelMask>>8)&0x3;
+    keptMask=0;
+    numSummaries=0;
+    for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+      if(!(blkHeader.channelMask&(1<<chan))) continue;
+      if(eventByte+(int)sizeof(AraStationEventBlockChannel_t)>numBytes) return -1;
+      channel=dda*RFCHAN_PER_DDA+chan;
+      if(inWindow(config,readout[dda],trigBlock) ||
+	 (config->aroundPeak && inWindow(config,readout[dda],peakBlock[channel]))) {
+	memcpy(&output[outByte],&event[eventByte],sizeof(AraStationEventBlockChannel_t));
+	outByte+=sizeof(AraStationEventBlockChannel_t);
+	keptMask|=(1<<chan);
+      }
+      else {
+	memcpy(samples,&event[eventByte],sizeof(samples));
+	summariseBlock(&summaries[numSummaries++],chan,samples);
+      }
+      eventByte+=sizeof(AraStationEventBlockChannel_t);
+    }
+    //Channels that were already summarised stay that way
+    numSuppressed+=numSummaries;
+    numOld=ARA_BLOCK_NUM_SUMMARIES(blkHeader.channelMask);
+    if(numOld) {
+      if(numSummaries+numOld>RFCHAN_PER_DDA ||
+	 eventByte+numOld*(int)sizeof(AraStationEventBlockChannelSummary_t)>numBytes) return -1;
+      memcpy(&summaries[numSummaries],&event[eventByte],numOld*sizeof(AraStationEventBlockChannelSummary_t));
+      eventByte+=numOld*sizeof(AraStationEventBlockChannelSummary_t);
+      numSummaries+=numOld;
+    }
+    memcpy(&output[outByte],summaries,numSummaries*sizeof(AraStationEventBlockChannelSummary_t));
+    outByte+=numSummaries*sizeof(AraStationEventBlockChannelSummary_t);
+    blkHeader.channelMask=(blkHeader.channelMask&0x300) | keptMask | (numSummaries<<ARA_BLOCK_NUM_SUMMARIES_SHIFT);
+    memcpy(&output[blkHeaderByte],&blkHeader,sizeof(blkHeader));
+    readout[dda]++;
+  }
+  if(numSuppressed==0) return 0;
+  outHeader->numBytes=outByte-sizeof(AraStationEventHeader_t);
+  return outByte;
+}
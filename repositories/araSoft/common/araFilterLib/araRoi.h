@@ -0,0 +1,46 @@
+/*
+   ARA ROI  region of interest block suppression.
+
+   Most of a readout is far from where the signal is. This copies an
+   unpacked event keeping the full samples only for the readouts in a
+   window round the trigger block and, optionally, round the block where
+   each channel has its largest range. Every other channel block is
+   replaced by an AraStationEventBlockChannelSummary_t (mean, min and max)
+   and counted in the block header, see araAtriStructures.h, so a 128 byte
+   block becomes 8.
+
+   The window is in readouts, as the triggerBlock in the event header is.
+*/
+
+#ifndef ARA_ROI_H
+#define ARA_ROI_H
+#include <stdint.h>
+#include "araAtriStructures.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  int blocksBefore; ///< Readouts kept before the trigger (or peak) block
+  int blocksAfter; ///< Readouts kept after it
+  int aroundPeak; ///< Also keep the window round each channel's largest range block
+} AraRoiConfig_t;
+
+/** \brief Copies event into output with the blocks outside the region of interest summarised.
+ *
+ * The window goes round the first of the RF0, RF1 and calpulser triggers
+ * in the event, and with aroundPeak round each channel's peak block too;
+ * with neither there is nothing to go round and nothing is suppressed.
+ * The event header numBytes is updated, the generic header is left for
+ * the caller. Returns the bytes in output, 0 if nothing was suppressed
+ * (output is then not to be used) or -1 if the blocks ran off the end of
+ * the event or output.
+ */
+int araRoiSuppress(const AraRoiConfig_t *config, const uint8_t *event, int numBytes, uint8_t *output, int maxBytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_ROI_H
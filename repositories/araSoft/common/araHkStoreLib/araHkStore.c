@@ -0,0 +1,482 @@
+/*
+   ARA Hk Store  Gorilla encoded housekeeping time series, see araHkStore.h
+*/
+
+#include "araHkStore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+#define ARA_HK_WORST_TIME_BITS 36 ///< '1111' and a 32 bit delta of delta
+#define ARA_HK_WORST_VALUE_BITS 77 ///< '11', 5 bit leading zeros, 6 bit length and 64 bits
+
+//! Where a field lives in a housekeeping structure
+typedef struct {
+  const char *name;
+  size_t offset;
+  uint8_t size; ///< Bytes per element, 1 2 4 or 8
+  uint8_t count;
+} AraHkField_t;
+
+#define ARA_HK_FIELD(type,member) {#member,offsetof(type,member),sizeof(((type*)0)->member),1}
+#define ARA_HK_ARRAY(type,member) {#member,offsetof(type,member),sizeof(((type*)0)->member[0]), \
+      sizeof(((type*)0)->member)/sizeof(((type*)0)->member[0])}
+
+static const AraHkField_t fEventHkFields[]={
+  ARA_HK_FIELD(AraEventHk_t,firmwareVersion),
+  ARA_HK_ARRAY(AraEventHk_t,wilkinsonCounter),
+  ARA_HK_ARRAY(AraEventHk_t,wilkinsonDelay),
+  ARA_HK_FIELD(AraEventHk_t,ppsCounter),
+  ARA_HK_FIELD(AraEventHk_t,clockCounter),
+  ARA_HK_ARRAY(AraEventHk_t,l1Scaler),
+  ARA_HK_ARRAY(AraEventHk_t,l1ScalerSurface),
+  ARA_HK_ARRAY(AraEventHk_t,l2Scaler),
+  ARA_HK_ARRAY(AraEventHk_t,l3Scaler),
+  ARA_HK_ARRAY(AraEventHk_t,l4Scaler),
+  ARA_HK_ARRAY(AraEventHk_t,t1Scaler),
+  ARA_HK_ARRAY(AraEventHk_t,vdlyDac),
+  ARA_HK_ARRAY(AraEventHk_t,vadjDac),
+  ARA_HK_ARRAY(AraEventHk_t,thresholdDac),
+  ARA_HK_ARRAY(AraEventHk_t,surfaceThresholdDac),
+  ARA_HK_FIELD(AraEventHk_t,evReadoutError),
+  ARA_HK_FIELD(AraEventHk_t,evReadoutCountAvg),
+  ARA_HK_FIELD(AraEventHk_t,evReadoutCountMin),
+  ARA_HK_FIELD(AraEventHk_t,blockBuffCountAvg),
+  ARA_HK_FIELD(AraEventHk_t,blockBuffCountMax),
+  ARA_HK_FIELD(AraEventHk_t,digDeadTime),
+  ARA_HK_FIELD(AraEventHk_t,buffDeadTime),
+  ARA_HK_FIELD(AraEventHk_t,totalDeadTime),
+  {"ppsFlags",offsetof(AraEventHk_t,gHdr.alsoReserved),4,1}
+};
+#define NUM_EVENT_HK_FIELDS (sizeof(fEventHkFields)/sizeof(AraHkField_t))
+
+static const AraHkField_t fSensorHkFields[]={
+  ARA_HK_FIELD(AraSensorHk_t,atriVoltage),
+  ARA_HK_FIELD(AraSensorHk_t,atriCurrent),
+  ARA_HK_ARRAY(AraSensorHk_t,ddaTemp),
+  ARA_HK_ARRAY(AraSensorHk_t,tdaTemp),
+  ARA_HK_ARRAY(AraSensorHk_t,ddaVoltageCurrent),
+  ARA_HK_ARRAY(AraSensorHk_t,tdaVoltageCurrent)
+};
+#define NUM_SENSOR_HK_FIELDS (sizeof(fSensorHkFields)/sizeof(AraHkField_t))
+
+static const int64_t fTierBucketMs[ARA_HK_NUM_TIERS]={0,60000,3600000};
+
+typedef void (*AraHkVisitor_t)(const AraHkPoint_t *point, void *arg);
+
+
+static int countFieldElements(const AraHkField_t *fields, int numFields)
+{
+  int i,count=0;
+  for(i=0;i<numFields;i++) count+=fields[i].count;
+  return count;
+}
+
+static double getFieldValue(const void *record, const AraHkField_t *field, int element)
+{
+  const uint8_t *ptr=(const uint8_t*)record+field->offset+element*field->size;
+  uint8_t value8;
+  uint16_t value16;
+  uint32_t value32;
+  uint64_t value64;
+  switch(field->size) {
+  case 1: memcpy(&value8,ptr,1); return value8;
+  case 2: memcpy(&value16,ptr,2); return value16;
+  case 4: memcpy(&value32,ptr,4); return value32;
+  default: memcpy(&value64,ptr,8); return value64;
+  }
+}
+
+static void nameSeries(AraHkSeries_t *series, const char *prefix, const AraHkField_t *field, int element)
+{
+  if(field->count>1)
+    snprintf(series->name,ARA_HK_SERIES_NAME_LENGTH,"%s.%s[%d]",prefix,field->name,element);
+  else
+    snprintf(series->name,ARA_HK_SERIES_NAME_LENGTH,"%s.%s",prefix,field->name);
+}
+
+
+int araHkStoreInit(AraHkStore_t *store, const int *chunksPerTier)
+{
+  int numEventSeries=countFieldElements(fEventHkFields,NUM_EVENT_HK_FIELDS);
+  int numSensorSeries=countFieldElements(fSensorHkFields,NUM_SENSOR_HK_FIELDS);
+  int chunksPerSeries=0;
+  int seriesNum,fieldNum,element,tier;
+  AraHkChunk_t *nextChunk;
+
+  memset(store,0,sizeof(AraHkStore_t));
+  for(tier=0;tier<ARA_HK_NUM_TIERS;tier++) {
+    if(chunksPerTier[tier]<1) return -1;
+    chunksPerSeries+=chunksPerTier[tier];
+  }
+  store->numSeries=numEventSeries+numSensorSeries;
+  store->numEventHkSeries=numEventSeries;
+  store->series=(AraHkSeries_t*)calloc(store->numSeries,sizeof(AraHkSeries_t));
+  store->chunkMemory=(AraHkChunk_t*)calloc((size_t)store->numSeries*chunksPerSeries,sizeof(AraHkChunk_t));
+  if(!store->series || !store->chunkMemory) {
+    araHkStoreFree(store);
+    return -1;
+  }
+  store->numBytes=store->numSeries*sizeof(AraHkSeries_t)+(size_t)store->numSeries*chunksPerSeries*sizeof(AraHkChunk_t);
+
+  seriesNum=0;
+  for(fieldNum=0;fieldNum<NUM_EVENT_HK_FIELDS;fieldNum++)
+    for(element=0;element<fEventHkFields[fieldNum].count;element++)
+      nameSeries(&store->series[seriesNum++],"eventHk",&fEventHkFields[fieldNum],element);
+  for(fieldNum=0;fieldNum<NUM_SENSOR_HK_FIELDS;fieldNum++)
+    for(element=0;element<fSensorHkFields[fieldNum].count;element++)
+      nameSeries(&store->series[seriesNum++],"sensorHk",&fSensorHkFields[fieldNum],element);
+
+  nextChunk=store->chunkMemory;
+  for(seriesNum=0;seriesNum<store->numSeries;seriesNum++) {
+    for(tier=0;tier<ARA_HK_NUM_TIERS;tier++) {
+      AraHkTier_t *tierPtr=&store->series[seriesNum].tiers[tier];
+      tierPtr->numValues=(tier==ARA_HK_TIER_RAW) ? 1 : 3;
+      tierPtr->numChunks=chunksPerTier[tier];
+      tierPtr->bucketMs=fTierBucketMs[tier];
+      tierPtr->chunks=nextChunk;
+      nextChunk+=chunksPerTier[tier];
+    }
+  }
+  return 0;
+}
+
+void araHkStoreFree(AraHkStore_t *store)
+{
+  free(store->series);
+  free(store->chunkMemory);
+  store->series=NULL;
+  store->chunkMemory=NULL;
+  store->numSeries=0;
+}
+
+
+static void putBits(AraHkChunk_t *chunk, uint64_t value, int numBits)
+{
+  int bit;
+  for(bit=numBits-1;bit>=0;bit--) {
+    if((value>>bit)&1) chunk->data[chunk->numBits>>3]|=0x80>>(chunk->numBits&7);
+    chunk->numBits++;
+  }
+}
+
+static uint64_t getBits(const AraHkChunk_t *chunk, uint32_t *position, int numBits)
+{
+  uint64_t value=0;
+  int bit;
+  for(bit=0;bit<numBits;bit++) {
+    value<<=1;
+    if(chunk->data[*position>>3]&(0x80>>(*position&7))) value|=1;
+    (*position)++;
+  }
+  return value;
+}
+
+static uint64_t doubleToBits(double value)
+{
+  uint64_t bits;
+  memcpy(&bits,&value,sizeof(uint64_t));
+  return bits;
+}
+
+static double bitsToDouble(uint64_t bits)
+{
+  double value;
+  memcpy(&value,&bits,sizeof(double));
+  return value;
+}
+
+
+static void putValue(AraHkTier_t *tier, AraHkChunk_t *chunk, int valueNum, double value)
+{
+  uint64_t bits=doubleToBits(value);
+  uint64_t xorBits=bits^tier->lastBits[valueNum];
+  int leading,trailing,numSignificant;
+  tier->lastBits[valueNum]=bits;
+  if(xorBits==0) {
+    putBits(chunk,0,1);
+    return;
+  }
+  leading=__builtin_clzll(xorBits);
+  trailing=__builtin_ctzll(xorBits);
+  if(leading>31) leading=31;
+  if(leading>=tier->lastLeading[valueNum] && trailing>=tier->lastTrailing[valueNum]) {
+    //Fits in the previous window
+    numSignificant=64-tier->lastLeading[valueNum]-tier->lastTrailing[valueNum];
+    putBits(chunk,2,2);
+    putBits(chunk,xorBits>>tier->lastTrailing[valueNum],numSignificant);
+    return;
+  }
+  numSignificant=64-leading-trailing;
+  putBits(chunk,3,2);
+  putBits(chunk,leading,5);
+  putBits(chunk,numSignificant-1,6);
+  putBits(chunk,xorBits>>trailing,numSignificant);
+  tier->lastLeading[valueNum]=leading;
+  tier->lastTrailing[valueNum]=trailing;
+}
+
+static void startChunk(AraHkTier_t *tier)
+{
+  int valueNum;
+  if(tier->numUsed>0) tier->current=(tier->current+1)%tier->numChunks;
+  if(tier->numUsed<tier->numChunks) tier->numUsed++;
+  memset(&tier->chunks[tier->current],0,sizeof(AraHkChunk_t));
+  tier->lastDeltaMs=0;
+  for(valueNum=0;valueNum<ARA_HK_MAX_VALUES;valueNum++) {
+    //No window yet, so the first non zero XOR always sends its own
+    tier->lastLeading[valueNum]=64;
+    tier->lastTrailing[valueNum]=64;
+  }
+}
+
+static int appendPoint(AraHkTier_t *tier, int64_t timeMs, const double *values)
+{
+  AraHkChunk_t *chunk=&tier->chunks[tier->current];
+  int64_t deltaMs=0,deltaOfDelta=0;
+  int valueNum;
+  int newChunk=(tier->numUsed==0);
+
+  if(!newChunk) {
+    if(timeMs<=tier->lastTimeMs) return -1;
+    deltaMs=timeMs-tier->lastTimeMs;
+    deltaOfDelta=deltaMs-tier->lastDeltaMs;
+    if(chunk->numBits+ARA_HK_WORST_TIME_BITS+tier->numValues*ARA_HK_WORST_VALUE_BITS>ARA_HK_CHUNK_BYTES*8 ||
+       deltaOfDelta>INT32_MAX || deltaOfDelta<INT32_MIN || chunk->numPoints==UINT16_MAX)
+      newChunk=1;
+  }
+
+  if(newChunk) {
+    //The first point of a chunk is stored as is so each chunk decodes on its own
+    startChunk(tier);
+    chunk=&tier->chunks[tier->current];
+    chunk->startTimeMs=timeMs;
+    putBits(chunk,(uint64_t)timeMs,64);
+    for(valueNum=0;valueNum<tier->numValues;valueNum++) {
+      tier->lastBits[valueNum]=doubleToBits(values[valueNum]);
+      putBits(chunk,tier->lastBits[valueNum],64);
+    }
+  }
+  else {
+    if(deltaOfDelta==0) putBits(chunk,0,1);
+    else if(deltaOfDelta>=-63 && deltaOfDelta<=64) {
+      putBits(chunk,2,2);
+      putBits(chunk,deltaOfDelta+63,7);
+    }
+    else if(deltaOfDelta>=-255 && deltaOfDelta<=256) {
+      putBits(chunk,6,3);
+      putBits(chunk,deltaOfDelta+255,9);
+    }
+    else if(deltaOfDelta>=-2047 && deltaOfDelta<=2048) {
+      putBits(chunk,14,4);
+      putBits(chunk,deltaOfDelta+2047,12);
+    }
+    else {
+      putBits(chunk,15,4);
+      putBits(chunk,(uint32_t)(int32_t)deltaOfDelta,32);
+    }
+    tier->lastDeltaMs=deltaMs;
+    for(valueNum=0;valueNum<tier->numValues;valueNum++)
+      putValue(tier,chunk,valueNum,values[valueNum]);
+  }
+  tier->lastTimeMs=timeMs;
+  chunk->endTimeMs=timeMs;
+  chunk->numPoints++;
+  return 0;
+}
+
+
+static void decodeChunk(const AraHkChunk_t *chunk, int numValues, int64_t startTimeMs, int64_t endTimeMs,
+			AraHkVisitor_t visitor, void *arg)
+{
+  AraHkPoint_t point;
+  uint64_t bits[ARA_HK_MAX_VALUES];
+  uint8_t leading[ARA_HK_MAX_VALUES],trailing[ARA_HK_MAX_VALUES];
+  uint32_t position=0;
+  int64_t timeMs=0,deltaMs=0,deltaOfDelta;
+  int pointNum,valueNum,numSignificant;
+  uint64_t xorBits;
+
+  memset(leading,0,sizeof(leading));
+  memset(trailing,0,sizeof(trailing));
+  for(pointNum=0;pointNum<chunk->numPoints;pointNum++) {
+    if(pointNum==0) {
+      timeMs=(int64_t)getBits(chunk,&position,64);
+      for(valueNum=0;valueNum<numValues;valueNum++)
+	bits[valueNum]=getBits(chunk,&position,64);
+    }
+    else {
+      if(!getBits(chunk,&position,1)) deltaOfDelta=0;
+      else if(!getBits(chunk,&position,1)) deltaOfDelta=(int64_t)getBits(chunk,&position,7)-63;
+      else if(!getBits(chunk,&position,1)) deltaOfDelta=(int64_t)getBits(chunk,&position,9)-255;
+      else if(!getBits(chunk,&position,1)) deltaOfDelta=(int64_t)getBits(chunk,&position,12)-2047;
+      else deltaOfDelta=(int32_t)(uint32_t)getBits(chunk,&position,32);
+      deltaMs+=deltaOfDelta;
+      timeMs+=deltaMs;
+      for(valueNum=0;valueNum<numValues;valueNum++) {
+	if(!getBits(chunk,&position,1)) continue;
+	if(getBits(chunk,&position,1)) {
+	  leading[valueNum]=getBits(chunk,&position,5);
+	  numSignificant=getBits(chunk,&position,6)+1;
+	  trailing[valueNum]=64-leading[valueNum]-numSignificant;
+	}
+	numSignificant=64-leading[valueNum]-trailing[valueNum];
+	xorBits=getBits(chunk,&position,numSignificant);
+	bits[valueNum]^=xorBits<<trailing[valueNum];
+      }
+    }
+    if(timeMs<startTimeMs || timeMs>endTimeMs) continue;
+    point.timeMs=timeMs;
+    point.value=bitsToDouble(bits[0]);
+    point.min=(numValues==3) ? bitsToDouble(bits[1]) : point.value;
+    point.max=(numValues==3) ? bitsToDouble(bits[2]) : point.value;
+    visitor(&point,arg);
+  }
+}
+
+static void visitTier(const AraHkTier_t *tier, int64_t startTimeMs, int64_t endTimeMs, AraHkVisitor_t visitor, void *arg)
+{
+  //Oldest chunk first
+  int first=(tier->numUsed<tier->numChunks) ? 0 : (tier->current+1)%tier->numChunks;
+  int chunkNum;
+  for(chunkNum=0;chunkNum<tier->numUsed;chunkNum++) {
+    const AraHkChunk_t *chunk=&tier->chunks[(first+chunkNum)%tier->numChunks];
+    if(chunk->endTimeMs<startTimeMs || chunk->startTimeMs>endTimeMs) continue;
+    decodeChunk(chunk,tier->numValues,startTimeMs,endTimeMs,visitor,arg);
+  }
+}
+
+
+static void addToSeries(AraHkStore_t *store, AraHkSeries_t *series, int64_t timeMs, double value)
+{
+  double bucketValues[ARA_HK_MAX_VALUES];
+  int64_t bucketStartMs;
+  int tier;
+
+  if(appendPoint(&series->tiers[ARA_HK_TIER_RAW],timeMs,&value)<0) {
+    store->numRejected++;
+    return;
+  }
+  for(tier=ARA_HK_TIER_RAW+1;tier<ARA_HK_NUM_TIERS;tier++) {
+    AraHkTier_t *tierPtr=&series->tiers[tier];
+    AraHkBucket_t *bucket=&tierPtr->bucket;
+    bucketStartMs=(timeMs/tierPtr->bucketMs)*tierPtr->bucketMs;
+    if(bucket->count && bucketStartMs!=bucket->startTimeMs) {
+      //Close the bucket, it is stored at its start time
+      bucketValues[0]=bucket->sum/bucket->count;
+      bucketValues[1]=bucket->min;
+      bucketValues[2]=bucket->max;
+      appendPoint(tierPtr,bucket->startTimeMs,bucketValues);
+      bucket->count=0;
+    }
+    if(!bucket->count) {
+      bucket->startTimeMs=bucketStartMs;
+      bucket->sum=0;
+      bucket->min=value;
+      bucket->max=value;
+    }
+    bucket->sum+=value;
+    if(value<bucket->min) bucket->min=value;
+    if(value>bucket->max) bucket->max=value;
+    bucket->count++;
+  }
+}
+
+static void addRecord(AraHkStore_t *store, int firstSeries, const void *record, const AraHkField_t *fields, int numFields,
+		      int64_t timeMs)
+{
+  int seriesNum=firstSeries;
+  int fieldNum,element;
+  for(fieldNum=0;fieldNum<numFields;fieldNum++)
+    for(element=0;element<fields[fieldNum].count;element++)
+      addToSeries(store,&store->series[seriesNum++],timeMs,getFieldValue(record,&fields[fieldNum],element));
+}
+
+int araHkStoreAddEventHk(AraHkStore_t *store, const AraEventHk_t *eventHk)
+{
+  int64_t timeMs=(int64_t)eventHk->unixTime*1000+eventHk->unixTimeUs/1000;
+  addRecord(store,0,eventHk,fEventHkFields,NUM_EVENT_HK_FIELDS,timeMs);
+  store->numEventHk++;
+  return 0;
+}
+
+int araHkStoreAddSensorHk(AraHkStore_t *store, const AraSensorHk_t *sensorHk)
+{
+  int64_t timeMs=(int64_t)sensorHk->unixTime*1000+sensorHk->unixTimeUs/1000;
+  addRecord(store,store->numEventHkSeries,sensorHk,fSensorHkFields,NUM_SENSOR_HK_FIELDS,timeMs);
+  store->numSensorHk++;
+  return 0;
+}
+
+
+int araHkStoreFindSeries(const AraHkStore_t *store, const char *name)
+{
+  int seriesNum;
+  for(seriesNum=0;seriesNum<store->numSeries;seriesNum++)
+    if(strncmp(store->series[seriesNum].name,name,ARA_HK_SERIES_NAME_LENGTH)==0) return seriesNum;
+  return -1;
+}
+
+int araHkStoreChooseTier(const AraHkStore_t *store, int seriesIndex, int64_t startTimeMs)
+{
+  const AraHkSeries_t *series=&store->series[seriesIndex];
+  int tier,oldest,lastWithData=ARA_HK_TIER_RAW;
+  for(tier=0;tier<ARA_HK_NUM_TIERS;tier++) {
+    const AraHkTier_t *tierPtr=&series->tiers[tier];
+    if(!tierPtr->numUsed) continue;
+    lastWithData=tier;
+    oldest=(tierPtr->numUsed<tierPtr->numChunks) ? 0 : (tierPtr->current+1)%tierPtr->numChunks;
+    if(tierPtr->chunks[oldest].startTimeMs<=startTimeMs) return tier;
+  }
+  return lastWithData;
+}
+
+
+typedef struct {
+  AraHkPoint_t *points;
+  int numPoints;
+  int maxPoints;
+} AraHkRangeArg_t;
+
+static void rangeVisitor(const AraHkPoint_t *point, void *arg)
+{
+  AraHkRangeArg_t *range=(AraHkRangeArg_t*)arg;
+  if(range->numPoints<range->maxPoints)
+    range->points[range->numPoints++]=*point;
+}
+
+int araHkStoreGetRange(const AraHkStore_t *store, int seriesIndex, int tier, int64_t startTimeMs, int64_t endTimeMs,
+		       AraHkPoint_t *points, int maxPoints)
+{
+  AraHkRangeArg_t range;
+  if(seriesIndex<0 || seriesIndex>=store->numSeries || tier<0 || tier>=ARA_HK_NUM_TIERS) return -1;
+  range.points=points;
+  range.numPoints=0;
+  range.maxPoints=maxPoints;
+  visitTier(&store->series[seriesIndex].tiers[tier],startTimeMs,endTimeMs,rangeVisitor,&range);
+  return range.numPoints;
+}
+
+static void aggregateVisitor(const AraHkPoint_t *point, void *arg)
+{
+  AraHkQueryReply_t *reply=(AraHkQueryReply_t*)arg;
+  if(reply->count==0 || point->min<reply->min) reply->min=point->min;
+  if(reply->count==0 || point->max>reply->max) reply->max=point->max;
+  reply->mean+=point->value;
+  reply->count++;
+}
+
+int araHkStoreAggregate(const AraHkStore_t *store, int seriesIndex, int tier, int64_t startTimeMs, int64_t endTimeMs,
+			AraHkQueryReply_t *reply)
+{
+  if(seriesIndex<0 || seriesIndex>=store->numSeries || tier<0 || tier>=ARA_HK_NUM_TIERS) return -1;
+  reply->count=0;
+  reply->mean=0;
+  reply->min=0;
+  reply->max=0;
+  visitTier(&store->series[seriesIndex].tiers[tier],startTimeMs,endTimeMs,aggregateVisitor,reply);
+  if(reply->count) reply->mean/=reply->count;
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+   ARA Hk Store  a fixed memory, compressed time series store of every
+   AraEventHk_t and AraSensorHk_t field.
+
+   Each field element (e.g. eventHk.l1Scaler[3]) is a series with three
+   tiers: the raw values, one minute buckets and one hour buckets. The
+   bucket tiers keep the mean, minimum and maximum of each bucket. Every
+   tier is a ring of fixed size chunks, when the ring is full the oldest
+   chunk is dropped, so the memory use never changes and each tier simply
+   reaches as far back as its chunks allow.
+
+   Within a chunk the points are Gorilla encoded: the time stamps as
+   delta of deltas and the values as the XOR with the previous value,
+   both with variable length codes. Slowly changing housekeeping costs a
+   few bits a point.
+
+   ARAHkStored fills the store from the ARAAcqd monitor shared memory and
+   answers queries over ARA_HK_STORE_SOCKET, araHkStoreQuery is the client
+   side of that.
+*/
+
+#ifndef ARA_HK_STORE_H
+#define ARA_HK_STORE_H
+#include <stdint.h>
+#include "araAtriStructures.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARA_HK_STORE_SOCKET "/tmp/araHkStore"
+
+#define ARA_HK_CHUNK_BYTES 256 ///< Encoded bytes per chunk
+#define ARA_HK_MAX_VALUES 3 ///< Values per point, one for raw points, mean/min/max for buckets
+#define ARA_HK_SERIES_NAME_LENGTH 40
+#define ARA_HK_MAX_QUERY_POINTS 20000 ///< Most points returned by a range query
+
+//! The tiers of each series
+enum {
+  ARA_HK_TIER_RAW=0,
+  ARA_HK_TIER_MINUTE=1,
+  ARA_HK_TIER_HOUR=2,
+  ARA_HK_NUM_TIERS
+};
+
+//! A fixed size block of encoded points
+typedef struct {
+  int64_t startTimeMs;
+  int64_t endTimeMs;
+  uint16_t numPoints;
+  uint16_t numBits;
+  uint8_t data[ARA_HK_CHUNK_BYTES];
+} AraHkChunk_t;
+
+//! Accumulates the raw points of a bucket tier until the bucket closes
+typedef struct {
+  int64_t startTimeMs;
+  double sum;
+  double min;
+  double max;
+  uint32_t count;
+} AraHkBucket_t;
+
+typedef struct {
+  int numValues;
+  int numChunks;
+  int current; ///< Chunk being written
+  int numUsed;
+  int64_t bucketMs; ///< Zero for the raw tier
+  AraHkBucket_t bucket;
+  //Encoder state for the current chunk
+  int64_t lastTimeMs;
+  int64_t lastDeltaMs;
+  uint64_t lastBits[ARA_HK_MAX_VALUES];
+  uint8_t lastLeading[ARA_HK_MAX_VALUES];
+  uint8_t lastTrailing[ARA_HK_MAX_VALUES];
+  AraHkChunk_t *chunks;
+} AraHkTier_t;
+
+typedef struct {
+  char name[ARA_HK_SERIES_NAME_LENGTH];
+  AraHkTier_t tiers[ARA_HK_NUM_TIERS];
+} AraHkSeries_t;
+
+typedef struct {
+  int numSeries;
+  int numEventHkSeries; ///< The event hk series come first
+  AraHkSeries_t *series;
+  AraHkChunk_t *chunkMemory;
+  size_t numBytes; ///< Total memory used
+  unsigned int numEventHk;
+  unsigned int numSensorHk;
+  unsigned int numRejected; ///< Points older than the last one in their series
+} AraHkStore_t;
+
+//! A decoded point, min and max equal the value for raw points
+typedef struct {
+  int64_t timeMs;
+  double value;
+  double min;
+  double max;
+} AraHkPoint_t;
+
+
+//Query protocol
+enum {
+  ARA_HK_QUERY_LIST=1, ///< Names of all the series
+  ARA_HK_QUERY_RANGE=2, ///< Points of one series between two times
+  ARA_HK_QUERY_AGGREGATE=3 ///< Count, mean, min and max of one series between two times
+};
+
+typedef struct {
+  uint32_t command;
+  int32_t tier; ///< -1 picks the finest tier reaching back to startTimeMs
+  int64_t startTimeMs;
+  int64_t endTimeMs;
+  uint32_t maxPoints;
+  char series[ARA_HK_SERIES_NAME_LENGTH];
+} AraHkQuery_t;
+
+//! Followed by numPoints AraHkPoint_t or numSeries names of ARA_HK_SERIES_NAME_LENGTH
+typedef struct {
+  int32_t status; ///< 0 okay, negative on error
+  int32_t tier;
+  uint32_t numPoints;
+  uint32_t numSeries;
+  uint32_t count;
+  double mean;
+  double min;
+  double max;
+} AraHkQueryReply_t;
+
+
+/** \brief Allocates a store with chunksPerTier[tier] chunks per tier per series. */
+int araHkStoreInit(AraHkStore_t *store, const int *chunksPerTier);
+void araHkStoreFree(AraHkStore_t *store);
+
+int araHkStoreAddEventHk(AraHkStore_t *store, const AraEventHk_t *eventHk);
+int araHkStoreAddSensorHk(AraHkStore_t *store, const AraSensorHk_t *sensorHk);
+
+/** \brief Returns the series index of name or -1. */
+int araHkStoreFindSeries(const AraHkStore_t *store, const char *name);
+
+/** \brief Finest tier whose oldest point is no later than startTimeMs. */
+int araHkStoreChooseTier(const AraHkStore_t *store, int seriesIndex, int64_t startTimeMs);
+
+/** \brief Decodes up to maxPoints points from [startTimeMs,endTimeMs], oldest first. Returns the number of points. */
+int araHkStoreGetRange(const AraHkStore_t *store, int seriesIndex, int tier, int64_t startTimeMs, int64_t endTimeMs,
+		       AraHkPoint_t *points, int maxPoints);
+
+/** \brief Fills reply->count, mean, min and max for [startTimeMs,endTimeMs]. Bucket tiers average the bucket means. */
+int araHkStoreAggregate(const AraHkStore_t *store, int seriesIndex, int tier, int64_t startTimeMs, int64_t endTimeMs,
+			AraHkQueryReply_t *reply);
+
+/** \brief Answers one query on fd, as used by ARAHkStored. */
+int araHkStoreServeQuery(const AraHkStore_t *store, int fd, const AraHkQuery_t *query);
+
+//Client side
+int araHkStoreConnect();
+/** \brief Sends a query and reads the reply header. The points or names that follow are read into buffer (up to bufferBytes). */
+int araHkStoreQuery(int fd, const AraHkQuery_t *query, AraHkQueryReply_t *reply, void *buffer, size_t bufferBytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_HK_STORE_H
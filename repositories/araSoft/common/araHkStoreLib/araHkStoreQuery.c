@@ -0,0 +1,140 @@
+/*
+   ARA Hk Store  the query protocol spoken over ARA_HK_STORE_SOCKET, both
+   the ARAHkStored side and the client side.
+*/
+
+#include "araHkStore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+static int writeAll(int fd, const void *buffer, size_t numBytes)
+{
+  const char *ptr=(const char*)buffer;
+  while(numBytes>0) {
+    ssize_t numWritten=write(fd,ptr,numBytes);
+    if(numWritten<0 && errno==EINTR) continue;
+    if(numWritten<=0) return -1;
+    ptr+=numWritten;
+    numBytes-=numWritten;
+  }
+  return 0;
+}
+
+static int readAll(int fd, void *buffer, size_t numBytes)
+{
+  char *ptr=(char*)buffer;
+  while(numBytes>0) {
+    ssize_t numRead=read(fd,ptr,numBytes);
+    if(numRead<0 && errno==EINTR) continue;
+    if(numRead<=0) return -1;
+    ptr+=numRead;
+    numBytes-=numRead;
+  }
+  return 0;
+}
+
+
+int araHkStoreServeQuery(const AraHkStore_t *store, int fd, const AraHkQuery_t *query)
+{
+  AraHkQueryReply_t reply;
+  AraHkPoint_t *points=NULL;
+  char seriesName[ARA_HK_SERIES_NAME_LENGTH];
+  int seriesIndex=-1;
+  int maxPoints;
+  int retVal=0;
+  int seriesNum;
+
+  memset(&reply,0,sizeof(AraHkQueryReply_t));
+  if(query->command!=ARA_HK_QUERY_LIST) {
+    strncpy(seriesName,query->series,ARA_HK_SERIES_NAME_LENGTH-1);
+    seriesName[ARA_HK_SERIES_NAME_LENGTH-1]='\0';
+    seriesIndex=araHkStoreFindSeries(store,seriesName);
+    if(seriesIndex<0) {
+      reply.status=-1;
+      return writeAll(fd,&reply,sizeof(AraHkQueryReply_t));
+    }
+    reply.tier=query->tier;
+    if(reply.tier<0 || reply.tier>=ARA_HK_NUM_TIERS)
+      reply.tier=araHkStoreChooseTier(store,seriesIndex,query->startTimeMs);
+  }
+
+  switch(query->command) {
+  case ARA_HK_QUERY_LIST:
+    reply.numSeries=store->numSeries;
+    retVal=writeAll(fd,&reply,sizeof(AraHkQueryReply_t));
+    for(seriesNum=0;seriesNum<store->numSeries && retVal==0;seriesNum++)
+      retVal=writeAll(fd,store->series[seriesNum].name,ARA_HK_SERIES_NAME_LENGTH);
+    return retVal;
+
+  case ARA_HK_QUERY_RANGE:
+    maxPoints=query->maxPoints;
+    if(maxPoints<=0 || maxPoints>ARA_HK_MAX_QUERY_POINTS) maxPoints=ARA_HK_MAX_QUERY_POINTS;
+    points=(AraHkPoint_t*)malloc(maxPoints*sizeof(AraHkPoint_t));
+    if(!points) {
+      reply.status=-2;
+      return writeAll(fd,&reply,sizeof(AraHkQueryReply_t));
+    }
+    reply.numPoints=araHkStoreGetRange(store,seriesIndex,reply.tier,query->startTimeMs,query->endTimeMs,points,maxPoints);
+    retVal=writeAll(fd,&reply,sizeof(AraHkQueryReply_t));
+    if(retVal==0 && reply.numPoints>0)
+      retVal=writeAll(fd,points,reply.numPoints*sizeof(AraHkPoint_t));
+    free(points);
+    return retVal;
+
+  case ARA_HK_QUERY_AGGREGATE:
+    araHkStoreAggregate(store,seriesIndex,reply.tier,query->startTimeMs,query->endTimeMs,&reply);
+    return writeAll(fd,&reply,sizeof(AraHkQueryReply_t));
+
+  default:
+    reply.status=-3;
+    return writeAll(fd,&reply,sizeof(AraHkQueryReply_t));
+  }
+}
+
+
+int araHkStoreConnect()
+{
+  struct sockaddr_un u_addr;
+  int fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if(fd<0) return -1;
+  memset(&u_addr,0,sizeof(struct sockaddr_un));
+  u_addr.sun_family=AF_UNIX;
+  strcpy(u_addr.sun_path,ARA_HK_STORE_SOCKET);
+  if(connect(fd,(struct sockaddr*)&u_addr,sizeof(struct sockaddr_un))<0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int araHkStoreQuery(int fd, const AraHkQuery_t *query, AraHkQueryReply_t *reply, void *buffer, size_t bufferBytes)
+{
+  //Returns the number of points or names read into buffer, or -1
+  size_t itemBytes,numItems,numFit,itemNum;
+  char discard[sizeof(AraHkPoint_t)>ARA_HK_SERIES_NAME_LENGTH ? sizeof(AraHkPoint_t) : ARA_HK_SERIES_NAME_LENGTH];
+
+  if(writeAll(fd,query,sizeof(AraHkQuery_t))<0) return -1;
+  if(readAll(fd,reply,sizeof(AraHkQueryReply_t))<0) return -1;
+  if(reply->numSeries) {
+    itemBytes=ARA_HK_SERIES_NAME_LENGTH;
+    numItems=reply->numSeries;
+  }
+  else {
+    itemBytes=sizeof(AraHkPoint_t);
+    numItems=reply->numPoints;
+  }
+  numFit=bufferBytes/itemBytes;
+  if(numFit>numItems) numFit=numItems;
+  if(numFit && readAll(fd,buffer,numFit*itemBytes)<0) return -1;
+  //Drain anything that didn't fit so the connection stays usable
+  for(itemNum=numFit;itemNum<numItems;itemNum++)
+    if(readAll(fd,discard,itemBytes)<0) return -1;
+  return numFit;
+}
@@ -0,0 +1,138 @@
+/*
+   ARA Monitor  shared memory snapshot of the live ARAAcqd state, see araMonitor.h
+*/
+
+#include "araMonitor.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+
+AraMonitorSegment_t *araMonitorCreate(const char *shmName)
+{
+  AraMonitorSegment_t *segment;
+  int fd=shm_open(shmName,O_RDWR|O_CREAT,0644);
+  if(fd<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: shm_open %s -- %s\n",__FUNCTION__,shmName,strerror(errno));
+    return NULL;
+  }
+  if(ftruncate(fd,sizeof(AraMonitorSegment_t))<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: ftruncate %s -- %s\n",__FUNCTION__,shmName,strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  segment=(AraMonitorSegment_t*)mmap(NULL,sizeof(AraMonitorSegment_t),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if(segment==MAP_FAILED) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: mmap %s -- %s\n",__FUNCTION__,shmName,strerror(errno));
+    return NULL;
+  }
+
+  //Readers check the magic last, so clear it first
+  segment->magic=0;
+  __sync_synchronize();
+  memset(segment,0,sizeof(AraMonitorSegment_t));
+  segment->version=ARA_MONITOR_VERSION;
+  segment->size=sizeof(AraMonitorSegment_t);
+  segment->pid=getpid();
+  __sync_synchronize();
+  segment->magic=ARA_MONITOR_MAGIC;
+  return segment;
+}
+
+
+void araMonitorDestroy(AraMonitorSegment_t *segment, const char *shmName)
+{
+  if(segment) {
+    segment->magic=0;
+    munmap(segment,sizeof(AraMonitorSegment_t));
+  }
+  shm_unlink(shmName);
+}
+
+
+void araMonitorPublish(AraMonitorSeqlock_t *lock, void *section, const void *src, size_t numBytes)
+{
+  struct timeval timeNow;
+  gettimeofday(&timeNow,NULL);
+  lock->sequence++;
+  __sync_synchronize();
+  memcpy(section,src,numBytes);
+  lock->numUpdates++;
+  lock->updateUnixTime=timeNow.tv_sec;
+  lock->updateUnixTimeUs=timeNow.tv_usec;
+  __sync_synchronize();
+  lock->sequence++;
+}
+
+
+AraMonitorSegment_t *araMonitorAttach(const char *shmName)
+{
+  AraMonitorSegment_t *segment;
+  struct stat shmStat;
+  int fd=shm_open(shmName,O_RDONLY,0);
+  if(fd<0) return NULL;
+  if(fstat(fd,&shmStat)<0 || shmStat.st_size<sizeof(AraMonitorSegment_t)) {
+    close(fd);
+    return NULL;
+  }
+  segment=(AraMonitorSegment_t*)mmap(NULL,sizeof(AraMonitorSegment_t),PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(segment==MAP_FAILED) return NULL;
+  if(segment->magic!=ARA_MONITOR_MAGIC || segment->version!=ARA_MONITOR_VERSION ||
+     segment->size!=sizeof(AraMonitorSegment_t)) {
+    munmap(segment,sizeof(AraMonitorSegment_t));
+    return NULL;
+  }
+  return segment;
+}
+
+
+void araMonitorDetach(AraMonitorSegment_t *segment)
+{
+  if(segment) munmap(segment,sizeof(AraMonitorSegment_t));
+}
+
+
+int araMonitorRead(const AraMonitorSeqlock_t *lock, const void *section, void *dest, size_t numBytes)
+{
+  uint32_t before,after,numUpdates;
+  int tries;
+  for(tries=0;tries<ARA_MONITOR_READ_RETRIES;tries++) {
+    before=lock->sequence;
+    if(before&1) {
+      //Mid write, let the writer finish
+      sched_yield();
+      continue;
+    }
+    __sync_synchronize();
+    memcpy(dest,section,numBytes);
+    numUpdates=lock->numUpdates;
+    __sync_synchronize();
+    after=lock->sequence;
+    if(before==after) return numUpdates;
+  }
+  return -1;
+}
+
+
+int araMonitorGetEventHk(const AraMonitorSegment_t *segment, AraEventHk_t *eventHk)
+{
+  return araMonitorRead(&segment->eventHkLock,&segment->eventHk,eventHk,sizeof(AraEventHk_t));
+}
+
+int araMonitorGetSensorHk(const AraMonitorSegment_t *segment, AraSensorHk_t *sensorHk)
+{
+  return araMonitorRead(&segment->sensorHkLock,&segment->sensorHk,sensorHk,sizeof(AraSensorHk_t));
+}
+
+int araMonitorGetStatus(const AraMonitorSegment_t *segment, AraMonitorStatus_t *status)
+{
+  return araMonitorRead(&segment->statusLock,&segment->status,status,sizeof(AraMonitorStatus_t));
+}
@@ -0,0 +1,141 @@
+/*
+   ARA Monitor  a POSIX shared memory snapshot of the live ARAAcqd state.
+
+   ARAAcqd publishes the latest event and sensor housekeeping, the event
+   rates, the servo DAC values and its pipeline statistics into a shared
+   memory segment. Each section is protected by its own seqlock: the one
+   writer bumps the sequence number to odd, copies the data and bumps it
+   back to even, readers copy the data and retry if the sequence number
+   was odd or changed under them. Readers never block the writer and never
+   touch the ATRI, so any number of local monitoring tools can run at no
+   cost to the DAQ.
+*/
+
+#ifndef ARA_MONITOR_H
+#define ARA_MONITOR_H
+#include <stdint.h>
+#include <stddef.h>
+#include "araAtriStructures.h"
+#include "atriDefines.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARA_MONITOR_SHM_NAME "/araacqd.monitor"
+#define ARA_MONITOR_MAGIC 0x4e4d5241 ///< "ARMN"
+#define ARA_MONITOR_VERSION 1
+#define ARA_MONITOR_READ_RETRIES 1000 ///< Give up on a section if the writer seems stuck
+#define ARA_MONITOR_NUM_SOFT_TRIG_SOURCES 2 ///< Forced and random
+#define ARA_MONITOR_MAX_HK_TASKS 8
+#define ARA_MONITOR_TASK_NAME_LENGTH 16
+
+//! Leads every section of the segment
+typedef struct {
+  volatile uint32_t sequence; ///< Odd while the section is being written
+  uint32_t numUpdates;
+  uint64_t updateUnixTime;
+  uint32_t updateUnixTimeUs;
+  uint32_t reserved;
+} AraMonitorSeqlock_t;
+
+typedef struct {
+  uint32_t numPackets;
+  uint32_t depth;
+  uint32_t maxDepth;
+  float meanLatencyUs;
+  float maxLatencyUs;
+} AraMonitorQueueStats_t;
+
+typedef struct {
+  uint32_t numSent;
+  uint32_t numFailed;
+  uint32_t numLate;
+  uint32_t numSkipped;
+  float meanJitterUs;
+  float maxJitterUs;
+} AraMonitorSoftTrigStats_t;
+
+typedef struct {
+  char name[ARA_MONITOR_TASK_NAME_LENGTH];
+  uint32_t numRuns;
+  uint32_t numOverruns;
+  float maxRunTimeUs;
+  float maxLatencyUs;
+} AraMonitorHkTaskStats_t;
+
+//! Run state, rates, servo settings and pipeline statistics
+typedef struct {
+  int32_t runNumber;
+  int32_t programState; ///< AraProgramStatus_t
+  uint32_t nextEventNumber; ///< Next software event number
+  float eventRateHz; ///< Good event rate at the last rate report
+  uint32_t numGoodEvents; ///< Since the rate report before that
+  uint32_t numBadEvents;
+  int64_t lastSoftwareTrigger; ///< Unix time
+  int64_t lastEventRead; ///< Unix time
+  uint16_t thresholdDac[NUM_L1_SCALERS];
+  uint16_t surfaceThresholdDac[ANTS_PER_TDA];
+  uint16_t vdlyDac[DDA_PER_ATRI];
+  uint16_t vadjDac[DDA_PER_ATRI];
+  AraMonitorQueueStats_t controlQueue[ATRI_CONTROL_NUM_PRIORITIES];
+  AraMonitorSoftTrigStats_t softTrig[ARA_MONITOR_NUM_SOFT_TRIG_SOURCES];
+  uint32_t numHkTasks;
+  AraMonitorHkTaskStats_t hkTasks[ARA_MONITOR_MAX_HK_TASKS];
+} AraMonitorStatus_t;
+
+//! The whole shared memory segment
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; ///< sizeof(AraMonitorSegment_t) of the writer
+  int32_t pid; ///< Of the writer
+  AraMonitorSeqlock_t eventHkLock;
+  AraEventHk_t eventHk;
+  AraMonitorSeqlock_t sensorHkLock;
+  AraSensorHk_t sensorHk;
+  AraMonitorSeqlock_t statusLock;
+  AraMonitorStatus_t status;
+} AraMonitorSegment_t;
+
+
+/** \brief Creates (or takes over) the segment for writing.
+ *
+ * Returns NULL on failure. The segment is zeroed, so every section reads
+ * as never updated until the first publish.
+ */
+AraMonitorSegment_t *araMonitorCreate(const char *shmName);
+
+/** \brief Unmaps the segment and removes it. */
+void araMonitorDestroy(AraMonitorSegment_t *segment, const char *shmName);
+
+/** \brief Copies numBytes from src into the section protected by lock.
+ *
+ * Only one thread may publish to a given section.
+ */
+void araMonitorPublish(AraMonitorSeqlock_t *lock, void *section, const void *src, size_t numBytes);
+
+/** \brief Maps the segment read only.
+ *
+ * Returns NULL if there is no segment or it was written by an
+ * incompatible version.
+ */
+AraMonitorSegment_t *araMonitorAttach(const char *shmName);
+void araMonitorDetach(AraMonitorSegment_t *segment);
+
+/** \brief Takes a consistent copy of a section.
+ *
+ * Returns the number of updates the section has had (0 if it has never
+ * been written) or -1 if no consistent copy could be made.
+ */
+int araMonitorRead(const AraMonitorSeqlock_t *lock, const void *section, void *dest, size_t numBytes);
+
+int araMonitorGetEventHk(const AraMonitorSegment_t *segment, AraEventHk_t *eventHk);
+int araMonitorGetSensorHk(const AraMonitorSegment_t *segment, AraSensorHk_t *sensorHk);
+int araMonitorGetStatus(const AraMonitorSegment_t *segment, AraMonitorStatus_t *status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_MONITOR_H
@@ -0,0 +1,374 @@
+/*
+   ARA Pedestal  the pedestal accumulator, see araPedestal.h
+*/
+
+#include "araPedestal.h"
+#include "araSoft.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <math.h>
+
+
+static inline void accumulateChannelBlock(uint64_t *restrict sum, uint64_t *restrict sumSq, const uint16_t *restrict samples)
+{
+  //Straight line over the 64 samples so the compiler can vectorise it,
+  //a squared 12 bit sample always fits in 32 bits
+  int sample;
+  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+    uint32_t value=samples[sample];
+    sum[sample]+=value;
+    sumSq[sample]+=value*value;
+  }
+}
+
+
+static inline void trackChannelBlock(int32_t *restrict mean, uint32_t *restrict var, const uint16_t *restrict samples, int shift)
+{
+  //With a=1/2^shift, mean += a(x-mean) and var = (1-a)(var+a(x-mean)^2),
+  //all in integers so the result doesn't depend on rounding modes. A
+  //shift of 0 restarts the cell at x with no spread.
+  int sample;
+  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+    int32_t delta=((int32_t)samples[sample]<<ARA_PED_TRACK_FRAC_BITS)-mean[sample];
+    int64_t deltaSq=((int64_t)delta*delta)>>(2*ARA_PED_TRACK_FRAC_BITS-ARA_PED_TRACK_VAR_FRAC_BITS);
+    mean[sample]+=delta>>shift;
+    var[sample]+=(deltaSq-(deltaSq>>shift)-(int64_t)var[sample])>>shift;
+  }
+}
+
+
+static int trackShiftForCount(int trackShift, uint32_t count)
+{
+  //Until 2^trackShift events are in, weight the new one by about 1/(count+1)
+  int shift=0;
+  while(shift<trackShift && ((uint32_t)2<<shift)<=count+1) shift++;
+  return shift;
+}
+
+
+static int accumulateEventShard(AraPedestalAccumulator_t *acc, const AraPedestalEvent_t *event, int shard, int numShards)
+{
+  //Adds the blocks of the DDAs in this shard. Returns 0, or -1 if the
+  //event had to be cut short; every shard stops at the same place.
+  const AraStationEventBlockHeader_t *blkHeader;
+  uint16_t samples[SAMPLES_PER_BLOCK];
+  int eventByte=sizeof(AraStationEventHeader_t);
+  int blockReadout,dda,chan,block,realDda,cell;
+
+  for(blockReadout=0;blockReadout<event->numReadoutBlocks;blockReadout++) {
+    for(dda=0;dda<DDA_PER_ATRI;dda++) {
+      if(!event->stackEnabled[dda]) continue;
+      if(eventByte+sizeof(AraStationEventBlockHeader_t)+RFCHAN_PER_DDA*sizeof(AraStationEventBlockChannel_t)>event->numBytes)
+	return -1;
+      blkHeader=(const AraStationEventBlockHeader_t*)&event->data[eventByte];
+      eventByte+=sizeof(AraStationEventBlockHeader_t);
+      if(event->forcedBlock>=0) {
+	block=event->forcedBlock;
+      }
+      else {
+	block=(blkHeader->irsBlockNumber)&0x1ff;
+	realDda=(blkHeader->channelMask&0x300)>>8;
+	if(realDda!=dda) return -1;
+      }
+      if((dda%numShards)!=shard || (blockReadout==0 && event->skipFirstReadout)) {
+	eventByte+=RFCHAN_PER_DDA*sizeof(AraStationEventBlockChannel_t);
+	continue;
+      }
+      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+	//The blocks are only 2 byte aligned in the event
+	memcpy(samples,&event->data[eventByte],sizeof(samples));
+	eventByte+=sizeof(AraStationEventBlockChannel_t);
+	cell=araPedestalCellIndex(dda,block,chan,0);
+	if(acc->trackMean)
+	  trackChannelBlock(&acc->trackMean[cell],&acc->trackVar[cell],samples,
+			    trackShiftForCount(acc->trackShift,acc->count[cell/SAMPLES_PER_BLOCK]));
+	else
+	  accumulateChannelBlock(&acc->sum[cell],&acc->sumSq[cell],samples);
+	acc->count[cell/SAMPLES_PER_BLOCK]++;
+      }
+    }
+  }
+  return 0;
+}
+
+
+static void finishEvent(AraPedestalAccumulator_t *acc, AraPedestalEvent_t *event, int badEvent)
+{
+  //Called with the mutex held
+  if(badEvent) acc->numBadEvents++;
+  else acc->numEvents++;
+  event->numPending=0;
+}
+
+
+static void *pedestalWorker(void *ptr)
+{
+  AraPedestalWorker_t *arg=(AraPedestalWorker_t*)ptr;
+  AraPedestalAccumulator_t *acc=arg->acc;
+  AraPedestalEvent_t *event;
+  unsigned int next=0;
+  int retVal;
+
+  pthread_mutex_lock(&acc->mutex);
+  next=acc->tail;
+  while(1) {
+    while(next==acc->head && !acc->stopping)
+      pthread_cond_wait(&acc->workCond,&acc->mutex);
+    if(next==acc->head) break; //Stopping and nothing left
+    event=&acc->queue[next%ARA_PED_QUEUE_DEPTH];
+    pthread_mutex_unlock(&acc->mutex);
+
+    retVal=accumulateEventShard(acc,event,arg->shard,acc->numThreads);
+
+    pthread_mutex_lock(&acc->mutex);
+    if(--event->numPending==0) {
+      //Only the last shard counts the event, they all saw the same retVal
+      finishEvent(acc,event,retVal<0);
+      while(acc->tail!=acc->head && acc->queue[acc->tail%ARA_PED_QUEUE_DEPTH].numPending==0)
+	acc->tail++;
+      pthread_cond_broadcast(&acc->doneCond);
+    }
+    next++;
+  }
+  pthread_mutex_unlock(&acc->mutex);
+  return NULL;
+}
+
+
+static int initAccumulator(AraPedestalAccumulator_t *acc, int numThreads, int maxEventBytes, int trackShift)
+{
+  //trackShift<0 for the plain sums
+  int slot,thread;
+  memset(acc,0,sizeof(AraPedestalAccumulator_t));
+  if(numThreads<0) numThreads=0;
+  if(numThreads>ARA_PED_MAX_THREADS) numThreads=ARA_PED_MAX_THREADS;
+  acc->numThreads=numThreads;
+  acc->maxEventBytes=maxEventBytes;
+  acc->count=calloc(ARA_PED_NUM_CHANNEL_BLOCKS,sizeof(uint32_t));
+  if(trackShift<0) {
+    acc->sum=calloc(ARA_PED_NUM_CELLS,sizeof(uint64_t));
+    acc->sumSq=calloc(ARA_PED_NUM_CELLS,sizeof(uint64_t));
+  }
+  else {
+    acc->trackShift=trackShift>ARA_PED_TRACK_MAX_SHIFT ? ARA_PED_TRACK_MAX_SHIFT : trackShift;
+    acc->trackMean=calloc(ARA_PED_NUM_CELLS,sizeof(int32_t));
+    acc->trackVar=calloc(ARA_PED_NUM_CELLS,sizeof(uint32_t));
+    acc->dropWhenFull=1;
+  }
+  if(!acc->count || (trackShift<0 && (!acc->sum || !acc->sumSq)) || (trackShift>=0 && (!acc->trackMean || !acc->trackVar))) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't allocate the pedestal sums\n",__FUNCTION__);
+    acc->numThreads=0;
+    araPedestalFree(acc);
+    return -1;
+  }
+  pthread_mutex_init(&acc->mutex,NULL);
+  pthread_cond_init(&acc->workCond,NULL);
+  pthread_cond_init(&acc->doneCond,NULL);
+  if(numThreads==0) return 0;
+
+  for(slot=0;slot<ARA_PED_QUEUE_DEPTH;slot++) {
+    acc->queue[slot].data=malloc(maxEventBytes);
+    if(!acc->queue[slot].data) {
+      ARA_LOG_MESSAGE(LOG_ERR,"%s: can't allocate the event queue\n",__FUNCTION__);
+      acc->numThreads=0;
+      araPedestalFree(acc);
+      return -1;
+    }
+  }
+  for(thread=0;thread<numThreads;thread++) {
+    acc->workers[thread].acc=acc;
+    acc->workers[thread].shard=thread;
+    if(pthread_create(&acc->threads[thread],NULL,pedestalWorker,&acc->workers[thread])) {
+      ARA_LOG_MESSAGE(LOG_ERR,"%s: can't start pedestal worker %d\n",__FUNCTION__,thread);
+      acc->numThreads=thread;
+      araPedestalFree(acc);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int araPedestalInit(AraPedestalAccumulator_t *acc, int numThreads, int maxEventBytes)
+{
+  return initAccumulator(acc,numThreads,maxEventBytes,-1);
+}
+
+
+int araPedestalInitTracker(AraPedestalAccumulator_t *acc, int numThreads, int maxEventBytes, int trackShift)
+{
+  return initAccumulator(acc,numThreads,maxEventBytes,trackShift<0 ? 0 : trackShift);
+}
+
+
+void araPedestalFree(AraPedestalAccumulator_t *acc)
+{
+  int slot,thread;
+  if(acc->numThreads>0) {
+    pthread_mutex_lock(&acc->mutex);
+    acc->stopping=1;
+    pthread_cond_broadcast(&acc->workCond);
+    pthread_mutex_unlock(&acc->mutex);
+    for(thread=0;thread<acc->numThreads;thread++)
+      pthread_join(acc->threads[thread],NULL);
+  }
+  for(slot=0;slot<ARA_PED_QUEUE_DEPTH;slot++) {
+    free(acc->queue[slot].data);
+    acc->queue[slot].data=NULL;
+  }
+  free(acc->sum);
+  free(acc->sumSq);
+  free(acc->count);
+  free(acc->trackMean);
+  free(acc->trackVar);
+  acc->sum=NULL;
+  acc->sumSq=NULL;
+  acc->count=NULL;
+  acc->trackMean=NULL;
+  acc->trackVar=NULL;
+  acc->numThreads=0;
+}
+
+
+void araPedestalClear(AraPedestalAccumulator_t *acc)
+{
+  if(acc->sum) memset(acc->sum,0,sizeof(uint64_t)*ARA_PED_NUM_CELLS);
+  if(acc->sumSq) memset(acc->sumSq,0,sizeof(uint64_t)*ARA_PED_NUM_CELLS);
+  if(acc->trackMean) memset(acc->trackMean,0,sizeof(int32_t)*ARA_PED_NUM_CELLS);
+  if(acc->trackVar) memset(acc->trackVar,0,sizeof(uint32_t)*ARA_PED_NUM_CELLS);
+  memset(acc->count,0,sizeof(uint32_t)*ARA_PED_NUM_CHANNEL_BLOCKS);
+  acc->numEvents=0;
+  acc->numBadEvents=0;
+  acc->numDropped=0;
+}
+
+
+int araPedestalAddEvent(AraPedestalAccumulator_t *acc, const uint8_t *event, int numBytes, int numReadoutBlocks,
+			int forcedBlock, int skipFirstReadout, const int *stackEnabled)
+{
+  AraPedestalEvent_t *slot;
+  AraPedestalEvent_t inlineEvent;
+  int dda;
+
+  if(numBytes>acc->maxEventBytes) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: event of %d bytes is bigger than %d\n",__FUNCTION__,numBytes,acc->maxEventBytes);
+    return -1;
+  }
+
+  if(acc->numThreads==0) {
+    inlineEvent.numBytes=numBytes;
+    inlineEvent.numReadoutBlocks=numReadoutBlocks;
+    inlineEvent.forcedBlock=forcedBlock;
+    inlineEvent.skipFirstReadout=skipFirstReadout;
+    for(dda=0;dda<DDA_PER_ATRI;dda++)
+      inlineEvent.stackEnabled[dda]=stackEnabled ? stackEnabled[dda] : 1;
+    inlineEvent.data=(uint8_t*)event;
+    finishEvent(acc,&inlineEvent,accumulateEventShard(acc,&inlineEvent,0,1)<0);
+    return 0;
+  }
+
+  pthread_mutex_lock(&acc->mutex);
+  if(acc->dropWhenFull && acc->head-acc->tail>=ARA_PED_QUEUE_DEPTH) {
+    acc->numDropped++;
+    pthread_mutex_unlock(&acc->mutex);
+    return 1;
+  }
+  while(acc->head-acc->tail>=ARA_PED_QUEUE_DEPTH)
+    pthread_cond_wait(&acc->doneCond,&acc->mutex);
+  slot=&acc->queue[acc->head%ARA_PED_QUEUE_DEPTH];
+  pthread_mutex_unlock(&acc->mutex);
+
+  //The slot is ours until head moves past it
+  memcpy(slot->data,event,numBytes);
+  slot->numBytes=numBytes;
+  slot->numReadoutBlocks=numReadoutBlocks;
+  slot->forcedBlock=forcedBlock;
+  slot->skipFirstReadout=skipFirstReadout;
+  for(dda=0;dda<DDA_PER_ATRI;dda++)
+    slot->stackEnabled[dda]=stackEnabled ? stackEnabled[dda] : 1;
+  slot->numPending=acc->numThreads;
+
+  pthread_mutex_lock(&acc->mutex);
+  acc->head++;
+  pthread_cond_broadcast(&acc->workCond);
+  pthread_mutex_unlock(&acc->mutex);
+  return 0;
+}
+
+
+void araPedestalWait(AraPedestalAccumulator_t *acc)
+{
+  if(acc->numThreads==0) return;
+  pthread_mutex_lock(&acc->mutex);
+  while(acc->tail!=acc->head)
+    pthread_cond_wait(&acc->doneCond,&acc->mutex);
+  pthread_mutex_unlock(&acc->mutex);
+}
+
+
+uint32_t araPedestalGetCount(AraPedestalAccumulator_t *acc, int dda, int block, int chan)
+{
+  return acc->count[araPedestalCellIndex(dda,block,chan,0)/SAMPLES_PER_BLOCK];
+}
+
+
+void araPedestalGetMeanRmsFloat(AraPedestalAccumulator_t *acc, int dda, int block, int chan, int sample, double *mean, double *rms)
+{
+  //The sums are exact, so this is the only place any rounding happens
+  int cell=araPedestalCellIndex(dda,block,chan,sample);
+  uint32_t count=acc->count[cell/SAMPLES_PER_BLOCK];
+  double variance;
+  if(count==0) {
+    *mean=ARA_PED_EMPTY_MEAN;
+    *rms=0;
+    return;
+  }
+  if(acc->trackMean) {
+    *mean=acc->trackMean[cell]*(1./(1<<ARA_PED_TRACK_FRAC_BITS));
+    variance=acc->trackVar[cell]*(1./(1<<ARA_PED_TRACK_VAR_FRAC_BITS));
+  }
+  else {
+    *mean=(double)acc->sum[cell]/count;
+    variance=(double)acc->sumSq[cell]/count-(*mean)*(*mean);
+  }
+  *rms=variance>0 ? sqrt(variance) : 0;
+}
+
+
+void araPedestalGetMeanRms(AraPedestalAccumulator_t *acc, int dda, int block, int chan, int sample, int *mean, int *rms)
+{
+  double meanValue,rmsValue;
+  araPedestalGetMeanRmsFloat(acc,dda,block,chan,sample,&meanValue,&rmsValue);
+  *mean=rint(meanValue);
+  *rms=rint(rmsValue);
+}
+
+
+int araPedestalWriteText(AraPedestalAccumulator_t *acc, FILE *fpMean, FILE *fpRms)
+{
+  int dda,block,chan,sample;
+  int mean[SAMPLES_PER_BLOCK],rms[SAMPLES_PER_BLOCK];
+  for(dda=0;dda<DDA_PER_ATRI;dda++) {
+    for(block=0;block<BLOCKS_PER_DDA;block++) {
+      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	  araPedestalGetMeanRms(acc,dda,block,chan,sample,&mean[sample],&rms[sample]);
+	if(fpMean) {
+	  fprintf(fpMean,"%d %d %d",dda,block,chan);
+	  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	    fprintf(fpMean," %d",mean[sample]);
+	  fprintf(fpMean,"\n");
+	}
+	if(fpRms) {
+	  fprintf(fpRms,"%d %d %d",dda,block,chan);
+	  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	    fprintf(fpRms," %d",rms[sample]);
+	  fprintf(fpRms,"\n");
+	}
+      }
+    }
+  }
+  if((fpMean && ferror(fpMean)) || (fpRms && ferror(fpRms))) return -1;
+  return 0;
+}
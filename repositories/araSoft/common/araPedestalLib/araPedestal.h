@@ -0,0 +1,143 @@
+/*
+   ARA Pedestal  pedestal accumulation for ARAAcqd's pedestal runs.
+
+   Every (dda,block,chan,sample) cell keeps a 64 bit integer sum and sum
+   of squares, and every (dda,block,chan) a 32 bit event count, so the
+   result is exact however many events go in and in whatever order they
+   are added.
+
+   Events are copied into a small queue and accumulated by worker threads,
+   each owning a fixed set of DDAs (dda % numThreads). Every worker walks
+   the whole event layout, so they all agree on where an event stops being
+   usable, and only adds the blocks of its own DDAs. The sums are
+   therefore bit-exact for any number of threads, including none (the
+   caller's thread does the work).
+
+   A tracker (araPedestalInitTracker) uses the same queue and workers but
+   keeps an exponentially weighted mean and variance per cell instead of
+   sums, in fixed point integers, for following pedestal drifts during
+   normal runs. Each DDA is only ever updated by one worker, in event
+   order, so the tracker is bit-exact too. A tracker drops events rather
+   than block the caller when its queue is full.
+*/
+
+#ifndef ARA_PEDESTAL_H
+#define ARA_PEDESTAL_H
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "araAtriStructures.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARA_PED_NUM_CHANNEL_BLOCKS (DDA_PER_ATRI*BLOCKS_PER_DDA*RFCHAN_PER_DDA)
+#define ARA_PED_NUM_CELLS (ARA_PED_NUM_CHANNEL_BLOCKS*SAMPLES_PER_BLOCK)
+#define ARA_PED_MAX_THREADS DDA_PER_ATRI
+#define ARA_PED_QUEUE_DEPTH 16 ///< Events that can be waiting for the workers
+#define ARA_PED_EMPTY_MEAN 2000 ///< Written for cells that never saw an event
+#define ARA_PED_TRACK_FRAC_BITS 16 ///< Fractional bits of the tracked means
+#define ARA_PED_TRACK_VAR_FRAC_BITS 4 ///< Fractional bits of the tracked variances
+#define ARA_PED_TRACK_MAX_SHIFT 16
+
+typedef struct {
+  int numBytes;
+  int numReadoutBlocks;
+  int forcedBlock; ///< IRS block for every readout, or -1 to take it from the block headers
+  int skipFirstReadout; ///< Don't accumulate the first readout block
+  int stackEnabled[DDA_PER_ATRI]; ///< The DDAs present in the event
+  int numPending; ///< Workers still to process this event
+  uint8_t *data;
+} AraPedestalEvent_t;
+
+typedef struct araPedestalAccumulator AraPedestalAccumulator_t;
+
+typedef struct {
+  AraPedestalAccumulator_t *acc;
+  int shard; ///< Owns the DDAs with dda % numThreads == shard
+} AraPedestalWorker_t;
+
+struct araPedestalAccumulator {
+  uint64_t *sum; ///< ARA_PED_NUM_CELLS
+  uint64_t *sumSq; ///< ARA_PED_NUM_CELLS
+  uint32_t *count; ///< ARA_PED_NUM_CHANNEL_BLOCKS
+
+  //Only for a tracker, each new event has a weight of 1/2^trackShift
+  int trackShift;
+  int32_t *trackMean; ///< ARA_PED_NUM_CELLS, ARA_PED_TRACK_FRAC_BITS fixed point
+  uint32_t *trackVar; ///< ARA_PED_NUM_CELLS, ARA_PED_TRACK_VAR_FRAC_BITS fixed point
+
+  //The worker queue, slots [tail,head) are in use
+  int numThreads;
+  int maxEventBytes;
+  int stopping;
+  int dropWhenFull;
+  unsigned int head;
+  unsigned int tail;
+  AraPedestalEvent_t queue[ARA_PED_QUEUE_DEPTH];
+  pthread_t threads[ARA_PED_MAX_THREADS];
+  AraPedestalWorker_t workers[ARA_PED_MAX_THREADS];
+  pthread_mutex_t mutex;
+  pthread_cond_t workCond; ///< Signalled when an event is queued
+  pthread_cond_t doneCond; ///< Signalled when an event is finished
+
+  //Stats
+  unsigned int numEvents;
+  unsigned int numBadEvents; ///< Events cut short by a DDA mismatch or running off the end
+  unsigned int numDropped; ///< Events not queued because the queue was full (trackers only)
+};
+
+
+/** \brief Allocates and zeroes the sums and starts numThreads workers (0 accumulates in araPedestalAddEvent itself).
+ *
+ * Returns 0, or -1 if the memory or threads can't be had.
+ */
+int araPedestalInit(AraPedestalAccumulator_t *acc, int numThreads, int maxEventBytes);
+
+/** \brief As araPedestalInit, but for a tracker with a time constant of 2^trackShift events per channel block.
+ *
+ * Until a channel block has seen 2^trackShift events the weight is
+ * larger, so the first estimate is roughly the plain mean.
+ */
+int araPedestalInitTracker(AraPedestalAccumulator_t *acc, int numThreads, int maxEventBytes, int trackShift);
+
+/** \brief Stops the workers, after they finish any queued events, and frees everything. */
+void araPedestalFree(AraPedestalAccumulator_t *acc);
+
+/** \brief Zeroes the sums, counts and stats. Only call when no events are queued. */
+void araPedestalClear(AraPedestalAccumulator_t *acc);
+
+/** \brief Queues an unpacked event (AraStationEventHeader_t then the blocks), waiting for a free slot if need be.
+ *
+ * The event is copied so the caller's buffer can be reused straight away.
+ * Returns 0, 1 if a tracker dropped the event, or -1 if the event is too big.
+ */
+int araPedestalAddEvent(AraPedestalAccumulator_t *acc, const uint8_t *event, int numBytes, int numReadoutBlocks,
+			int forcedBlock, int skipFirstReadout, const int *stackEnabled);
+
+/** \brief Waits for every queued event to be accumulated. */
+void araPedestalWait(AraPedestalAccumulator_t *acc);
+
+/** \brief The number of events in a channel block. Call araPedestalWait first. */
+uint32_t araPedestalGetCount(AraPedestalAccumulator_t *acc, int dda, int block, int chan);
+
+/** \brief The mean and RMS of one cell, or ARA_PED_EMPTY_MEAN and 0 if it has no events. */
+void araPedestalGetMeanRmsFloat(AraPedestalAccumulator_t *acc, int dda, int block, int chan, int sample, double *mean, double *rms);
+
+/** \brief The rounded mean and RMS of one cell. */
+void araPedestalGetMeanRms(AraPedestalAccumulator_t *acc, int dda, int block, int chan, int sample, int *mean, int *rms);
+
+/** \brief Writes the legacy text pedestal files, one "dda block chan" line of 64 values per channel block. Either file may be NULL. */
+int araPedestalWriteText(AraPedestalAccumulator_t *acc, FILE *fpMean, FILE *fpRms);
+
+static inline int araPedestalCellIndex(int dda, int block, int chan, int sample)
+{
+  return sample+(chan*SAMPLES_PER_BLOCK)+(block*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK)+(dda*BLOCKS_PER_DDA*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_PEDESTAL_H
@@ -0,0 +1,317 @@
+/*
+   ARA Pedestal File  reading and writing pedestal sets, see araPedestalFile.h
+*/
+
+#include "araPedestalFile.h"
+#include "araSoft.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+typedef char araPedestalHeaderIs64Bytes[sizeof(AraPedestalFileHeader_t)==64 ? 1 : -1];
+
+
+static void initHeader(AraPedestalFileHeader_t *header, uint32_t runNumber, uint32_t unixTime)
+{
+  memset(header,0,sizeof(AraPedestalFileHeader_t));
+  header->magic=ARA_PED_FILE_MAGIC;
+  header->version=ARA_PED_FILE_VERSION;
+  header->headerBytes=sizeof(AraPedestalFileHeader_t);
+  header->dataOffset=sizeof(AraPedestalFileHeader_t);
+  header->stationId=THIS_STATION;
+  header->fracBits=ARA_PED_FILE_FRAC_BITS;
+  header->numDda=DDA_PER_ATRI;
+  header->numBlocks=BLOCKS_PER_DDA;
+  header->numChans=RFCHAN_PER_DDA;
+  header->numSamples=SAMPLES_PER_BLOCK;
+  header->runNumber=runNumber;
+  header->unixTime=unixTime;
+}
+
+
+static int allocateSet(AraPedestalSet_t *set)
+{
+  memset(set,0,sizeof(AraPedestalSet_t));
+  set->owned=calloc(2*ARA_PED_NUM_CELLS,sizeof(uint16_t));
+  if(!set->owned) {
+    ARA_LOG_MESSAGE(LOG_ERR,"araPedestalLib: can't allocate a pedestal set\n");
+    return -1;
+  }
+  set->mean=set->owned;
+  set->rms=set->owned+ARA_PED_NUM_CELLS;
+  return 0;
+}
+
+
+static uint32_t setChecksum(AraPedestalFileHeader_t *header, const uint16_t *mean, const uint16_t *rms)
+{
+  AraPedestalFileHeader_t zeroed=*header;
+  uLong crc=crc32(0L,Z_NULL,0);
+  zeroed.checksum=0;
+  crc=crc32(crc,(const Bytef*)&zeroed,sizeof(zeroed));
+  crc=crc32(crc,(const Bytef*)mean,sizeof(uint16_t)*ARA_PED_NUM_CELLS);
+  crc=crc32(crc,(const Bytef*)rms,sizeof(uint16_t)*ARA_PED_NUM_CELLS);
+  return crc;
+}
+
+
+static uint16_t toFixedPoint(double value)
+{
+  value=rint(value*ARA_PED_FILE_SCALE);
+  if(value<0) return 0;
+  if(value>0xffff) return 0xffff;
+  return value;
+}
+
+
+int araPedestalSetFromAccumulator(AraPedestalSet_t *set, AraPedestalAccumulator_t *acc, uint32_t runNumber, uint32_t unixTime)
+{
+  uint16_t *mean,*rms;
+  uint32_t count,minCount=0xffffffff;
+  double meanValue,rmsValue;
+  int dda,block,chan,sample,cell;
+  if(allocateSet(set)<0) return -1;
+  mean=set->owned;
+  rms=set->owned+ARA_PED_NUM_CELLS;
+  for(dda=0;dda<DDA_PER_ATRI;dda++) {
+    for(block=0;block<BLOCKS_PER_DDA;block++) {
+      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+	count=araPedestalGetCount(acc,dda,block,chan);
+	if(count<minCount) minCount=count;
+	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+	  cell=araPedestalCellIndex(dda,block,chan,sample);
+	  araPedestalGetMeanRmsFloat(acc,dda,block,chan,sample,&meanValue,&rmsValue);
+	  mean[cell]=toFixedPoint(meanValue);
+	  rms[cell]=toFixedPoint(rmsValue);
+	}
+      }
+    }
+  }
+  initHeader(&set->header,runNumber,unixTime);
+  set->header.numEvents=acc->numEvents;
+  set->header.minCount=minCount;
+  return 0;
+}
+
+
+int araPedestalSetWriteBinary(AraPedestalSet_t *set, const char *filename)
+{
+  char tempName[FILENAME_MAX];
+  FILE *fp;
+  int retVal=0;
+
+  set->header.checksum=setChecksum(&set->header,set->mean,set->rms);
+  snprintf(tempName,sizeof(tempName),"%s.tmp",filename);
+  fp=fopen(tempName,"wb");
+  if(!fp) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't open %s\n",__FUNCTION__,tempName);
+    return -1;
+  }
+  if(fwrite(&set->header,sizeof(AraPedestalFileHeader_t),1,fp)!=1 ||
+     fwrite(set->mean,sizeof(uint16_t),ARA_PED_NUM_CELLS,fp)!=ARA_PED_NUM_CELLS ||
+     fwrite(set->rms,sizeof(uint16_t),ARA_PED_NUM_CELLS,fp)!=ARA_PED_NUM_CELLS)
+    retVal=-1;
+  if(fclose(fp)!=0) retVal=-1;
+  if(retVal==0 && rename(tempName,filename)!=0) retVal=-1;
+  if(retVal<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: error writing %s\n",__FUNCTION__,filename);
+    unlink(tempName);
+  }
+  return retVal;
+}
+
+
+int araPedestalSetLoadBinary(AraPedestalSet_t *set, const char *filename, int verifyChecksum)
+{
+  const AraPedestalFileHeader_t *header;
+  struct stat fileStat;
+  size_t needBytes;
+  void *mapping;
+  int fd;
+
+  memset(set,0,sizeof(AraPedestalSet_t));
+  fd=open(filename,O_RDONLY);
+  if(fd<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't open %s\n",__FUNCTION__,filename);
+    return -1;
+  }
+  if(fstat(fd,&fileStat)<0 || fileStat.st_size<(off_t)sizeof(AraPedestalFileHeader_t)) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: %s is too short\n",__FUNCTION__,filename);
+    close(fd);
+    return -1;
+  }
+  mapping=mmap(NULL,fileStat.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(mapping==MAP_FAILED) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't map %s\n",__FUNCTION__,filename);
+    return -1;
+  }
+  set->mapping=mapping;
+  set->mappingBytes=fileStat.st_size;
+
+  header=(const AraPedestalFileHeader_t*)mapping;
+  needBytes=header->dataOffset+2*sizeof(uint16_t)*ARA_PED_NUM_CELLS;
+  if(header->magic!=ARA_PED_FILE_MAGIC || header->version!=ARA_PED_FILE_VERSION ||
+     header->headerBytes!=sizeof(AraPedestalFileHeader_t) || header->fracBits!=ARA_PED_FILE_FRAC_BITS ||
+     header->numDda!=DDA_PER_ATRI || header->numBlocks!=BLOCKS_PER_DDA ||
+     header->numChans!=RFCHAN_PER_DDA || header->numSamples!=SAMPLES_PER_BLOCK ||
+     (header->dataOffset%sizeof(uint16_t)) || needBytes>set->mappingBytes) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: %s is not a version %d pedestal file\n",__FUNCTION__,filename,ARA_PED_FILE_VERSION);
+    araPedestalSetFree(set);
+    return -1;
+  }
+  set->header=*header;
+  set->mean=(const uint16_t*)((const uint8_t*)mapping+header->dataOffset);
+  set->rms=set->mean+ARA_PED_NUM_CELLS;
+  if(verifyChecksum && setChecksum(&set->header,set->mean,set->rms)!=set->header.checksum) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: %s has a bad checksum\n",__FUNCTION__,filename);
+    araPedestalSetFree(set);
+    return -1;
+  }
+  return 0;
+}
+
+
+static int readTextFile(const char *filename, uint16_t *values)
+{
+  //Each line is "dda block chan" and 64 values, the lines may be in any order
+  char line[1024];
+  char *ptr,*end;
+  long dda,block,chan,value;
+  int sample,lineNum=0,numLines=0;
+  FILE *fp=fopen(filename,"r");
+  if(!fp) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't open %s\n",__FUNCTION__,filename);
+    return -1;
+  }
+  while(fgets(line,sizeof(line),fp)) {
+    lineNum++;
+    ptr=line;
+    dda=strtol(ptr,&end,10);
+    if(end==ptr) continue; //Blank line
+    block=strtol(ptr=end,&end,10);
+    chan=strtol(ptr=end,&end,10);
+    if(dda<0 || dda>=DDA_PER_ATRI || block<0 || block>=BLOCKS_PER_DDA || chan<0 || chan>=RFCHAN_PER_DDA) {
+      ARA_LOG_MESSAGE(LOG_ERR,"%s: bad channel block on line %d of %s\n",__FUNCTION__,lineNum,filename);
+      fclose(fp);
+      return -1;
+    }
+    for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
+      value=strtol(ptr=end,&end,10);
+      if(end==ptr) {
+	ARA_LOG_MESSAGE(LOG_ERR,"%s: line %d of %s is short\n",__FUNCTION__,lineNum,filename);
+	fclose(fp);
+	return -1;
+      }
+      values[araPedestalCellIndex(dda,block,chan,sample)]=toFixedPoint(value);
+    }
+    numLines++;
+  }
+  fclose(fp);
+  if(numLines!=ARA_PED_NUM_CHANNEL_BLOCKS)
+    ARA_LOG_MESSAGE(LOG_WARNING,"%s: %s has %d of %d channel blocks\n",__FUNCTION__,filename,numLines,ARA_PED_NUM_CHANNEL_BLOCKS);
+  return numLines;
+}
+
+
+int araPedestalSetReadText(AraPedestalSet_t *set, const char *meanFilename, const char *rmsFilename, uint32_t runNumber)
+{
+  struct stat fileStat;
+  int cell;
+  if(allocateSet(set)<0) return -1;
+  //Missing channel blocks look like ones that never saw an event
+  for(cell=0;cell<ARA_PED_NUM_CELLS;cell++)
+    set->owned[cell]=ARA_PED_EMPTY_MEAN*ARA_PED_FILE_SCALE;
+  if(readTextFile(meanFilename,set->owned)<0 ||
+     (rmsFilename && readTextFile(rmsFilename,set->owned+ARA_PED_NUM_CELLS)<0)) {
+    araPedestalSetFree(set);
+    return -1;
+  }
+  initHeader(&set->header,runNumber,stat(meanFilename,&fileStat)==0 ? fileStat.st_mtime : 0);
+  return 0;
+}
+
+
+int araPedestalSetWriteText(AraPedestalSet_t *set, FILE *fpMean, FILE *fpRms)
+{
+  int dda,block,chan,sample,cell;
+  for(dda=0;dda<DDA_PER_ATRI;dda++) {
+    for(block=0;block<BLOCKS_PER_DDA;block++) {
+      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+	cell=araPedestalCellIndex(dda,block,chan,0);
+	if(fpMean) {
+	  fprintf(fpMean,"%d %d %d",dda,block,chan);
+	  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	    fprintf(fpMean," %d",(int)rint(set->mean[cell+sample]*(1./ARA_PED_FILE_SCALE)));
+	  fprintf(fpMean,"\n");
+	}
+	if(fpRms) {
+	  fprintf(fpRms,"%d %d %d",dda,block,chan);
+	  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	    fprintf(fpRms," %d",(int)rint(set->rms[cell+sample]*(1./ARA_PED_FILE_SCALE)));
+	  fprintf(fpRms,"\n");
+	}
+      }
+    }
+  }
+  if((fpMean && ferror(fpMean)) || (fpRms && ferror(fpRms))) return -1;
+  return 0;
+}
+
+
+int araPedestalSetLoad(AraPedestalSet_t *set, const char *filename, const char *rmsFilename)
+{
+  uint32_t magic=0;
+  FILE *fp=fopen(filename,"rb");
+  if(!fp) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't open %s\n",__FUNCTION__,filename);
+    return -1;
+  }
+  if(fread(&magic,sizeof(magic),1,fp)!=1) magic=0;
+  fclose(fp);
+  if(magic==ARA_PED_FILE_MAGIC)
+    return araPedestalSetLoadBinary(set,filename,1);
+  return araPedestalSetReadText(set,filename,rmsFilename,0);
+}
+
+
+void araPedestalSetDiff(AraPedestalSet_t *setA, AraPedestalSet_t *setB, double threshold, AraPedestalDiff_t *diff)
+{
+  double delta,sumDelta=0,sumDeltaSq=0;
+  int cell,maxCell=0;
+  memset(diff,0,sizeof(AraPedestalDiff_t));
+  for(cell=0;cell<ARA_PED_NUM_CELLS;cell++) {
+    delta=((int)setB->mean[cell]-(int)setA->mean[cell])*(1./ARA_PED_FILE_SCALE);
+    sumDelta+=delta;
+    sumDeltaSq+=delta*delta;
+    if(fabs(delta)>threshold) diff->numMeanOver++;
+    if(fabs(delta)>fabs(diff->maxMeanDiff)) {
+      diff->maxMeanDiff=delta;
+      maxCell=cell;
+    }
+  }
+  diff->numCells=ARA_PED_NUM_CELLS;
+  diff->meanMeanDiff=sumDelta/ARA_PED_NUM_CELLS;
+  diff->rmsMeanDiff=sqrt(sumDeltaSq/ARA_PED_NUM_CELLS);
+  diff->maxSample=maxCell%SAMPLES_PER_BLOCK;
+  diff->maxChan=(maxCell/SAMPLES_PER_BLOCK)%RFCHAN_PER_DDA;
+  diff->maxBlock=(maxCell/(SAMPLES_PER_BLOCK*RFCHAN_PER_DDA))%BLOCKS_PER_DDA;
+  diff->maxDda=maxCell/(SAMPLES_PER_BLOCK*RFCHAN_PER_DDA*BLOCKS_PER_DDA);
+}
+
+
+void araPedestalSetFree(AraPedestalSet_t *set)
+{
+  if(set->mapping) munmap(set->mapping,set->mappingBytes);
+  free(set->owned);
+  set->mapping=NULL;
+  set->owned=NULL;
+  set->mean=NULL;
+  set->rms=NULL;
+}
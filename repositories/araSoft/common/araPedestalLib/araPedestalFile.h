@@ -0,0 +1,116 @@
+/*
+   ARA Pedestal File  the binary pedestal format.
+
+   A 64 byte header followed by the mean of every (dda,block,chan,sample)
+   cell and then the RMS, both as uint16_t fixed point with
+   ARA_PED_FILE_FRAC_BITS fractional bits, in araPedestalCellIndex order.
+   Everything is little endian and the arrays start at dataOffset, so a
+   loaded file is just an mmap of it.
+
+   The checksum is the zlib crc32 of the header (with checksum set to 0)
+   followed by the two arrays.
+
+   The legacy text files (one "dda block chan" line of 64 integers per
+   channel block, mean and width in separate files) can be converted both
+   ways, see araPedestalTool.
+*/
+
+#ifndef ARA_PEDESTAL_FILE_H
+#define ARA_PEDESTAL_FILE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include "araPedestal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARA_PED_FILE_MAGIC 0x44455041 ///< "APED"
+#define ARA_PED_FILE_VERSION 1
+#define ARA_PED_FILE_FRAC_BITS 4 ///< A 12 bit ADC mean still fits in 16 bits
+#define ARA_PED_FILE_SCALE (1<<ARA_PED_FILE_FRAC_BITS)
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerBytes;
+  uint32_t checksum;
+  uint32_t dataOffset; ///< Bytes from the start of the file to the means
+  uint8_t stationId;
+  uint8_t fracBits;
+  uint16_t numDda;
+  uint16_t numBlocks;
+  uint16_t numChans;
+  uint16_t numSamples;
+  uint16_t reserved;
+  uint32_t runNumber;
+  uint32_t unixTime; ///< When the pedestals were taken
+  uint32_t numEvents; ///< Events accumulated, 0 if converted from text
+  uint32_t minCount; ///< Fewest events in any channel block
+  uint8_t spare[20];
+} AraPedestalFileHeader_t;
+
+typedef struct {
+  AraPedestalFileHeader_t header;
+  const uint16_t *mean; ///< ARA_PED_NUM_CELLS fixed point values
+  const uint16_t *rms;
+  //Either a mapping of the file or our own memory
+  void *mapping;
+  size_t mappingBytes;
+  uint16_t *owned;
+} AraPedestalSet_t;
+
+typedef struct {
+  unsigned int numCells;
+  unsigned int numMeanOver; ///< Cells whose means differ by more than the threshold
+  double maxMeanDiff; ///< ADC counts
+  double meanMeanDiff;
+  double rmsMeanDiff; ///< RMS of the mean differences
+  int maxDda,maxBlock,maxChan,maxSample; ///< Where maxMeanDiff is
+} AraPedestalDiff_t;
+
+
+/** \brief Fills a set from the accumulator sums or tracker, call araPedestalWait first. */
+int araPedestalSetFromAccumulator(AraPedestalSet_t *set, AraPedestalAccumulator_t *acc, uint32_t runNumber, uint32_t unixTime);
+
+/** \brief Writes a binary pedestal file, via a temporary file so readers never see half of one. */
+int araPedestalSetWriteBinary(AraPedestalSet_t *set, const char *filename);
+
+/** \brief Maps a binary pedestal file read only. Returns 0, or -1 if it isn't a valid pedestal file. */
+int araPedestalSetLoadBinary(AraPedestalSet_t *set, const char *filename, int verifyChecksum);
+
+/** \brief Reads the legacy text files, rmsFilename may be NULL (all widths 0). */
+int araPedestalSetReadText(AraPedestalSet_t *set, const char *meanFilename, const char *rmsFilename, uint32_t runNumber);
+
+/** \brief Writes the legacy text files, rounding to whole ADC counts. Either file may be NULL.
+ *
+ * Text read with araPedestalSetReadText comes back unchanged. A set from
+ * the accumulator is rounded twice, so a value can be one count away
+ * from the text ARAAcqd wrote alongside it.
+ */
+int araPedestalSetWriteText(AraPedestalSet_t *set, FILE *fpMean, FILE *fpRms);
+
+/** \brief Loads either format, binary if the file starts with the magic number. */
+int araPedestalSetLoad(AraPedestalSet_t *set, const char *filename, const char *rmsFilename);
+
+/** \brief Compares the means of two sets, counting cells that differ by more than threshold ADC counts. */
+void araPedestalSetDiff(AraPedestalSet_t *setA, AraPedestalSet_t *setB, double threshold, AraPedestalDiff_t *diff);
+
+void araPedestalSetFree(AraPedestalSet_t *set);
+
+static inline float araPedestalSetMean(const AraPedestalSet_t *set, int dda, int block, int chan, int sample)
+{
+  return set->mean[araPedestalCellIndex(dda,block,chan,sample)]*(1./ARA_PED_FILE_SCALE);
+}
+
+static inline float araPedestalSetRms(const AraPedestalSet_t *set, int dda, int block, int chan, int sample)
+{
+  return set->rms[araPedestalCellIndex(dda,block,chan,sample)]*(1./ARA_PED_FILE_SCALE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_PEDESTAL_FILE_H
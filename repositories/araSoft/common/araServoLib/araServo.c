@@ -0,0 +1,185 @@
+/*
+   ARA Servo  the generic PID update, see araServo.h
+
+   The per channel configuration and state are kept as separate arrays so
+   an update is one pass over flat float arrays for all the channels.
+*/
+
+#include "araServo.h"
+#include "araSoft.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+
+void araServoInit(AraServo_t *servo, const char *name, int numChannels,
+		  AraServoSensor_t sensor, AraServoActuator_t actuator, uint16_t *currentOutputs)
+{
+  int ch;
+  memset(servo,0,sizeof(AraServo_t));
+  if(numChannels>ARA_SERVO_MAX_CHANNELS) numChannels=ARA_SERVO_MAX_CHANNELS;
+  servo->name=name;
+  servo->numChannels=numChannels;
+  servo->sensor=sensor;
+  servo->actuator=actuator;
+  servo->currentOutputs=currentOutputs;
+  servo->outputMin=0;
+  servo->outputMax=65535;
+  for(ch=0;ch<numChannels;ch++)
+    servo->enabled[ch]=1;
+}
+
+
+void araServoSetGains(AraServo_t *servo, int channel, const AraServoGains_t *gains)
+{
+  int ch;
+  for(ch=0;ch<servo->numChannels;ch++) {
+    if(channel>=0 && ch!=channel) continue;
+    servo->pGain[ch]=gains->pGain;
+    servo->iGain[ch]=gains->iGain;
+    servo->dGain[ch]=gains->dGain;
+    servo->iMax[ch]=gains->iMax;
+    servo->iMin[ch]=gains->iMin;
+  }
+}
+
+
+void araServoReset(AraServo_t *servo)
+{
+  servo->haveLast=0;
+  servo->lastStamp=0;
+  servo->windowIndex=0;
+  memset(servo->haveMeasured,0,sizeof(servo->haveMeasured));
+  memset(servo->iState,0,sizeof(servo->iState));
+  memset(servo->lastMeasured,0,sizeof(servo->lastMeasured));
+  memset(servo->window,0,sizeof(servo->window));
+  servo->numUpdates=0;
+  servo->numSkipped=0;
+  servo->numSaturated=0;
+  servo->numRateLimited=0;
+  servo->numWindupHeld=0;
+  servo->numActuatorErrors=0;
+}
+
+
+static void araServoClampIntegrator(AraServo_t *servo, int ch)
+{
+  if(servo->iState[ch]>servo->iMax[ch])
+    servo->iState[ch]=servo->iMax[ch];
+  else if(servo->iState[ch]<servo->iMin[ch])
+    servo->iState[ch]=servo->iMin[ch];
+}
+
+
+int araServoUpdate(AraServo_t *servo, const void *input, void *actuatorContext)
+{
+  uint32_t stamp=0;
+  float pTerm,iTerm,dTerm,lastI,removed;
+  int ch,change,current,proposed,saturated,prime,slot;
+  int anyChange=0;
+
+  if(servo->sensor(servo,input,&stamp,servo->measured)<0) {
+    servo->numSkipped++;
+    return 0;
+  }
+  //Only update once the last change has had an effect
+  if(servo->haveLast && stamp<servo->lastStamp+servo->settleStamps) {
+    servo->numSkipped++;
+    return 0;
+  }
+
+  prime=servo->primeOnFirstUpdate && !servo->haveLast;
+  slot=servo->windowIndex;
+  for(ch=0;ch<servo->numChannels;ch++) {
+    current=servo->currentOutputs[ch];
+    servo->outputs[ch]=current;
+    servo->error[ch]=0;
+    if(!servo->enabled[ch] || isnan(servo->measured[ch])) continue;
+    servo->error[ch]=servo->goal[ch]-servo->measured[ch];
+    if(prime || (servo->deadband>0 && fabsf(servo->error[ch])<=servo->deadband)) {
+      servo->lastMeasured[ch]=servo->measured[ch];
+      servo->haveMeasured[ch]=1;
+      continue;
+    }
+
+    // Integral, either for ever or over a sliding window
+    lastI=servo->iState[ch];
+    removed=0;
+    if(servo->integratorWindow>0) {
+      removed=servo->window[slot][ch];
+      servo->window[slot][ch]=servo->error[ch];
+    }
+    servo->iState[ch]+=servo->error[ch]-removed;
+    araServoClampIntegrator(servo,ch);
+
+    pTerm=servo->pGain[ch]*servo->error[ch];
+    iTerm=servo->iGain[ch]*servo->iState[ch];
+    dTerm=0;
+    if(servo->haveMeasured[ch])
+      dTerm=servo->dGain[ch]*(servo->measured[ch]-servo->lastMeasured[ch]);
+    servo->lastMeasured[ch]=servo->measured[ch];
+    servo->haveMeasured[ch]=1;
+
+    //Put them together
+    change=(int)(pTerm+iTerm-dTerm);
+    if(servo->maxStep>0) {
+      if(change>servo->maxStep) {
+	change=servo->maxStep;
+	servo->numRateLimited++;
+      }
+      else if(change<-servo->maxStep) {
+	change=-servo->maxStep;
+	servo->numRateLimited++;
+      }
+    }
+    proposed=current+change;
+    saturated=0;
+    if(proposed>servo->outputMax) {
+      proposed=servo->outputMax;
+      saturated=1;
+    }
+    else if(proposed<servo->outputMin) {
+      proposed=servo->outputMin;
+      saturated=-1;
+    }
+    if(saturated) {
+      servo->numSaturated++;
+      //Anti-windup, don't integrate an error that only pushes further into the limit
+      if((saturated>0 && servo->iGain[ch]*servo->error[ch]>0) ||
+	 (saturated<0 && servo->iGain[ch]*servo->error[ch]<0)) {
+	servo->iState[ch]=lastI-removed;
+	if(servo->integratorWindow>0) servo->window[slot][ch]=0;
+	araServoClampIntegrator(servo,ch);
+	servo->numWindupHeld++;
+      }
+    }
+    servo->outputs[ch]=proposed;
+    if(proposed!=current) anyChange=1;
+
+    if(ch==0) {
+      ARA_LOG_MESSAGE(LOG_DEBUG,"%s servo stamp %u measured %f goal %f\n",servo->name,stamp,servo->measured[ch],servo->goal[ch]);
+      ARA_LOG_MESSAGE(LOG_DEBUG,"%s servo PID %f %f %f\n",servo->name,pTerm,iTerm,-1*dTerm);
+      ARA_LOG_MESSAGE(LOG_DEBUG,"%s servo outcome %d %d %d\n",servo->name,current,proposed,change);
+    }
+  }
+  if(servo->integratorWindow>0 && !prime)
+    servo->windowIndex=(slot+1)%servo->integratorWindow;
+  servo->haveLast=1;
+  servo->lastStamp=stamp;
+
+  if(prime || !anyChange) return 0;
+  if(servo->actuator(servo,actuatorContext,servo->outputs)<0) {
+    servo->numActuatorErrors++;
+    return -1;
+  }
+  servo->numUpdates++;
+  return 1;
+}
+
+
+void araServoLogStats(AraServo_t *servo)
+{
+  ARA_LOG_MESSAGE(LOG_INFO,"%s servo -- %u updates, %u skipped, %u saturated, %u rate limited, %u windup held, %u actuator errors\n",
+		  servo->name,servo->numUpdates,servo->numSkipped,servo->numSaturated,
+		  servo->numRateLimited,servo->numWindupHeld,servo->numActuatorErrors);
+}
@@ -0,0 +1,160 @@
+/*
+   ARA Servo  a generic multi channel PID servo, used for the threshold and
+   Vdly servos in ARAAcqd and by the offline replay (araServoReplay).
+
+   A servo gets its inputs through a sensor function, which turns whatever
+   it is handed (an AraEventHk_t in practice) into a stamp and one measured
+   value per channel, and applies its outputs through an actuator function.
+   The update itself only works on the per channel arrays, so the same
+   servo behaves identically against the ATRI and against recorded
+   housekeeping.
+
+   Each update is incremental: the PID result is added to the current DAC
+   value, which is then rate limited to maxStep and clamped to
+   [outputMin,outputMax]. The integrator is clamped to [iMin,iMax] and is
+   not accumulated while the output is saturated in the direction the error
+   is pushing it (anti-windup).
+*/
+
+#ifndef ARA_SERVO_H
+#define ARA_SERVO_H
+#include <stdint.h>
+#include "araAtriStructures.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARA_SERVO_MAX_CHANNELS 32
+#define ARA_SERVO_MAX_WINDOW 16 ///< Longest sliding integrator window
+
+typedef struct {
+  float pGain;
+  float iGain;
+  float dGain;
+  float iMax; ///< Integrator limits
+  float iMin;
+} AraServoGains_t;
+
+typedef struct araServo AraServo_t;
+
+/** \brief Fills measured[] (NAN skips a channel) and the stamp (e.g. the PPS counter). Returns 0, or -1 if the input is unusable. */
+typedef int (*AraServoSensor_t)(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured);
+/** \brief Applies all numChannels outputs and updates currentOutputs. Returns 0, or -1 on failure. */
+typedef int (*AraServoActuator_t)(AraServo_t *servo, void *context, const uint16_t *outputs);
+
+struct araServo {
+  const char *name;
+  int numChannels;
+  AraServoSensor_t sensor;
+  AraServoActuator_t actuator;
+  uint16_t *currentOutputs; ///< The values currently applied, owned by the caller
+
+  //Behaviour common to all channels
+  int outputMin;
+  int outputMax;
+  int maxStep; ///< Largest change in one update, 0 for no limit
+  float deadband; ///< Errors no bigger than this leave the channel alone
+  int integratorWindow; ///< Integrate the last N errors, 0 integrates for ever
+  uint32_t settleStamps; ///< Smallest stamp advance between updates, so changes have had an effect
+  int primeOnFirstUpdate; ///< The first update only records the measurements
+
+  //Per channel configuration
+  int enabled[ARA_SERVO_MAX_CHANNELS];
+  float goal[ARA_SERVO_MAX_CHANNELS];
+  float pGain[ARA_SERVO_MAX_CHANNELS];
+  float iGain[ARA_SERVO_MAX_CHANNELS];
+  float dGain[ARA_SERVO_MAX_CHANNELS];
+  float iMax[ARA_SERVO_MAX_CHANNELS];
+  float iMin[ARA_SERVO_MAX_CHANNELS];
+
+  //State
+  int haveLast;
+  uint32_t lastStamp;
+  int windowIndex;
+  int haveMeasured[ARA_SERVO_MAX_CHANNELS];
+  float iState[ARA_SERVO_MAX_CHANNELS];
+  float lastMeasured[ARA_SERVO_MAX_CHANNELS];
+  float window[ARA_SERVO_MAX_WINDOW][ARA_SERVO_MAX_CHANNELS];
+
+  //The last update, for logging and the replay
+  float measured[ARA_SERVO_MAX_CHANNELS];
+  float error[ARA_SERVO_MAX_CHANNELS];
+  uint16_t outputs[ARA_SERVO_MAX_CHANNELS];
+
+  //Stats since the last araServoReset
+  unsigned int numUpdates; ///< Updates that applied new outputs
+  unsigned int numSkipped; ///< Unusable or unsettled inputs
+  unsigned int numSaturated; ///< Channel updates clamped to the output range
+  unsigned int numRateLimited; ///< Channel updates clamped to maxStep
+  unsigned int numWindupHeld; ///< Channel updates that didn't integrate because of saturation
+  unsigned int numActuatorErrors;
+};
+
+
+/** \brief Clears the servo and sets the defaults: every channel enabled, output 0-65535, no rate limit, deadband or window. */
+void araServoInit(AraServo_t *servo, const char *name, int numChannels,
+		  AraServoSensor_t sensor, AraServoActuator_t actuator, uint16_t *currentOutputs);
+
+/** \brief Sets the gains of one channel, or of all of them if channel is -1. */
+void araServoSetGains(AraServo_t *servo, int channel, const AraServoGains_t *gains);
+
+/** \brief Forgets the integrators and last measurements and zeroes the stats. */
+void araServoReset(AraServo_t *servo);
+
+/** \brief Runs one update.
+ *
+ * Returns 1 if new outputs were applied, 0 if there was nothing to do and
+ * -1 if the actuator failed.
+ */
+int araServoUpdate(AraServo_t *servo, const void *input, void *actuatorContext);
+
+void araServoLogStats(AraServo_t *servo);
+
+
+//The station servos, shared by ARAAcqd and the replay
+#define ARA_SERVO_VDLY_WINDOW 10 ///< Integrator window of the Vdly PID
+#define ARA_SERVO_VDLY_STEP_GAIN 5.0 ///< DAC counts per ns of the fixed gain Vdly servo
+#define ARA_SERVO_VDLY_STEP_DEADBAND 10 ///< ns, the counter resolution is about 1 ns with +/-2 counts noise
+
+int araServoSensorL1Scalers(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured);
+int araServoSensorSurfaceScalers(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured);
+int araServoSensorWilkinsonNs(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured);
+
+/** \brief The L1 (antenna) threshold servo, gainScale (may be NULL) scales each channel's gains. */
+void araServoInitAnt(AraServo_t *servo, const uint16_t *goals, const AraServoGains_t *gains, const float *gainScale,
+		     AraServoActuator_t actuator, uint16_t *currentThresholds);
+void araServoInitSurface(AraServo_t *servo, const uint16_t *goals, const AraServoGains_t *gains,
+			 AraServoActuator_t actuator, uint16_t *currentThresholds);
+/** \brief The Wilkinson Vdly servo, a PID if gains is given otherwise the fixed gain proportional servo. */
+void araServoInitVdly(AraServo_t *servo, int goalNs, const int *stackEnabled, const AraServoGains_t *gains,
+		      AraServoActuator_t actuator, uint16_t *currentVdly);
+
+//The rate servo holds the L4 RF trigger rate by scaling the ant servo goals,
+//so the threshold servo stays the only thing touching the thresholds
+#define ARA_SERVO_RATE_SCALE_UNIT 1000 ///< Rate servo output that leaves the configured scaler goals unchanged
+
+typedef struct {
+  uint32_t ppsCounter; ///< At the end of the window
+  float rateHz; ///< Mean L4 RF0 rate over the window
+  //Accumulation of the current window
+  int haveLast;
+  uint32_t lastPps;
+  uint32_t numSeconds;
+  uint32_t sumCounts;
+} AraServoRateInput_t;
+
+/** \brief Adds one event hk, returns 1 once windowSeconds of L4 RF0 counts are averaged into rateHz. */
+int araServoAccumulateRate(AraServoRateInput_t *input, const AraEventHk_t *eventHk, int windowSeconds);
+int araServoSensorRate(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured);
+/** \brief The rate servo, its output is the goal scale in units of 1/ARA_SERVO_RATE_SCALE_UNIT. */
+void araServoInitRate(AraServo_t *servo, float goalHz, const AraServoGains_t *gains, float minScale, float maxScale,
+		      AraServoActuator_t actuator, uint16_t *currentScale);
+/** \brief Sets the servo goals to baseGoals times scale/ARA_SERVO_RATE_SCALE_UNIT. */
+void araServoScaleGoals(AraServo_t *servo, const uint16_t *baseGoals, uint16_t scale);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ARA_SERVO_H
@@ -0,0 +1,152 @@
+/*
+   ARA Station Servo  the sensors and set up of the threshold and Vdly
+   servos, so ARAAcqd and araServoReplay run exactly the same servos.
+*/
+
+#include "araServo.h"
+#include "araSoft.h"
+#include "atriComLib/atriCom.h"
+#include <math.h>
+
+
+int araServoSensorL1Scalers(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured)
+{
+  const AraEventHk_t *eventHk=(const AraEventHk_t*)input;
+  int ch;
+  *stamp=eventHk->ppsCounter;
+  for(ch=0;ch<servo->numChannels;ch++)
+    measured[ch]=eventHk->l1Scaler[ch];
+  return 0;
+}
+
+int araServoSensorSurfaceScalers(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured)
+{
+  const AraEventHk_t *eventHk=(const AraEventHk_t*)input;
+  int ch;
+  *stamp=eventHk->ppsCounter;
+  for(ch=0;ch<servo->numChannels;ch++)
+    measured[ch]=eventHk->l1ScalerSurface[ch];
+  return 0;
+}
+
+int araServoSensorWilkinsonNs(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured)
+{
+  const AraEventHk_t *eventHk=(const AraEventHk_t*)input;
+  unsigned int wilkCounterNs;
+  int stack;
+  *stamp=eventHk->ppsCounter;
+  for(stack=0;stack<servo->numChannels;stack++) {
+    wilkCounterNs=atriConvertWilkCounterToNs(eventHk->wilkinsonCounter[stack]);
+    //A stopped counter says nothing about the speed
+    measured[stack]=wilkCounterNs>0 ? wilkCounterNs : NAN;
+  }
+  return 0;
+}
+
+
+void araServoInitAnt(AraServo_t *servo, const uint16_t *goals, const AraServoGains_t *gains, const float *gainScale,
+		     AraServoActuator_t actuator, uint16_t *currentThresholds)
+{
+  int ch;
+  araServoInit(servo,"ant",THRESHOLDS_PER_ATRI,araServoSensorL1Scalers,actuator,currentThresholds);
+  araServoSetGains(servo,-1,gains);
+  for(ch=0;ch<servo->numChannels;ch++) {
+    servo->goal[ch]=goals[ch];
+    if(gainScale) {
+      servo->pGain[ch]*=gainScale[ch];
+      servo->iGain[ch]*=gainScale[ch];
+      servo->dGain[ch]*=gainScale[ch];
+    }
+  }
+  servo->settleStamps=2;
+  servo->primeOnFirstUpdate=1;
+}
+
+
+void araServoInitSurface(AraServo_t *servo, const uint16_t *goals, const AraServoGains_t *gains,
+			 AraServoActuator_t actuator, uint16_t *currentThresholds)
+{
+  int ant;
+  araServoInit(servo,"surface",ANTS_PER_TDA,araServoSensorSurfaceScalers,actuator,currentThresholds);
+  araServoSetGains(servo,-1,gains);
+  for(ant=0;ant<ANTS_PER_TDA;ant++)
+    servo->goal[ant]=goals[ant];
+  servo->settleStamps=2;
+  servo->primeOnFirstUpdate=1;
+}
+
+
+void araServoInitVdly(AraServo_t *servo, int goalNs, const int *stackEnabled, const AraServoGains_t *gains,
+		      AraServoActuator_t actuator, uint16_t *currentVdly)
+{
+  AraServoGains_t stepGains={0};
+  int stack;
+  araServoInit(servo,"vdly",DDA_PER_ATRI,araServoSensorWilkinsonNs,actuator,currentVdly);
+  for(stack=0;stack<DDA_PER_ATRI;stack++) {
+    servo->enabled[stack]=stackEnabled[stack];
+    servo->goal[stack]=goalNs;
+  }
+  if(gains) {
+    araServoSetGains(servo,-1,gains);
+    servo->integratorWindow=ARA_SERVO_VDLY_WINDOW;
+    servo->outputMin=20000;
+    servo->outputMax=65533;
+    servo->primeOnFirstUpdate=1;
+  }
+  else {
+    // If the counter is too *low* the Vdly needs to go *down*. Rough guess
+    // is about 32767 DAC counts for 6830 ns, so 5 DAC counts per ns.
+    stepGains.pGain=-ARA_SERVO_VDLY_STEP_GAIN;
+    araServoSetGains(servo,-1,&stepGains);
+    servo->deadband=ARA_SERVO_VDLY_STEP_DEADBAND;
+    servo->settleStamps=4;
+  }
+}
+
+
+int araServoAccumulateRate(AraServoRateInput_t *input, const AraEventHk_t *eventHk, int windowSeconds)
+{
+  //The L4 scalers count the triggers in the last second, so each new
+  //event hk adds one second to the window
+  if(input->haveLast && eventHk->ppsCounter==input->lastPps) return 0;
+  input->haveLast=1;
+  input->lastPps=eventHk->ppsCounter;
+  input->sumCounts+=eventHk->l4Scaler[triggerL4_RF0];
+  input->numSeconds++;
+  if(windowSeconds<1) windowSeconds=1;
+  if(input->numSeconds<(uint32_t)windowSeconds) return 0;
+  input->ppsCounter=eventHk->ppsCounter;
+  input->rateHz=((float)input->sumCounts)/input->numSeconds;
+  input->sumCounts=0;
+  input->numSeconds=0;
+  return 1;
+}
+
+int araServoSensorRate(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured)
+{
+  const AraServoRateInput_t *rateInput=(const AraServoRateInput_t*)input;
+  *stamp=rateInput->ppsCounter;
+  measured[0]=rateInput->rateHz;
+  return 0;
+}
+
+
+void araServoInitRate(AraServo_t *servo, float goalHz, const AraServoGains_t *gains, float minScale, float maxScale,
+		      AraServoActuator_t actuator, uint16_t *currentScale)
+{
+  araServoInit(servo,"rate",1,araServoSensorRate,actuator,currentScale);
+  araServoSetGains(servo,-1,gains);
+  servo->goal[0]=goalHz;
+  servo->outputMin=(int)(minScale*ARA_SERVO_RATE_SCALE_UNIT);
+  servo->outputMax=(int)(maxScale*ARA_SERVO_RATE_SCALE_UNIT);
+  if(servo->outputMin<1) servo->outputMin=1;
+  if(servo->outputMax>65535) servo->outputMax=65535;
+}
+
+
+void araServoScaleGoals(AraServo_t *servo, const uint16_t *baseGoals, uint16_t scale)
+{
+  int ch;
+  for(ch=0;ch<servo->numChannels;ch++)
+    servo->goal[ch]=((float)baseGoals[ch]*scale)/ARA_SERVO_RATE_SCALE_UNIT;
+}
@@ -8,6 +8,7 @@
 
 #define ATRI_COM
 #include "atriCom.h"
+#include "atriRegisterShadow.h"
 #include "araSoft.h"
 #include "math.h"
 
@@ -106,6 +107,18 @@ int sendControlPacketToAtri(int fAtriControlSockFd,AtriControlPacket_t *pktPtr)
   return 0;
 }
 
+int atriSetControlPriority(int fAtriControlSockFd,AtriControlPriority_t priority)
+{
+  AtriControlPacket_t controlPacket;
+  memset(&controlPacket,0,sizeof(AtriControlPacket_t));
+  controlPacket.header.frameStart=ATRI_CONTROL_FRAME_START;
+  controlPacket.header.packetLocation=ATRI_LOC_HOST_PRIORITY;
+  controlPacket.header.packetLength=1;
+  controlPacket.data[0]=priority;
+  controlPacket.data[1]=ATRI_CONTROL_FRAME_END;
+  return sendControlPacketToAtri(fAtriControlSockFd,&controlPacket);
+}
+
 int readResponsePacketFromAtri(int fAtriControlSockFd,AtriControlPacket_t *pktPtr)
 {
   if(fAtriControlSockFd==0) {
@@ -233,6 +246,14 @@ int readFromAtriI2C(int fAtriControlSockFd,AtriDaughterStack_t stack, uint8_t i2
 
 
 int atriWishboneRead(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data)
+{
+  if(atriRegisterShadowIsEnabled())
+    return atriRegisterShadowRead(fAtriControlSockFd,wishboneAddress,length,data);
+  return atriWishboneReadDirect(fAtriControlSockFd,wishboneAddress,length,data);
+}
+
+
+int atriWishboneReadDirect(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data)
 {
   int i,k;
   int retVal=0;
@@ -350,6 +371,14 @@ int atriWishboneRead(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t len
 
 
 int atriWishboneWrite(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data)
+{
+  if(atriRegisterShadowIsEnabled())
+    return atriRegisterShadowWrite(fAtriControlSockFd,wishboneAddress,length,data);
+  return atriWishboneWriteDirect(fAtriControlSockFd,wishboneAddress,length,data);
+}
+
+
+int atriWishboneWriteDirect(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data)
 {
   int retVal=0;
   AtriControlPacket_t controlPacket;
@@ -428,6 +457,8 @@ int atriDaughterPowerOn(int fAtriControlSockFd,AtriDaughterStack_t stack, AtriDa
 	    __FUNCTION__);
     return -1;
   }
+  // A freshly powered daughter has lost its DAC settings
+  atriRegisterShadowInvalidate();
 
 
 
@@ -720,6 +751,9 @@ int setAtriThresholds(int fAtriControlSockFd,AtriDaughterStack_t stack,  uint16_
   unsigned char i2cDacWrite[12];
   int ret;
 
+  // Don't rewrite the DACs if nothing has changed
+  if(atriRegisterShadowThresholdsUnchanged(0,stack,thresholds)) return 0;
+
   // DAC command byte
   i2cDacWrite[0] = tdaThresh0 | dacWriteOnly;
   i2cDacWrite[1] = (thresholds[0] & 0xFF00)>>8;
@@ -733,7 +767,9 @@ int setAtriThresholds(int fAtriControlSockFd,AtriDaughterStack_t stack,  uint16_
   i2cDacWrite[9] = tdaThresh3 | dacWriteUpdateAll;
   i2cDacWrite[10] = (thresholds[3] & 0xFF00)>>8;
   i2cDacWrite[11] = (thresholds[3] & 0x00FF);
-  if((ret=writeToAtriI2C(fAtriControlSockFd,stack, tdaDacAddress, 12, i2cDacWrite)) < 0) {
+  ret=writeToAtriI2C(fAtriControlSockFd,stack, tdaDacAddress, 12, i2cDacWrite);
+  atriRegisterShadowStoreThresholds(0,stack,thresholds,ret==0);
+  if(ret < 0) {
     if (ret == -1) {
       ARA_LOG_MESSAGE(LOG_ERR, "%s : write to %sTDA threshold DAC failed (NACK)\n", __FUNCTION__, atriDaughterStackStrings[stack]);
       return -1;
@@ -752,6 +788,10 @@ int setAtriThresholds(int fAtriControlSockFd,AtriDaughterStack_t stack,  uint16_
 int setSurfaceAtriThresholds(int fAtriControlSockFd,AtriDaughterStack_t stack,  uint16_t *thresholds)
 {
   unsigned char i2cDacWrite[12];
+  int ret;
+
+  // Don't rewrite the DACs if nothing has changed
+  if(atriRegisterShadowThresholdsUnchanged(1,stack,thresholds)) return 0;
   
   // DAC command byte
   i2cDacWrite[0] = surfaceThresh0 | dacWriteOnly;
@@ -766,7 +806,9 @@ int setSurfaceAtriThresholds(int fAtriControlSockFd,AtriDaughterStack_t stack,
   i2cDacWrite[9] = surfaceThresh3 | dacWriteUpdateAll;
   i2cDacWrite[10] = (thresholds[3] & 0xFF00)>>8;
   i2cDacWrite[11] = (thresholds[3] & 0x00FF);
- if(writeToAtriI2C(fAtriControlSockFd,stack, surfaceDacAddress, 12, i2cDacWrite) < 0) {
+  ret=writeToAtriI2C(fAtriControlSockFd,stack, surfaceDacAddress, 12, i2cDacWrite);
+  atriRegisterShadowStoreThresholds(1,stack,thresholds,ret==0);
+  if(ret < 0) {
     ARA_LOG_MESSAGE(LOG_ERR, "%s: error setting surface thresholds value\n",
 		    __FUNCTION__);
     return -1;
@@ -418,6 +418,8 @@ int openConnectionToAtriControlSocket(); ///<Returns fd
 int sendControlPacketToAtri(int fAtriControlSockFd,AtriControlPacket_t *pktPtr);
 int readResponsePacketFromAtri(int fAtriControlSockFd,AtriControlPacket_t *pktPtr);
 int closeConnectionToAtriControlSocket(int fAtriControlSockFd);
+//Sets the queue priority class of every later packet on this connection, there is no reply
+int atriSetControlPriority(int fAtriControlSockFd,AtriControlPriority_t priority);
 
 
 //Useful wrappers to read write to the wishbone bus and I2C
@@ -426,6 +428,9 @@ int writeToAtriI2C(int fAtriControlSockFd,AtriDaughterStack_t stack, uint8_t i2c
 int readFromAtriI2C(int fAtriControlSockFd,AtriDaughterStack_t stack, uint8_t i2cAddress, uint8_t length, uint8_t *data);
 int atriWishboneRead(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data);
 int atriWishboneWrite(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data);
+//Always go to the ATRI, bypassing the register shadow (see atriRegisterShadow.h)
+int atriWishboneReadDirect(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data);
+int atriWishboneWriteDirect(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data);
 
 //Utility functions that do something
 
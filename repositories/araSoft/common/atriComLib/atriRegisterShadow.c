@@ -0,0 +1,390 @@
+/*
+   ATRI Register Shadow
+
+   Write elision, write coalescing and cached reads for the static ATRI
+   wishbone registers. See atriRegisterShadow.h for the rules.
+*/
+
+#include "atriRegisterShadow.h"
+#include "araSoft.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+
+//% The static (cacheable) registers and the registers whose writes reset the firmware.
+//% Anything not listed here is volatile.
+static const AtriRegisterRange_t atriRegisterRanges[] = {
+  {ATRI_WISH_DCM,           ATRI_WISH_DCM,            atriRegVolatile, 0x80},
+  {ATRI_WISH_IRSEN,         ATRI_WISH_IRSEN,          atriRegVolatile, irsctlResetMask},
+  {ATRI_WISH_IRSEN+1,       ATRI_WISH_IRSPEDEN+1,     atriRegStatic,   0}, // IRS mode, readout delay, pedestal mode
+  {ATRI_WISH_TTRIG_MAJOR,   ATRI_WISH_TTRIG_CTRL,     atriRegStatic,   0},
+  {ATRI_WISH_L1MASK,        ATRI_WISH_EXTPRETRIG,     atriRegStatic,   0}, // Trigger masks and window sizes
+  {ATRI_WISH_L1WINDOW,      ATRI_WISH_L1WINDOW,       atriRegStatic,   0},
+  {ATRI_WISH_TRIGCTL,       ATRI_WISH_TRIGCTL,        atriRegVolatile, trigctlResetMask},
+  {ATRI_WISH_GATEWINDOW,    ATRI_WISH_GATEWINDOW+1,   atriRegStatic,   0}
+};
+#define NUM_ATRI_REGISTER_RANGES (sizeof(atriRegisterRanges)/sizeof(AtriRegisterRange_t))
+
+//% Registers inside the static ranges that must never be cached: writing
+//% the same value again re-arms something, so the write can't be skipped
+static const uint16_t atriRegisterNeverCache[] = {
+  ATRI_WISH_IRSPEDEN,   // Written before every pedestal trigger
+  ATRI_WISH_TTRIG_CTRL  // A one-shot timed trigger is re-armed by each write
+};
+#define NUM_ATRI_REGISTER_NEVER_CACHE (sizeof(atriRegisterNeverCache)/sizeof(uint16_t))
+
+static pthread_mutex_t fShadowMutex = PTHREAD_MUTEX_INITIALIZER;
+static int fShadowEnabled=0;
+static uint8_t fRegVolatility[ATRI_SHADOW_NUM_REGS];
+static uint8_t fRegResetMask[ATRI_SHADOW_NUM_REGS];
+static uint8_t fShadowValue[ATRI_SHADOW_NUM_REGS];
+static uint8_t fShadowValid[ATRI_SHADOW_NUM_REGS];
+static uint16_t fShadowThresholds[2][TDA_PER_ATRI][ANTS_PER_TDA];
+static int fShadowThresholdsValid[2][TDA_PER_ATRI];
+static AtriRegisterShadowStats_t fShadowStats;
+
+//The pending batch write belongs to the thread that started the batch
+static __thread int fBatchDepth=0;
+static __thread int fBatchError=0;
+static __thread int fPendingFd=0;
+static __thread uint16_t fPendingStart=0;
+static __thread int fPendingLength=0;
+
+
+static void invalidateShadowLocked()
+{
+  memset(fShadowValid,0,sizeof(fShadowValid));
+  memset(fShadowThresholdsValid,0,sizeof(fShadowThresholdsValid));
+}
+
+static int isAllStatic(uint16_t wishboneAddress, int length)
+{
+  int i;
+  if(wishboneAddress+length>ATRI_SHADOW_NUM_REGS) return 0;
+  for(i=0;i<length;i++)
+    if(fRegVolatility[wishboneAddress+i]!=atriRegStatic) return 0;
+  return 1;
+}
+
+static int isAllStaticAndValid(uint16_t wishboneAddress, int length)
+{
+  int i;
+  if(!isAllStatic(wishboneAddress,length)) return 0;
+  for(i=0;i<length;i++)
+    if(!fShadowValid[wishboneAddress+i]) return 0;
+  return 1;
+}
+
+
+//The socket transactions are made without the mutex, so one slow
+//transaction doesn't hold up the other threads' lookups. A register is
+//only marked valid again once the reply says the write went in
+
+//Takes the pending write, with the mutex held, for sendPending
+static int takePendingLocked(uint8_t *buffer, int *fd, uint16_t *start)
+{
+  int length=fPendingLength;
+  if(length==0) return 0;
+  memcpy(buffer,&fShadowValue[fPendingStart],length);
+  *fd=fPendingFd;
+  *start=fPendingStart;
+  fPendingLength=0;
+  return length;
+}
+
+static int sendPending(const uint8_t *buffer, int fd, uint16_t start, int length)
+{
+  int retVal;
+  if(length==0) return 0;
+  retVal=atriWishboneWriteDirect(fd,start,length,(uint8_t*)buffer);
+  pthread_mutex_lock(&fShadowMutex);
+  fShadowStats.numTransactions++;
+  if(retVal<0) memset(&fShadowValid[start],0,length);
+  pthread_mutex_unlock(&fShadowMutex);
+  if(retVal<0) fBatchError=1;
+  return retVal;
+}
+
+static int flushPending()
+{
+  uint8_t buffer[ATRI_SHADOW_MAX_WRITE];
+  uint16_t start=0;
+  int fd=0,length;
+  if(fPendingLength==0) return 0;
+  pthread_mutex_lock(&fShadowMutex);
+  length=takePendingLocked(buffer,&fd,&start);
+  pthread_mutex_unlock(&fShadowMutex);
+  return sendPending(buffer,fd,start,length);
+}
+
+
+void atriRegisterShadowEnable(int enable)
+{
+  unsigned int range;
+  int addr;
+  pthread_mutex_lock(&fShadowMutex);
+  memset(fRegVolatility,atriRegVolatile,sizeof(fRegVolatility));
+  memset(fRegResetMask,0,sizeof(fRegResetMask));
+  for(range=0;range<NUM_ATRI_REGISTER_RANGES;range++) {
+    for(addr=atriRegisterRanges[range].start;addr<=atriRegisterRanges[range].end;addr++) {
+      fRegVolatility[addr]=atriRegisterRanges[range].volatility;
+      fRegResetMask[addr]=atriRegisterRanges[range].resetMask;
+    }
+  }
+  for(range=0;range<NUM_ATRI_REGISTER_NEVER_CACHE;range++)
+    fRegVolatility[atriRegisterNeverCache[range]]=atriRegVolatile;
+  invalidateShadowLocked();
+  fShadowEnabled=enable;
+  pthread_mutex_unlock(&fShadowMutex);
+}
+
+int atriRegisterShadowIsEnabled()
+{
+  return fShadowEnabled;
+}
+
+void atriRegisterShadowInvalidate()
+{
+  pthread_mutex_lock(&fShadowMutex);
+  invalidateShadowLocked();
+  pthread_mutex_unlock(&fShadowMutex);
+}
+
+
+void atriRegisterShadowBeginBatch()
+{
+  if(fBatchDepth==0) fBatchError=0;
+  fBatchDepth++;
+}
+
+int atriRegisterShadowEndBatch()
+{
+  if(fBatchDepth>0) fBatchDepth--;
+  if(fBatchDepth>0) return 0;
+  flushPending();
+  return fBatchError?-1:0;
+}
+
+
+int atriRegisterShadowWrite(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data)
+{
+  uint8_t buffer[ATRI_SHADOW_MAX_WRITE];
+  uint16_t flushStart=0;
+  int i,first=-1,last=-1;
+  int retVal=0,flushFd=0,flushLength;
+
+  if(!fShadowEnabled || length==0)
+    return atriWishboneWriteDirect(fAtriControlSockFd,wishboneAddress,length,data);
+
+  if(!isAllStatic(wishboneAddress,length)) {
+    //Volatile, keep the ordering by sending anything pending first
+    flushPending();
+    retVal=atriWishboneWriteDirect(fAtriControlSockFd,wishboneAddress,length,data);
+    if(wishboneAddress>=ATRI_SHADOW_NUM_REGS) return retVal;
+    pthread_mutex_lock(&fShadowMutex);
+    for(i=0;i<length && wishboneAddress+i<ATRI_SHADOW_NUM_REGS;i++) {
+      if(data[i] & fRegResetMask[wishboneAddress+i]) {
+	invalidateShadowLocked();
+	break;
+      }
+      if(fRegVolatility[wishboneAddress+i]==atriRegStatic) {
+	fShadowValue[wishboneAddress+i]=data[i];
+	fShadowValid[wishboneAddress+i]=(retVal==0);
+      }
+    }
+    pthread_mutex_unlock(&fShadowMutex);
+    return retVal;
+  }
+
+  pthread_mutex_lock(&fShadowMutex);
+  fShadowStats.numWrites++;
+  for(i=0;i<length;i++) {
+    if(!fShadowValid[wishboneAddress+i] || fShadowValue[wishboneAddress+i]!=data[i]) {
+      if(first<0) first=i;
+      last=i;
+    }
+  }
+  if(first<0) {
+    //Nothing has changed
+    fShadowStats.numWritesElided++;
+    fShadowStats.numBytesElided+=length;
+    pthread_mutex_unlock(&fShadowMutex);
+    return 0;
+  }
+  fShadowStats.numBytesElided+=length-(last-first+1);
+
+  if(fBatchDepth>0) {
+    //Batched writes go into the shadow now, it is what the pending write
+    //is sent from
+    for(i=first;i<=last;i++) {
+      fShadowValue[wishboneAddress+i]=data[i];
+      fShadowValid[wishboneAddress+i]=1;
+    }
+    int start=wishboneAddress+first;
+    int end=wishboneAddress+last;
+    if(fPendingLength && fPendingFd==fAtriControlSockFd) {
+      //Merge if the combined write is small enough and any gap can be
+      //filled from the shadow
+      int mergedStart=start<fPendingStart?start:fPendingStart;
+      int mergedEnd=end>fPendingStart+fPendingLength-1?end:fPendingStart+fPendingLength-1;
+      if(mergedEnd-mergedStart+1<=ATRI_SHADOW_MAX_WRITE &&
+	 isAllStaticAndValid(mergedStart,mergedEnd-mergedStart+1)) {
+	fPendingStart=mergedStart;
+	fPendingLength=mergedEnd-mergedStart+1;
+	fShadowStats.numWritesCoalesced++;
+	pthread_mutex_unlock(&fShadowMutex);
+	return 0;
+      }
+    }
+    flushLength=takePendingLocked(buffer,&flushFd,&flushStart);
+    fPendingFd=fAtriControlSockFd;
+    fPendingStart=start;
+    fPendingLength=end-start+1;
+    pthread_mutex_unlock(&fShadowMutex);
+    sendPending(buffer,flushFd,flushStart,flushLength);
+    return 0;
+  }
+
+  //Not valid while the write is in flight, so nobody elides against or
+  //reads a value the ATRI may not have
+  memset(&fShadowValid[wishboneAddress+first],0,last-first+1);
+  pthread_mutex_unlock(&fShadowMutex);
+  retVal=atriWishboneWriteDirect(fAtriControlSockFd,wishboneAddress+first,last-first+1,&data[first]);
+  pthread_mutex_lock(&fShadowMutex);
+  fShadowStats.numTransactions++;
+  if(retVal==0) {
+    for(i=first;i<=last;i++) {
+      fShadowValue[wishboneAddress+i]=data[i];
+      fShadowValid[wishboneAddress+i]=1;
+    }
+  }
+  pthread_mutex_unlock(&fShadowMutex);
+  return retVal;
+}
+
+
+int atriRegisterShadowRead(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data)
+{
+  int i,retVal;
+
+  if(!fShadowEnabled || length==0)
+    return atriWishboneReadDirect(fAtriControlSockFd,wishboneAddress,length,data);
+
+  //Reads always see our earlier writes
+  flushPending();
+
+  if(isAllStatic(wishboneAddress,length)) {
+    pthread_mutex_lock(&fShadowMutex);
+    fShadowStats.numReads++;
+    if(isAllStaticAndValid(wishboneAddress,length)) {
+      memcpy(data,&fShadowValue[wishboneAddress],length);
+      fShadowStats.numReadsCached++;
+      pthread_mutex_unlock(&fShadowMutex);
+      return 0;
+    }
+    pthread_mutex_unlock(&fShadowMutex);
+  }
+
+  retVal=atriWishboneReadDirect(fAtriControlSockFd,wishboneAddress,length,data);
+  if(retVal<0 || wishboneAddress>=ATRI_SHADOW_NUM_REGS) return retVal;
+
+  //Fill in any static registers we didn't know yet
+  pthread_mutex_lock(&fShadowMutex);
+  for(i=0;i<length && wishboneAddress+i<ATRI_SHADOW_NUM_REGS;i++) {
+    if(fRegVolatility[wishboneAddress+i]==atriRegStatic && !fShadowValid[wishboneAddress+i]) {
+      fShadowValue[wishboneAddress+i]=data[i];
+      fShadowValid[wishboneAddress+i]=1;
+    }
+  }
+  pthread_mutex_unlock(&fShadowMutex);
+  return retVal;
+}
+
+
+int atriRegisterShadowVerify(int fAtriControlSockFd)
+{
+  uint8_t buffer[ATRI_SHADOW_MAX_WRITE];
+  uint8_t expected[ATRI_SHADOW_MAX_WRITE];
+  int addr,start,length,i;
+  int numMismatched=0;
+
+  if(!fShadowEnabled) return 0;
+  flushPending();
+  addr=0;
+  while(addr<ATRI_SHADOW_NUM_REGS) {
+    //Find the next run of valid static registers
+    pthread_mutex_lock(&fShadowMutex);
+    if(fRegVolatility[addr]!=atriRegStatic || !fShadowValid[addr]) {
+      pthread_mutex_unlock(&fShadowMutex);
+      addr++;
+      continue;
+    }
+    start=addr;
+    while(addr<ATRI_SHADOW_NUM_REGS && addr-start<ATRI_SHADOW_MAX_WRITE &&
+	  fRegVolatility[addr]==atriRegStatic && fShadowValid[addr]) addr++;
+    length=addr-start;
+    memcpy(expected,&fShadowValue[start],length);
+    pthread_mutex_unlock(&fShadowMutex);
+
+    if(atriWishboneReadDirect(fAtriControlSockFd,start,length,buffer)<0) {
+      ARA_LOG_MESSAGE(LOG_ERR,"%s : error reading back %#x (%d bytes)\n",__FUNCTION__,start,length);
+      return -1;
+    }
+    pthread_mutex_lock(&fShadowMutex);
+    for(i=0;i<length;i++) {
+      if(buffer[i]!=expected[i]) {
+	ARA_LOG_MESSAGE(LOG_WARNING,"%s : register %#4.4x is %#2.2x, expected %#2.2x\n",
+			__FUNCTION__,start+i,buffer[i],expected[i]);
+	numMismatched++;
+      }
+      //Unless it was written while we were reading it
+      if(fShadowValid[start+i] && fShadowValue[start+i]==expected[i])
+	fShadowValue[start+i]=buffer[i];
+    }
+    pthread_mutex_unlock(&fShadowMutex);
+  }
+  return numMismatched;
+}
+
+
+void atriRegisterShadowGetStats(AtriRegisterShadowStats_t *stats)
+{
+  pthread_mutex_lock(&fShadowMutex);
+  memcpy(stats,&fShadowStats,sizeof(AtriRegisterShadowStats_t));
+  pthread_mutex_unlock(&fShadowMutex);
+}
+
+void atriRegisterShadowResetStats()
+{
+  pthread_mutex_lock(&fShadowMutex);
+  memset(&fShadowStats,0,sizeof(AtriRegisterShadowStats_t));
+  pthread_mutex_unlock(&fShadowMutex);
+}
+
+
+int atriRegisterShadowThresholdsUnchanged(int surface, AtriDaughterStack_t stack, uint16_t *thresholds)
+{
+  int unchanged=0;
+  if(!fShadowEnabled || stack<0 || stack>=TDA_PER_ATRI) return 0;
+  surface=surface?1:0;
+  pthread_mutex_lock(&fShadowMutex);
+  if(fShadowThresholdsValid[surface][stack] &&
+     memcmp(fShadowThresholds[surface][stack],thresholds,sizeof(uint16_t)*ANTS_PER_TDA)==0) {
+    fShadowStats.numThresholdWritesElided++;
+    unchanged=1;
+  }
+  pthread_mutex_unlock(&fShadowMutex);
+  return unchanged;
+}
+
+void atriRegisterShadowStoreThresholds(int surface, AtriDaughterStack_t stack, uint16_t *thresholds, int valid)
+{
+  if(!fShadowEnabled || stack<0 || stack>=TDA_PER_ATRI) return;
+  surface=surface?1:0;
+  pthread_mutex_lock(&fShadowMutex);
+  memcpy(fShadowThresholds[surface][stack],thresholds,sizeof(uint16_t)*ANTS_PER_TDA);
+  fShadowThresholdsValid[surface][stack]=valid;
+  pthread_mutex_unlock(&fShadowMutex);
+}
@@ -0,0 +1,104 @@
+/*
+   ATRI Register Shadow
+
+   An in-memory copy of the ATRI wishbone configuration registers. When
+   enabled atriWishboneWrite skips writes that would not change a cached
+   register and, inside a batch, merges writes to adjacent registers into
+   a single wishbone transaction. atriWishboneRead of cached registers is
+   answered from the shadow.
+
+   Each address is declared either static (only ever changed by us, safe
+   to cache) or volatile (status, counters, strobes and pointer/data
+   pairs, always passed straight through). A short never-cache list
+   overrides the static ranges for registers where rewriting the same
+   value re-arms something. Writes that reset the firmware invalidate the
+   whole shadow, and so does any write forwarded by the control socket
+   from another program (see atriControl.c).
+
+   There is only one ATRI per DAQ box so the shadow is shared by all the
+   control sockets in a process.
+*/
+
+#ifndef ATRI_REGISTER_SHADOW_H
+#define ATRI_REGISTER_SHADOW_H
+#include "atriCom.h"
+
+#define ATRI_SHADOW_NUM_REGS 0x200 ///< Wishbone addresses covered by the shadow
+#define ATRI_SHADOW_MAX_WRITE 58 ///< Largest coalesced write payload
+
+//% Enum defining how a register may be cached
+typedef enum atriRegisterVolatility {
+  atriRegVolatile = 0, ///< Never cached, every access goes to the ATRI
+  atriRegStatic = 1    ///< Only changed by software, cached and written only on change
+} AtriRegisterVolatility_t;
+
+//% A range of wishbone addresses with the same caching behaviour
+typedef struct {
+  uint16_t start;
+  uint16_t end; ///< Inclusive
+  AtriRegisterVolatility_t volatility;
+  uint8_t resetMask; ///< A write with any of these bits set invalidates the whole shadow
+} AtriRegisterRange_t;
+
+typedef struct {
+  unsigned int numWrites; ///< Writes to static registers
+  unsigned int numWritesElided; ///< Writes that didn't change anything
+  unsigned int numBytesElided; ///< Unchanged bytes not sent
+  unsigned int numWritesCoalesced; ///< Writes merged into a pending batch write
+  unsigned int numTransactions; ///< Wishbone writes actually sent for static registers
+  unsigned int numReads; ///< Reads of static registers
+  unsigned int numReadsCached; ///< Reads answered from the shadow
+  unsigned int numThresholdWritesElided; ///< Threshold DAC writes that didn't change anything
+} AtriRegisterShadowStats_t;
+
+
+/** \brief Enables or disables the register shadow.
+ *
+ * Enabling starts from an empty (invalid) shadow, so the first write to
+ * every register always goes to the ATRI.
+ */
+void atriRegisterShadowEnable(int enable);
+int atriRegisterShadowIsEnabled();
+
+/** \brief Forgets all cached register and threshold values.
+ *
+ * Should be called whenever something outside this process may have
+ * written to the ATRI.
+ */
+void atriRegisterShadowInvalidate();
+
+/** \brief Starts a batch of writes.
+ *
+ * Until the matching atriRegisterShadowEndBatch writes to adjacent static
+ * registers from this thread are held back and merged. Any read, or any
+ * write to a volatile register, flushes the pending write first so the
+ * ordering seen by the ATRI is unchanged. Batches nest.
+ */
+void atriRegisterShadowBeginBatch();
+
+/** \brief Ends a batch, sending any pending write.
+ *
+ * Returns 0 if every write sent during the batch succeeded, -1 otherwise.
+ */
+int atriRegisterShadowEndBatch();
+
+/** \brief Reads back every valid static register and compares it with the shadow.
+ *
+ * Mismatches are logged and the shadow is updated to the value in the
+ * ATRI. Returns the number of mismatched bytes, or -1 on a read error.
+ */
+int atriRegisterShadowVerify(int fAtriControlSockFd);
+
+void atriRegisterShadowGetStats(AtriRegisterShadowStats_t *stats);
+void atriRegisterShadowResetStats();
+
+//Used by atriWishboneRead/Write when the shadow is enabled
+int atriRegisterShadowWrite(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data);
+int atriRegisterShadowRead(int fAtriControlSockFd,uint16_t wishboneAddress,uint8_t length, uint8_t *data);
+
+//Used by setAtriThresholds and setSurfaceAtriThresholds, the DACs are on I2C not wishbone
+int atriRegisterShadowThresholdsUnchanged(int surface, AtriDaughterStack_t stack, uint16_t *thresholds);
+void atriRegisterShadowStoreThresholds(int surface, AtriDaughterStack_t stack, uint16_t *thresholds, int valid);
+
+
+#endif // ATRI_REGISTER_SHADOW_H
@@ -6,8 +6,12 @@
    rjn@hep.ucl.ac.uk, July 2011
 */
 
+#define _GNU_SOURCE
 #include "araSoft.h"
 #include "atriControl.h"
+#include "atriTrace.h"
+#include "atriComLib/atriCom.h"
+#include "atriComLib/atriRegisterShadow.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -79,7 +83,10 @@ void initAtriControlSocket(char *socketPath)
 
   pthread_mutex_lock(&atri_packet_queue_mutex);
   fAtriPacketNumber=0;
-  fAtriPacketFifo=NULL;
+  memset(fAtriPacketFifo,0,sizeof(fAtriPacketFifo));
+  memset(fAtriPacketFifoTail,0,sizeof(fAtriPacketFifoTail));
+  memset(fAtriPacketFifoSkipped,0,sizeof(fAtriPacketFifoSkipped));
+  memset(fAtriControlQueueStats,0,sizeof(fAtriControlQueueStats));
   pthread_mutex_unlock(&atri_packet_queue_mutex);
 
 }
@@ -184,13 +191,38 @@ void sendAtriControlPacketToSocket(AtriControlPacket_t *packetPtr)
 }
 
 
+static int isForeignConnection(int socketFd)
+{
+  //Connections from our own process (ARAAcqd's threads) go through its
+  //register shadow, anything else doesn't. If we can't tell, assume foreign.
+  struct ucred cred;
+  socklen_t len=sizeof(cred);
+  if(getsockopt(socketFd,SOL_SOCKET,SO_PEERCRED,&cred,&len)<0) return 1;
+  return cred.pid!=getpid();
+}
+
+
+static int isAtriWritePacket(AtriControlPacket_t *packetPtr)
+{
+  //Wishbone writes and I2C writes (even address) to the daughterboards
+  uint8_t location=packetPtr->header.packetLocation;
+  if(location==ATRI_LOC_WISHBONE) return packetPtr->data[0]==WB_WRITE;
+  if(location>=ATRI_LOC_I2C_DB1 && location<=ATRI_LOC_I2C_DB4)
+    return packetPtr->data[0]==I2C_DIRECT && !(packetPtr->data[1]&0x1);
+  return 0;
+}
+
+
 int addToAtriControlSocketList(int socketFd)
 {
   AtriSocketLinkedList_t *tempSocketList=NULL;
+  int foreign=isForeignConnection(socketFd);
   pthread_mutex_lock(&atri_socket_list_mutex);
   // Create new item in the list at the head of the list
   tempSocketList=(AtriSocketLinkedList_t*)malloc(sizeof(AtriSocketLinkedList_t));
   tempSocketList->socketFd=socketFd;
+  tempSocketList->priority=atriControlPriorityNormal;
+  tempSocketList->foreign=foreign;
   tempSocketList->next=fAtriControlSocketList;
   fAtriControlSocketList=tempSocketList;
   fNumAtriSockets++;
@@ -229,6 +261,29 @@ int removeFromAtriControlSocketList(int socketFd)
 }
 
 
+int setAtriControlSocketPriority(int socketFd, AtriControlPriority_t priority)
+{
+  int retVal=-1;
+  if(priority<0 || priority>=ATRI_CONTROL_NUM_PRIORITIES) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: invalid priority %d for socketFd %d\n",__FUNCTION__,priority,socketFd);
+    return -1;
+  }
+  pthread_mutex_lock(&atri_socket_list_mutex);
+  AtriSocketLinkedList_t *tempSocketList=fAtriControlSocketList;
+  while(tempSocketList) {
+    if(tempSocketList->socketFd==socketFd) {
+      tempSocketList->priority=priority;
+      retVal=0;
+      break;
+    }
+    tempSocketList=tempSocketList->next;
+  }
+  pthread_mutex_unlock(&atri_socket_list_mutex);
+  ARA_LOG_MESSAGE(LOG_DEBUG,"%s: socketFd %d priority %d\n",__FUNCTION__,socketFd,priority);
+  return retVal;
+}
+
+
 void closeAtriControl(char *socketPath) 
 {
   
@@ -247,6 +302,8 @@ int serviceOpenAtriControlConnections()
   //Okay so this essentially checks the open connections and services them in some way
   //Could be combined with the check for new connections
   struct pollfd fds[MAX_ATRI_CONNECTIONS];
+  AtriControlPriority_t socketPriority[MAX_ATRI_CONNECTIONS];
+  int socketForeign[MAX_ATRI_CONNECTIONS];
 
   AtriControlPacket_t controlPacket;
   int nbytes;
@@ -264,6 +321,8 @@ int serviceOpenAtriControlConnections()
     fds[nfds].fd = tempSocketList->socketFd;
     fds[nfds].events = POLLIN;
     fds[nfds].revents = 0;
+    socketPriority[nfds] = tempSocketList->priority;
+    socketForeign[nfds] = tempSocketList->foreign;
     nfds++;
     tempSocketList=tempSocketList->next;
   }
@@ -298,11 +357,18 @@ int serviceOpenAtriControlConnections()
     } else if (fds[tempInd].revents & POLLIN) {
       // data on the pipe
       nbytes = recv(thisFd, &controlPacket, sizeof(AtriControlPacket_t), 0); 
-      if (nbytes) {
+      if (nbytes && controlPacket.header.packetLocation==ATRI_LOC_HOST_PRIORITY) {
+	//Just for us, nothing goes to the ATRI and there is no reply
+	setAtriControlSocketPriority(thisFd,controlPacket.data[0]);
+      } else if (nbytes) {
 	ARA_LOG_MESSAGE(LOG_DEBUG,"%s: %d bytes from control pipe\n", __FUNCTION__,nbytes);
+	//Another program (wbw, atriSetThresholds...) is changing the ATRI
+	//behind the shadow's back, so it can no longer trust what it has
+	if(socketForeign[tempInd] && isAtriWritePacket(&controlPacket) && atriRegisterShadowIsEnabled())
+	  atriRegisterShadowInvalidate();
 	
 	///Now add it to the queue and add it to the packet list
-	addControlPacketToQueue(&controlPacket);
+	addControlPacketToQueue(&controlPacket,getControlPacketPriority(&controlPacket,socketPriority[tempInd]));
 	addToAtriPacketList(thisFd,controlPacket.header.packetNumber);
 	//	fprintf(stderr,"Got packet %d from thisFd %d\n",controlPacket.header.packetNumber,thisFd);
       } else {
@@ -318,57 +384,136 @@ int serviceOpenAtriControlConnections()
 }
 
 
-void addControlPacketToQueue(AtriControlPacket_t *packetPtr)
+AtriControlPriority_t getControlPacketPriority(AtriControlPacket_t *packetPtr, AtriControlPriority_t socketPriority)
+{
+  //Writes to the soft trigger, trigger control and digitiser enable
+  //registers start and stop triggering so never wait behind anything else
+  if(packetPtr->header.packetLocation==ATRI_LOC_WISHBONE && packetPtr->data[0]==WB_WRITE) {
+    uint16_t wishboneAddress=(packetPtr->data[1]<<8) | packetPtr->data[2];
+    switch(wishboneAddress) {
+    case ATRI_WISH_SOFTTRIG:
+    case ATRI_WISH_SOFTINFO:
+    case ATRI_WISH_TRIGCTL:
+    case ATRI_WISH_IRSEN:
+      return atriControlPriorityCritical;
+    default:
+      break;
+    }
+  }
+  return socketPriority;
+}
+
+
+void addControlPacketToQueue(AtriControlPacket_t *packetPtr, AtriControlPriority_t priority)
 {
   //should add a check packet link here
   ///but won't for now
+  if(priority<0 || priority>=ATRI_CONTROL_NUM_PRIORITIES) priority=atriControlPriorityNormal;
   pthread_mutex_lock(&atri_packet_queue_mutex);
   AtriPacketQueueFifo_t *tempQueue=(AtriPacketQueueFifo_t*)malloc(sizeof(AtriPacketQueueFifo_t));
-  AtriPacketQueueFifo_t *nextQueue;
   fAtriPacketNumber++;
   
   //The software breaks if it tries packet number 0
   if(fAtriPacketNumber==0) fAtriPacketNumber++;
   packetPtr->header.packetNumber=fAtriPacketNumber;
   memcpy(&(tempQueue->controlPacket),packetPtr,sizeof(AtriControlPacket_t));
+  gettimeofday(&(tempQueue->queueTime),NULL);
   tempQueue->next=NULL;
 
-  if(fAtriPacketFifo==NULL) {
-    fAtriPacketFifo=tempQueue;
+  if(fAtriPacketFifo[priority]==NULL) {
+    fAtriPacketFifo[priority]=tempQueue;
   }
   else {
-    nextQueue=fAtriPacketFifo;
-    while(nextQueue->next) {
-      nextQueue=nextQueue->next;
-    }
-    nextQueue->next=tempQueue;
+    fAtriPacketFifoTail[priority]->next=tempQueue;
   }
+  fAtriPacketFifoTail[priority]=tempQueue;
+
+  fAtriControlQueueStats[priority].depth++;
+  if(fAtriControlQueueStats[priority].depth>fAtriControlQueueStats[priority].maxDepth)
+    fAtriControlQueueStats[priority].maxDepth=fAtriControlQueueStats[priority].depth;
   pthread_mutex_unlock(&atri_packet_queue_mutex);  
 
-  ARA_LOG_MESSAGE(LOG_DEBUG,"%s: packetNumber=%d\n",__FUNCTION__,packetPtr->header.packetNumber);
+  ARA_LOG_MESSAGE(LOG_DEBUG,"%s: packetNumber=%d priority=%d\n",__FUNCTION__,packetPtr->header.packetNumber,priority);
 
 }
 
 int getControlPacketFromQueue(AtriControlPacket_t *packetPtr)
 {
+  struct timeval timeNow;
+  double latencyUs;
+  int priority,thisPriority=-1;
   pthread_mutex_lock(&atri_packet_queue_mutex);
-  AtriPacketQueueFifo_t *tempQueue=fAtriPacketFifo;
-  //  ARA_LOG_MESSAGE(LOG_DEBUG,"getControlPacketFromQueue tempQueue=%d\n",tempQueue);
-  if(tempQueue==NULL) {
+
+  //Strict priority, except that a class which has been jumped by
+  //ATRI_CONTROL_STARVATION_BUDGET packets gets the next turn. The most
+  //jumped class wins if there is more than one.
+  for(priority=0;priority<ATRI_CONTROL_NUM_PRIORITIES;priority++) {
+    if(fAtriPacketFifo[priority]==NULL) continue;
+    if(thisPriority<0) {
+      thisPriority=priority;
+    }
+    else if(fAtriPacketFifoSkipped[priority]>=ATRI_CONTROL_STARVATION_BUDGET &&
+	    (fAtriPacketFifoSkipped[priority]>fAtriPacketFifoSkipped[thisPriority] ||
+	     fAtriPacketFifoSkipped[thisPriority]<ATRI_CONTROL_STARVATION_BUDGET)) {
+      thisPriority=priority;
+    }
+  }
+  if(thisPriority<0) {
       pthread_mutex_unlock(&atri_packet_queue_mutex);  
       return 0;
   }
-  AtriPacketQueueFifo_t *nextInQueue=fAtriPacketFifo->next;  
+  for(priority=0;priority<ATRI_CONTROL_NUM_PRIORITIES;priority++) {
+    if(priority>thisPriority && fAtriPacketFifo[priority]) fAtriPacketFifoSkipped[priority]++;
+  }
+  for(priority=0;priority<thisPriority;priority++) {
+    if(fAtriPacketFifo[priority]) {
+      fAtriControlQueueStats[thisPriority].numStarvationTurns++;
+      break;
+    }
+  }
+  fAtriPacketFifoSkipped[thisPriority]=0;
+
+  AtriPacketQueueFifo_t *tempQueue=fAtriPacketFifo[thisPriority];
   memcpy(packetPtr,&(tempQueue->controlPacket),sizeof(AtriControlPacket_t));
+  gettimeofday(&timeNow,NULL);
+  latencyUs=(timeNow.tv_sec-tempQueue->queueTime.tv_sec)*1e6 + (timeNow.tv_usec-tempQueue->queueTime.tv_usec);
   
-  free(fAtriPacketFifo);
-  fAtriPacketFifo=nextInQueue;     
+  fAtriPacketFifo[thisPriority]=tempQueue->next;
+  if(fAtriPacketFifo[thisPriority]==NULL) fAtriPacketFifoTail[thisPriority]=NULL;
+  free(tempQueue);
+
+  fAtriControlQueueStats[thisPriority].numPackets++;
+  fAtriControlQueueStats[thisPriority].depth--;
+  fAtriControlQueueStats[thisPriority].totalLatencyUs+=latencyUs;
+  if(latencyUs>fAtriControlQueueStats[thisPriority].maxLatencyUs)
+    fAtriControlQueueStats[thisPriority].maxLatencyUs=latencyUs;
   pthread_mutex_unlock(&atri_packet_queue_mutex);  
-  ARA_LOG_MESSAGE(LOG_DEBUG,"Got packetNumber=%d from queue\n",packetPtr->header.packetNumber);
+  ARA_LOG_MESSAGE(LOG_DEBUG,"Got packetNumber=%d from queue (priority %d)\n",packetPtr->header.packetNumber,thisPriority);
   return 1;
 
 }
 
+void getAtriControlQueueStats(AtriControlQueueStats_t *stats)
+{
+  pthread_mutex_lock(&atri_packet_queue_mutex);
+  memcpy(stats,fAtriControlQueueStats,sizeof(fAtriControlQueueStats));
+  pthread_mutex_unlock(&atri_packet_queue_mutex);
+}
+
+void resetAtriControlQueueStats()
+{
+  int priority;
+  pthread_mutex_lock(&atri_packet_queue_mutex);
+  for(priority=0;priority<ATRI_CONTROL_NUM_PRIORITIES;priority++) {
+    //Keep the current depth, those packets are still in the queue
+    unsigned int depth=fAtriControlQueueStats[priority].depth;
+    memset(&fAtriControlQueueStats[priority],0,sizeof(AtriControlQueueStats_t));
+    fAtriControlQueueStats[priority].depth=depth;
+    fAtriControlQueueStats[priority].maxDepth=depth;
+  }
+  pthread_mutex_unlock(&atri_packet_queue_mutex);
+}
+
 
 
 //Now for the worker functions
@@ -559,7 +704,13 @@ int serviceOpenFx2ControlConnections()
     } else if (fds[tempInd].revents & POLLIN) {
       // data on the pipe
       nbytes = recv(thisFd, (char*)&tempPacket, sizeof(Fx2ControlPacket_t), 0); 
-      if (nbytes) {
+      if (nbytes && tempPacket.bRequest==VR_HOST_BATCH) {
+	if(serviceFx2BatchRequest(thisFd,&tempPacket)<0) {
+	  close(thisFd);
+	  removeFromFx2ControlSocketList(thisFd);
+	  thisFd = 0;
+	}
+      } else if (nbytes) {
 	ARA_LOG_MESSAGE(LOG_DEBUG,"%s: %d bytes from control pipe\n",__FUNCTION__, nbytes);
 	retVal=sendVendorRequestStruct(&tempPacket);
 	memcpy(&(responsePacket.control),&tempPacket,sizeof(Fx2ControlPacket_t));
@@ -582,6 +733,48 @@ int serviceOpenFx2ControlConnections()
 
 }
 
+int serviceFx2BatchRequest(int socketFd, Fx2ControlPacket_t *batchPacket)
+{
+  //The batch header is followed by dataLength ordinary control packets.
+  //They are sent to the FX2 back to back, with nothing from other
+  //connections in between, and the header response plus one response per
+  //request go back in a single send.
+  Fx2ControlPacket_t requests[MAX_FX2_BATCH_REQUESTS];
+  Fx2ResponsePacket_t responses[MAX_FX2_BATCH_REQUESTS+1];
+  Fx2ControlPacket_t tempPacket;
+  int numRequests=batchPacket->dataLength;
+  int i,nbytes;
+
+  for(i=0;i<numRequests;i++) {
+    nbytes=recv(socketFd,(char*)&tempPacket,sizeof(Fx2ControlPacket_t),MSG_WAITALL);
+    if(nbytes!=sizeof(Fx2ControlPacket_t)) {
+      ARA_LOG_MESSAGE(LOG_ERR,"%s: only got %d of %d requests\n",__FUNCTION__,i,numRequests);
+      return -1;
+    }
+    if(i<MAX_FX2_BATCH_REQUESTS) memcpy(&requests[i],&tempPacket,sizeof(Fx2ControlPacket_t));
+  }
+
+  memcpy(&(responses[0].control),batchPacket,sizeof(Fx2ControlPacket_t));
+  if(numRequests>MAX_FX2_BATCH_REQUESTS) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: batch of %d requests is too big (max %d)\n",__FUNCTION__,numRequests,MAX_FX2_BATCH_REQUESTS);
+    responses[0].status=-1;
+    numRequests=0;
+  }
+  else {
+    responses[0].status=numRequests;
+    for(i=0;i<numRequests;i++) {
+      responses[i+1].status=sendVendorRequestStruct(&requests[i]);
+      memcpy(&(responses[i+1].control),&requests[i],sizeof(Fx2ControlPacket_t));
+    }
+  }
+
+  if (send(socketFd, (char*)responses, (numRequests+1)*sizeof(Fx2ResponsePacket_t), 0) == -1) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: send -- %s\n",__FUNCTION__,strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
 /* Switch from USB to PCIe event readout */
 void enablePcieEndPoint() {
     usePcieReadout = 1;
@@ -605,6 +798,12 @@ int closePcieDevice() {
         return -1;
 }
 
+/* getEventEndPointFd(): the PCIe event char device to poll() on, -1 for USB
+   readout where the bulk read itself has to do the waiting */
+int getEventEndPointFd() {
+    return usePcieReadout ? pcieHandle : -1;
+}
+
 /* struct usb_device *findEzUsbAtriBoard(){  */
 /*   ARA_LOG_MESSAGE(LOG_DEBUG,"findEzUsbAtriBoard()\n");     */
 
@@ -859,6 +1058,7 @@ int sendVendorRequest(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
   //  }
 
   int retVal=libusb_control_transfer(currentHandle,bmRequestType,bRequest,wValue,wIndex,data,wLength,USB_TOUT_MS*10);
+  atriTraceRecord(ATRI_TRACE_VENDOR_REQUEST,bRequest,bmRequestType,retVal<0?retVal:0,(((uint32_t)wValue)<<16)|wIndex,data,wLength);
   //  fprintf(stderr, "In sendVendorRequest: DIRECT %d B requested. Return value: %d .\n", wLength,retVal);
   //  fprintf(stderr,"VR retVal=%d\n",retVal);
   if(retVal<0){
@@ -9,6 +9,7 @@
 #include <pthread.h>
 #include <libusb.h>
 #include <stdint.h>
+#include <sys/time.h>
 #include "fx2Defines.h"
 #include "atriDefines.h"
 
@@ -16,6 +17,7 @@
 #define MAX_ATRI_CONNECTIONS 128
 #define MAX_FX2_CONNECTIONS 128
 #define MAX_ATRI_PACKETS 256   //Arbitrary numbers may change to something more meaningful
+#define ATRI_CONTROL_STARVATION_BUDGET 16 ///< Higher priority packets allowed past a waiting class before it gets a turn
 
 #define NUM_ASYNC_BUFFERS 480
 #define NUM_ASYNC_REQUESTS 10
@@ -42,6 +44,8 @@ pthread_mutex_t libusb_command_mutex;
 //Here is the socket list
 struct socket_list {
   int socketFd;
+  AtriControlPriority_t priority; ///< Only used for the ATRI control sockets
+  int foreign; ///< The other end is another process, whose writes the register shadow can't see
   struct socket_list *next;
 } ;
 typedef struct socket_list AtriSocketLinkedList_t;
@@ -60,12 +64,27 @@ AtriPacketLinkedList_t *fPacketList;
 
 struct packet_queue {
   AtriControlPacket_t controlPacket;
+  struct timeval queueTime;
   struct packet_queue *next;
 } ;
 typedef struct packet_queue AtriPacketQueueFifo_t;
-AtriPacketQueueFifo_t *fAtriPacketFifo;
+//One fifo per priority class
+AtriPacketQueueFifo_t *fAtriPacketFifo[ATRI_CONTROL_NUM_PRIORITIES];
+AtriPacketQueueFifo_t *fAtriPacketFifoTail[ATRI_CONTROL_NUM_PRIORITIES];
+unsigned int fAtriPacketFifoSkipped[ATRI_CONTROL_NUM_PRIORITIES]; ///< Higher priority packets sent while this class was waiting
 uint8_t fAtriPacketNumber;
 
+//Per class queue statistics
+typedef struct {
+  unsigned int numPackets; ///< Packets sent to the ATRI
+  unsigned int numStarvationTurns; ///< Packets sent ahead of a higher class by the anti-starvation budget
+  unsigned int depth; ///< Packets currently waiting
+  unsigned int maxDepth;
+  double totalLatencyUs; ///< Summed time from arriving on the socket to leaving the queue
+  double maxLatencyUs;
+} AtriControlQueueStats_t;
+AtriControlQueueStats_t fAtriControlQueueStats[ATRI_CONTROL_NUM_PRIORITIES];
+
 
 
 //Need to add documentation for all of this
@@ -75,8 +94,12 @@ int checkForNewAtriControlConnections();
 int serviceOpenAtriControlConnections();
 int addToAtriControlSocketList(int socketFd);
 int removeFromAtriControlSocketList(int socketFd);
-void addControlPacketToQueue(AtriControlPacket_t *packetPtr);
+void addControlPacketToQueue(AtriControlPacket_t *packetPtr, AtriControlPriority_t priority);
 int getControlPacketFromQueue(AtriControlPacket_t *packetPtr);
+AtriControlPriority_t getControlPacketPriority(AtriControlPacket_t *packetPtr, AtriControlPriority_t socketPriority);
+int setAtriControlSocketPriority(int socketFd, AtriControlPriority_t priority);
+void getAtriControlQueueStats(AtriControlQueueStats_t *stats); ///< Copies ATRI_CONTROL_NUM_PRIORITIES entries
+void resetAtriControlQueueStats();
 int addToAtriPacketList(int socketFd, uint8_t packetNumber);
 int removeFromAtriPacketList(uint8_t packetNumber);
 void sendAtriControlPacketToSocket(AtriControlPacket_t *packetPtr);
@@ -87,6 +110,7 @@ void closeAtriControl(char *socketPath);
 void initFx2ControlSocket(char *socketPath);
 int checkForNewFx2ControlConnections();
 int serviceOpenFx2ControlConnections();
+int serviceFx2BatchRequest(int socketFd, Fx2ControlPacket_t *batchPacket);
 int addToFx2ControlSocketList(int socketFd);
 int removeFromFx2ControlSocketList(int socketFd);
 void closeFx2Control(char *socketPath);
@@ -131,6 +155,7 @@ void enablePcieEndPoint();
 void disablePcieEndPoint();
 int openPcieDevice();
 int closePcieDevice();
+int getEventEndPointFd(); ///< The PCIe device, for poll(), or -1 when events come over USB
 
 int openFx2Device();
 int flushControlEndPoint();
@@ -0,0 +1,224 @@
+/*
+   ATRI Trace  a fixed size in-memory binary trace of the traffic on the ATRI control and event end points.
+
+   Writers claim a slot with an atomic increment of the head and publish the entry by setting its sequence
+   number last, so there are no locks on the hot paths. The dump only uses open/write so it can be called
+   from a signal handler.
+*/
+
+#include "atriTrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#define ATRI_TRACE_DUMP_CHUNK 64
+
+static AtriTraceEntry_t fAtriTraceRing[ATRI_TRACE_RING_SIZE];
+static volatile uint32_t fAtriTraceHead=0;
+static volatile uint32_t fAtriTraceMask=0;
+static volatile int fAtriTraceDumping=0;
+static char fAtriTraceDumpFile[FILENAME_MAX]="/tmp/atriTrace.dat";
+
+//Reference point for the time stamp counter calibration
+static uint64_t fAtriTraceStartTicks=0;
+static struct timeval fAtriTraceStartTime;
+
+
+static inline uint64_t atriTraceTicks()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  uint32_t low,high;
+  __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+  return ((uint64_t)high << 32) | low;
+#else
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return ((uint64_t)tv.tv_sec)*1000000 + tv.tv_usec;
+#endif
+}
+
+
+void atriTraceInit(uint32_t directionMask)
+{
+  gettimeofday(&fAtriTraceStartTime,NULL);
+  fAtriTraceStartTicks=atriTraceTicks();
+  fAtriTraceMask=directionMask;
+}
+
+void atriTraceSetMask(uint32_t directionMask)
+{
+  if(fAtriTraceStartTicks==0) {
+    atriTraceInit(directionMask);
+    return;
+  }
+  fAtriTraceMask=directionMask;
+}
+
+uint32_t atriTraceGetMask()
+{
+  return fAtriTraceMask;
+}
+
+
+void atriTraceRecord(AtriTraceDirection_t direction, uint8_t location, uint8_t packetNumber, int8_t status, uint32_t aux, const uint8_t *data, int length)
+{
+  if(!(fAtriTraceMask & (1<<direction))) return;
+
+  uint32_t position=__sync_fetch_and_add(&fAtriTraceHead,1);
+  AtriTraceEntry_t *entry=&fAtriTraceRing[position&(ATRI_TRACE_RING_SIZE-1)];
+  int numStored=length;
+  if(numStored>ATRI_TRACE_MAX_PAYLOAD) numStored=ATRI_TRACE_MAX_PAYLOAD;
+  if(numStored<0 || data==NULL) numStored=0;
+
+  //Mark the entry as in progress before touching the rest of it
+  entry->sequence=0;
+  __sync_synchronize();
+  entry->timeStamp=atriTraceTicks();
+  entry->direction=direction;
+  entry->location=location;
+  entry->packetNumber=packetNumber;
+  entry->status=status;
+  entry->length=length>0?length:0;
+  entry->numStored=numStored;
+  entry->aux=aux;
+  if(numStored) memcpy(entry->payload,data,numStored);
+  __sync_synchronize();
+  entry->sequence=position+1;
+}
+
+
+static double atriTraceCalibrate(uint64_t nowTicks, struct timeval *nowTime)
+{
+  double deltaUs=(nowTime->tv_sec-fAtriTraceStartTime.tv_sec)*1e6;
+  deltaUs+=(nowTime->tv_usec-fAtriTraceStartTime.tv_usec);
+  if(deltaUs<=0 || nowTicks<=fAtriTraceStartTicks) return 0;
+  return (nowTicks-fAtriTraceStartTicks)/deltaUs;
+}
+
+static int atriTraceWriteAll(int fd, const void *buffer, size_t numBytes)
+{
+  const char *ptr=(const char*)buffer;
+  while(numBytes>0) {
+    ssize_t numWritten=write(fd,ptr,numBytes);
+    if(numWritten<=0) return -1;
+    ptr+=numWritten;
+    numBytes-=numWritten;
+  }
+  return 0;
+}
+
+
+int atriTraceDump(const char *fileName)
+{
+  AtriTraceFileHeader_t header;
+  AtriTraceEntry_t chunk[ATRI_TRACE_DUMP_CHUNK];
+  struct timeval nowTime;
+  uint32_t head,first,position;
+  int numInChunk=0;
+  int fd;
+
+  //Only one dump at a time, a crash during a dump shouldn't recurse
+  if(!__sync_bool_compare_and_swap(&fAtriTraceDumping,0,1)) return -1;
+
+  fd=open(fileName,O_WRONLY|O_CREAT|O_TRUNC,0644);
+  if(fd<0) {
+    fAtriTraceDumping=0;
+    return -1;
+  }
+
+  head=fAtriTraceHead;
+  first=0;
+  if(head>ATRI_TRACE_RING_SIZE) first=head-ATRI_TRACE_RING_SIZE;
+
+  memset(&header,0,sizeof(AtriTraceFileHeader_t));
+  header.magic=ATRI_TRACE_FILE_MAGIC;
+  header.version=ATRI_TRACE_FILE_VERSION;
+  header.entrySize=sizeof(AtriTraceEntry_t);
+  header.ringSize=ATRI_TRACE_RING_SIZE;
+  header.totalRecorded=head;
+  gettimeofday(&nowTime,NULL);
+  header.dumpTimeStamp=atriTraceTicks();
+  header.dumpUnixTime=nowTime.tv_sec;
+  header.dumpUnixTimeUs=nowTime.tv_usec;
+  header.ticksPerUs=atriTraceCalibrate(header.dumpTimeStamp,&nowTime);
+
+  //Count the entries first so the header is complete, entries overwritten
+  //while we are copying are dropped so the count is an upper bound that
+  //gets fixed up at the end
+  header.numEntries=head-first;
+  if(atriTraceWriteAll(fd,&header,sizeof(AtriTraceFileHeader_t))<0) {
+    close(fd);
+    fAtriTraceDumping=0;
+    return -1;
+  }
+
+  header.numEntries=0;
+  for(position=first;position!=head;position++) {
+    AtriTraceEntry_t *entry=&fAtriTraceRing[position&(ATRI_TRACE_RING_SIZE-1)];
+    if(entry->sequence!=position+1) continue; //Being written or already overwritten
+    __sync_synchronize();
+    memcpy(&chunk[numInChunk],entry,sizeof(AtriTraceEntry_t));
+    __sync_synchronize();
+    if(entry->sequence!=position+1) continue; //Overwritten during the copy
+    numInChunk++;
+    header.numEntries++;
+    if(numInChunk==ATRI_TRACE_DUMP_CHUNK) {
+      if(atriTraceWriteAll(fd,chunk,numInChunk*sizeof(AtriTraceEntry_t))<0) break;
+      numInChunk=0;
+    }
+  }
+  if(numInChunk) atriTraceWriteAll(fd,chunk,numInChunk*sizeof(AtriTraceEntry_t));
+
+  //Now fix up the number of entries actually written
+  if(lseek(fd,0,SEEK_SET)==0)
+    atriTraceWriteAll(fd,&header,sizeof(AtriTraceFileHeader_t));
+  close(fd);
+  fAtriTraceDumping=0;
+  return header.numEntries;
+}
+
+
+void atriTraceSetDumpFile(const char *fileName)
+{
+  strncpy(fAtriTraceDumpFile,fileName,FILENAME_MAX-1);
+  fAtriTraceDumpFile[FILENAME_MAX-1]='\0';
+}
+
+
+static void atriTraceDumpHandler(int sig)
+{
+  atriTraceDump(fAtriTraceDumpFile);
+}
+
+static void atriTraceCrashHandler(int sig)
+{
+  atriTraceDump(fAtriTraceDumpFile);
+  //Now let the default action happen so we still get the core
+  signal(sig,SIG_DFL);
+  raise(sig);
+}
+
+void atriTraceInstallSignalHandlers()
+{
+  signal(SIGUSR1,atriTraceDumpHandler);
+  signal(SIGSEGV,atriTraceCrashHandler);
+  signal(SIGBUS,atriTraceCrashHandler);
+  signal(SIGFPE,atriTraceCrashHandler);
+  signal(SIGABRT,atriTraceCrashHandler);
+}
+
+
+const char *atriTraceDirectionAsString(AtriTraceDirection_t direction)
+{
+  switch(direction) {
+  case ATRI_TRACE_CONTROL_IN: return "CTL_IN";
+  case ATRI_TRACE_CONTROL_OUT: return "CTL_OUT";
+  case ATRI_TRACE_EVENT_IN: return "EVT_IN";
+  case ATRI_TRACE_VENDOR_REQUEST: return "VENDOR";
+  default: return "UNKNOWN";
+  }
+}
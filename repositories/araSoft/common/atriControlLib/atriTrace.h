@@ -0,0 +1,72 @@
+/*
+   ATRI Trace  a fixed size in-memory binary trace of the traffic on the ATRI control and event end points.
+
+   Entries are written lock free from the USB handling threads so the trace can be left on in normal running,
+   the ring is only written to disk on request (atriTraceDump), on SIGUSR1 or when the program crashes.
+   The resulting file can be decoded with programs/offline/atriTraceDecode
+*/
+
+#ifndef ATRI_TRACE_H
+#define ATRI_TRACE_H
+#include <stdint.h>
+
+#define ATRI_TRACE_RING_SIZE 8192 ///< Number of entries in the ring, must be a power of two
+#define ATRI_TRACE_MAX_PAYLOAD 72 ///< Large enough for a full control packet (4+64+1 bytes)
+
+#define ATRI_TRACE_FILE_MAGIC 0x54525441 ///< "ATRT"
+#define ATRI_TRACE_FILE_VERSION 1
+
+//! The direction (or source) of a traced transfer
+enum {
+  ATRI_TRACE_CONTROL_IN=0, ///< Control packet read from the ATRI
+  ATRI_TRACE_CONTROL_OUT=1, ///< Control packet written to the ATRI
+  ATRI_TRACE_EVENT_IN=2, ///< Block read from the event end point
+  ATRI_TRACE_VENDOR_REQUEST=3, ///< FX2 vendor request
+  ATRI_TRACE_NUM_DIRECTIONS
+};
+typedef uint8_t AtriTraceDirection_t;
+
+#define ATRI_TRACE_MASK_CONTROL ((1<<ATRI_TRACE_CONTROL_IN)|(1<<ATRI_TRACE_CONTROL_OUT)|(1<<ATRI_TRACE_VENDOR_REQUEST))
+#define ATRI_TRACE_MASK_EVENT (1<<ATRI_TRACE_EVENT_IN)
+
+//! A single trace entry, fixed size (96 bytes) so the ring never allocates
+typedef struct {
+  uint64_t timeStamp; ///< CPU time stamp counter when the entry was written
+  uint32_t sequence; ///< Position in the trace plus one, zero while the entry is being written
+  AtriTraceDirection_t direction;
+  uint8_t location; ///< Packet location, event frame type or bRequest
+  uint8_t packetNumber; ///< Packet number, event frame number or bmRequestType
+  int8_t status; ///< Negative return value of the transfer, zero if okay
+  uint16_t length; ///< Full length of the transfer
+  uint16_t numStored; ///< Number of bytes stored in payload
+  uint32_t aux; ///< wValue<<16 | wIndex for vendor requests
+  uint8_t payload[ATRI_TRACE_MAX_PAYLOAD];
+} AtriTraceEntry_t;
+
+//! The header at the start of a trace dump, followed by numEntries AtriTraceEntry_t in time order
+typedef struct {
+  uint32_t magic; ///< ATRI_TRACE_FILE_MAGIC
+  uint16_t version;
+  uint16_t entrySize; ///< sizeof(AtriTraceEntry_t)
+  uint32_t ringSize;
+  uint32_t numEntries; ///< Number of entries following the header
+  uint32_t totalRecorded; ///< Number of entries ever recorded (wraps)
+  uint32_t dumpUnixTime;
+  uint32_t dumpUnixTimeUs;
+  uint32_t reserved;
+  uint64_t dumpTimeStamp; ///< Time stamp counter at dumpUnixTime
+  double ticksPerUs; ///< Time stamp counter calibration
+} AtriTraceFileHeader_t;
+
+
+void atriTraceInit(uint32_t directionMask);
+void atriTraceSetMask(uint32_t directionMask);
+uint32_t atriTraceGetMask();
+void atriTraceRecord(AtriTraceDirection_t direction, uint8_t location, uint8_t packetNumber, int8_t status, uint32_t aux, const uint8_t *data, int length);
+int atriTraceDump(const char *fileName);
+void atriTraceSetDumpFile(const char *fileName);
+void atriTraceInstallSignalHandlers();
+const char *atriTraceDirectionAsString(AtriTraceDirection_t direction);
+
+
+#endif // ATRI_TRACE_H
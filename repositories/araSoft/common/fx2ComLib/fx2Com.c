@@ -169,54 +169,168 @@ int disableAtriComponents(int fFx2SockFd,uint8_t disableMask)
 
 int writeToI2CRegister(int fFx2SockFd,uint16_t i2cAddress, uint8_t reg, uint8_t value)
 {
-  uint8_t data[2]={reg,value};
-  return writeToI2C(fFx2SockFd,i2cAddress,2,data);
+  //Single transactions are batches of one so they share the batch path.
+  //A socket failure leaves the status at 0 so that is turned into -1.
+  Fx2I2CBatch_t batch;
+  fx2I2CBatchInit(&batch);
+  if(fx2I2CBatchAddRegisterWrite(&batch,i2cAddress,reg,value)<0) return -1;
+  if(fx2I2CBatchExecute(fFx2SockFd,&batch)<0 && batch.ops[0].status>=0) return -1;
+  return batch.ops[0].status;
 }
 
 
 int writeToI2C(int fFx2SockFd,uint16_t i2cAddress, uint8_t length, uint8_t *data)
 {
-  int i=0;
-  Fx2ControlPacket_t controlPacket;
-  Fx2ResponsePacket_t responsePacket;
+  Fx2I2CBatch_t batch;
+  fx2I2CBatchInit(&batch);
+  if(fx2I2CBatchAddWrite(&batch,i2cAddress,length,data)<0) return -1;
+  if(fx2I2CBatchExecute(fFx2SockFd,&batch)<0 && batch.ops[0].status>=0) return -1;
+  return batch.ops[0].status;
+}
 
-  controlPacket.bmRequestType=VR_HOST_TO_DEVICE;
-  controlPacket.bRequest=VR_ATRI_I2C;
-  controlPacket.wValue=i2cAddress;
-  controlPacket.wIndex=0;
-  controlPacket.dataLength=length;
-  if(length>0 && length<MAX_FX2_BUFFER_SIZE) {
-    for(i=0;i<length;i++) {
-      controlPacket.data[i]=data[i];
-    }
+
+int readFromI2C(int fFx2SockFd,uint16_t i2cAddress, uint8_t length, uint8_t *data)
+{
+  Fx2I2CBatch_t batch;
+  fx2I2CBatchInit(&batch);
+  if(fx2I2CBatchAddRead(&batch,i2cAddress,length)<0) return -1;
+  if(fx2I2CBatchExecute(fFx2SockFd,&batch)<0 && batch.ops[0].status>=0) return -1;
+  if(length>0) memcpy(data,batch.ops[0].data,length);
+  return batch.ops[0].status;
+}
+
+
+void fx2I2CBatchInit(Fx2I2CBatch_t *batch)
+{
+  batch->numOps=0;
+}
+
+static Fx2I2COp_t *fx2I2CBatchNewOp(Fx2I2CBatch_t *batch, Fx2I2COpType_t type, uint16_t i2cAddress, uint8_t length)
+{
+  Fx2I2COp_t *op;
+  if(batch->numOps>=MAX_FX2_BATCH_REQUESTS) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: batch is full (%d operations)\n",__FUNCTION__,batch->numOps);
+    return NULL;
+  }
+  if(length>=MAX_FX2_BUFFER_SIZE) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: length %d is too big\n",__FUNCTION__,length);
+    return NULL;
   }
+  op=&(batch->ops[batch->numOps]);
+  op->type=type;
+  op->i2cAddress=i2cAddress;
+  op->length=length;
+  op->status=0;
+  return op;
+}
 
-  sendControlPacketToFx2(fFx2SockFd,&controlPacket);
-  readResponsePacketFromFx2(fFx2SockFd,&responsePacket);
-  return responsePacket.status;
+int fx2I2CBatchAddWrite(Fx2I2CBatch_t *batch, uint16_t i2cAddress, uint8_t length, uint8_t *data)
+{
+  Fx2I2COp_t *op=fx2I2CBatchNewOp(batch,fx2I2CWrite,i2cAddress,length);
+  if(!op) return -1;
+  if(length>0) memcpy(op->data,data,length);
+  return batch->numOps++;
+}
 
+int fx2I2CBatchAddRegisterWrite(Fx2I2CBatch_t *batch, uint16_t i2cAddress, uint8_t reg, uint8_t value)
+{
+  uint8_t data[2]={reg,value};
+  return fx2I2CBatchAddWrite(batch,i2cAddress,2,data);
+}
+
+int fx2I2CBatchAddRead(Fx2I2CBatch_t *batch, uint16_t i2cAddress, uint8_t length)
+{
+  Fx2I2COp_t *op=fx2I2CBatchNewOp(batch,fx2I2CRead,i2cAddress,length);
+  if(!op) return -1;
+  memset(op->data,0,sizeof(op->data));
+  return batch->numOps++;
+}
+
+int fx2I2CBatchAddWriteRead(Fx2I2CBatch_t *batch, uint16_t i2cAddress, uint8_t writeLength, uint8_t *writeData, uint8_t readLength)
+{
+  //Need room for both or the read would be left dangling
+  if(batch->numOps+2>MAX_FX2_BATCH_REQUESTS) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: batch is full (%d operations)\n",__FUNCTION__,batch->numOps);
+    return -1;
+  }
+  //Addresses are 8-bit with the read/write flag in the low bit
+  if(fx2I2CBatchAddWrite(batch,i2cAddress&0xfffe,writeLength,writeData)<0) return -1;
+  return fx2I2CBatchAddRead(batch,i2cAddress|0x1,readLength);
+}
 
+static void fx2I2COpToControlPacket(Fx2I2COp_t *op, Fx2ControlPacket_t *controlPacket)
+{
+  controlPacket->bmRequestType=(op->type==fx2I2CRead) ? VR_DEVICE_TO_HOST : VR_HOST_TO_DEVICE;
+  controlPacket->bRequest=VR_ATRI_I2C;
+  controlPacket->wValue=op->i2cAddress;
+  controlPacket->wIndex=0;
+  controlPacket->dataLength=op->length;
+  if(op->type==fx2I2CWrite && op->length>0)
+    memcpy(controlPacket->data,op->data,op->length);
 }
 
+static void fx2I2COpFromResponsePacket(Fx2I2COp_t *op, Fx2ResponsePacket_t *responsePacket)
+{
+  op->status=responsePacket->status;
+  if(op->type==fx2I2CRead && op->length>0)
+    memcpy(op->data,responsePacket->control.data,op->length);
+}
 
-int readFromI2C(int fFx2SockFd,uint16_t i2cAddress, uint8_t length, uint8_t *data)
+int fx2I2CBatchExecute(int fFx2SockFd, Fx2I2CBatch_t *batch)
 {
-  int i=0;
-  Fx2ControlPacket_t controlPacket;
-  Fx2ResponsePacket_t responsePacket;
+  Fx2ControlPacket_t controlPackets[MAX_FX2_BATCH_REQUESTS+1];
+  Fx2ResponsePacket_t responsePackets[MAX_FX2_BATCH_REQUESTS+1];
+  int numBytes,numExpected,opNum;
+  int retVal=0;
 
-  controlPacket.bmRequestType=VR_DEVICE_TO_HOST;
-  controlPacket.bRequest=VR_ATRI_I2C;
-  controlPacket.wValue=i2cAddress;
-  controlPacket.wIndex=0;
-  controlPacket.dataLength=length;
-  sendControlPacketToFx2(fFx2SockFd,&controlPacket);
-  readResponsePacketFromFx2(fFx2SockFd,&responsePacket);
-  if(length>0 && length<MAX_FX2_BUFFER_SIZE) {
-    for(i=0;i<length;i++) {
-      data[i]=responsePacket.control.data[i];
-    }
+  if(batch->numOps==0) return 0;
+  if(fFx2SockFd==0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"FX2 control socket not open\n");
+    return -1;
+  }
+
+  if(batch->numOps==1) {
+    //No point in the batch header for a single transaction
+    fx2I2COpToControlPacket(&(batch->ops[0]),&controlPackets[0]);
+    if(sendControlPacketToFx2(fFx2SockFd,&controlPackets[0])<0) return -1;
+    if(readResponsePacketFromFx2(fFx2SockFd,&responsePackets[0])<0) return -1;
+    fx2I2COpFromResponsePacket(&(batch->ops[0]),&responsePackets[0]);
+    return batch->ops[0].status<0 ? batch->ops[0].status : 0;
+  }
+
+  //The header tells the control socket how many requests follow
+  memset(&controlPackets[0],0,sizeof(Fx2ControlPacket_t));
+  controlPackets[0].bmRequestType=VR_HOST_TO_DEVICE;
+  controlPackets[0].bRequest=VR_HOST_BATCH;
+  controlPackets[0].dataLength=batch->numOps;
+  for(opNum=0;opNum<batch->numOps;opNum++)
+    fx2I2COpToControlPacket(&(batch->ops[opNum]),&controlPackets[opNum+1]);
+
+  if (send(fFx2SockFd, (char*)controlPackets, (batch->numOps+1)*sizeof(Fx2ControlPacket_t), 0) == -1) {
+    ARA_LOG_MESSAGE(LOG_ERR,"send --%s\n",strerror(errno));
+    return -1;
   }
-  return responsePacket.status;
 
+  //First just the header response, it says whether the rest are coming
+  numBytes=recv(fFx2SockFd,(char*)&responsePackets[0],sizeof(Fx2ResponsePacket_t),MSG_WAITALL);
+  if(numBytes!=sizeof(Fx2ResponsePacket_t)) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: recv -- %d bytes (%s)\n",__FUNCTION__,numBytes,strerror(errno));
+    return -1;
+  }
+  if(responsePackets[0].status!=batch->numOps) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: batch of %d rejected (status %d)\n",__FUNCTION__,batch->numOps,responsePackets[0].status);
+    return -1;
+  }
+
+  numExpected=batch->numOps*sizeof(Fx2ResponsePacket_t);
+  numBytes=recv(fFx2SockFd,(char*)&responsePackets[1],numExpected,MSG_WAITALL);
+  if(numBytes!=numExpected) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: recv -- %d of %d bytes (%s)\n",__FUNCTION__,numBytes,numExpected,strerror(errno));
+    return -1;
+  }
+  for(opNum=0;opNum<batch->numOps;opNum++) {
+    fx2I2COpFromResponsePacket(&(batch->ops[opNum]),&responsePackets[opNum+1]);
+    if(batch->ops[opNum].status<0 && retVal==0) retVal=batch->ops[opNum].status;
+  }
+  return retVal;
 }
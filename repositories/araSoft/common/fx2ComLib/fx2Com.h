@@ -28,5 +28,42 @@ int writeToI2CRegister(int fFx2SockFd,uint16_t i2cAddress, uint8_t reg, uint8_t
 int writeToI2C(int fFx2SockFd,uint16_t i2cAddress, uint8_t length, uint8_t *data);
 int readFromI2C(int fFx2SockFd,uint16_t i2cAddress, uint8_t length, uint8_t *data);
 
+//% Enum for the direction of an FX2 I2C operation
+typedef enum fx2I2COpType {
+  fx2I2CWrite = 0,
+  fx2I2CRead = 1
+} Fx2I2COpType_t;
+
+//% A single I2C transaction in a batch
+typedef struct {
+  Fx2I2COpType_t type;
+  uint16_t i2cAddress;
+  uint8_t length;
+  uint8_t data[MAX_FX2_BUFFER_SIZE]; ///< Data to write, or the data read back
+  int status; ///< Status of this transaction once the batch has run
+} Fx2I2COp_t;
+
+//% A list of I2C transactions sent to the FX2 control socket in one go
+typedef struct {
+  int numOps;
+  Fx2I2COp_t ops[MAX_FX2_BATCH_REQUESTS];
+} Fx2I2CBatch_t;
+
+/** \brief Batched FX2 I2C transactions
+ *
+ * Each fx2I2CBatchAdd* call returns the index of the new operation (used to
+ * find read data and status after fx2I2CBatchExecute) or -1 if the batch is
+ * full or the length is too big. fx2I2CBatchExecute sends the whole batch
+ * to the control socket in one round trip, the operations are run in order
+ * with no other requests in between. It returns 0 if every operation
+ * succeeded and otherwise the first negative status.
+ */
+void fx2I2CBatchInit(Fx2I2CBatch_t *batch);
+int fx2I2CBatchAddWrite(Fx2I2CBatch_t *batch, uint16_t i2cAddress, uint8_t length, uint8_t *data);
+int fx2I2CBatchAddRegisterWrite(Fx2I2CBatch_t *batch, uint16_t i2cAddress, uint8_t reg, uint8_t value);
+int fx2I2CBatchAddRead(Fx2I2CBatch_t *batch, uint16_t i2cAddress, uint8_t length);
+int fx2I2CBatchAddWriteRead(Fx2I2CBatch_t *batch, uint16_t i2cAddress, uint8_t writeLength, uint8_t *writeData, uint8_t readLength);
+int fx2I2CBatchExecute(int fFx2SockFd, Fx2I2CBatch_t *batch);
+
 
 #endif // FX2_COM_H
@@ -371,6 +371,9 @@ int checkPacket(void *thePtr)
   case ARA_HEADER_TYPE: dataSize=0; break;
   case ARA_EVENT_HK_TYPE: dataSize=sizeof(AraEventHk_t); break;
   case ARA_SENSOR_HK_TYPE: dataSize=sizeof(AraSensorHk_t); break;
+  case ARA_SOFT_TRIG_HK_TYPE: dataSize=sizeof(AraSoftTriggerHk_t); break;
+  case ARA_EVENT_SUMMARY_TYPE: dataSize=sizeof(AraEventSummary_t); break;
+  case ARA_DQ_HK_TYPE: dataSize=sizeof(AraDqHk_t); break;
   case ARA_SBC_HK_TYPE: dataSize=0; break;
   default: dataSize=0; retVal+=PKT_E_CODE; break;
   }
@@ -403,6 +406,9 @@ const char *araDataTypeAsString(AraDataStructureType_t type)
   case ARA_HEADER_TYPE: return "AraStationHeader_t";
   case ARA_EVENT_HK_TYPE: return "AraEventHk_t";
   case ARA_SENSOR_HK_TYPE: return "AraSensorHk_t";
+  case ARA_SOFT_TRIG_HK_TYPE: return "AraSoftTriggerHk_t";
+  case ARA_EVENT_SUMMARY_TYPE: return "AraEventSummary_t";
+  case ARA_DQ_HK_TYPE: return "AraDqHk_t";
   case ARA_SBC_HK_TYPE: return "AraSbcHk_t";
   default: return "Unknown";
   }
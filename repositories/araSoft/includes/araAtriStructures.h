@@ -36,7 +36,10 @@ enum {
   ARA_EVENT_HK_TYPE=0x3, ///< Scalers, thresholds, etc.
   ARA_SENSOR_HK_TYPE=0x4, ///< Temperatures, Voltages, Currents, etc.
   ARA_SBC_HK_TYPE=0x5, ///< SBC related values disk space, etc.
-  ARA_ICRR_EVENT_TYPE=0x06 ///< ICRR Event Type
+  ARA_ICRR_EVENT_TYPE=0x06, ///< ICRR Event Type
+  ARA_SOFT_TRIG_HK_TYPE=0x07, ///< Planned and actual software trigger times
+  ARA_EVENT_SUMMARY_TYPE=0x08, ///< Per channel summary of an event
+  ARA_DQ_HK_TYPE=0x09 ///< Online data quality counters and histograms
 } ;
 typedef uint8_t AraDataStructureType_t;  ///< Ensure that it is just 8 bits
 
@@ -100,7 +103,8 @@ typedef uint8_t AraStationId_t;  ///< Ensure that it is just 8 bits
 
 enum {
   softTrigger_FORCED=0, ///< Software trigger for normal running
-  softTrigger_PED=1     ///< Software trigger for pedestal mode
+  softTrigger_PED=1,     ///< Software trigger for pedestal mode
+  softTrigger_RANDOM=2  ///< Random (Poisson) software trigger
 
 } ;
 typedef uint8_t AraAtriSoftTriggerInfo_t;  ///< Ensure that it is just 8 bits
@@ -154,6 +158,12 @@ typedef struct {
   uint16_t totalDeadTime; ///< Total deadtime in us, prescale 16
 } AraEventHk_t;
 
+//Flags stored in gHdr.alsoReserved of AraEventHk_t
+#define EVENT_HK_FLAG_SKIPPED_SECONDS 0x1 ///< One or more seconds before this one have no event hk
+#define EVENT_HK_FLAG_EXTRA_PPS 0x2 ///< PPS counter advanced further than the system clock (double counted PPS)
+#define EVENT_HK_FLAG_MISSING_PPS 0x4 ///< PPS counter advanced less than the system clock (missed PPS)
+#define EVENT_HK_FLAG_PPS_UNLOCKED 0x8 ///< The PPS edge was found by polling rather than predicted
+
 
 //!  Part of AraEvent library. The ATRI sensor housekeeping data structure.
 /*!
@@ -172,6 +182,122 @@ typedef struct {
 } AraSensorHk_t;
 
 
+#define SOFT_TRIGGERS_PER_HK 64
+
+//!  Part of AraEvent library. The timing of a single software trigger.
+/*!
+  The planned time is when the scheduler meant to send the trigger, latencyNs is how much later the wishbone write actually started.
+*/
+typedef struct {
+  uint32_t plannedUnixTime; ///< Planned time in seconds
+  uint32_t plannedUnixTimeNs; ///< Planned time nanoseconds
+  int32_t latencyNs; ///< Actual minus planned time
+  AraAtriSoftTriggerInfo_t triggerInfo; ///< softTrigger_FORCED or softTrigger_RANDOM
+  int8_t status; ///< Zero if the trigger was sent, negative if the write failed
+  uint16_t reserved;
+} AraSoftTriggerTime_t;
+
+
+//!  Part of AraEvent library. The software trigger housekeeping data structure.
+/*!
+  Up to SOFT_TRIGGERS_PER_HK software trigger times, written by the housekeeping thread so forced trigger livetime can be worked out offline.
+*/
+typedef struct {
+  AtriGenericHeader_t gHdr; ///< The generic header 
+  uint64_t unixTime; ///< Time in seconds (64-bits for future proofing)
+  uint32_t unixTimeUs; ///< Time in microseconds (32-bits)
+  uint16_t numTriggers; ///< Number of valid entries in triggers
+  uint16_t numDropped; ///< Triggers since the last record that were not recorded (buffer full)
+  AraSoftTriggerTime_t triggers[SOFT_TRIGGERS_PER_HK];
+} AraSoftTriggerHk_t;
+
+
+#define ARA_EVENT_SUMMARY_RMS_SCALE 16 ///< rms is in 1/16 ADC counts
+#define ARA_EVENT_SUMMARY_NO_SAMPLE 0xffff ///< peakSample of a channel that wasn't read out
+//Flags in AraEventSummary_t
+#define ARA_EVENT_SUMMARY_PED_SUBTRACTED 0x1 ///< Pedestals subtracted, otherwise the mean of each block
+#define ARA_EVENT_SUMMARY_WRITTEN 0x2 ///< The full event was written (not prescaled away)
+#define ARA_EVENT_SUMMARY_BAD 0x4 ///< The blocks ran off the end of the event
+
+//!  Part of AraEvent library. The summary of one event.
+/*!
+  A few numbers per channel worked out by ARAAcqd as each event is read, written to their own small stream so the run can be looked at (and the events to send picked) without the full events. The mean is taken over the whole readout with pedestals and per block without.
+*/
+typedef struct {
+  AtriGenericHeader_t gHdr; ///< The generic header 
+  uint64_t unixTime; ///< Software event time in seconds
+  uint32_t unixTimeUs; ///< Software event time in microseconds
+  uint32_t eventNumber; ///< Software event number, as in the event
+  uint32_t timeStamp; ///< Timestamp
+  uint32_t ppsNumber;
+  uint32_t eventId;
+  uint16_t numReadoutBlocks;
+  uint16_t filterFlag; ///< The event's filterFlag, 0 if the filter is off
+  uint8_t triggerMask; ///< Bit n is set if triggerInfo[n] of the event is
+  uint8_t triggerBlock[MAX_TRIG_BLOCKS]; ///< Which block each trigger occured in
+  uint8_t flags; ///< ARA_EVENT_SUMMARY_* flags
+  uint16_t reserved;
+  uint16_t firstBlock[DDA_PER_ATRI]; ///< IRS block number of the first readout of each DDA
+  uint16_t rms[DDA_PER_ATRI*RFCHAN_PER_DDA]; ///< In 1/ARA_EVENT_SUMMARY_RMS_SCALE ADC counts
+  int16_t peak[DDA_PER_ATRI*RFCHAN_PER_DDA]; ///< Largest excursion from the mean in ADC counts, with its sign
+  uint16_t peakSample[DDA_PER_ATRI*RFCHAN_PER_DDA]; ///< Samples from the start of the readout to the peak
+} AraEventSummary_t;
+
+
+#define ARA_DQ_NUM_CHANNELS (DDA_PER_ATRI*RFCHAN_PER_DDA)
+#define ARA_DQ_RANGE_BINS 12 ///< Bin 0 is a block range of 0, bin n (n>0) is 2^(n-1) to 2^n-1, the last bin everything above
+#define ARA_DQ_ADC_BINS 16
+#define ARA_DQ_ADC_BIN_BITS 8 ///< adcHist bins are 2^8 ADC counts wide
+#define ARA_DQ_ADC_MAX 4095 ///< Samples at 0 or this are on the rail
+//Read and unpack failures, ARAAcqd's unpackAtriEventV2 returns -(class)
+#define ARA_DQ_NUM_ERROR_CLASSES 8
+#define ARA_DQ_ERR_READ 0 ///< readAtriEventV2 failed
+#define ARA_DQ_ERR_OVERRUN 1 ///< The frames ran past the end of what was read
+#define ARA_DQ_ERR_FIRST_FRAME 2 ///< A first frame in the middle of an event
+#define ARA_DQ_ERR_FRAME_SEQUENCE 3 ///< Frame number not the one expected
+#define ARA_DQ_ERR_WRONG_DDA 4 ///< Block header of a different DDA than the block info said
+#define ARA_DQ_ERR_OUTPUT_OVERFLOW 5 ///< Unpacked event too big for the buffer
+//Alarms in AraDqHk_t
+#define ARA_DQ_ALARM_ERRORS 0x01 ///< Read and unpack errors
+#define ARA_DQ_ALARM_EVENT_GAP 0x02 ///< Events missing from the eventId sequence
+#define ARA_DQ_ALARM_TIME_JUMP 0x04 ///< PPS jumps or timeStamps going backwards
+#define ARA_DQ_ALARM_BLOCK_SEQUENCE 0x08 ///< IRS blocks out of sequence or DDAs reading out different numbers of blocks
+#define ARA_DQ_ALARM_STUCK 0x10 ///< Channels with too many blocks of one repeated value
+#define ARA_DQ_ALARM_DEAD 0x20 ///< Channels with too little spread in their blocks
+#define ARA_DQ_ALARM_RAIL 0x40 ///< Channels with too many samples on the rail
+
+//!  Part of AraEvent library. The online data quality record.
+/*!
+  Counters and histograms kept by ARAAcqd as it unpacks events, written to the dqHk stream every dqPeriodS and then zeroed, so each record covers the events between startUnixTime and unixTime. The channel masks and alarmMask are the thresholds in the config applied to that period.
+*/
+typedef struct {
+  AtriGenericHeader_t gHdr; ///< The generic header 
+  uint64_t unixTime; ///< End of the period in seconds
+  uint32_t unixTimeUs; ///< End of the period, microseconds
+  uint32_t startUnixTime; ///< Start of the period
+  uint32_t numEvents; ///< Events unpacked
+  uint32_t numHistEvents; ///< Events in adcHist
+  uint32_t numErrors[ARA_DQ_NUM_ERROR_CLASSES]; ///< By ARA_DQ_ERR_* class
+  uint32_t numEventIdGaps; ///< Events whose eventId isn't one after the last
+  uint32_t numEventsMissed; ///< eventIds skipped over in those gaps
+  uint32_t numPpsJumps; ///< Events where the PPS count moved more than a second away from the unix time
+  uint32_t numTimeStampBackwards; ///< Events with a timeStamp below the last in the same PPS second
+  uint32_t numBlockSequenceErrors[DDA_PER_ATRI]; ///< Readouts whose IRS block isn't the one after the DDA's last
+  uint32_t numDdaMismatches; ///< Events where the DDAs read out different numbers of blocks
+  uint32_t alarmMask; ///< ARA_DQ_ALARM_* bits
+  uint32_t stuckChannelMask; ///< Bit per channel (dda*RFCHAN_PER_DDA+chan) over the stuck threshold
+  uint32_t deadChannelMask;
+  uint32_t railChannelMask;
+  uint32_t reserved;
+  uint32_t numBlocks[ARA_DQ_NUM_CHANNELS]; ///< Channel blocks looked at
+  uint32_t numStuckBlocks[ARA_DQ_NUM_CHANNELS]; ///< Blocks with all samples the same
+  uint32_t numRailSamples[ARA_DQ_NUM_CHANNELS]; ///< Samples at 0 or ARA_DQ_ADC_MAX
+  uint32_t rangeHist[ARA_DQ_NUM_CHANNELS][ARA_DQ_RANGE_BINS]; ///< Max-min of each block
+  uint32_t adcHist[ARA_DQ_NUM_CHANNELS][ARA_DQ_ADC_BINS]; ///< Sample occupancy of one in dqSampleHistPrescale events
+  uint16_t blockHits[DDA_PER_ATRI][BLOCKS_PER_DDA]; ///< Readouts of each IRS block, stops at 0xffff
+} AraDqHk_t;
+
+
 //!  Part of AraEvent library. A simple structure used for development when getting the ATRI data format running.
 /*!
   This is the N-byte structure that contains the event data in some format. This format will change when we have the full system working
@@ -221,6 +347,14 @@ typedef struct {
   //  uint8_t atriDdaNumber; 
 } AraStationEventBlockHeader_t;
 
+//The channelMask has the channels whose samples follow in [7:0] and the DDA
+//in [9:8]. Blocks far from the region of interest can have some channels
+//replaced by an AraStationEventBlockChannelSummary_t each, after the full
+//channels, and [13:10] then has how many
+#define ARA_BLOCK_NUM_SUMMARIES_SHIFT 10
+#define ARA_BLOCK_NUM_SUMMARIES_MASK 0xf
+#define ARA_BLOCK_NUM_SUMMARIES(channelMask) (((channelMask)>>ARA_BLOCK_NUM_SUMMARIES_SHIFT)&ARA_BLOCK_NUM_SUMMARIES_MASK)
+
 
 //!  Part of AraEvent library. The ARA ATRI Station Event Block Channel
 /*!
@@ -229,6 +363,19 @@ typedef struct {
 typedef struct {
   uint16_t samples[SAMPLES_PER_BLOCK]; ///< The IRS block readout
 } AraStationEventBlockChannel_t;
+
+
+//!  Part of AraEvent library. The ARA ATRI Station Event Block Channel Summary
+/*!
+  This is the 8-byte structure that stands in for a suppressed AraStationEventBlockChannel_t
+*/
+typedef struct {
+  uint8_t channel; ///< Channel in the DDA, the bit it would have in the channelMask
+  uint8_t reserved;
+  uint16_t mean; ///< Of the 64 samples, rounded
+  uint16_t min;
+  uint16_t max;
+} AraStationEventBlockChannelSummary_t;
   
 
 
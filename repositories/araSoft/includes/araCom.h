@@ -83,7 +83,8 @@ enum {
   ARA_PROG_PREPARED, ///< Ready to start
   ARA_PROG_RUNNING,  ///< Actively taking data
   ARA_PROG_STOPPING, ///< Stoping, closing files etc
-  ARA_PROG_TERMINATE ///< Stop the program
+  ARA_PROG_TERMINATE, ///< Stop the program
+  ARA_PROG_ROLLING_OVER ///< Between runs with the hardware left running, the last run's files are closed
 }; 
 typedef uint8_t AraProgramStatus_t;
 
@@ -97,7 +98,8 @@ enum {
   ARA_PROG_CONTROL_PREPARE=0x101, ///< Prepare to start
   ARA_PROG_CONTROL_START, ///< Start taking data
   ARA_PROG_CONTROL_STOP, ///< Stop data taking
-  ARA_PROG_CONTROL_TERMINATE ///< Stop and end the program
+  ARA_PROG_CONTROL_TERMINATE, ///< Stop and end the program
+  ARA_PROG_CONTROL_ROLLOVER ///< Close the run's files leaving the hardware running and wait for the START of the next run, answered with ARA_PROG_CONTROL_STOP if it needs a stop and start instead
 } ;
 typedef uint32_t AraProgramControl_t;
 
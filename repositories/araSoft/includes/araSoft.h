@@ -77,6 +77,7 @@ int printToScreen;
 //PID Files  //will change to /var/run
 #define ARAD_PID_FILE "/tmp/arad.pid"
 #define ARA_ACQD_PID_FILE "/tmp/araAcqd.pid"
+#define ARA_HK_STORED_PID_FILE "/tmp/araHkStored.pid"
 
 //CONFIG Files //will change to absoulte path maybe
 #define ARAD_CONFIG_FILE "arad.config"
@@ -92,12 +93,26 @@ int printToScreen;
 #define DAQ_EVENT_DIR "event/"
 #define DAQ_SENSOR_HK_DIR    "sensorHk/"
 #define DAQ_EVENT_HK_DIR "eventHk/"
+#define DAQ_SOFT_TRIG_HK_DIR "softTrigHk/"
+#define DAQ_EVENT_SUMMARY_DIR "eventSummary/"
+#define DAQ_DQ_HK_DIR "dqHk/"
+#define DAQ_PED_EVENT_DIR "pedEvent/"
+#define DAQ_CAL_EVENT_DIR "calEvent/"
+#define DAQ_SOFT_EVENT_DIR "softEvent/"
+#define DAQ_PRIORITY_EVENT_DIR "priorityEvent/"
 #define MONITOR_HK_DIR "monitorHk/"
 #define DAQ_PED_DIR   "peds/"
 
 #define EVENT_FILE_HEAD "ev"
 #define SENSOR_HK_FILE_HEAD    "sensorHk"
 #define EVENT_HK_FILE_HEAD    "eventHk"
+#define SOFT_TRIG_HK_FILE_HEAD    "softTrigHk"
+#define EVENT_SUMMARY_FILE_HEAD    "evSummary"
+#define DQ_HK_FILE_HEAD    "dqHk"
+#define PED_EVENT_FILE_HEAD "pedEv"
+#define CAL_EVENT_FILE_HEAD "calEv"
+#define SOFT_EVENT_FILE_HEAD "softEv"
+#define PRIORITY_EVENT_FILE_HEAD "priorityEv"
 #define PED_FILE_HEAD   "peds"
 #define DAQ_RUNLOG_DIR  "logs"
 
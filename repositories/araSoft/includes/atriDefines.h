@@ -36,11 +36,24 @@ enum {
   ATRI_LOC_I2C_DB1=3, ///< The I2C controller for daughterboard 1
   ATRI_LOC_I2C_DB2=4, ///< The I2C controller for daughterboard 2
   ATRI_LOC_I2C_DB3=5, ///< The I2C controller for daughterboard 3
-  ATRI_LOC_I2C_DB4=6 ///< The I2C controller for daughterboard 4
+  ATRI_LOC_I2C_DB4=6, ///< The I2C controller for daughterboard 4
+  ATRI_LOC_HOST_PRIORITY=0xF0 ///< Never sent to the ATRI, sets the priority class (data[0]) of the sending connection
 } ;
 typedef uint8_t AtriControlPacketLocation_t;  ///<Should only ever be 8 bytes long
 
 
+//!  The priority classes of the ATRI control packet queue
+/*!
+  Packets are sent to the ATRI in strict priority order (lowest number first) except that a waiting class is let through after ATRI_CONTROL_STARVATION_BUDGET packets from higher classes have jumped it. Each connection has a class (normal by default) and a few event critical wishbone writes are always critical.
+*/
+typedef enum atriControlPriority {
+  atriControlPriorityCritical=0, ///< Soft triggers, trigger enable/disable and run stop
+  atriControlPriorityNormal=1, ///< Default for a new connection
+  atriControlPriorityBulk=2, ///< Housekeeping, I2C sweeps and scan DAC loads
+  ATRI_CONTROL_NUM_PRIORITIES
+} AtriControlPriority_t;
+
+
 
 //!  The ATRI Control Packet Header
 /*!
@@ -20,6 +20,8 @@
 
 //This is just an arbitrary number for now
 #define MAX_FX2_BUFFER_SIZE 64
+//The most requests the control socket will run back to back in one VR_HOST_BATCH
+#define MAX_FX2_BATCH_REQUESTS 64
 
 
 //!  The FX2 Vendor Request Options
@@ -31,7 +33,8 @@ enum {
   VR_LED_DEBUG = 0xb5,
   VR_VERSION = 0xb7,
   VR_ATRI_COMPONENT_ENABLE=0xb6,
-  VR_ATRI_RESET = 0xBB
+  VR_ATRI_RESET = 0xBB,
+  VR_HOST_BATCH = 0xF0 ///< Never sent to the FX2, tells the control socket that dataLength requests follow
 };
 typedef uint8_t Fx2VendorRequest_t;
 
@@ -14,13 +14,21 @@ a  v) A thread which reads out the housekeeping data
 #include "ARAAcqd.h"
 #include "utilLib/util.h"
 #include "atriControlLib/atriControl.h"
+#include "atriControlLib/atriTrace.h"
 #include "fx2ComLib/fx2Com.h"
 #include "atriComLib/atriCom.h"
+#include "atriComLib/atriRegisterShadow.h"
 #include "kvpLib/keyValuePair.h"
 #include "configLib/configLib.h"
 #include "araRunLogLib/araRunLogLib.h"
 #include "araAtriStructures.h"
 #include "calpulserLib/calpulser.h"
+#include "araPedestalLib/araPedestal.h"
+#include "araPedestalLib/araPedestalFile.h"
+#include "araFilterLib/araFilter.h"
+#include "araFilterLib/araEventSummary.h"
+#include "araFilterLib/araRoi.h"
+#include "araDqLib/araDq.h"
 
 #include <stdlib.h>
 #include <stdarg.h>
@@ -37,13 +45,16 @@ a  v) A thread which reads out the housekeeping data
 #include <netinet/in.h>
 #include <poll.h>
 #include <math.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 
 //Global Variables
 //#define NO_USB 0
 //#define CLOCK_DEBUG 1
 
-#define MAX_SOFT_TRIG_RATE 50
+#define MAX_SOFT_TRIG_RATE 1000 //Soft triggers have their own thread now
 #define MAX_RAND_TRIG_RATE MAX_SOFT_TRIG_RATE
 #define MAX_EVENT_RATE_REPORT_RATE 1
 
@@ -51,6 +62,18 @@ a  v) A thread which reads out the housekeeping data
 ARAWriterStruct_t eventHkWriter;
 ARAWriterStruct_t sensorHkWriter;
 ARAWriterStruct_t eventWriter;
+ARAWriterStruct_t eventSummaryWriter;
+ARAWriterStruct_t dqHkWriter;
+ARAWriterStruct_t eventStreamWriter[NUM_EVENT_STREAMS]; ///< The other event streams, eventStreamMain's is eventWriter
+
+//Per event stream, see EventStream_t
+static const char *fEventStreamName[NUM_EVENT_STREAMS]={"main","ped","cal","soft","priority"};
+static const char *fEventStreamDir[NUM_EVENT_STREAMS]={DAQ_EVENT_DIR,DAQ_PED_EVENT_DIR,DAQ_CAL_EVENT_DIR,
+						       DAQ_SOFT_EVENT_DIR,DAQ_PRIORITY_EVENT_DIR};
+static const char *fEventStreamFileHead[NUM_EVENT_STREAMS]={EVENT_FILE_HEAD,PED_EVENT_FILE_HEAD,CAL_EVENT_FILE_HEAD,
+							    SOFT_EVENT_FILE_HEAD,PRIORITY_EVENT_FILE_HEAD};
+unsigned int fEventStreamNumEvents[NUM_EVENT_STREAMS];
+static ARAWriterStruct_t *getEventStreamWriter(int stream);
 
 
 //Threads
@@ -59,12 +82,70 @@ pthread_t fAtriControlSocketThread;
 pthread_t fFx2ControlUsbThread;
 pthread_t fAraHkThread;
 pthread_t fLibusbPollThread;
+pthread_t fSoftTrigThread;
 
 //Event loop variables
 int fHkThreadPrepared=0;
 int fHkThreadStopped=0;
+//Rolling over to the next run with the hardware left running
+int fRunOutputsOpen=0; ///< Set by openRunOutputs, cleared by closeRunOutputs
+int fRolloverStart=0; ///< The next run's number is in, open its files
+uint32_t fRunConfigHash=0; ///< Of the config files the run was prepared with
+int fSoftTrigThreadActive=0; ///< Set by the main thread once it is taking normal data
+SoftTriggerStats_t fSoftTrigStats[NUM_SOFT_TRIG_SOURCES];
+pthread_mutex_t fSoftTrigStatsMutex=PTHREAD_MUTEX_INITIALIZER;
+//Trigger times from the soft trigger thread waiting to be written by the hk thread
+AraSoftTriggerTime_t fSoftTrigTimes[SOFT_TRIG_TIME_BUFFER_SIZE];
+unsigned int fNumSoftTrigTimes=0;
+unsigned int fNumSoftTrigTimesDropped=0;
+ARAWriterStruct_t softTrigHkWriter;
+HkTask_t fHkTasks[NUM_HK_TASKS];
+PpsEdgeTracker_t fPpsEdgeTracker; ///< Only used by the event hk task
+AraMonitorSegment_t *fMonitorSegment=NULL; ///< Live state for monitoring tools
+AraServo_t fVdlyServo; ///< Each servo is only used by its own hk task
+AraServo_t fAntServo;
+AraServo_t fSurfaceServo;
+AraServo_t fRateServo; ///< Run by the ant servo task, it moves the ant servo goals
+AraServoRateInput_t fRateInput;
+uint16_t fScalerGoalScale=ARA_SERVO_RATE_SCALE_UNIT; ///< Current rate servo output
+//Latest event hk, published by the event hk task for the servo tasks
+AraEventHk_t fLatestEventHk;
+unsigned int fLatestEventHkNumber=0;
+pthread_mutex_t fLatestEventHkMutex=PTHREAD_MUTEX_INITIALIZER;
+//Event counts from the last rate report, for the status file
+int32_t fStatusGoodEvents=0;
+int32_t fStatusBadEvents=0;
 AraProgramStatus_t fProgramState;
+pthread_mutex_t fProgramStateMutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fProgramStateCond; ///< Broadcast on every state and thread flag change
+int fProgramStateFd=-1; ///< eventfd poked on every state change, polled along with the PCIe device
+int fEventWaitSawData=0; ///< The last waitForEventData woke for data, cleared when an event is read
+int fNumSpuriousEventWakeups=0; ///< In a row
+int fEventFdPollable=1;
 int32_t fInPedestalMode=0;
+//Online pedestal tracking, only touched by the main thread
+AraPedestalAccumulator_t fPedTracker;
+int fPedTrackerActive=0;
+AraPedestalSet_t fPedReference; ///< From the last pedestal run, to measure the drift against
+int fHavePedReference=0;
+int fPedTrackSnapshotNum=0;
+struct timeval fNextPedTrackSnapshot;
+//The L5 filter, events go through it between readout and writing
+AraFilter_t fFilter;
+int fFilterActive=0;
+unsigned int fFilterNumPrescaled=0; ///< Below filterWriteMaxPriority, counts towards the prescale
+unsigned int fFilterNumDropped=0;
+FilterManifestFile_t fFilterManifest[NUM_EVENT_STREAMS];
+//Region of interest suppression of the filtered events, see araRoi.h
+AraRoiConfig_t fRoiConfig;
+unsigned char *fRoiBuffer;
+unsigned int fRoiNumEvents=0;
+uint64_t fRoiBytesIn=0;
+uint64_t fRoiBytesOut=0;
+//Online data quality, filled and written by the main thread
+AraDq_t fDq;
+int fDqActive=0;
+struct timeval fNextDqPublish;
 int32_t fCurrentRun;
 int32_t fCurrentEvent;
 int32_t fLastEventCount;
@@ -93,7 +174,6 @@ ARAacqdRunInfo_t runInfo;
 pthread_mutex_t libusb_command_mutex;
 
 
-FILE *fpAtriEventLog=NULL;
 
 AraStationEventHeader_t *fEventHeader;
 unsigned char *fEventReadBuffer;
@@ -110,6 +190,12 @@ time_t lastEventRead;
 
 
 #define CONDITION_MET( yes, nt, tt ) ( yes && ( nt.tv_sec > tt.tv_sec || ( nt.tv_sec == tt.tv_sec && nt.tv_usec >= tt.tv_usec ) ) )
+//Sleeps until the condition on the program state and thread flags holds
+#define WAIT_FOR_PROGRAM_STATE( condition ) do {	\
+    pthread_mutex_lock(&fProgramStateMutex);		\
+    while(!(condition)) waitProgramStateCond();		\
+    pthread_mutex_unlock(&fProgramStateMutex);		\
+  } while(0)
 
 void ARAAcqdLogger(int debug_level, char *fmt, ...) {
   va_list argptr;
@@ -123,6 +209,7 @@ int main(int argc, char *argv[])
   char filename[FILENAME_MAX];
   fEventReadBuffer = malloc(MAX_EVENT_BUFFER_SIZE);
   fEventWriteBuffer = malloc(MAX_EVENT_BUFFER_SIZE);
+  fRoiBuffer = malloc(MAX_EVENT_BUFFER_SIZE);
   fEventHeader = (AraStationEventHeader_t*)fEventWriteBuffer;
 
 
@@ -131,22 +218,19 @@ int main(int argc, char *argv[])
   int numBytesRead;
   int fMainThreadAtriSockFd;
   int fMainThreadFx2SockFd;
-  float randScale;
   //  char* configFileName="/Users/rjn/ara/repositories/araSoft/trunk/config/ARAAcqd.config";
   char* configFileName="ARAAcqd.config";
   void *status;
 
 
   char* progName = basename(argv[0]);
-  fProgramState=ARA_PROG_IDLE;
+  initProgramState(ARA_PROG_IDLE);
 
   // Time values
   struct timeval nowTime;
-  struct timeval nextPrintTrig, nextPrintStep;
   struct timeval nextPrintEvent, nextPrintEventStep;
-  struct timeval nextSoftTrig,nextRandTrig,nextEventRateReport;//,nextHkRead,nextServoCalc;
-  struct timeval nextSoftStep,nextRandStep,nextEventRateReportStep;//,nextHkStep,nextServoStep;
-  unsigned int softTrigCount = 0;
+  struct timeval nextEventRateReport;//,nextHkRead,nextServoCalc;
+  struct timeval nextEventRateReportStep;//,nextHkStep,nextServoStep;
 
   // Check PID file
   retVal=checkPidFile(ARA_ACQD_PID_FILE);
@@ -177,6 +261,19 @@ int main(int argc, char *argv[])
 
   printToScreen=theConfig.printToScreen;
   printf("ARAAcqd: Output verbosity level: %d\n", printToScreen);
+
+  // Shared memory for the monitoring tools, they read it without going near the ATRI
+  if(theConfig.enableMonitorShm) {
+    fMonitorSegment=araMonitorCreate(ARA_MONITOR_SHM_NAME);
+    if(!fMonitorSegment)
+      ARA_LOG_MESSAGE(LOG_WARNING,"Can't create monitor shared memory %s\n",ARA_MONITOR_SHM_NAME);
+  }
+
+  // Start the control/event trace ring, it is dumped on SIGUSR1 or if we crash
+  atriTraceInit(getAtriTraceMask(&theConfig));
+  sprintf(filename,"%s/current/atriTrace.dat",theConfig.topDataDir);
+  atriTraceSetDumpFile(filename);
+  atriTraceInstallSignalHandlers();
    
   // Setup console logging
   if( theConfig.printToScreen ){
@@ -281,6 +378,11 @@ int main(int argc, char *argv[])
     ARA_LOG_MESSAGE(LOG_ERR,"Can't make ARA Hk Thread\n");
   }
 
+  retVal=pthread_create(&fSoftTrigThread,&attr,softTriggerThreadHandler,NULL);
+  if (retVal!=0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"Can't make soft trigger thread\n");
+  }
+
   {
     unsigned short fx2Version = 0;
     int rv;
@@ -327,8 +429,7 @@ int main(int argc, char *argv[])
   while(fProgramState!=ARA_PROG_TERMINATE) {
     switch(fProgramState) {
     case ARA_PROG_IDLE:
-      usleep(1000);
-      
+      WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_IDLE);
       break; //Don't do anything just wait
 
     case ARA_PROG_PREPARING:
@@ -338,6 +439,7 @@ int main(int argc, char *argv[])
 	ARA_LOG_MESSAGE(LOG_ERR,"Error reading config file %s: bailing\n",configFileName);
 	exit(1);
       }    
+      fRunConfigHash=getConfigFilesHash(configFileName);
       // Debugging: Dump the cal pulser configuration.
       calpulser_DumpFullConfig();
 
@@ -360,6 +462,12 @@ int main(int argc, char *argv[])
       // check last known calpulser configuration, and if nothing has changed,
       // it'll just return.
       calpulser_ApplyConfig(fMainThreadFx2SockFd);
+
+      // Start each run with an empty register shadow, other programs may
+      // have talked to the ATRI since the last one
+      atriRegisterShadowEnable(theConfig.atriRegisterShadow);
+      atriRegisterShadowResetStats();
+      resetAtriControlQueueStats();
        
       // Main ATRI initialization: turn on daughterboards, etc.
 
@@ -378,33 +486,12 @@ int main(int argc, char *argv[])
       // Flush event end point. The entire event path should be clear now.
       retVal=flushEventEndPoint();
 
-      //Setup output directories
-      makeDirectories(theConfig.eventTopDir);
-      makeDirectories(theConfig.eventHkTopDir);
-      makeDirectories(theConfig.sensorHkTopDir);
-      makeDirectories(theConfig.pedsTopDir);
-      makeDirectories(theConfig.runLogDir);
-      if( theConfig.linkForXfer )
-	makeDirectories(theConfig.linkDir);
-
-      sprintf(filename,"%s/current/atriEvent.log",theConfig.topDataDir);
-      if(theConfig.atriEventLog) {
-	fpAtriEventLog=fopen(filename,"w");
-	if(fpAtriEventLog==NULL) {
-	  ARA_LOG_MESSAGE (LOG_ERR,"fopen: %s ---  %s\n",strerror(errno),
-			   filename);
-	}
-      }
+      // The config may have changed which paths we trace
+      atriTraceSetMask(getAtriTraceMask(&theConfig));
+      sprintf(filename,"%s/current/atriTrace.dat",theConfig.topDataDir);
+      atriTraceSetDumpFile(filename);
 
-      ///Initialize writer structures
-      initWriter(&eventWriter,
-		 fCurrentRun,
-		 theConfig.compressionLevel,
-		 theConfig.filesPerDir,
-		 theConfig.eventsPerFile,
-		 EVENT_FILE_HEAD,
-		 theConfig.eventTopDir,
-		 theConfig.linkForXfer?theConfig.linkDir:NULL);
+      openRunOutputs();
 
       gettimeofday(&nowTime,NULL);
 
@@ -413,16 +500,16 @@ int main(int argc, char *argv[])
       setNextTime(&nextPrintEvent, &nowTime, &nextPrintEventStep);
 
 
-      // Enable soft triggering. Also set up how often we're going to
-      // actually *output* that we're soft triggering.
+      // Check the soft and random trigger rates, the triggers themselves
+      // are sent by softTriggerThreadHandler once we start taking data
+      resetSoftTriggerStats();
       if(  theConfig.enableSoftTrigger 
 	   && theConfig.softTriggerRateHz > 0.0
 	   && theConfig.softTriggerRateHz < MAX_SOFT_TRIG_RATE ){
-	setTimeInterval(&nextSoftStep, 1.0/theConfig.softTriggerRateHz);
-	setNextTime(&nextSoftTrig,&nowTime,&nextSoftStep);
-	// Only output once every 5 seconds maximum.
-	setTimeInterval(&nextPrintStep, 5.0);
-	setNextTime(&nextPrintTrig,&nowTime,&nextPrintStep);
+	if(theConfig.softTriggerMode!=softTriggerModeFixedPeriod && theConfig.softTriggerMode!=softTriggerModePpsLocked) {
+	  ARA_LOG_MESSAGE(LOG_WARNING,"Invalid soft trigger mode %d, using fixed period.\n",theConfig.softTriggerMode);
+	  theConfig.softTriggerMode=softTriggerModeFixedPeriod;
+	}
       }else{
 	if( theConfig.enableSoftTrigger )
 	  ARA_LOG_MESSAGE(LOG_WARNING,"Invalid soft trigger rate, disabling soft trigger.");
@@ -431,10 +518,7 @@ int main(int argc, char *argv[])
       if(  theConfig.enableRandTrigger
 	   && theConfig.randTriggerRateHz > 0.0 
 	   && theConfig.randTriggerRateHz < MAX_RAND_TRIG_RATE ){
-	srand(nowTime.tv_sec);
-	randScale = 2.0 / theConfig.randTriggerRateHz / RAND_MAX;
-	setTimeInterval(&nextRandStep,rand()*randScale);
-	setNextTime(&nextRandTrig,&nowTime,&nextRandStep);
+	ARA_LOG_MESSAGE(LOG_DEBUG,"Random triggers at %.1f Hz\n",theConfig.randTriggerRateHz);
       }else{
 	if( theConfig.enableRandTrigger )
 	  ARA_LOG_MESSAGE(LOG_WARNING,"Invalid random trigger rate, disabling random trigger.");
@@ -458,7 +542,7 @@ int main(int argc, char *argv[])
       }
       
 
-      while(!fHkThreadPrepared && fProgramState==ARA_PROG_PREPARING) usleep(1000);
+      WAIT_FOR_PROGRAM_STATE(fHkThreadPrepared || fProgramState!=ARA_PROG_PREPARING);
 
       /////
       // PSA: I don't understand this here: I think this should go in a state
@@ -466,22 +550,7 @@ int main(int argc, char *argv[])
       //      trigger until we're ready to catch data flying at us.
       ///// 
 
-      char RunComment[180];
-      sprintf(RunComment,"First Attempt at runInfo JPD");
-      recordStartDAQ( &(runInfo) , fCurrentRun, RunComment, theConfig.runLogDir, theConfig.topDataDir); 
-      latchDAQConfiguration( &(runInfo) ,   
-			     theConfig.enableRF0Trigger , theConfig.enableSoftTrigger , theConfig.enableRandTrigger , theConfig.pedestalMode||fInPedestalMode ,  
-			     theConfig.softTriggerRateHz , theConfig.randTriggerRateHz ,  
-			     theConfig.thresholdValues[0]//FIXME -- which threshold?  
-			     );  
-
-      char runLogConfigFile[100];
-      char configFileFullPath[100];
-      char* configPath = 0 ;
-      configPath = getenv ("ARA_CONFIG_DIR");
-      sprintf(configFileFullPath, "%s/%s", configPath, configFileName);
-      sprintf(runLogConfigFile, "%s/configFile.run%6.6d.dat", theConfig.runLogDir, fCurrentRun);
-      retVal = copyFileToFile(configFileFullPath, runLogConfigFile);
+      startRunLog(configFileName);
 
       ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: Enabling digitizer subsystem.\n");
       setIRSEnable(fMainThreadAtriSockFd, 1);      
@@ -495,13 +564,19 @@ int main(int argc, char *argv[])
 
       //FIXME -- set the number of trigger blocks for each trigger type
       initialiseTriggers(fMainThreadAtriSockFd);
+
+      if(theConfig.atriRegisterShadow && theConfig.atriRegisterVerify) {
+	retVal=atriRegisterShadowVerify(fMainThreadAtriSockFd);
+	if(retVal!=0)
+	  ARA_LOG_MESSAGE(LOG_WARNING,"ARAAcqd: ATRI register readback returned %d\n",retVal);
+      }
       
 
-      fProgramState=ARA_PROG_PREPARED;
+      changeProgramState(ARA_PROG_PREPARING,ARA_PROG_PREPARED);
     case ARA_PROG_PREPARED:
       fCurrentEvent=0;
       fLastEventCount = 0;
-      sleep(5);
+      WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_PREPARED);
       break; // Don't do anything just wait
     case ARA_PROG_RUNNING:
       // Main event loop
@@ -512,9 +587,9 @@ int main(int argc, char *argv[])
 	int retVal = doPedestalRunNotPedestalMode(fMainThreadAtriSockFd,fMainThreadFx2SockFd);
 	if(retVal<0){
 	  fprintf(stderr, "%s: pedestalRun failed!\n", __FUNCTION__);
-	  fProgramState=ARA_PROG_TERMINATE;
+	  setProgramState(ARA_PROG_TERMINATE);
 	}
-	fProgramState=ARA_PROG_STOPPING;
+	setProgramState(ARA_PROG_STOPPING);
 	//Toggle out of pedestal mode
 	fInPedestalMode=0;
 	break;
@@ -529,7 +604,7 @@ int main(int argc, char *argv[])
 
 	theConfig.enableVdlyServo=0;
 	doThresholdScan(fMainThreadAtriSockFd);
-	fProgramState=ARA_PROG_STOPPING;
+	setProgramState(ARA_PROG_STOPPING);
 	break;
       }
       else if(theConfig.thresholdScanSingleChannel){
@@ -541,7 +616,7 @@ int main(int argc, char *argv[])
 	setTriggerL4Mask(fMainThreadAtriSockFd, trigMask);
 
 	doThresholdScanSingleChannel(fMainThreadAtriSockFd);
-	fProgramState=ARA_PROG_STOPPING;
+	setProgramState(ARA_PROG_STOPPING);
 	break;
       }
       else if(theConfig.vdlyScan) {
@@ -555,10 +630,13 @@ int main(int argc, char *argv[])
 	setTriggerL4Mask(fMainThreadAtriSockFd, trigMask);
 
 	doVdlyScan(fMainThreadAtriSockFd);
-	fProgramState=ARA_PROG_STOPPING;
+	setProgramState(ARA_PROG_STOPPING);
 	break;
       }
 
+      //Normal data taking, let the soft trigger thread go
+      if(!fSoftTrigThreadActive && (theConfig.enableSoftTrigger || theConfig.enableRandTrigger))
+	setProgramFlag(&fSoftTrigThreadActive,1);
 
       gettimeofday(&nowTime,NULL);
 
@@ -566,6 +644,7 @@ int main(int argc, char *argv[])
       numBytesRead=0;
 
       retVal = readAtriEventV2(fEventReadBuffer);
+      if(retVal!=0) fEventWaitSawData=0;
       if(retVal>0){
 	ARA_LOG_MESSAGE(LOG_DEBUG, "We are reading %d bytes of event %d at %ld and %ld\n", retVal, fCurrentEvent, nowTime.tv_sec, nowTime.tv_usec);  //FIXME: Added this line: FIXED: Changed to LOG_DEBUG
         retVal = unpackAtriEventV2(fEventReadBuffer, fEventWriteBuffer,retVal); 
@@ -579,62 +658,42 @@ int main(int argc, char *argv[])
 	  
 	  //	  fEventHeader->ppsNumber=fCurrentPps;
 	  fillGenericHeader(fEventHeader, ARA_EVENT_TYPE, numBytesRead);
+	  if(fDqActive) araDqAddEvent(&fDq,fEventWriteBuffer,numBytesRead);
+	  if(fPedTrackerActive) trackPedestalEvent(numBytesRead);
 	  
-	  //Store Event
-	  int new_file_flag = 0;
-	  retVal = writeBuffer( &eventWriter, (char*)fEventWriteBuffer, numBytesRead, &(new_file_flag));
-	  if( retVal != numBytesRead ){
-	    ARA_LOG_MESSAGE(LOG_WARNING,"Error writing event %d\n",retVal);
-	    numBadEvents++;
+	  //Store Event, via the filter if it is on
+	  if(fFilterActive) {
+	    if(araFilterNumQueued(&fFilter)>=ARA_FILTER_QUEUE_DEPTH) writeFilteredEvents(1);
+	    if(araFilterAddEvent(&fFilter,fEventWriteBuffer,numBytesRead)<0) numBadEvents++;
+	  }
+	  else {
+	    storeEvent(fEventWriteBuffer,numBytesRead,getEventStream(fEventWriteBuffer));
+	    if(theConfig.enableEventSummary) writeEventSummary(fEventWriteBuffer,numBytesRead,1);
 	  }
-	  else numGoodEvents++;
-	  //jpd runInfo
-	   if(new_file_flag != 0){ 
-	     recordCloseEventFile( &(runInfo) , fCurrentEvent ); 
-	     updateRunLogFile( &(runInfo) ); 
-	     recordOpenEventFile( &(runInfo) ,  fCurrentEvent, eventWriter.startTime.tv_sec , eventWriter.startTime.tv_usec ); 
-	   } 
 	}
 	else {
 	  // TEMP FIXME
 	  ARA_LOG_MESSAGE(LOG_ERR, "unpackAtriEventV2 of event %d failed (%d)\n", fCurrentEvent, retVal);
+	  if(fDqActive) araDqAddError(&fDq,-retVal);
 	  numBadEvents++;
 	}
       }
       else if(retVal==0){
-      	usleep(1000);
+	waitForEventData();
       }
       else {
       	ARA_LOG_MESSAGE(LOG_WARNING,"Error reading event %d\n",retVal);
+	if(fDqActive) araDqAddError(&fDq,ARA_DQ_ERR_READ);
 	numBadEvents++;
       }	
+      if(fFilterActive) writeFilteredEvents(0);
+      if(fDqActive && timercmp(&nowTime,&fNextDqPublish,>)) publishDq(&nowTime);
 
-      ///Now we check if we want to send a software trigger
-      if( CONDITION_MET( theConfig.enableSoftTrigger, nowTime, nextSoftTrig ) ){
-      //retVal = sendSoftwareTriggerWithInfo(fMainThreadAtriSockFd, softTrigger_FORCED);
-	retVal = sendSoftwareTrigger(fMainThreadAtriSockFd);
-
-	if(retVal < 0){
-	  ARA_LOG_MESSAGE(LOG_ERR,"Error %d soft triggering",  retVal);
-	  fProgramState = ARA_PROG_TERMINATE;
-	  continue;
-	}
-	else {
-	  softTrigCount++;
-	  if (CONDITION_MET(1, nowTime, nextPrintTrig)) {
-	    ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: %d soft %s (since last update)\n", softTrigCount, 
-			    (softTrigCount > 1) ? "trigs" : "trig");
-	    softTrigCount = 0;
-	    setNextTime(&nextPrintTrig, &nowTime, &nextPrintStep);
-	  }
-	}
-	setNextTime(&nextSoftTrig,&nextSoftTrig,&nextSoftStep);
-      }
-      
       if( theConfig.enableEventRateReport &&
 	  CONDITION_MET(1, nowTime, nextEventRateReport)){
 	ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: Event Rate %0.2f Hz - %i good events %i bad events since last update\n", numGoodEvents*theConfig.eventRateReportRateHz, numGoodEvents, numBadEvents);
-	writeHelpfulTempFile();
+	fStatusGoodEvents=numGoodEvents;
+	fStatusBadEvents=numBadEvents;
 	numGoodEvents=0;
 	numBadEvents=0;
 	setNextTime(&nextEventRateReport, &nowTime, &nextEventRateReportStep);
@@ -645,17 +704,39 @@ int main(int argc, char *argv[])
     case ARA_PROG_STOPPING:
       //Close files and do everything neccessary
       ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: stopping run.\n");
+      setProgramFlag(&fSoftTrigThreadActive,0);
       ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: masking T1 trigger.\n");
       setTriggerT1Mask(fMainThreadAtriSockFd, 1);
-      
-      if(fpAtriEventLog) fclose(fpAtriEventLog);
-      fpAtriEventLog=NULL;
-
 
-      closeWriter(&eventWriter);
+      if(fRunOutputsOpen) closeRunOutputs();
 
-      while(!fHkThreadStopped && fProgramState==ARA_PROG_STOPPING) usleep(1000);
-      fProgramState=ARA_PROG_IDLE;
+      WAIT_FOR_PROGRAM_STATE(fHkThreadStopped || fProgramState!=ARA_PROG_STOPPING);
+      setProgramFlag(&fRolloverStart,0);
+      setProgramState(ARA_PROG_IDLE);
+      break;
+    case ARA_PROG_ROLLING_OVER:
+      //The triggers are left running, the events wait in the hardware
+      //until the next run's files are open
+      if(fRunOutputsOpen) {
+	ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: rolling over from run %d.\n",fCurrentRun);
+	closeRunOutputs();
+	break;
+      }
+      if(!fRolloverStart) {
+	WAIT_FOR_PROGRAM_STATE(fRolloverStart || fProgramState!=ARA_PROG_ROLLING_OVER);
+	break;
+      }
+      resetSoftTriggerStats();
+      atriRegisterShadowResetStats();
+      resetAtriControlQueueStats();
+      openRunOutputs();
+      WAIT_FOR_PROGRAM_STATE(fHkThreadPrepared || fProgramState!=ARA_PROG_ROLLING_OVER);
+      startRunLog(configFileName);
+      fCurrentEvent=0;
+      fLastEventCount=0;
+      setProgramFlag(&fRolloverStart,0);
+      ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: rolled over to run %d.\n",fCurrentRun);
+      changeProgramState(ARA_PROG_ROLLING_OVER,ARA_PROG_RUNNING);
       break;
     case ARA_PROG_TERMINATE:
       //Immediately exit
@@ -685,6 +766,10 @@ int main(int argc, char *argv[])
   if(retVal) {
     ARA_LOG_MESSAGE(LOG_ERR,"ERROR; return code from pthread_join() is %d\n", retVal);
   } 
+  retVal = pthread_join(fSoftTrigThread,&status);
+  if(retVal) {
+    ARA_LOG_MESSAGE(LOG_ERR,"ERROR; return code from pthread_join() is %d\n", retVal);
+  } 
   //  retVal = pthread_join(fLibusbPollThread,&status);
   //  if(retVal) {
   //    ARA_LOG_MESSAGE(LOG_ERR,"ERROR; return code from pthread_join() is %d\n", retVal);
@@ -697,8 +782,10 @@ int main(int argc, char *argv[])
   
   free(fEventReadBuffer);
   free(fEventWriteBuffer);
+  free(fRoiBuffer);
 
 
+  if(fMonitorSegment) araMonitorDestroy(fMonitorSegment,ARA_MONITOR_SHM_NAME);
   unlink(ARA_ACQD_PID_FILE);
   return 0; 
 }
@@ -707,6 +794,187 @@ int main(int argc, char *argv[])
 
 
 
+void openRunOutputs()
+{
+  //Everything the run writes, and the software that feeds it. The hardware
+  //is left alone so a rollover can do this between two events
+  int stream;
+  //Setup output directories
+  makeDirectories(theConfig.eventTopDir);
+  makeDirectories(theConfig.eventHkTopDir);
+  makeDirectories(theConfig.sensorHkTopDir);
+  makeDirectories(theConfig.softTrigHkTopDir);
+  if(theConfig.enableEventSummary) makeDirectories(theConfig.eventSummaryTopDir);
+  makeDirectories(theConfig.pedsTopDir);
+  makeDirectories(theConfig.runLogDir);
+  if( theConfig.linkForXfer )
+    makeDirectories(theConfig.linkDir);
+
+  if((theConfig.pedestalTrack || theConfig.enableFilter || theConfig.enableEventSummary) &&
+     !theConfig.pedestalMode && !fInPedestalMode)
+    loadPedestalReference();
+  if(theConfig.pedestalTrack && !theConfig.pedestalMode && !fInPedestalMode)
+    startPedestalTracker();
+  if(theConfig.enableFilter && !theConfig.pedestalMode && !fInPedestalMode)
+    startFilter();
+  if(theConfig.enableDq && !theConfig.pedestalMode && !fInPedestalMode)
+    startDq();
+
+  ///Initialize writer structures
+  initWriter(&eventWriter,
+	     fCurrentRun,
+	     theConfig.compressionLevel,
+	     theConfig.filesPerDir,
+	     theConfig.eventsPerFile,
+	     EVENT_FILE_HEAD,
+	     theConfig.eventTopDir,
+	     theConfig.linkForXfer?theConfig.linkDir:NULL);
+  for(stream=0;stream<NUM_EVENT_STREAMS;stream++) {
+    fEventStreamNumEvents[stream]=0;
+    if(stream==eventStreamMain || !theConfig.eventStreamEnable[stream]) continue;
+    makeDirectories(theConfig.eventStreamTopDir[stream]);
+    if(theConfig.linkForXfer) makeDirectories(theConfig.eventStreamLinkDir[stream]);
+    initWriter(&eventStreamWriter[stream],
+	       fCurrentRun,
+	       theConfig.eventStreamCompression[stream],
+	       theConfig.filesPerDir,
+	       theConfig.eventStreamEventsPerFile[stream],
+	       fEventStreamFileHead[stream],
+	       theConfig.eventStreamTopDir[stream],
+	       theConfig.linkForXfer?theConfig.eventStreamLinkDir[stream]:NULL);
+  }
+  if(theConfig.enableEventSummary)
+    initWriter(&eventSummaryWriter,
+	       fCurrentRun,
+	       theConfig.compressionLevel,
+	       theConfig.filesPerDir,
+	       theConfig.summariesPerFile,
+	       EVENT_SUMMARY_FILE_HEAD,
+	       theConfig.eventSummaryTopDir,
+	       theConfig.linkForXfer?theConfig.linkDir:NULL);
+  setProgramFlag(&fRunOutputsOpen,1);
+}
+
+
+void startRunLog(const char *configFileName)
+{
+  char RunComment[180];
+  sprintf(RunComment,"First Attempt at runInfo JPD");
+  recordStartDAQ( &(runInfo) , fCurrentRun, RunComment, theConfig.runLogDir, theConfig.topDataDir);
+  latchDAQConfiguration( &(runInfo) ,
+			 theConfig.enableRF0Trigger , theConfig.enableSoftTrigger , theConfig.enableRandTrigger , theConfig.pedestalMode||fInPedestalMode ,
+			 theConfig.softTriggerRateHz , theConfig.randTriggerRateHz ,
+			 theConfig.thresholdValues[0]//FIXME -- which threshold?
+			 );
+
+  char runLogConfigFile[100];
+  char configFileFullPath[100];
+  char* configPath = 0 ;
+  configPath = getenv ("ARA_CONFIG_DIR");
+  sprintf(configFileFullPath, "%s/%s", configPath, configFileName);
+  sprintf(runLogConfigFile, "%s/configFile.run%6.6d.dat", theConfig.runLogDir, fCurrentRun);
+  copyFileToFile(configFileFullPath, runLogConfigFile);
+}
+
+
+void closeRunOutputs()
+{
+  //Logs the run's statistics and closes what openRunOutputs opened
+  char filename[FILENAME_MAX];
+  SoftTriggerStats_t softTrigStats[NUM_SOFT_TRIG_SOURCES];
+  int source,priority,stream,retVal;
+  getSoftTriggerStats(softTrigStats);
+  for(source=0;source<NUM_SOFT_TRIG_SOURCES;source++) {
+    if(softTrigStats[source].numSent==0) continue;
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: sent %u %s triggers at %.1f Hz (%u late, %u skipped, %u failed), jitter mean %.1f us rms %.1f us max %.1f us\n",
+		    softTrigStats[source].numSent,
+		    source==SOFT_TRIG_SOURCE_RANDOM ? "random" : "soft",
+		    source==SOFT_TRIG_SOURCE_RANDOM ? theConfig.randTriggerRateHz : theConfig.softTriggerRateHz,
+		    softTrigStats[source].numLate,softTrigStats[source].numSkipped,softTrigStats[source].numFailed,
+		    softTrigStats[source].sumJitterUs/softTrigStats[source].numSent,
+		    sqrt(softTrigStats[source].sumJitterSqUs/softTrigStats[source].numSent),
+		    softTrigStats[source].maxJitterUs);
+  }
+
+  if(theConfig.atriRegisterShadow) {
+    AtriRegisterShadowStats_t shadowStats;
+    atriRegisterShadowGetStats(&shadowStats);
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: register shadow elided %u of %u writes (%u bytes, %u thresholds), coalesced %u, sent %u, %u of %u reads cached\n",
+		    shadowStats.numWritesElided,shadowStats.numWrites,
+		    shadowStats.numBytesElided,shadowStats.numThresholdWritesElided,
+		    shadowStats.numWritesCoalesced,shadowStats.numTransactions,
+		    shadowStats.numReadsCached,shadowStats.numReads);
+  }
+
+  AtriControlQueueStats_t queueStats[ATRI_CONTROL_NUM_PRIORITIES];
+  getAtriControlQueueStats(queueStats);
+  for(priority=0;priority<ATRI_CONTROL_NUM_PRIORITIES;priority++) {
+    if(queueStats[priority].numPackets==0) continue;
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: control queue priority %d sent %u packets (%u starvation turns), latency avg %.1f us max %.1f us, max depth %u\n",
+		    priority,queueStats[priority].numPackets,queueStats[priority].numStarvationTurns,
+		    queueStats[priority].totalLatencyUs/queueStats[priority].numPackets,
+		    queueStats[priority].maxLatencyUs,queueStats[priority].maxDepth);
+  }
+
+  if(atriTraceGetMask()) {
+    sprintf(filename,"%s/atriTrace.run%6.6d.dat",theConfig.runLogDir,fCurrentRun);
+    retVal=atriTraceDump(filename);
+    if(retVal<0)
+      ARA_LOG_MESSAGE(LOG_ERR,"Error dumping atri trace to %s\n",filename);
+  }
+
+  if(fFilterActive) stopFilter();
+  if(fDqActive) stopDq();
+  if(fPedTrackerActive) stopPedestalTracker();
+  if(fHavePedReference) araPedestalSetFree(&fPedReference);
+  fHavePedReference=0;
+
+  closeWriter(&eventWriter);
+  for(stream=0;stream<NUM_EVENT_STREAMS;stream++) {
+    if(!theConfig.eventStreamEnable[stream]) continue;
+    if(stream!=eventStreamMain) closeWriter(&eventStreamWriter[stream]);
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: wrote %u events to the %s event stream\n",
+		    fEventStreamNumEvents[stream],fEventStreamName[stream]);
+  }
+  if(theConfig.enableEventSummary) closeWriter(&eventSummaryWriter);
+  setProgramFlag(&fRunOutputsOpen,0);
+}
+
+
+uint32_t getConfigFilesHash(const char *configFileName)
+{
+  //FNV-1a of ARAAcqd's and ARAd's config files, 0 if one can't be read
+  const char *fileNames[2]={configFileName,ARAD_CONFIG_FILE};
+  uint32_t hash=2166136261u;
+  FILE *fp;
+  int fileNum,ch;
+  for(fileNum=0;fileNum<2;fileNum++) {
+    fp=fopen(configFileSpec((char*)fileNames[fileNum]),"r");
+    if(!fp) return 0;
+    while((ch=fgetc(fp))!=EOF) hash=(hash^(uint8_t)ch)*16777619u;
+    fclose(fp);
+  }
+  return hash;
+}
+
+
+int canRollover(const char *configFileName)
+{
+  //Only normal data taking rolls over, and only with the config the
+  //hardware was set up with; anything else needs a full stop and start
+  uint32_t hash;
+  if(!theConfig.enableRollover || fProgramState!=ARA_PROG_RUNNING) return 0;
+  if(theConfig.pedestalMode || fInPedestalMode || theConfig.thresholdScan ||
+     theConfig.thresholdScanSingleChannel || theConfig.vdlyScan) return 0;
+  hash=getConfigFilesHash(configFileName);
+  if(hash==0 || hash!=fRunConfigHash) {
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: the config has changed since run %d was prepared, not rolling over\n",fCurrentRun);
+    return 0;
+  }
+  return 1;
+}
+
+
 int runControlSocketHandler() {
   struct pollfd fds[5];
   int sockfd, newsockfd, pollVal;
@@ -756,7 +1024,8 @@ int runControlSocketHandler() {
     fds[3].revents=0;
     fds[4].revents=0;
     
-    pollVal=poll(fds,nfds,1);
+    //The timeout is only for noticing the program terminating
+    pollVal=poll(fds,nfds,PROGRAM_STATE_WAIT_MS);
     if(pollVal==0)
       continue;
     //    fprintf(stderr,"pollVal %d, nfds %d\n",pollVal,nfds);
@@ -823,12 +1092,10 @@ int runControlSocketHandler() {
 		  fInPedestalMode=0;
 		}
 
-		fProgramState=ARA_PROG_PREPARING;		
+		setProgramState(ARA_PROG_PREPARING);
 		sendProgramReply(newsockfd,progMsg.controlState);
 		//now wait for prepared
-		while(fProgramState==ARA_PROG_PREPARING) {
-		  usleep(1000);
-		}
+		WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_PREPARING);
 		if(fProgramState==ARA_PROG_PREPARED) {
 		  sendProgramReply(newsockfd,progMsg.controlState);
 		}
@@ -852,30 +1119,43 @@ int runControlSocketHandler() {
 		else {
 		  fInPedestalMode=0;
 		}
-		fProgramState=ARA_PROG_PREPARING;
+		setProgramState(ARA_PROG_PREPARING);
 		sendProgramReply(newsockfd,progMsg.controlState);
 		//now wait for prepared
-		while(fProgramState==ARA_PROG_PREPARING) {
-		  usleep(1000);
-		}
+		WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_PREPARING);
 		sendProgramReply(newsockfd,progMsg.controlState);
 	      }
-	      if(fProgramState==ARA_PROG_PREPARED) {
-		fProgramState=ARA_PROG_RUNNING;
+	      changeProgramState(ARA_PROG_PREPARED,ARA_PROG_RUNNING);
+	      if(fProgramState==ARA_PROG_ROLLING_OVER && !fRunOutputsOpen) {
+		//Rolling over --> Running, once the new run's files are open
+		fCurrentRun=progMsg.runNumber;
+		setProgramFlag(&fRolloverStart,1);
+		WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_ROLLING_OVER);
 	      }
 	      sendProgramReply(newsockfd,progMsg.controlState);
 	      break;
+	    case ARA_PROG_CONTROL_ROLLOVER:
+	      // Running --> Rolling over, replying once the run's files are
+	      // closed. If the run can't roll over the reply asks for a stop
+	      if(canRollover(ARA_ACQD_CONFIG_FILE)) {
+		setProgramState(ARA_PROG_ROLLING_OVER);
+		WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_ROLLING_OVER || (!fRunOutputsOpen && fHkThreadStopped));
+		sendProgramReply(newsockfd,progMsg.controlState);
+	      }
+	      else {
+		sendProgramReply(newsockfd,ARA_PROG_CONTROL_STOP);
+	      }
+	      break;
 	    case ARA_PROG_CONTROL_STOP:
 	      // Send confirmation that we got the command and then depending on the current state go
 	      /// Running --> Stopping ---> Idle
-	      /// Preparing/Prepared --> Stopping ---> Idle
+	      /// Preparing/Prepared/Rolling over --> Stopping ---> Idle
 	      /// Idle (do nothing)
-	      if(fProgramState==ARA_PROG_RUNNING || fProgramState==ARA_PROG_PREPARED || fProgramState==ARA_PROG_PREPARING) {
-		fProgramState=ARA_PROG_STOPPING;
+	      if(fProgramState==ARA_PROG_RUNNING || fProgramState==ARA_PROG_PREPARED || fProgramState==ARA_PROG_PREPARING ||
+		 fProgramState==ARA_PROG_ROLLING_OVER) {
+		setProgramState(ARA_PROG_STOPPING);
 		sendProgramReply(newsockfd,progMsg.controlState);
-		while(fProgramState==ARA_PROG_STOPPING) {
-		  usleep(1000);
-		}
+		WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_STOPPING);
 	      }
 	      sendProgramReply(newsockfd,progMsg.controlState);
 
@@ -971,10 +1251,6 @@ void *fx2ControlUsbHandlder(void *ptr)
 {
   ARA_LOG_MESSAGE(LOG_DEBUG,"Starting fx2ControlUsbHandlder\n");
   AtriControlPacket_t controlPacket;
-  FILE *fpAtriControlLog;
-  char filename[FILENAME_MAX];
-  FILE *fpAtriControlSentLog;
-  char filenameSent[FILENAME_MAX];
   int retVal=0,i=0,count=0;;
   int numBytesRead=0;
   int numBytesLeft=0;
@@ -983,8 +1259,6 @@ void *fx2ControlUsbHandlder(void *ptr)
   int numBytesWritten=0;
   unsigned char buffer[512]; //Shoiuld be large enough for now
   unsigned char outBuffer[2048]; //Shoiuld be large enough for now
-  sprintf(filename,"%s/current/atriControl.log",theConfig.topDataDir);
-  sprintf(filenameSent,"%s/current/atriControlSent.log",theConfig.topDataDir);
   int loopCount=0;
   while (fProgramState!=ARA_PROG_TERMINATE) {
     //Need to read stuff from the control port
@@ -1002,19 +1276,6 @@ void *fx2ControlUsbHandlder(void *ptr)
 	ARA_LOG_MESSAGE(LOG_ERR,"Can't read from usb control endpoint\n");
     }
     else if(numBytesRead>0) {
-      if(theConfig.atriControlLog) {
-	fpAtriControlLog=fopen(filename,"a");
-	if(fpAtriControlLog==NULL) {
-	  ARA_LOG_MESSAGE(LOG_ERR,"Error opening %s -- %s\n",filename,strerror(errno));
-	}
-	else {
-	  for(i=0;i<numBytesRead;i++) {
-	    fprintf(fpAtriControlLog,"%#2.2x ",buffer[i]);
-	  }
-	  fprintf(fpAtriControlLog,"\n");
-	  fclose(fpAtriControlLog);
-	}
-      }
       ARA_LOG_MESSAGE(LOG_DEBUG,"Read %d bytes from control endpoint\n",numBytesRead);
       numBytesLeft=numBytesRead;
       //Now we have read an atri control packet
@@ -1026,6 +1287,11 @@ void *fx2ControlUsbHandlder(void *ptr)
 	controlPacket.header.packetNumber=buffer[startByte+2];
 	controlPacket.header.packetLength=buffer[startByte+3];
 	thisPacketSize=5+controlPacket.header.packetLength;
+	atriTraceRecord(ATRI_TRACE_CONTROL_IN,
+			controlPacket.header.packetLocation,
+			controlPacket.header.packetNumber,0,0,
+			&buffer[startByte],
+			thisPacketSize<numBytesLeft?thisPacketSize:numBytesLeft);
 	if(numBytesRead>=buffer[startByte+3]+5) {
 	  //Have read enough bytes to fill data array
 	  for(i=0;i<controlPacket.header.packetLength+1;i++) {
@@ -1114,23 +1380,12 @@ void *fx2ControlUsbHandlder(void *ptr)
       //      }
 	  
 
-      if(theConfig.atriControlLog) {
-	fpAtriControlSentLog=fopen(filenameSent,"a");
-	if(fpAtriControlSentLog==NULL) {
-	  ARA_LOG_MESSAGE(LOG_ERR,"Error opening %s -- %s\n",filenameSent,strerror(errno));
-	}
-	else {
-	  for(i=0;i<count;i++) {
-	    fprintf(fpAtriControlSentLog,"%#2.2x ",outBuffer[i]);
-	  }
-	  fprintf(fpAtriControlSentLog,"\n");
-	  fclose(fpAtriControlSentLog);
-	}
-      }
-
-
       numBytesWritten=0;
       retVal=writeControlEndPoint(outBuffer,count,&numBytesWritten);
+      atriTraceRecord(ATRI_TRACE_CONTROL_OUT,
+		      controlPacket.header.packetLocation,
+		      controlPacket.header.packetNumber,
+		      retVal<0?retVal:0,0,outBuffer,count);
       if(retVal<0) {
 	ARA_LOG_MESSAGE(LOG_ERR,"Can't write to usb control endpoint\n");
       }
@@ -1148,14 +1403,131 @@ void *fx2ControlUsbHandlder(void *ptr)
 
 void sigUsr1Handler(int sig)
 {
+  //The condition can't be signalled from here, the waits see it on their
+  //next timeout and the main thread straight away
   fProgramState=ARA_PROG_STOPPING;
+  pokeProgramStateFd();
 } 
 
 void sigUsr2Handler(int sig)
 {
   fProgramState=ARA_PROG_TERMINATE;
+  pokeProgramStateFd();
 } 
 
+void initProgramState(AraProgramStatus_t state)
+{
+  pthread_condattr_t condAttr;
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setclock(&condAttr,CLOCK_MONOTONIC);
+  pthread_cond_init(&fProgramStateCond,&condAttr);
+  pthread_condattr_destroy(&condAttr);
+  fProgramStateFd=eventfd(0,EFD_NONBLOCK);
+  if(fProgramStateFd<0)
+    ARA_LOG_MESSAGE(LOG_WARNING,"%s: eventfd -- %s, the readout will wait for events with short sleeps\n",__FUNCTION__,strerror(errno));
+  fProgramState=state;
+}
+
+void setProgramState(AraProgramStatus_t state)
+{
+  pthread_mutex_lock(&fProgramStateMutex);
+  fProgramState=state;
+  pthread_cond_broadcast(&fProgramStateCond);
+  pthread_mutex_unlock(&fProgramStateMutex);
+  pokeProgramStateFd();
+}
+
+int changeProgramState(AraProgramStatus_t fromState, AraProgramStatus_t toState)
+{
+  //Only if nothing else has changed it first, returns 1 if it did change
+  int changed=0;
+  pthread_mutex_lock(&fProgramStateMutex);
+  if(fProgramState==fromState) {
+    fProgramState=toState;
+    pthread_cond_broadcast(&fProgramStateCond);
+    changed=1;
+  }
+  pthread_mutex_unlock(&fProgramStateMutex);
+  if(changed) pokeProgramStateFd();
+  return changed;
+}
+
+void setProgramFlag(int *flag, int value)
+{
+  pthread_mutex_lock(&fProgramStateMutex);
+  *flag=value;
+  pthread_cond_broadcast(&fProgramStateCond);
+  pthread_mutex_unlock(&fProgramStateMutex);
+}
+
+void waitProgramStateCond()
+{
+  //With fProgramStateMutex held, as in WAIT_FOR_PROGRAM_STATE
+  struct timespec wakeTime;
+  clock_gettime(CLOCK_MONOTONIC,&wakeTime);
+  wakeTime.tv_sec+=PROGRAM_STATE_WAIT_MS/1000;
+  wakeTime.tv_nsec+=(PROGRAM_STATE_WAIT_MS%1000)*1000000L;
+  if(wakeTime.tv_nsec>=1000000000L) {
+    wakeTime.tv_sec++;
+    wakeTime.tv_nsec-=1000000000L;
+  }
+  pthread_cond_timedwait(&fProgramStateCond,&fProgramStateMutex,&wakeTime);
+}
+
+void pokeProgramStateFd()
+{
+  //Wakes the main thread out of waitForEventData, safe in a signal handler
+  uint64_t one=1;
+  if(fProgramStateFd>=0 && write(fProgramStateFd,&one,sizeof(uint64_t))!=sizeof(uint64_t))
+    return;
+}
+
+void waitForEventData()
+{
+  //Sleeps until the PCIe device has data, the program state changes or
+  //eventWaitMaxMs is up. The USB bulk read already waits READ_USB_TIMEOUT
+  //so over USB this is just a short wait that the state can cut short
+  struct pollfd fds[2];
+  uint64_t numPokes;
+  int eventFd=getEventEndPointFd();
+  int numFds=0,timeoutMs=1;
+
+  //A driver without poll support says it is always readable
+  if(fEventWaitSawData) fNumSpuriousEventWakeups++;
+  else fNumSpuriousEventWakeups=0;
+  fEventWaitSawData=0;
+  if(fEventFdPollable && fNumSpuriousEventWakeups>=EVENT_WAIT_MAX_SPURIOUS) {
+    ARA_LOG_MESSAGE(LOG_WARNING,"%s: %d wakeups in a row for PCIe data that wasn't there, no longer polling the device\n",
+		    __FUNCTION__,fNumSpuriousEventWakeups);
+    fEventFdPollable=0;
+  }
+
+  if(fProgramStateFd>=0) {
+    fds[numFds].fd=fProgramStateFd;
+    fds[numFds].events=POLLIN;
+    fds[numFds].revents=0;
+    numFds++;
+  }
+  if(eventFd>=0 && fEventFdPollable) {
+    fds[numFds].fd=eventFd;
+    fds[numFds].events=POLLIN;
+    fds[numFds].revents=0;
+    numFds++;
+    timeoutMs=theConfig.eventWaitMaxMs>1 ? theConfig.eventWaitMaxMs : 1;
+  }
+  if(numFds==0) {
+    usleep(1000);
+    return;
+  }
+  if(poll(fds,numFds,timeoutMs)<=0) return;
+  if(fProgramStateFd>=0 && (fds[0].revents&POLLIN)) {
+    if(read(fProgramStateFd,&numPokes,sizeof(uint64_t))!=sizeof(uint64_t))
+      numPokes=0;
+  }
+  if(fds[numFds-1].fd==eventFd && (fds[numFds-1].revents&POLLIN))
+    fEventWaitSawData=1;
+}
+
 int initialiseAtri(int fAtriSockFd,int fFx2SockFd,ARAAcqdConfig_t *theConfig)
 {
   ARA_LOG_MESSAGE(LOG_DEBUG,"%s\n",__FUNCTION__);
@@ -1219,48 +1591,52 @@ int initialiseAtriClocks(int fFx2SockFd,ARAAcqdConfig_t *theConfig)
   // If we initialize to the external Rubidium clock, we instead
   // would disable the FPGA oscillator.
 
+  //The register writes all go to the control socket as one batch
+  Fx2I2CBatch_t clockBatch;
+  fx2I2CBatchInit(&clockBatch);
+
   // Register 0: No free run, no clockout always on, CKOUT5 is output, no bypass
-  writeToI2CRegister(fFx2SockFd,0xd0,0x00,0x14);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x00,0x14);
 
   // Register 1: Clock priorities. 1, then 2, then 3.
-  writeToI2CRegister(fFx2SockFd,0xd0,0x01,0xE4);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x01,0xE4);
 
   // Register 2: BWSEL_REG[3:0], 0010. BWSEL = 0000.
-  writeToI2CRegister(fFx2SockFd,0xd0,0x02,0x02);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x02,0x02);
 
   // Register 3: CKSEL_REG[1:0], DHOLD, SQ_ICAL, 0101. CKSEL_REG = 10: clock 1 (ext. Rb)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x03,0x05);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x03,0x05);
 
   // Register 4: Autoselect clocks enabled (1, then 2, then 3)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x04,0x92);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x04,0x92);
 
   // Register 5: CKOUT2/CKOUT1 are LVDS
-  writeToI2CRegister(fFx2SockFd,0xd0,0x05,0x3F);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x05,0x3F);
   // Register 6: CKOUT4/CKOUT3 are LVDS
-  writeToI2CRegister(fFx2SockFd,0xd0,0x06,0x3F);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x06,0x3F);
   // Register 7: CKOUT5 is LVDS. CKIN3 is frequency offset alarms (who cares)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x07,0x3B);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x07,0x3B);
   // Register 8: Hold logic. All normal ops.
-  writeToI2CRegister(fFx2SockFd,0xd0,0x08,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x08,0x00);
   // Register 9: Histogram generation, plus hold logic.
-  writeToI2CRegister(fFx2SockFd,0xd0,0x09,0xC0);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x09,0xC0);
   // Register 10: Output buffer power.
-  writeToI2CRegister(fFx2SockFd,0xd0,0x0A,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x0A,0x00);
   // Register 11: Power down CKIN4 input buffer.
-  writeToI2CRegister(fFx2SockFd,0xd0,0x0B,0x48);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x0B,0x48);
   // Register 19: Frequency offset alarn, who cares.
-  writeToI2CRegister(fFx2SockFd,0xd0,0x13,0x2C);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x13,0x2C);
   // Register 20: Alarm pin setups.
-  writeToI2CRegister(fFx2SockFd,0xd0,0x14,0x02);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x14,0x02);
   // Register 21: Ignore INC/DEC/FSYNC_ALIGN, tristate CKx_ACTV, ignore CKSEL
   // bleh this is default now 
-  writeToI2CRegister(fFx2SockFd,0xd0,0x15,0xE0);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x15,0xE0);
   // Register 22: Default
-  writeToI2CRegister(fFx2SockFd,0xd0,0x16,0xDF);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x16,0xDF);
   // Register 23: mask everything
-  writeToI2CRegister(fFx2SockFd,0xd0,0x17,0x1F);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x17,0x1F);
   // Register 24: mask everything
-  writeToI2CRegister(fFx2SockFd,0xd0,0x18,0x3F);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x18,0x3F);
 
   // These determine output clock frequencies.
   // CKOUTx is 5 GHz divided by N1_HS divided by NCx_LS
@@ -1275,48 +1651,53 @@ int initialiseAtriClocks(int fFx2SockFd,ARAAcqdConfig_t *theConfig)
   // 100 MHz.
 
   // Register 25-27: N1_HS=001 (N1=5), NC1_LS = 0x09 (10)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x19,0x20);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x1A,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x1B,0x09);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x19,0x20);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x1A,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x1B,0x09);
   // Register 28-30: NC2_LS = 0x09 (10)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x1C,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x1D,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x1E,0x09);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x1C,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x1D,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x1E,0x09);
   // Register 31-33: NC3_LS = 0x09 (10) 
-  writeToI2CRegister(fFx2SockFd,0xd0,0x1F,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x20,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x21,0x09);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x1F,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x20,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x21,0x09);
   // Register 34-36: NC4_LS = 0x09 (10)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x22,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x23,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x24,0x09);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x22,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x23,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x24,0x09);
   // Register 37-39: NC5_LS = 0x09 (10)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x25,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x26,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x27,0x09);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x25,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x26,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x27,0x09);
 
   // These determine the VCO frequency.
   // It's (CKINx/N3x)*(N2_HS)*(N2_LS).
   // For CKIN1 or CKIN3 = 10 MHz, this is (10/1)*(10)*(500) = 5 GHz
 
   // Register 40-42: N2_HS = 110 (10), N2_LS = 500
-  writeToI2CRegister(fFx2SockFd,0xd0,0x28,0xC0);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x29,0x01);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x2A,0xF4);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x28,0xC0);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x29,0x01);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x2A,0xF4);
   // Register 44-45: CKIN1 divider (N31) = 0x0 (1)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x2B,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x2C,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x2D,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x2B,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x2C,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x2D,0x00);
   // Register 46-48: CKIN2 divider (N32) = 0x0 (1)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x2E,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x2F,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x30,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x2E,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x2F,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x30,0x00);
   // Register 49-51: CKIN3 divider (N33) = 0x0 (1)
-  writeToI2CRegister(fFx2SockFd,0xd0,0x31,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x32,0x00);
-  writeToI2CRegister(fFx2SockFd,0xd0,0x33,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x31,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x32,0x00);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x33,0x00);
   // done, now do an ICAL
-  writeToI2CRegister(fFx2SockFd,0xd0,0x88,0x40);
+  fx2I2CBatchAddRegisterWrite(&clockBatch,0xd0,0x88,0x40);
+
+  //Send the whole register set in one go
+  retVal=fx2I2CBatchExecute(fFx2SockFd,&clockBatch);
+  if(retVal<0)
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: Error writing Si5367 registers %d\n",__FUNCTION__,retVal);
 
 
   //all done
@@ -1426,6 +1807,8 @@ int initialiseTriggers(int fAtriSockFd)
   uint8_t numTrigBlocks=0;
   TriggerL4_t trigType;
 
+  //The trigger block sizes and masks are adjacent, send them together
+  atriRegisterShadowBeginBatch();
 
   //Masking of the l4Triggers
   if(theConfig.enableRF0Trigger){
@@ -1537,6 +1920,8 @@ int initialiseTriggers(int fAtriSockFd)
 
   setTriggerL3Mask(fAtriSockFd, trigMask);
 
+  if(atriRegisterShadowEndBatch()<0)
+    ARA_LOG_MESSAGE(LOG_ERR, "ARAAcqd: Error writing trigger setup.\n");
   
   ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: Enabling T1 trigger.\n"); 
   setTriggerT1Mask(fAtriSockFd, 0);      
@@ -1550,9 +1935,10 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
 {
 
   int status = 0, allStatus = 0;
+  int stream;
   KvpErrorCode kvpStatus = 0;
   const char* configSection[] = { "log","acq","thresholds","trigger",
-				  "servo","calpulser",NULL };
+				  "servo","calpulser","filter","dq","streams",NULL };
   const char** currSection = configSection;
 
   kvpReset();
@@ -1598,8 +1984,12 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
     SET_STRING(topDataDir,".");
     sprintf(theConfig->eventTopDir,"%s/current/%s",theConfig->topDataDir,DAQ_EVENT_DIR);
     sprintf(theConfig->eventHkTopDir,"%s/current/%s",theConfig->topDataDir,DAQ_EVENT_HK_DIR);
+    sprintf(theConfig->softTrigHkTopDir,"%s/current/%s",theConfig->topDataDir,DAQ_SOFT_TRIG_HK_DIR);
+    sprintf(theConfig->eventSummaryTopDir,"%s/current/%s",theConfig->topDataDir,DAQ_EVENT_SUMMARY_DIR);
+    sprintf(theConfig->dqHkTopDir,"%s/current/%s",theConfig->topDataDir,DAQ_DQ_HK_DIR);
     sprintf(theConfig->sensorHkTopDir,"%s/current/%s",theConfig->topDataDir,DAQ_SENSOR_HK_DIR);
     sprintf(theConfig->pedsTopDir,"%s/current/%s",theConfig->topDataDir,DAQ_PED_DIR);
+    sprintf(theConfig->pedsReferenceDir,"%s/%s",theConfig->topDataDir,DAQ_PED_DIR);
     sprintf(theConfig->runLogDir,"%s/current/%s",theConfig->topDataDir,DAQ_RUNLOG_DIR);
     SET_STRING(runNumFile,"run_number");
     SET_STRING(linkDir,"./link");
@@ -1607,6 +1997,7 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
     SET_INT(filesPerDir,100);
     SET_INT(eventsPerFile,100);
     SET_INT(hkPerFile,500);
+    SET_INT(summariesPerFile,1000);
     // Run parameters
     SET_INT(doAtriInitialisation,0);
     SET_INT(standAlone,0);
@@ -1614,6 +2005,12 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
     SET_INT(enableHkRead,1);
     SET_FLOAT(eventHkReadRateHz,1);
     SET_INT(sensorHkReadPeriod,10);
+    SET_INT(ppsEdgePrediction,1);
+    SET_FLOAT(statusFilePeriodS,5);
+    SET_INT(enableMonitorShm,1);
+    SET_FLOAT(monitorPeriodS,1);
+    SET_INT(hkRealtimePriority,0);
+    SET_INT(enableRollover,0);
     SET_INT(pedestalMode,0);
     SET_INT(pedestalNumTriggerBlocks,2);
     if(theConfig->pedestalNumTriggerBlocks%2==1) {
@@ -1624,8 +2021,21 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
 
     SET_INT(pedestalSamples,1000);
     SET_INT(pedestalDebugMode,1);
+    SET_INT(pedestalNumThreads,DDA_PER_ATRI);
+    SET_INT(pedestalWriteBinary,1);
+    SET_INT(pedestalMaxInFlight,1);
+    if(theConfig->pedestalMaxInFlight<1) theConfig->pedestalMaxInFlight=1;
+    SET_INT(pedestalTriggerSpacingUs,5000);
+    SET_INT(pedestalTrack,0);
+    SET_INT(pedestalTrackShift,6);
+    SET_FLOAT(pedestalTrackSnapshotPeriodS,600);
+    SET_FLOAT(pedestalTrackDriftWarn,5);
     SET_INT(vdlyScan,0);
     SET_INT(enablePcieReadout, 0);
+    SET_INT(eventWaitMaxMs,1);
+    SET_INT(atriRegisterShadow, 0);
+    SET_INT(atriRegisterVerify, 0);
+    SET_INT(enableEventSummary, 0);
     //    SET_INT(usePatrickEvent,0);
     
     // Thresholds
@@ -1635,6 +2045,7 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
     SET_INT(thresholdScanStep,1);
     SET_INT(thresholdScanStartPoint,1);
     SET_INT(thresholdScanPoints,1);
+    SET_INT(thresholdScanCoarseStride,1);
     SET_INT(setThreshold,1);
     SET_INT(useGlobalThreshold,0);
     SET_INT(globalThreshold,2068);
@@ -1711,6 +2122,8 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
 
     SET_FLOAT(softTriggerRateHz,0.0);
     SET_FLOAT(randTriggerRateHz,0.0);
+    SET_INT(softTriggerMode,softTriggerModeFixedPeriod);
+    SET_INT(softTriggerPpsOffsetUs,0);
 
 
 
@@ -1763,6 +2176,8 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
     SET_FLOAT(vdlyDGain,0.0);
     SET_FLOAT(vdlyIMax,100);
     SET_FLOAT(vdlyIMin,-100);
+    SET_INT(vdlyUsePid,0);
+    SET_INT(vdlyMaxStep,0);
 
     
     SET_INT(enableAntServo,0);
@@ -1779,16 +2194,30 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
     SET_FLOAT(scalerDGain,0.0);
     SET_FLOAT(scalerIMax,100);
     SET_FLOAT(scalerIMin,-100);
+    { // Per channel scaler gains, one if not given
+      int tempNum=THRESHOLDS_PER_ATRI;
+      int chan;
+      for(chan=0;chan<THRESHOLDS_PER_ATRI;chan++)
+	theConfig->scalerGainScale[chan]=1;
+      kvpStatus=kvpGetFloatArray("scalerGainScale",theConfig->scalerGainScale,&tempNum);
+      if(kvpStatus!=KVP_E_OK){
+	ARA_LOG_MESSAGE(LOG_DEBUG,"kvpGetFloatArray(scalerGainScale): %s",kvpErrorString(kvpStatus));
+      }
+    }
+    SET_INT(scalerMaxStep,0);
 
     SET_INT(enableRateServo,0);
     SET_FLOAT(servoCalcPeriodS,1);
     SET_FLOAT(servoCalcDelayS,10);
     SET_FLOAT(rateGoalHz,5); 
-    SET_FLOAT(ratePGain,0.5);
-    SET_FLOAT(rateIGain,0.01);
+    SET_FLOAT(ratePGain,20);
+    SET_FLOAT(rateIGain,2);
     SET_FLOAT(rateDGain,0.0);
-    SET_FLOAT(rateIMax,100);
-    SET_FLOAT(rateIMin,-100);
+    SET_FLOAT(rateIMax,50);
+    SET_FLOAT(rateIMin,-50);
+    SET_FLOAT(rateGoalScaleMin,0.25);
+    SET_FLOAT(rateGoalScaleMax,4);
+    SET_FLOAT(rateGoalScaleStep,0.1);
 
     SET_INT(enableSurfaceServo,0);
     { // Read individual scaler goals
@@ -1813,6 +2242,72 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
       }
       ARA_LOG_MESSAGE(LOG_INFO,"There are %d stacks enabled\n", theConfig->numEnabledStacks);
     }
+
+    // Filter
+    SET_INT(enableFilter,0);
+    SET_INT(filterNumThreads,0);
+    if(theConfig->filterNumThreads>ARA_FILTER_MAX_THREADS) theConfig->filterNumThreads=ARA_FILTER_MAX_THREADS;
+    SET_FLOAT(filterSnrThreshold,6);
+    SET_INT(filterMinHitChannels,3);
+    SET_INT(filterMinHitStrings,2);
+    SET_INT(filterCoincidenceWindow,640);
+    SET_INT(filterCalTimeStampMin,0);
+    SET_INT(filterCalTimeStampMax,0);
+    { // CW lines, none if not given
+      int tempNum=ARA_FILTER_MAX_CW_LINES;
+      kvpStatus=kvpGetFloatArray("filterCwFrequency",theConfig->filterCwFrequency,&tempNum);
+      if(kvpStatus!=KVP_E_OK){
+	ARA_LOG_MESSAGE(LOG_DEBUG,"kvpGetFloatArray(filterCwFrequency): %s",kvpErrorString(kvpStatus));
+	tempNum=0;
+      }
+      theConfig->filterNumCwLines=tempNum;
+    }
+    SET_FLOAT(filterCwFraction,0.5);
+    SET_INT(filterCwMinChannels,4);
+    SET_INT(filterBudgetUs,0);
+    SET_INT(filterWriteMaxPriority,ARA_FILTER_NUM_PRIORITIES-1);
+    SET_INT(filterLowPriorityPrescale,1);
+    SET_INT(roiEnable,0);
+    SET_INT(roiKeepMaxPriority,ARA_FILTER_PRIORITY_FORCED);
+    SET_INT(roiBlocksBefore,2);
+    SET_INT(roiBlocksAfter,2);
+    SET_INT(roiAroundPeak,1);
+
+    // Data quality
+    SET_INT(enableDq,0);
+    SET_FLOAT(dqPeriodS,60);
+    SET_INT(dqSampleHistPrescale,16);
+    SET_FLOAT(dqStuckFractionAlarm,0);
+    SET_FLOAT(dqDeadRangeAlarm,0);
+    SET_FLOAT(dqRailFractionAlarm,0);
+    SET_INT(dqErrorAlarm,0);
+    SET_INT(dqEventGapAlarm,0);
+    SET_INT(dqTimeJumpAlarm,0);
+    SET_INT(dqBlockSequenceAlarm,0);
+
+    // Event streams, the main one has the output section's settings
+    {
+      char keyName[64];
+      char *tmpStr;
+      theConfig->eventStreamEnable[eventStreamMain]=1;
+      theConfig->eventStreamEventsPerFile[eventStreamMain]=theConfig->eventsPerFile;
+      theConfig->eventStreamCompression[eventStreamMain]=theConfig->compressionLevel;
+      strcpy(theConfig->eventStreamTopDir[eventStreamMain],theConfig->eventTopDir);
+      strcpy(theConfig->eventStreamLinkDir[eventStreamMain],theConfig->linkDir);
+      for(stream=1;stream<NUM_EVENT_STREAMS;stream++) {
+	sprintf(keyName,"%sStreamEnable",fEventStreamName[stream]);
+	theConfig->eventStreamEnable[stream]=kvpGetInt(keyName,0);
+	sprintf(keyName,"%sStreamEventsPerFile",fEventStreamName[stream]);
+	theConfig->eventStreamEventsPerFile[stream]=kvpGetInt(keyName,theConfig->eventsPerFile);
+	sprintf(keyName,"%sStreamCompression",fEventStreamName[stream]);
+	theConfig->eventStreamCompression[stream]=kvpGetInt(keyName,theConfig->compressionLevel);
+	sprintf(keyName,"%sStreamLinkDir",fEventStreamName[stream]);
+	tmpStr=kvpGetString(keyName);
+	strcpy(theConfig->eventStreamLinkDir[stream],tmpStr?tmpStr:theConfig->linkDir);
+	sprintf(theConfig->eventStreamTopDir[stream],"%s/current/%s",theConfig->topDataDir,fEventStreamDir[stream]);
+      }
+    }
+    SET_INT(priorityStreamMaxPriority,ARA_FILTER_PRIORITY_COINCIDENT);
   }
 
   return allStatus;
@@ -1823,146 +2318,111 @@ int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig)
 
 void *araHkThreadHandler(void *ptr)
 {
+  //Looks after the hk writers and the task threads, the reading and
+  //servoing happens in hkTaskThreadHandler
   ARA_LOG_MESSAGE(LOG_DEBUG,"Starting %s\n",__FUNCTION__);
-  struct timeval lastSensorHkTime;
-  struct timeval lastEventHkTime;
   struct timeval currentTime;
-
-  AraSensorHk_t sensorHk;
-  AraEventHk_t eventHk;
+  int taskNum;
   int retVal;
 
-
-  int fHkThreadFx2SockFd=openConnectionToFx2ControlSocket();
-  if(!fHkThreadFx2SockFd) {
-    ARA_LOG_MESSAGE(LOG_ERR,"Can not open connection to FX2_CONTROL from %s\n",__FUNCTION__);
-  }
-  else {
-    ARA_LOG_MESSAGE(LOG_DEBUG,"fHkThreadFx2SockFd=%d\n",fHkThreadFx2SockFd);
-  }  
-
-
-  int fHkThreadAtriSockFd=openConnectionToAtriControlSocket();
-  if(!fHkThreadAtriSockFd) {
-    ARA_LOG_MESSAGE(LOG_ERR,"Can not open connection to ATRI_CONTROL from %s\n",__FUNCTION__);
-  }
-  else {
-    ARA_LOG_MESSAGE(LOG_DEBUG,"fHkThreadAtriSockFd=%d\n",fHkThreadAtriSockFd);
+  initHkTasks();
+  for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++) {
+    retVal=pthread_create(&fHkTasks[taskNum].thread,NULL,hkTaskThreadHandler,&fHkTasks[taskNum]);
+    if(retVal!=0) {
+      ARA_LOG_MESSAGE(LOG_ERR,"Can't make hk task thread %s\n",fHkTasks[taskNum].name);
+      fHkTasks[taskNum].runTask=NULL;
+    }
   }
 
-
-
-  lastSensorHkTime.tv_sec=0;
-  lastEventHkTime.tv_sec=0;
-
-  float sensorHkPeriod=1;
-  float eventHkPeriod=1;
-  fHkThreadPrepared=0;
-  fHkThreadStopped=0;
+  setProgramFlag(&fHkThreadPrepared,0);
+  setProgramFlag(&fHkThreadStopped,0);
 
   while (fProgramState!=ARA_PROG_TERMINATE) {
     switch(fProgramState) {
     case ARA_PROG_IDLE:
-      usleep(1000);
-      fHkThreadPrepared=0;
-      fHkThreadStopped=0;
+      setProgramFlag(&fHkThreadPrepared,0);
+      setProgramFlag(&fHkThreadStopped,0);
+      WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_IDLE);
       break; //Don't do anything just wait
 
     case ARA_PROG_PREPARING:
       //Setup output directories
       if(!fHkThreadPrepared) {
 	printf("ARA_PROG_PREPARING in araHkThreadHandler\n");
-	makeDirectories(theConfig.eventHkTopDir);
-	makeDirectories(theConfig.sensorHkTopDir);
-	
-	///Initialize writer structures
-	initWriter(&eventHkWriter,
-		   fCurrentRun,
-		   theConfig.compressionLevel,
-		   theConfig.filesPerDir,
-		   theConfig.hkPerFile,
-		   EVENT_HK_FILE_HEAD,
-		   theConfig.eventHkTopDir,
-		   theConfig.linkForXfer?theConfig.linkDir:NULL);    
-	
-	initWriter(&sensorHkWriter,
-		   fCurrentRun,
-		   theConfig.compressionLevel,
-		   theConfig.filesPerDir,
-		   theConfig.hkPerFile,
-		   SENSOR_HK_FILE_HEAD,
-		   theConfig.sensorHkTopDir,
-		   theConfig.linkForXfer?theConfig.linkDir:NULL);        
-	
-	eventHkPeriod=1./theConfig.eventHkReadRateHz;
-	sensorHkPeriod=theConfig.sensorHkReadPeriod;
-	fHkThreadPrepared=1;
+	openHkWriters();
+
+	//The servo tasks check their enable flags each time they run since
+	//the scans turn them off during the run
+	fHkTasks[HK_TASK_EVENT_HK].periodS=1./theConfig.eventHkReadRateHz;
+	fHkTasks[HK_TASK_SENSOR_HK].periodS=theConfig.sensorHkReadPeriod;
+	fHkTasks[HK_TASK_VDLY_SERVO].periodS=theConfig.servoCalcPeriodS;
+	fHkTasks[HK_TASK_ANT_SERVO].periodS=theConfig.servoCalcPeriodS;
+	fHkTasks[HK_TASK_SURFACE_SERVO].periodS=theConfig.servoCalcPeriodS;
+	fHkTasks[HK_TASK_STATUS_FILE].periodS=theConfig.statusFilePeriodS;
+	fHkTasks[HK_TASK_MONITOR].periodS=fMonitorSegment ? theConfig.monitorPeriodS : 0;
+	fHkTasks[HK_TASK_EVENT_HK].nextDeadlineNs=theConfig.ppsEdgePrediction ? eventHkNextDeadline : NULL;
+	resetPpsEdgeTracker(&fPpsEdgeTracker);
+	initServos();
+	resetHkTaskStats();
+	setProgramFlag(&fHkThreadPrepared,1);
       }
+      else WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_PREPARING);
       break;
     case ARA_PROG_PREPARED:
-      usleep(1000);
+      WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_PREPARED);
       break; // Don't do anything just wait
     case ARA_PROG_RUNNING:
-      // Main event loop
-      //      printf("ARA_PROG_RUNNING in araHkThreadHandler\n");
-      fHkThreadStopped=0;
-      gettimeofday(&currentTime,NULL);
-      if(checkDeltaT(&currentTime,&lastSensorHkTime,sensorHkPeriod)) {
-	//Need to read out a sensor hk thingy
-	lastSensorHkTime=currentTime;
-	retVal=readSensorHk(fHkThreadFx2SockFd,fHkThreadAtriSockFd,&sensorHk,&currentTime);
-	//Now need to add it to the writer thingy
-
-	// Store hk event
-	int new_hk_file_flag = 0;
-	retVal = writeBuffer( &sensorHkWriter, (char*)&sensorHk, sizeof(AraSensorHk_t) , &(new_hk_file_flag) );
-	if( retVal != sizeof(AraSensorHk_t) ) {
-	  ARA_LOG_MESSAGE(LOG_WARNING,"%s: failed to write sensor housekeeping event (return %d)\n", __FUNCTION__, retVal);
-	}
-	else {
-	  ARA_LOG_MESSAGE(LOG_DEBUG,"%s: wrote %lu bytes of sensor housekeeping\n", __FUNCTION__, sizeof(AraSensorHk_t));
-	}
-	
-      }
-      
-      if(checkDeltaT(&currentTime,&lastEventHkTime,eventHkPeriod)) {
-	//Need to read out a sensor hk thingy
-
-	retVal=readEventHk(fHkThreadAtriSockFd,&eventHk,&currentTime);
-	//Now need to add it to the writer thingy
-
-	if(retVal) {
-	  lastEventHkTime=currentTime;
-	  // Store hk event
-	  int new_hk_file_flag = 0;
-	  retVal = writeBuffer( &eventHkWriter, (char*)&eventHk, sizeof(AraEventHk_t) , &(new_hk_file_flag) );
-	  if( retVal != sizeof(AraEventHk_t) )
-	    ARA_LOG_MESSAGE(LOG_WARNING,"Failed to write event housekeeping event\n");
-
-
-	  //Got data from a new second
-	  if(theConfig.enableVdlyServo) updateWilkinsonVdly(fHkThreadAtriSockFd, &eventHk);
-
-	    //updateWilkinsonVdlyUsingPID(fHkThreadAtriSockFd, &eventHk);
-
-	  //Try and servo on thresholds if we want that
-	  if(theConfig.enableAntServo) updateThresholdsUsingPID(fHkThreadAtriSockFd,&eventHk);
-
-	  //Try and servo on the surface thresholds
-	  if(theConfig.enableSurfaceServo) updateSurfaceThresholdsUsingPID(fHkThreadAtriSockFd,&eventHk);
-
-	}
-      }
-      usleep(1000);
-
+      // The tasks run themselves
+      setProgramFlag(&fHkThreadStopped,0);
+      WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_RUNNING);
       break;
     case ARA_PROG_STOPPING:
       //Close files and do everything neccessary
       if(!fHkThreadStopped)  {
-	closeWriter(&sensorHkWriter);
-	closeWriter(&eventHkWriter);
-	fHkThreadStopped=1;
+	//Wait for any task in the middle of a run, they won't start
+	//another now we are stopping
+	for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++)
+	  pthread_mutex_lock(&fHkTasks[taskNum].runMutex);
+	gettimeofday(&currentTime,NULL);
+	writeSoftTriggerHk(&currentTime);
+	closeHkWriters();
+	if(theConfig.ppsEdgePrediction) {
+	  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: PPS edge prediction -- %u counter reads for %u seconds, %u skipped seconds, %u extra PPS, %u missing PPS, lost lock %u times\n",
+			  fPpsEdgeTracker.numReads,fPpsEdgeTracker.numEdges,fPpsEdgeTracker.numSkippedSeconds,
+			  fPpsEdgeTracker.numExtraPps,fPpsEdgeTracker.numMissingPps,fPpsEdgeTracker.numLockLost);
+	}
+	for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++)
+	  pthread_mutex_unlock(&fHkTasks[taskNum].runMutex);
+	logHkTaskStats();
+	logServoStats();
+	setProgramFlag(&fHkThreadStopped,1);
       }      
+      else WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_STOPPING);
+      break;
+    case ARA_PROG_ROLLING_OVER:
+      //Only the files change, the tasks and servos carry on as they were
+      if(!fHkThreadStopped) {
+	for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++)
+	  pthread_mutex_lock(&fHkTasks[taskNum].runMutex);
+	gettimeofday(&currentTime,NULL);
+	writeSoftTriggerHk(&currentTime);
+	closeHkWriters();
+	setProgramFlag(&fHkThreadPrepared,0);
+	setProgramFlag(&fHkThreadStopped,1);
+	for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++)
+	  pthread_mutex_unlock(&fHkTasks[taskNum].runMutex);
+	logHkTaskStats();
+      }
+      else if(fRolloverStart && !fHkThreadPrepared) {
+	for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++)
+	  pthread_mutex_lock(&fHkTasks[taskNum].runMutex);
+	openHkWriters();
+	resetHkTaskStats();
+	for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++)
+	  pthread_mutex_unlock(&fHkTasks[taskNum].runMutex);
+	setProgramFlag(&fHkThreadPrepared,1);
+      }
+      else WAIT_FOR_PROGRAM_STATE(fProgramState!=ARA_PROG_ROLLING_OVER || (fRolloverStart && !fHkThreadPrepared));
       break;
     case ARA_PROG_TERMINATE:
       fprintf(stderr,"ARAAcqd is exiting\n");
@@ -1972,98 +2432,741 @@ void *araHkThreadHandler(void *ptr)
       break;
     }    
   }
-  closeConnectionToFx2ControlSocket(fHkThreadFx2SockFd);
-  closeConnectionToAtriControlSocket(fHkThreadAtriSockFd);
+  for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++) {
+    if(fHkTasks[taskNum].runTask)
+      pthread_join(fHkTasks[taskNum].thread,NULL);
+  }
 
   pthread_exit(NULL);
 }
 
 
-int checkDeltaT(struct timeval *currTime, struct timeval *lastTime, float deltaT)
+void getSoftTriggerStats(SoftTriggerStats_t *stats)
 {
-  float timeDiff=(currTime->tv_usec-lastTime->tv_usec)*1e-6;
-  timeDiff+=(currTime->tv_sec-lastTime->tv_sec);
-  return (timeDiff>deltaT);
+  pthread_mutex_lock(&fSoftTrigStatsMutex);
+  memcpy(stats,fSoftTrigStats,sizeof(fSoftTrigStats));
+  pthread_mutex_unlock(&fSoftTrigStatsMutex);
 }
 
+void resetSoftTriggerStats()
+{
+  pthread_mutex_lock(&fSoftTrigStatsMutex);
+  memset(fSoftTrigStats,0,sizeof(fSoftTrigStats));
+  fNumSoftTrigTimes=0;
+  fNumSoftTrigTimesDropped=0;
+  pthread_mutex_unlock(&fSoftTrigStatsMutex);
+}
 
-void copyTwoBytes(uint8_t *data, uint16_t *value)
+int fillSoftTriggerHk(AraSoftTriggerHk_t *softTrigHkPtr, struct timeval *currTime)
 {
-  memcpy(value,data,2);
+  //Takes up to SOFT_TRIGGERS_PER_HK of the oldest trigger times, returns
+  //the number taken
+  int numTriggers;
+  memset(softTrigHkPtr,0,sizeof(AraSoftTriggerHk_t));
+  softTrigHkPtr->unixTime=currTime->tv_sec;
+  softTrigHkPtr->unixTimeUs=currTime->tv_usec;
+
+  pthread_mutex_lock(&fSoftTrigStatsMutex);
+  numTriggers=fNumSoftTrigTimes;
+  if(numTriggers>SOFT_TRIGGERS_PER_HK) numTriggers=SOFT_TRIGGERS_PER_HK;
+  if(numTriggers>0) {
+    memcpy(softTrigHkPtr->triggers,fSoftTrigTimes,numTriggers*sizeof(AraSoftTriggerTime_t));
+    fNumSoftTrigTimes-=numTriggers;
+    memmove(fSoftTrigTimes,&fSoftTrigTimes[numTriggers],fNumSoftTrigTimes*sizeof(AraSoftTriggerTime_t));
+  }
+  softTrigHkPtr->numDropped=fNumSoftTrigTimesDropped>0xffff ? 0xffff : fNumSoftTrigTimesDropped;
+  fNumSoftTrigTimesDropped=0;
+  pthread_mutex_unlock(&fSoftTrigStatsMutex);
+
+  softTrigHkPtr->numTriggers=numTriggers;
+  fillGenericHeader(softTrigHkPtr,ARA_SOFT_TRIG_HK_TYPE,sizeof(AraSoftTriggerHk_t));
+  return numTriggers;
 }
 
-void copyFourBytes(uint8_t *data, uint32_t *value)
+
+void openHkWriters()
 {
-  memcpy(value,data,4);
+  makeDirectories(theConfig.eventHkTopDir);
+  makeDirectories(theConfig.sensorHkTopDir);
+
+  ///Initialize writer structures
+  initWriter(&eventHkWriter,
+	     fCurrentRun,
+	     theConfig.compressionLevel,
+	     theConfig.filesPerDir,
+	     theConfig.hkPerFile,
+	     EVENT_HK_FILE_HEAD,
+	     theConfig.eventHkTopDir,
+	     theConfig.linkForXfer?theConfig.linkDir:NULL);
+
+  initWriter(&sensorHkWriter,
+	     fCurrentRun,
+	     theConfig.compressionLevel,
+	     theConfig.filesPerDir,
+	     theConfig.hkPerFile,
+	     SENSOR_HK_FILE_HEAD,
+	     theConfig.sensorHkTopDir,
+	     theConfig.linkForXfer?theConfig.linkDir:NULL);
+
+  makeDirectories(theConfig.softTrigHkTopDir);
+  initWriter(&softTrigHkWriter,
+	     fCurrentRun,
+	     theConfig.compressionLevel,
+	     theConfig.filesPerDir,
+	     theConfig.hkPerFile,
+	     SOFT_TRIG_HK_FILE_HEAD,
+	     theConfig.softTrigHkTopDir,
+	     theConfig.linkForXfer?theConfig.linkDir:NULL);
 }
 
 
+void closeHkWriters()
+{
+  closeWriter(&sensorHkWriter);
+  closeWriter(&eventHkWriter);
+  closeWriter(&softTrigHkWriter);
+}
+
 
-int readSensorHk(int fFx2SockFd,int fAtriSockFd,AraSensorHk_t *sensorPtr, struct timeval *currTime)
+int writeSoftTriggerHk(struct timeval *currTime)
 {
-  int stack;
-  sensorPtr->unixTime=currTime->tv_sec;
-  sensorPtr->unixTimeUs=currTime->tv_usec;
-  
-#ifndef NO_USB
-  //From Patrick's email
-  /* 4: ATRI voltage/current: 
-     write 0x4 to FX2 I2C address 0x96, 
-     read 1 byte from FX2 I2C address 0x97 (ATRI current), 
-     write 0x5 to FX2 I2C address 0x96, 
-     read 1 byte from FX2 I2C address 0x97 (ATRI voltage) */
-  /* 5: DDA/TDA voltage/temperature/current: For all daughterboards: 
-     write 0x0C to I2C address 0xE4, 
-     write 0x0C to I2C address 0xFC, 
-     read 2 bytes from I2C address 0x91 (DDA temp), 
-     read 2 bytes from I2C address 0x93 (TDA temp), 
-     read 3 bytes from I2C address 0xE5 (DDA voltage/current),
-     read 3 bytes from I2C address 0xFD (TDA voltage/current). */
-  
-  //jpd - previous version of software (<4.2) had the ATRI current and voltage
-  //      the wrong way around
+  //Only the hk thread calls this, it writes as many records as it takes to
+  //empty the buffer
+  AraSoftTriggerHk_t softTrigHk;
+  int numWritten=0;
+  int retVal;
+  while(fillSoftTriggerHk(&softTrigHk,currTime)>0 || softTrigHk.numDropped>0) {
+    int new_hk_file_flag = 0;
+    retVal = writeBuffer( &softTrigHkWriter, (char*)&softTrigHk, sizeof(AraSoftTriggerHk_t) , &(new_hk_file_flag) );
+    if( retVal != sizeof(AraSoftTriggerHk_t) ) {
+      ARA_LOG_MESSAGE(LOG_WARNING,"%s: failed to write soft trigger housekeeping (return %d)\n", __FUNCTION__, retVal);
+      return -1;
+    }
+    numWritten++;
+  }
+  return numWritten;
+}
 
-  //ATRI Voltage
-  uint8_t data[4]={0,0,0,0};
-  uint16_t value16=0;
-  uint32_t value32=0;
-  data[0]=0x4;
-  writeToI2C(fFx2SockFd,0x96,1,data);
-  readFromI2C(fFx2SockFd,0x97,1,data);
-  sensorPtr->atriCurrent=data[0];
+static int64_t timespecToNs(struct timespec *ts)
+{
+  return ((int64_t)ts->tv_sec)*1000000000LL + ts->tv_nsec;
+}
 
-  //ATRI Current
-  data[0]=0x5;
-  writeToI2C(fFx2SockFd,0x96,1,data);
-  readFromI2C(fFx2SockFd,0x97,1,data);
-  sensorPtr->atriVoltage=data[0];
+static void nsToTimespec(int64_t ns, struct timespec *ts)
+{
+  ts->tv_sec=ns/1000000000LL;
+  ts->tv_nsec=ns%1000000000LL;
+}
 
-  //DDA Temp/voltage/current
-  for(stack=D1;stack<=D4;stack++) {  
-    if (theConfig.stackEnabled[stack]) 
-       {	  
-	 data[0]=0x1A; //email from psa 11th Nov 2012
-	 writeToAtriI2C(fAtriSockFd,stack,atriHotSwapAddressMap[DDA]+i2cWrite,1,data);
-	 writeToAtriI2C(fAtriSockFd,stack,atriHotSwapAddressMap[TDA]+i2cWrite,1,data);
-       }
+static int armSoftTriggerTimer(int timerFd, int64_t deadlineNs)
+{
+  struct itimerspec timerSpec;
+  memset(&timerSpec,0,sizeof(struct itimerspec));
+  nsToTimespec(deadlineNs,&timerSpec.it_value);
+  if(timerfd_settime(timerFd,TFD_TIMER_ABSTIME,&timerSpec,NULL)<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: timerfd_settime -- %s\n",__FUNCTION__,strerror(errno));
+    return -1;
   }
+  return 0;
+}
 
-  for(stack=D1;stack<=D4;stack++) {  
-    if (theConfig.stackEnabled[stack]) {	  
-    //Read DDA temp
-    readFromAtriI2C(fAtriSockFd,stack,atriTempAddressMap[DDA]+i2cRead,2,data);
-    value16=data[1];
-    value16=(value16<<8);
-    value16|=data[0];
-    sensorPtr->ddaTemp[stack]=value16;
-    //Read TDA temp
-    readFromAtriI2C(fAtriSockFd,stack,atriTempAddressMap[TDA]+i2cRead,2,data);
+static int64_t nextPpsLockedTrigger(int64_t lastNs, int64_t offsetNs, float rateHz)
+{
+  //Triggers sit in fixed slots within each second of system time, which is
+  //assumed to be disciplined to the GPS. Below 1 Hz only every Nth second
+  //gets a trigger.
+  int perSecond=1,everySeconds=1;
+  if(rateHz>=1) perSecond=(int)(rateHz+0.5);
+  else everySeconds=(int)(1./rateHz+0.5);
+  int64_t stepNs=1000000000LL/perSecond;
+  int64_t sinceOffset=lastNs-offsetNs;
+  int64_t sec=sinceOffset/1000000000LL;
+  int64_t slot=(sinceOffset%1000000000LL)/stepNs+1;
+  if(slot>=perSecond) {
+    slot=0;
+    sec++;
+  }
+  while(sec%everySeconds) sec++;
+  return sec*1000000000LL + slot*stepNs + offsetNs;
+}
+
+static int64_t nextPoissonTrigger(int64_t lastNs, float rateHz, unsigned short *randState)
+{
+  //Exponentially distributed gaps give a Poisson process
+  return lastNs + (int64_t)(-log(1.-erand48(randState))/rateHz*1e9);
+}
+
+static void recordSoftTrigger(int source, int64_t plannedNs, int64_t latencyNs, int retVal, int64_t periodNs)
+{
+  //Called with the actual time (not the timer clock) so the planned time
+  //goes to disk as unix time
+  double jitterUs=latencyNs/1e3;
+  pthread_mutex_lock(&fSoftTrigStatsMutex);
+  if(retVal<0) {
+    fSoftTrigStats[source].numFailed++;
+  }
+  else {
+    fSoftTrigStats[source].numSent++;
+    fSoftTrigStats[source].sumJitterUs+=jitterUs;
+    fSoftTrigStats[source].sumJitterSqUs+=jitterUs*jitterUs;
+    if(jitterUs>fSoftTrigStats[source].maxJitterUs) fSoftTrigStats[source].maxJitterUs=jitterUs;
+    if(periodNs>0 && latencyNs*2>periodNs) fSoftTrigStats[source].numLate++;
+  }
+  if(fNumSoftTrigTimes<SOFT_TRIG_TIME_BUFFER_SIZE) {
+    AraSoftTriggerTime_t *trigTime=&fSoftTrigTimes[fNumSoftTrigTimes++];
+    trigTime->plannedUnixTime=plannedNs/1000000000LL;
+    trigTime->plannedUnixTimeNs=plannedNs%1000000000LL;
+    trigTime->latencyNs=latencyNs>INT32_MAX ? INT32_MAX : latencyNs;
+    trigTime->triggerInfo=(source==SOFT_TRIG_SOURCE_RANDOM) ? softTrigger_RANDOM : softTrigger_FORCED;
+    trigTime->status=retVal<0 ? -1 : 0;
+    trigTime->reserved=0;
+  }
+  else {
+    fNumSoftTrigTimesDropped++;
+  }
+  pthread_mutex_unlock(&fSoftTrigStatsMutex);
+}
+
+void *softTriggerThreadHandler(void *ptr)
+{
+  //Sends the soft and random triggers on its own connection so they don't
+  //wait for event readout. Each source has a timerfd armed with absolute
+  //deadlines so the rate doesn't drift with the send time. The control
+  //packet never changes so it is built once and the wishbone write goes
+  //straight to the socket.
+  ARA_LOG_MESSAGE(LOG_DEBUG,"Starting %s\n",__FUNCTION__);
+  AtriControlPacket_t softTrigPacket;
+  AtriControlPacket_t responsePacket;
+  struct pollfd fds[NUM_SOFT_TRIG_SOURCES];
+  struct timespec timeNow,realTimeNow;
+  clockid_t timerClock[NUM_SOFT_TRIG_SOURCES];
+  int64_t deadlineNs[NUM_SOFT_TRIG_SOURCES];
+  int64_t periodNs[NUM_SOFT_TRIG_SOURCES];
+  int64_t latencyNs,nextPrintNs=0;
+  int sourceEnabled[NUM_SOFT_TRIG_SOURCES];
+  unsigned short randState[3];
+  unsigned int numSinceLastPrint=0;
+  uint64_t numExpirations;
+  int running=0;
+  int source,pollVal;
+  int retVal;
+
+  int fSoftTrigAtriSockFd=openConnectionToAtriControlSocket();
+  if(fSoftTrigAtriSockFd<=0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"Can not open connection to ATRI_CONTROL from %s\n",__FUNCTION__);
+    pthread_exit(NULL);
+  }
+  ARA_LOG_MESSAGE(LOG_DEBUG,"fSoftTrigAtriSockFd=%d\n",fSoftTrigAtriSockFd);
+  atriSetControlPriority(fSoftTrigAtriSockFd,atriControlPriorityCritical);
+
+  memset(&softTrigPacket,0,sizeof(AtriControlPacket_t));
+  softTrigPacket.header.frameStart=ATRI_CONTROL_FRAME_START;
+  softTrigPacket.header.packetLocation=ATRI_LOC_WISHBONE;
+  softTrigPacket.header.packetLength=4;
+  softTrigPacket.data[0]=WB_WRITE;
+  softTrigPacket.data[1]=(ATRI_WISH_SOFTTRIG & 0xFF00)>>8;
+  softTrigPacket.data[2]=ATRI_WISH_SOFTTRIG & 0xFF;
+  softTrigPacket.data[3]=0x1;
+  softTrigPacket.data[4]=ATRI_CONTROL_FRAME_END;
+
+  for(source=0;source<NUM_SOFT_TRIG_SOURCES;source++) {
+    fds[source].fd=-1;
+    sourceEnabled[source]=0;
+  }
+
+  while (fProgramState!=ARA_PROG_TERMINATE) {
+    if(fProgramState!=ARA_PROG_RUNNING || !fSoftTrigThreadActive) {
+      if(running) {
+	for(source=0;source<NUM_SOFT_TRIG_SOURCES;source++) {
+	  if(fds[source].fd>=0) close(fds[source].fd);
+	  fds[source].fd=-1;
+	}
+	running=0;
+      }
+      WAIT_FOR_PROGRAM_STATE(fProgramState==ARA_PROG_TERMINATE ||
+			     (fProgramState==ARA_PROG_RUNNING && fSoftTrigThreadActive));
+      continue;
+    }
+    if(!running) {
+      //The config can change between runs so set everything up again
+      clock_gettime(CLOCK_REALTIME,&realTimeNow);
+      randState[0]=realTimeNow.tv_nsec & 0xffff;
+      randState[1]=realTimeNow.tv_sec & 0xffff;
+      randState[2]=getpid() & 0xffff;
+      sourceEnabled[SOFT_TRIG_SOURCE_FORCED]=theConfig.enableSoftTrigger;
+      sourceEnabled[SOFT_TRIG_SOURCE_RANDOM]=theConfig.enableRandTrigger;
+      timerClock[SOFT_TRIG_SOURCE_FORCED]=(theConfig.softTriggerMode==softTriggerModePpsLocked) ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+      timerClock[SOFT_TRIG_SOURCE_RANDOM]=CLOCK_MONOTONIC;
+      periodNs[SOFT_TRIG_SOURCE_FORCED]=theConfig.enableSoftTrigger ? (int64_t)(1e9/theConfig.softTriggerRateHz) : 0;
+      periodNs[SOFT_TRIG_SOURCE_RANDOM]=0; //No fixed period so nothing is late
+
+      for(source=0;source<NUM_SOFT_TRIG_SOURCES;source++) {
+	fds[source].fd=-1;
+	fds[source].events=POLLIN;
+	fds[source].revents=0;
+	if(!sourceEnabled[source]) continue;
+	fds[source].fd=timerfd_create(timerClock[source],TFD_NONBLOCK);
+	if(fds[source].fd<0) {
+	  ARA_LOG_MESSAGE(LOG_ERR,"%s: timerfd_create -- %s\n",__FUNCTION__,strerror(errno));
+	  sourceEnabled[source]=0;
+	  continue;
+	}
+	clock_gettime(timerClock[source],&timeNow);
+	if(source==SOFT_TRIG_SOURCE_RANDOM)
+	  deadlineNs[source]=nextPoissonTrigger(timespecToNs(&timeNow),theConfig.randTriggerRateHz,randState);
+	else if(theConfig.softTriggerMode==softTriggerModePpsLocked)
+	  deadlineNs[source]=nextPpsLockedTrigger(timespecToNs(&timeNow),theConfig.softTriggerPpsOffsetUs*1000LL,theConfig.softTriggerRateHz);
+	else //First trigger one period after the run starts, like before
+	  deadlineNs[source]=timespecToNs(&timeNow)+periodNs[source];
+	armSoftTriggerTimer(fds[source].fd,deadlineNs[source]);
+      }
+      clock_gettime(CLOCK_MONOTONIC,&timeNow);
+      nextPrintNs=timespecToNs(&timeNow)+5000000000LL;
+      numSinceLastPrint=0;
+      running=1;
+    }
+
+    //Short timeout so we notice the run stopping
+    pollVal=poll(fds,NUM_SOFT_TRIG_SOURCES,10);
+    if(pollVal<0) {
+      if(errno==EINTR) continue;
+      ARA_LOG_MESSAGE(LOG_ERR,"%s: Error calling poll: %s\n",__FUNCTION__,strerror(errno));
+      usleep(1000);
+      continue;
+    }
+    if(fProgramState!=ARA_PROG_RUNNING || !fSoftTrigThreadActive) continue;
+
+    for(source=0;source<NUM_SOFT_TRIG_SOURCES;source++) {
+      if(!sourceEnabled[source] || !(fds[source].revents & POLLIN)) continue;
+      if(read(fds[source].fd,&numExpirations,sizeof(uint64_t))!=sizeof(uint64_t)) continue;
+
+      clock_gettime(timerClock[source],&timeNow);
+      clock_gettime(CLOCK_REALTIME,&realTimeNow);
+      latencyNs=timespecToNs(&timeNow)-deadlineNs[source];
+      retVal=sendControlPacketToAtri(fSoftTrigAtriSockFd,&softTrigPacket);
+      if(retVal==0)
+	retVal=readResponsePacketFromAtri(fSoftTrigAtriSockFd,&responsePacket);
+      time(&lastSoftwareTrigger);
+      recordSoftTrigger(source,timespecToNs(&realTimeNow)-latencyNs,latencyNs,retVal,periodNs[source]);
+
+      if(retVal<0) {
+	ARA_LOG_MESSAGE(LOG_ERR,"Error %d soft triggering",retVal);
+	setProgramState(ARA_PROG_TERMINATE);
+	break;
+      }
+      numSinceLastPrint++;
+
+      //Work out the next deadline. If we have fallen behind drop the
+      //missed triggers rather than sending a burst.
+      clock_gettime(timerClock[source],&timeNow);
+      do {
+	if(source==SOFT_TRIG_SOURCE_RANDOM)
+	  deadlineNs[source]=nextPoissonTrigger(deadlineNs[source],theConfig.randTriggerRateHz,randState);
+	else if(theConfig.softTriggerMode==softTriggerModePpsLocked)
+	  deadlineNs[source]=nextPpsLockedTrigger(deadlineNs[source],theConfig.softTriggerPpsOffsetUs*1000LL,theConfig.softTriggerRateHz);
+	else
+	  deadlineNs[source]+=periodNs[source];
+	if(deadlineNs[source]<=timespecToNs(&timeNow)) {
+	  pthread_mutex_lock(&fSoftTrigStatsMutex);
+	  fSoftTrigStats[source].numSkipped++;
+	  pthread_mutex_unlock(&fSoftTrigStatsMutex);
+	}
+      } while(deadlineNs[source]<=timespecToNs(&timeNow));
+      armSoftTriggerTimer(fds[source].fd,deadlineNs[source]);
+    }
+
+    // Only output once every 5 seconds maximum.
+    clock_gettime(CLOCK_MONOTONIC,&timeNow);
+    if(timespecToNs(&timeNow)>=nextPrintNs) {
+      if(numSinceLastPrint>0)
+	ARA_LOG_MESSAGE(LOG_INFO, "ARAAcqd: %d soft %s (since last update)\n", numSinceLastPrint,
+			(numSinceLastPrint > 1) ? "trigs" : "trig");
+      numSinceLastPrint=0;
+      nextPrintNs=timespecToNs(&timeNow)+5000000000LL;
+    }
+  }
+  for(source=0;source<NUM_SOFT_TRIG_SOURCES;source++) {
+    if(fds[source].fd>=0) close(fds[source].fd);
+  }
+  closeConnectionToAtriControlSocket(fSoftTrigAtriSockFd);
+
+  pthread_exit(NULL);
+}
+
+
+static int runEventHkTask(HkTask_t *task)
+{
+  AraEventHk_t eventHk;
+  struct timeval currentTime;
+  uint32_t ppsFlags=0;
+  int retVal;
+  if(theConfig.ppsEdgePrediction) {
+    retVal=pollPpsEdge(task->fAtriSockFd,&fPpsEdgeTracker,&ppsFlags);
+    if(retVal<=0) return retVal; //Not past the edge yet
+  }
+  gettimeofday(&currentTime,NULL);
+  retVal=readEventHk(task->fAtriSockFd,&eventHk,&currentTime);
+  if(retVal<=0) return retVal; //Still the same second
+  eventHk.gHdr.alsoReserved=ppsFlags;
+
+  // Store hk event
+  int new_hk_file_flag = 0;
+  retVal = writeBuffer( &eventHkWriter, (char*)&eventHk, sizeof(AraEventHk_t) , &(new_hk_file_flag) );
+  if( retVal != sizeof(AraEventHk_t) )
+    ARA_LOG_MESSAGE(LOG_WARNING,"Failed to write event housekeeping event\n");
+
+  if(fMonitorSegment)
+    araMonitorPublish(&fMonitorSegment->eventHkLock,&fMonitorSegment->eventHk,&eventHk,sizeof(AraEventHk_t));
+
+  //Got data from a new second, pass it on to the servos
+  pthread_mutex_lock(&fLatestEventHkMutex);
+  memcpy(&fLatestEventHk,&eventHk,sizeof(AraEventHk_t));
+  fLatestEventHkNumber++;
+  pthread_mutex_unlock(&fLatestEventHkMutex);
+
+  //And store the soft trigger times from the last second
+  writeSoftTriggerHk(&currentTime);
+  return 0;
+}
+
+int64_t eventHkNextDeadline(HkTask_t *task, int64_t nowNs)
+{
+  //Set by pollPpsEdge, zero until the first read of the run
+  if(fPpsEdgeTracker.nextReadNs==0) return nowNs;
+  return fPpsEdgeTracker.nextReadNs;
+}
+
+static int runSensorHkTask(HkTask_t *task)
+{
+  AraSensorHk_t sensorHk;
+  struct timeval currentTime;
+  int retVal;
+  gettimeofday(&currentTime,NULL);
+  retVal=readSensorHk(task->fFx2SockFd,task->fAtriSockFd,&sensorHk,&currentTime);
+  //Don't let a failed read replace the last good values in the monitor
+  if(retVal==0 && fMonitorSegment)
+    araMonitorPublish(&fMonitorSegment->sensorHkLock,&fMonitorSegment->sensorHk,&sensorHk,sizeof(AraSensorHk_t));
+
+  // Store hk event
+  int new_hk_file_flag = 0;
+  retVal = writeBuffer( &sensorHkWriter, (char*)&sensorHk, sizeof(AraSensorHk_t) , &(new_hk_file_flag) );
+  if( retVal != sizeof(AraSensorHk_t) ) {
+    ARA_LOG_MESSAGE(LOG_WARNING,"%s: failed to write sensor housekeeping event (return %d)\n", __FUNCTION__, retVal);
+    return -1;
+  }
+  ARA_LOG_MESSAGE(LOG_DEBUG,"%s: wrote %lu bytes of sensor housekeeping\n", __FUNCTION__, sizeof(AraSensorHk_t));
+  return 0;
+}
+
+static int getNewEventHk(HkTask_t *task, AraEventHk_t *eventHk)
+{
+  //Returns 1 if there is an event hk the task hasn't seen yet
+  int isNew=0;
+  pthread_mutex_lock(&fLatestEventHkMutex);
+  if(fLatestEventHkNumber!=task->lastEventHkNumber) {
+    memcpy(eventHk,&fLatestEventHk,sizeof(AraEventHk_t));
+    task->lastEventHkNumber=fLatestEventHkNumber;
+    isNew=1;
+  }
+  pthread_mutex_unlock(&fLatestEventHkMutex);
+  return isNew;
+}
+
+static int runVdlyServoTask(HkTask_t *task)
+{
+  AraEventHk_t eventHk;
+  if(!getNewEventHk(task,&eventHk) || !theConfig.enableVdlyServo) return 0;
+  return araServoUpdate(&fVdlyServo,&eventHk,&task->fAtriSockFd);
+}
+
+static int runAntServoTask(HkTask_t *task)
+{
+  AraEventHk_t eventHk;
+  if(!getNewEventHk(task,&eventHk) || !theConfig.enableAntServo) return 0;
+  //The rate servo only moves the goals, and only every servoCalcDelayS,
+  //so the threshold servo has settled on the last goals first
+  if(theConfig.enableRateServo &&
+     araServoAccumulateRate(&fRateInput,&eventHk,(int)theConfig.servoCalcDelayS))
+    araServoUpdate(&fRateServo,&fRateInput,NULL);
+  return araServoUpdate(&fAntServo,&eventHk,&task->fAtriSockFd);
+}
+
+static int runSurfaceServoTask(HkTask_t *task)
+{
+  AraEventHk_t eventHk;
+  if(!getNewEventHk(task,&eventHk) || !theConfig.enableSurfaceServo) return 0;
+  return araServoUpdate(&fSurfaceServo,&eventHk,&task->fAtriSockFd);
+}
+
+static int runStatusFileTask(HkTask_t *task)
+{
+  writeHelpfulTempFile();
+  return 0;
+}
+
+static int runMonitorTask(HkTask_t *task)
+{
+  AraMonitorStatus_t status;
+  fillMonitorStatus(&status);
+  araMonitorPublish(&fMonitorSegment->statusLock,&fMonitorSegment->status,&status,sizeof(AraMonitorStatus_t));
+  return 0;
+}
+
+static void setupHkTask(int taskNum, const char *name, int (*runTask)(HkTask_t*),
+			int priority, int controlPriority, int needsFx2, int alignToSecond)
+{
+  HkTask_t *task=&fHkTasks[taskNum];
+  memset(task,0,sizeof(HkTask_t));
+  task->name=name;
+  task->runTask=runTask;
+  task->priority=priority;
+  task->controlPriority=controlPriority;
+  task->needsFx2=needsFx2;
+  task->alignToSecond=alignToSecond;
+  pthread_mutex_init(&task->runMutex,NULL);
+}
+
+void initHkTasks()
+{
+  //The event hk is what the servos and the offline rates depend on so it
+  //gets the highest priority, housekeeping should never hold up
+  //triggering or stopping a run so nothing here is critical on the ATRI
+  //control queue
+  setupHkTask(HK_TASK_EVENT_HK,"eventHk",runEventHkTask,40,atriControlPriorityNormal,0,1);
+  setupHkTask(HK_TASK_VDLY_SERVO,"vdlyServo",runVdlyServoTask,30,atriControlPriorityNormal,0,0);
+  setupHkTask(HK_TASK_ANT_SERVO,"antServo",runAntServoTask,30,atriControlPriorityNormal,0,0);
+  setupHkTask(HK_TASK_SURFACE_SERVO,"surfaceServo",runSurfaceServoTask,30,atriControlPriorityNormal,0,0);
+  setupHkTask(HK_TASK_SENSOR_HK,"sensorHk",runSensorHkTask,20,atriControlPriorityBulk,1,0);
+  setupHkTask(HK_TASK_STATUS_FILE,"statusFile",runStatusFileTask,10,atriControlPriorityBulk,0,0);
+  setupHkTask(HK_TASK_MONITOR,"monitor",runMonitorTask,10,atriControlPriorityBulk,0,0);
+}
+
+void resetHkTaskStats()
+{
+  int taskNum;
+  for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++) {
+    HkTask_t *task=&fHkTasks[taskNum];
+    pthread_mutex_lock(&task->runMutex);
+    task->numRuns=0;
+    task->numOverruns=0;
+    task->numPeriodsSkipped=0;
+    task->maxRunTimeUs=0;
+    task->maxLatencyUs=0;
+    pthread_mutex_unlock(&task->runMutex);
+  }
+}
+
+void logHkTaskStats()
+{
+  int taskNum;
+  for(taskNum=0;taskNum<NUM_HK_TASKS;taskNum++) {
+    HkTask_t *task=&fHkTasks[taskNum];
+    pthread_mutex_lock(&task->runMutex);
+    if(task->numRuns) {
+      ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: hk task %s -- %u runs, %u overruns (%u periods skipped), max run time %.1f ms, max latency %.1f ms\n",
+		      task->name,task->numRuns,task->numOverruns,task->numPeriodsSkipped,
+		      task->maxRunTimeUs/1000.,task->maxLatencyUs/1000.);
+    }
+    pthread_mutex_unlock(&task->runMutex);
+  }
+}
+
+void *hkTaskThreadHandler(void *ptr)
+{
+  //Runs one hk task at absolute deadlines with clock_nanosleep, so the
+  //period doesn't drift with the time the task takes. A run that goes past
+  //the next deadline counts as an overrun and the missed periods are
+  //skipped rather than run back to back.
+  HkTask_t *task=(HkTask_t*)ptr;
+  clockid_t taskClock=task->alignToSecond ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+  struct timespec timeNow,wakeTime;
+  int64_t nowNs,endNs,wakeNs,deadlineNs=0,periodNs=0;
+  int64_t numMissed;
+  double runTimeUs,latencyUs;
+  int scheduled=0;
+
+  ARA_LOG_MESSAGE(LOG_DEBUG,"Starting %s for %s\n",__FUNCTION__,task->name);
+  task->fAtriSockFd=openConnectionToAtriControlSocket();
+  if(!task->fAtriSockFd) {
+    ARA_LOG_MESSAGE(LOG_ERR,"Can not open connection to ATRI_CONTROL from %s (%s)\n",__FUNCTION__,task->name);
+  }
+  else {
+    atriSetControlPriority(task->fAtriSockFd,task->controlPriority);
+  }
+  if(task->needsFx2) {
+    task->fFx2SockFd=openConnectionToFx2ControlSocket();
+    if(!task->fFx2SockFd) {
+      ARA_LOG_MESSAGE(LOG_ERR,"Can not open connection to FX2_CONTROL from %s (%s)\n",__FUNCTION__,task->name);
+    }
+  }
+
+  if(theConfig.hkRealtimePriority) {
+    struct sched_param schedParam;
+    memset(&schedParam,0,sizeof(struct sched_param));
+    schedParam.sched_priority=task->priority;
+    if(pthread_setschedparam(pthread_self(),SCHED_FIFO,&schedParam)) {
+      ARA_LOG_MESSAGE(LOG_WARNING,"%s: can't set SCHED_FIFO priority %d for %s\n",__FUNCTION__,task->priority,task->name);
+    }
+  }
+
+  while(fProgramState!=ARA_PROG_TERMINATE) {
+    if(fProgramState!=ARA_PROG_RUNNING || task->periodS<=0) {
+      scheduled=0;
+      WAIT_FOR_PROGRAM_STATE(fProgramState==ARA_PROG_TERMINATE ||
+			     (fProgramState==ARA_PROG_RUNNING && task->periodS>0));
+      continue;
+    }
+    clock_gettime(taskClock,&timeNow);
+    nowNs=timespecToNs(&timeNow);
+    if(!scheduled) {
+      //Event hk deadlines sit just after the second ticks over, the rest
+      //start straight away
+      periodNs=(int64_t)(task->periodS*1e9);
+      if(periodNs<1000000) periodNs=1000000;
+      deadlineNs=nowNs;
+      if(task->nextDeadlineNs)
+	deadlineNs=task->nextDeadlineNs(task,nowNs);
+      else if(task->alignToSecond) 
+	deadlineNs=((nowNs-EVENT_HK_SECOND_OFFSET_NS)/periodNs+1)*periodNs+EVENT_HK_SECOND_OFFSET_NS;
+      scheduled=1;
+    }
+    if(nowNs<deadlineNs) {
+      //Sleep in short steps so we notice the run stopping
+      wakeNs=deadlineNs;
+      if(wakeNs-nowNs>HK_TASK_MAX_SLEEP_NS) wakeNs=nowNs+HK_TASK_MAX_SLEEP_NS;
+      nsToTimespec(wakeNs,&wakeTime);
+      clock_nanosleep(taskClock,TIMER_ABSTIME,&wakeTime,NULL);
+      continue;
+    }
+
+    latencyUs=(nowNs-deadlineNs)/1000.;
+    pthread_mutex_lock(&task->runMutex);
+    if(fProgramState==ARA_PROG_RUNNING) {
+      task->runTask(task);
+      clock_gettime(taskClock,&timeNow);
+      endNs=timespecToNs(&timeNow);
+      runTimeUs=(endNs-nowNs)/1000.;
+      task->numRuns++;
+      if(runTimeUs>task->maxRunTimeUs) task->maxRunTimeUs=runTimeUs;
+      if(latencyUs>task->maxLatencyUs) task->maxLatencyUs=latencyUs;
+
+      //Next deadline, skipping any we have already missed
+      if(task->nextDeadlineNs)
+	deadlineNs=task->nextDeadlineNs(task,endNs);
+      else if((deadlineNs+=periodNs)<=endNs) {
+	numMissed=(endNs-deadlineNs)/periodNs+1;
+	task->numOverruns++;
+	task->numPeriodsSkipped+=numMissed;
+	deadlineNs+=numMissed*periodNs;
+      }
+    }
+    pthread_mutex_unlock(&task->runMutex);
+  }
+
+  if(task->fAtriSockFd) closeConnectionToAtriControlSocket(task->fAtriSockFd);
+  if(task->fFx2SockFd) closeConnectionToFx2ControlSocket(task->fFx2SockFd);
+  pthread_exit(NULL);
+}
+
+
+uint32_t getAtriTraceMask(ARAAcqdConfig_t *theConfig)
+{
+  uint32_t mask=0;
+  if(theConfig->atriControlLog) mask|=ATRI_TRACE_MASK_CONTROL;
+  if(theConfig->atriEventLog) mask|=ATRI_TRACE_MASK_EVENT;
+  return mask;
+}
+
+
+int checkDeltaT(struct timeval *currTime, struct timeval *lastTime, float deltaT)
+{
+  float timeDiff=(currTime->tv_usec-lastTime->tv_usec)*1e-6;
+  timeDiff+=(currTime->tv_sec-lastTime->tv_sec);
+  return (timeDiff>deltaT);
+}
+
+
+void copyTwoBytes(uint8_t *data, uint16_t *value)
+{
+  memcpy(value,data,2);
+}
+
+void copyFourBytes(uint8_t *data, uint32_t *value)
+{
+  memcpy(value,data,4);
+}
+
+
+
+int readSensorHk(int fFx2SockFd,int fAtriSockFd,AraSensorHk_t *sensorPtr, struct timeval *currTime)
+{
+  int stack;
+  int retVal=0;
+  sensorPtr->unixTime=currTime->tv_sec;
+  sensorPtr->unixTimeUs=currTime->tv_usec;
+  
+#ifndef NO_USB
+  //From Patrick's email
+  /* 4: ATRI voltage/current: 
+     write 0x4 to FX2 I2C address 0x96, 
+     read 1 byte from FX2 I2C address 0x97 (ATRI current), 
+     write 0x5 to FX2 I2C address 0x96, 
+     read 1 byte from FX2 I2C address 0x97 (ATRI voltage) */
+  /* 5: DDA/TDA voltage/temperature/current: For all daughterboards: 
+     write 0x0C to I2C address 0xE4, 
+     write 0x0C to I2C address 0xFC, 
+     read 2 bytes from I2C address 0x91 (DDA temp), 
+     read 2 bytes from I2C address 0x93 (TDA temp), 
+     read 3 bytes from I2C address 0xE5 (DDA voltage/current),
+     read 3 bytes from I2C address 0xFD (TDA voltage/current). */
+  
+  //jpd - previous version of software (<4.2) had the ATRI current and voltage
+  //      the wrong way around
+
+  //ATRI Voltage
+  uint8_t data[4]={0,0,0,0};
+  uint16_t value16=0;
+  uint32_t value32=0;
+  //Both pairs go to the control socket as one batch
+  Fx2I2CBatch_t atriBatch;
+  int currentOp,voltageOp;
+  fx2I2CBatchInit(&atriBatch);
+  data[0]=0x4;
+  currentOp=fx2I2CBatchAddWriteRead(&atriBatch,0x96,1,data,1);
+
+  //ATRI Current
+  data[0]=0x5;
+  voltageOp=fx2I2CBatchAddWriteRead(&atriBatch,0x96,1,data,1);
+  if(fx2I2CBatchExecute(fFx2SockFd,&atriBatch)<0) retVal=-1;
+  sensorPtr->atriCurrent=atriBatch.ops[currentOp].data[0];
+  sensorPtr->atriVoltage=atriBatch.ops[voltageOp].data[0];
+
+  //DDA Temp/voltage/current
+  for(stack=D1;stack<=D4;stack++) {  
+    if (theConfig.stackEnabled[stack]) 
+       {	  
+	 data[0]=0x1A; //email from psa 11th Nov 2012
+	 writeToAtriI2C(fAtriSockFd,stack,atriHotSwapAddressMap[DDA]+i2cWrite,1,data);
+	 writeToAtriI2C(fAtriSockFd,stack,atriHotSwapAddressMap[TDA]+i2cWrite,1,data);
+       }
+  }
+
+  for(stack=D1;stack<=D4;stack++) {  
+    if (theConfig.stackEnabled[stack]) {	  
+    //Read DDA temp
+    if(readFromAtriI2C(fAtriSockFd,stack,atriTempAddressMap[DDA]+i2cRead,2,data)<0) retVal=-1;
+    value16=data[1];
+    value16=(value16<<8);
+    value16|=data[0];
+    sensorPtr->ddaTemp[stack]=value16;
+    //Read TDA temp
+    if(readFromAtriI2C(fAtriSockFd,stack,atriTempAddressMap[TDA]+i2cRead,2,data)<0) retVal=-1;
     value16=data[1];
     value16=(value16<<8);
     value16|=data[0];
     sensorPtr->tdaTemp[stack]=value16;
     //Read DDA voltage/current
-    readFromAtriI2C(fAtriSockFd,stack,atriHotSwapAddressMap[DDA]+i2cRead,3,data);
+    if(readFromAtriI2C(fAtriSockFd,stack,atriHotSwapAddressMap[DDA]+i2cRead,3,data)<0) retVal=-1;
     value32=data[2];
     value32=(value32<<16);
     value16=data[1];
@@ -2072,7 +3175,7 @@ int readSensorHk(int fFx2SockFd,int fAtriSockFd,AraSensorHk_t *sensorPtr, struct
     value32|=data[0];
     sensorPtr->ddaVoltageCurrent[stack]=value32;
     //Read TDA voltage/current
-    readFromAtriI2C(fAtriSockFd,stack,atriHotSwapAddressMap[TDA]+i2cRead,3,data);
+    if(readFromAtriI2C(fAtriSockFd,stack,atriHotSwapAddressMap[TDA]+i2cRead,3,data)<0) retVal=-1;
     value32=data[2];
     value32=(value32<<16);
     value16=data[1];
@@ -2084,10 +3187,182 @@ int readSensorHk(int fFx2SockFd,int fAtriSockFd,AraSensorHk_t *sensorPtr, struct
   }
 #endif
   fillGenericHeader(sensorPtr,ARA_SENSOR_HK_TYPE,sizeof(AraSensorHk_t));  
-  return 0;
+  return retVal;
   
 }
 		     
+int readPpsCounters(int fAtriSockFd, uint32_t *ppsCounter, uint32_t *clockCounter)
+{
+  //The clock and PPS counters are next to each other so one read gets both
+  uint8_t data[8];
+  int retVal=atriWishboneRead(fAtriSockFd,ATRI_WISH_CLKCNT,8,data);
+  if(retVal<0) return retVal;
+  copyFourBytes(&(data[0]),clockCounter);
+  copyFourBytes(&(data[ATRI_WISH_PPSCNT-ATRI_WISH_CLKCNT]),ppsCounter);
+  return 0;
+}
+
+
+void resetPpsEdgeTracker(PpsEdgeTracker_t *tracker)
+{
+  memset(tracker,0,sizeof(PpsEdgeTracker_t));
+}
+
+static int64_t wrapPpsPhase(int64_t phaseNs)
+{
+  //Into the range [-0.5,0.5) s
+  phaseNs%=1000000000LL;
+  if(phaseNs>=500000000LL) phaseNs-=1000000000LL;
+  if(phaseNs<-500000000LL) phaseNs+=1000000000LL;
+  return phaseNs;
+}
+
+static int64_t predictedPpsEdge(PpsEdgeTracker_t *tracker, int64_t afterNs)
+{
+  //The first predicted edge after afterNs
+  int64_t sinceEdge=afterNs-tracker->edgePhaseNs;
+  int64_t edgeNs=(sinceEdge/1000000000LL)*1000000000LL+tracker->edgePhaseNs;
+  while(edgeNs<=afterNs) edgeNs+=1000000000LL;
+  return edgeNs;
+}
+
+int pollPpsEdge(int fAtriSockFd, PpsEdgeTracker_t *tracker, uint32_t *flags)
+{
+  //Reads the PPS counter and works out when to read it next. Returns 1
+  //once the counter has moved on, with flags saying what was odd about the
+  //new second, 0 if it hasn't yet and -1 on a read error.
+  //
+  //When locked the reads sit PPS_EDGE_GUARD_NS either side of the
+  //predicted edge, the middle of the two is taken as the edge time and
+  //nudges the prediction. Without a lock the counter is polled from just
+  //before where the last edge could have been.
+  struct timespec readStart,readEnd;
+  uint32_t ppsCounter,clockCounter;
+  int64_t nowNs,bracketNs,edgeNs,predictedNs,errorNs;
+  int64_t numSeconds;
+  int32_t ppsDelta;
+  int measured;
+
+  *flags=0;
+  clock_gettime(CLOCK_REALTIME,&readStart);
+  if(readPpsCounters(fAtriSockFd,&ppsCounter,&clockCounter)<0) {
+    clock_gettime(CLOCK_REALTIME,&readEnd);
+    tracker->nextReadNs=timespecToNs(&readEnd)+PPS_EDGE_POLL_NS;
+    return -1;
+  }
+  clock_gettime(CLOCK_REALTIME,&readEnd);
+  nowNs=(timespecToNs(&readStart)+timespecToNs(&readEnd))/2;
+  tracker->numReads++;
+
+  if(!tracker->havePps) {
+    //Nothing to compare with yet
+    tracker->havePps=1;
+    tracker->lastPpsCounter=ppsCounter;
+    tracker->lastOldReadNs=nowNs;
+    tracker->nextReadNs=nowNs+PPS_EDGE_POLL_NS;
+    return 0;
+  }
+
+  if(ppsCounter==tracker->lastPpsCounter) {
+    //Still before the edge
+    tracker->lastOldReadNs=nowNs;
+    tracker->nextReadNs=nowNs+PPS_EDGE_POLL_NS;
+    if(tracker->locked) {
+      predictedNs=predictedPpsEdge(tracker,nowNs-PPS_EDGE_LOCK_TOLERANCE_NS);
+      if(nowNs<predictedNs) {
+	tracker->nextReadNs=predictedNs+PPS_EDGE_GUARD_NS;
+      }
+      else if(nowNs>predictedNs+PPS_EDGE_LOCK_TOLERANCE_NS) {
+	ARA_LOG_MESSAGE(LOG_WARNING,"%s: no PPS edge %lld ms after the prediction, lost lock\n",
+			__FUNCTION__,(long long)((nowNs-predictedNs)/1000000));
+	tracker->locked=0;
+	tracker->numLockLost++;
+      }
+    }
+    return 0;
+  }
+
+  //The counter has moved on, so the edge was between the last two reads
+  tracker->numEdges++;
+  bracketNs=nowNs-tracker->lastOldReadNs;
+  edgeNs=tracker->lastOldReadNs+bracketNs/2;
+  measured=(bracketNs<=PPS_EDGE_MAX_BRACKET_NS);
+  if(!tracker->locked) *flags|=EVENT_HK_FLAG_PPS_UNLOCKED;
+
+  if(measured) {
+    if(!tracker->locked) {
+      tracker->edgePhaseNs=edgeNs%1000000000LL;
+      tracker->locked=1;
+    }
+    else {
+      errorNs=wrapPpsPhase(edgeNs-tracker->edgePhaseNs);
+      if(llabs(errorNs)>PPS_EDGE_LOCK_TOLERANCE_NS) {
+	//The PPS has jumped, start again from this edge
+	ARA_LOG_MESSAGE(LOG_WARNING,"%s: PPS edge %lld ms from the prediction\n",
+			__FUNCTION__,(long long)(errorNs/1000000));
+	tracker->numLockLost++;
+	tracker->edgePhaseNs=edgeNs%1000000000LL;
+      }
+      else {
+	tracker->edgePhaseNs+=(int64_t)(PPS_EDGE_FILTER_WEIGHT*errorNs);
+	tracker->edgePhaseNs=(tracker->edgePhaseNs+1000000000LL)%1000000000LL;
+      }
+    }
+  }
+  else if(tracker->locked) {
+    //The edge came before the first read, so the prediction is out by more
+    //than the guard
+    ARA_LOG_MESSAGE(LOG_WARNING,"%s: PPS edge before the predicted window, lost lock\n",__FUNCTION__);
+    tracker->locked=0;
+    tracker->numLockLost++;
+  }
+
+  //Check the counter against the number of seconds of system time, only
+  //meaningful if both edge times are good to a few ms
+  if(tracker->haveEdge) {
+    ppsDelta=(int32_t)(ppsCounter-tracker->lastEdgePps);
+    if(ppsDelta<0) {
+      ARA_LOG_MESSAGE(LOG_WARNING,"%s: PPS counter went backwards (%u -> %u)\n",
+		      __FUNCTION__,tracker->lastEdgePps,ppsCounter);
+    }
+    else {
+      if(ppsDelta>1) {
+	*flags|=EVENT_HK_FLAG_SKIPPED_SECONDS;
+	tracker->numSkippedSeconds+=ppsDelta-1;
+      }
+      if(measured && tracker->lastEdgeMeasured) {
+	numSeconds=llround((edgeNs-tracker->lastEdgeNs)/1e9);
+	if(ppsDelta>numSeconds) {
+	  *flags|=EVENT_HK_FLAG_EXTRA_PPS;
+	  tracker->numExtraPps++;
+	  ARA_LOG_MESSAGE(LOG_WARNING,"%s: PPS counter advanced %d in %lld s\n",
+			  __FUNCTION__,ppsDelta,(long long)numSeconds);
+	}
+	else if(ppsDelta<numSeconds) {
+	  *flags|=EVENT_HK_FLAG_MISSING_PPS;
+	  tracker->numMissingPps++;
+	  ARA_LOG_MESSAGE(LOG_WARNING,"%s: PPS counter advanced %d in %lld s\n",
+			  __FUNCTION__,ppsDelta,(long long)numSeconds);
+	}
+      }
+    }
+  }
+  tracker->haveEdge=1;
+  tracker->lastEdgeMeasured=measured;
+  tracker->lastEdgeNs=edgeNs;
+  tracker->lastEdgePps=ppsCounter;
+
+  //This read saw the new value, so it is the old one for the next edge
+  if(tracker->locked)
+    tracker->nextReadNs=predictedPpsEdge(tracker,nowNs+PPS_EDGE_GUARD_NS)-PPS_EDGE_GUARD_NS;
+  else
+    tracker->nextReadNs=tracker->lastOldReadNs+1000000000LL-PPS_EDGE_POLL_NS;
+  tracker->lastPpsCounter=ppsCounter;
+  tracker->lastOldReadNs=nowNs;
+  return 1;
+}
+
+
 int readEventHk(int fAtriSockFd,AraEventHk_t *eventPtr, struct timeval *currTime)
 {
   //At the moment we are doing everything with small reads. At some point will chnage to big reads when we need the extra speed.
@@ -2111,8 +3386,8 @@ int readEventHk(int fAtriSockFd,AraEventHk_t *eventPtr, struct timeval *currTime
   /*  3: read address 0x0100-0x15F on the WISHBONE bus (scalers) */
 
 
-  //PPS counter
-  atriWishboneRead(fAtriSockFd,ATRI_WISH_PPSCNT,4,(uint8_t*)&(eventPtr->ppsCounter));
+  //PPS counter, and the clock counter next to it
+  readPpsCounters(fAtriSockFd,&(eventPtr->ppsCounter),&(eventPtr->clockCounter));
   fCurrentPps=eventPtr->ppsCounter;
   if(lastPpsCounter==eventPtr->ppsCounter && lastPpsCounter!=0) {
     return 0;
@@ -2162,9 +3437,6 @@ int readEventHk(int fAtriSockFd,AraEventHk_t *eventPtr, struct timeval *currTime
   fprintf(stderr,"Vdly %d %d %d %d\n",currentVdly[0],currentVdly[1],currentVdly[2],currentVdly[3]);
   */
 
-  //Clock counter
-  atriWishboneRead(fAtriSockFd,ATRI_WISH_CLKCNT,4,(uint8_t*)&(eventPtr->clockCounter));
-
   //Deadtime 
   // PSA: these don't exist yet, and will be heavily reordered anyway
   /*
@@ -2224,28 +3496,19 @@ int readEventHk(int fAtriSockFd,AraEventHk_t *eventPtr, struct timeval *currTime
     copyTwoBytes(&(data[2*loop]),(uint16_t*)&(eventPtr->t1Scaler[loop]));
   }
 
-  //JPD deadtime statistics
-  atriWishboneRead(fAtriSockFd, ATRI_WISH_EVERROR, 1,data);
+  //JPD deadtime statistics, 0x80-0x8F in one read
+  atriWishboneRead(fAtriSockFd, ATRI_WISH_EVERROR, 16,data);
   eventPtr->evReadoutError=data[0];
 
-  atriWishboneRead(fAtriSockFd, ATRI_WISH_EVCOUNTAVG, 2,data);
-  copyTwoBytes(&(data[0]),(uint16_t*)&(eventPtr->evReadoutCountAvg));
-  atriWishboneRead(fAtriSockFd, ATRI_WISH_EVCOUNTMIN, 2,data);
-  copyTwoBytes(&(data[0]),(uint16_t*)&(eventPtr->evReadoutCountMin));
-
-  atriWishboneRead(fAtriSockFd, ATRI_WISH_BLKCOUNTAVG, 2,data);
-  copyTwoBytes(&(data[0]),(uint16_t*)&(eventPtr->blockBuffCountAvg));
-  atriWishboneRead(fAtriSockFd, ATRI_WISH_BLKCOUNTMAX, 2,data);
-  copyTwoBytes(&(data[0]),(uint16_t*)&(eventPtr->blockBuffCountMax));
+  copyTwoBytes(&(data[ATRI_WISH_EVCOUNTAVG-ATRI_WISH_EVERROR]),(uint16_t*)&(eventPtr->evReadoutCountAvg));
+  copyTwoBytes(&(data[ATRI_WISH_EVCOUNTMIN-ATRI_WISH_EVERROR]),(uint16_t*)&(eventPtr->evReadoutCountMin));
 
-  atriWishboneRead(fAtriSockFd, ATRI_WISH_IRS_DEADTIME, 2,data);
-  copyTwoBytes(&(data[0]),(uint16_t*)&(eventPtr->digDeadTime));
+  copyTwoBytes(&(data[ATRI_WISH_BLKCOUNTAVG-ATRI_WISH_EVERROR]),(uint16_t*)&(eventPtr->blockBuffCountAvg));
+  copyTwoBytes(&(data[ATRI_WISH_BLKCOUNTMAX-ATRI_WISH_EVERROR]),(uint16_t*)&(eventPtr->blockBuffCountMax));
 
-  atriWishboneRead(fAtriSockFd, ATRI_WISH_USB_DEADTIME, 2,data);
-  copyTwoBytes(&(data[0]),(uint16_t*)&(eventPtr->buffDeadTime));
-
-  atriWishboneRead(fAtriSockFd, ATRI_WISH_TOT_DEADTIME, 2,data);
-  copyTwoBytes(&(data[0]),(uint16_t*)&(eventPtr->totalDeadTime));
+  copyTwoBytes(&(data[ATRI_WISH_IRS_DEADTIME-ATRI_WISH_EVERROR]),(uint16_t*)&(eventPtr->digDeadTime));
+  copyTwoBytes(&(data[ATRI_WISH_USB_DEADTIME-ATRI_WISH_EVERROR]),(uint16_t*)&(eventPtr->buffDeadTime));
+  copyTwoBytes(&(data[ATRI_WISH_TOT_DEADTIME-ATRI_WISH_EVERROR]),(uint16_t*)&(eventPtr->totalDeadTime));
   
 #endif
   //Tend to readout garbage in the first second
@@ -2328,7 +3591,7 @@ int readAtriEventPatrick(char *eventBuffer)
 {
   //Try to read an event, returns 0 if there is no event, 1 if there is an event and -1 if there is a protocol error
   int retVal=0;
-  int numBytesRead,i;
+  int numBytesRead;
   unsigned char buffer[4096];
   
   int expectFrame=0;
@@ -2463,15 +3726,7 @@ int readAtriEventPatrick(char *eventBuffer)
 
 
 	//Log the event
-	if(fpAtriEventLog!=NULL && theConfig.atriEventLog) {
-	  for (i=0;i<numBytesRead;i++) 
-	    {
-              fprintf(fpAtriEventLog,"%2.2x", buffer[i]); 
-              if (!((i+1)%16) || (i+1==numBytesRead)) fprintf(fpAtriEventLog, "\n"); 
-              else fprintf(fpAtriEventLog," ");      
-	    }
-	  fprintf(fpAtriEventLog,"\n");
-	}
+	atriTraceRecord(ATRI_TRACE_EVENT_IN,buffer[0],buffer[1],0,0,buffer,numBytesRead);
       }
       else {
 	//	fprintf(stderr,"*");
@@ -2491,7 +3746,7 @@ int readAtriEventPatrick(char *eventBuffer)
 int readAtriEventV2(unsigned char *eventBuffer)
 {
   int ret = 0;
-  int nb,i;
+  int nb;
 
   int upToByteIn=0;
   int upToByteOut=0;
@@ -2527,15 +3782,7 @@ int readAtriEventV2(unsigned char *eventBuffer)
       // otherwise, start counting
       ARA_LOG_MESSAGE(LOG_DEBUG,  "%s : read %d bytes\n", __FUNCTION__, nb);
 
-      if(fpAtriEventLog!=NULL && theConfig.atriEventLog) {
-	for (i=0;i<nb;i++) 
-	  {
-	    fprintf(fpAtriEventLog,"%2.2x", buffer[i]); 
-	    if (!((i+1)%16) || (i+1==nb)) fprintf(fpAtriEventLog, "\n"); 
-	    else fprintf(fpAtriEventLog," ");      
-	  }
-	fprintf(fpAtriEventLog,"\n");
-      }
+      atriTraceRecord(ATRI_TRACE_EVENT_IN,buffer[0],buffer[1],0,0,buffer,nb);
 
       if ( (buffer[0] != FIRST_BLOCK_FRAME_OTHER &&
 	    buffer[0] != MIDDLE_BLOCK_FRAME_OTHER &&
@@ -2632,6 +3879,7 @@ int readAtriEventV2(unsigned char *eventBuffer)
 int unpackAtriEventV2(unsigned char *inputBuffer, unsigned char *outputBuffer, int numBytesIn){
   //RJN added a variable to unpackAtriEventV2 which is the number of input bytes
   //This function takes an event from the inputBuffer and stuffs ATRI events into the outputBuffer
+  //Returns the unpacked bytes, or -(ARA_DQ_ERR_* class) when the event is no good
   int up_to_byte_input=0;
   int up_to_byte_output=0;
   uint32_t temp_value=0;
@@ -2687,7 +3935,7 @@ int unpackAtriEventV2(unsigned char *inputBuffer, unsigned char *outputBuffer, i
 
     if(up_to_byte_input>numBytesIn || up_to_byte_input>MAX_EVENT_BUFFER_SIZE) {
       ARA_LOG_MESSAGE(LOG_ERR,"%s : Whoops! we only had %d bytes but we are already unpacking up to %d bytes (buffer size %d)\n",__FUNCTION__, up_to_byte_input,numBytesIn,MAX_EVENT_BUFFER_SIZE);
-      return -1;
+      return -ARA_DQ_ERR_OVERRUN;
     }
 
 
@@ -2697,7 +3945,7 @@ int unpackAtriEventV2(unsigned char *inputBuffer, unsigned char *outputBuffer, i
 	//We weren't expecting this frame
 	//fprintf(stderr,  "%s :  expected_frame_number %d frame_number %d frame_type %c\n", __FUNCTION__, expected_frame_number, frame_number, frame_type);
 	ARA_LOG_MESSAGE(LOG_DEBUG, "%s :  expected_frame_number %d frame_number %d frame_type %c\n", __FUNCTION__, expected_frame_number, frame_number, frame_type);
-	return -1;
+	return -ARA_DQ_ERR_FIRST_FRAME;
       }
 
       //Event Header
@@ -2800,7 +4048,7 @@ int unpackAtriEventV2(unsigned char *inputBuffer, unsigned char *outputBuffer, i
 	  this_dda = (block_header >> 8) & 0x3;
 
 	  blkHeaderPtr->irsBlockNumber=block_id;
-	  blkHeaderPtr->channelMask=block_header; //DDA [9:8] Channels [7:0]
+	  blkHeaderPtr->channelMask=block_header&0x3ff; //DDA [9:8] Channels [7:0], the bits above are software only (see ARA_BLOCK_NUM_SUMMARIES)
 
 	  //	  fprintf(stderr, "%s : block_header %d channel_mask %2.2x this_dda %d\n", __FUNCTION__, block_header, channel_mask, this_dda);
 	  //ARA_LOG_MESSAGE(LOG_DEBUG, "%s : block_header %d channel_mask %2.2x this_dda %d\n", __FUNCTION__, block_header, channel_mask, this_dda);
@@ -2808,7 +4056,7 @@ int unpackAtriEventV2(unsigned char *inputBuffer, unsigned char *outputBuffer, i
 	  if((dda_mask_bit ) != this_dda){
 	    //	    fprintf(stderr, "%s : Wrong DDA got %d expected %d\n", __FUNCTION__, this_dda,  dda_mask_bit);
 	    //ARA_LOG_MESSAGE(LOG_DEBUG, "%s : Wrong DDA got %d expected %d\n", __FUNCTION__, this_dda,  dda_mask_bit);
-	    return -1;
+	    return -ARA_DQ_ERR_WRONG_DDA;
 	  }
 	  
 	  uint8_t channel_mask_bit=0;
@@ -2831,11 +4079,11 @@ int unpackAtriEventV2(unsigned char *inputBuffer, unsigned char *outputBuffer, i
 
 	  if(up_to_byte_input>numBytesIn || up_to_byte_input>MAX_EVENT_BUFFER_SIZE) {
 	    ARA_LOG_MESSAGE(LOG_ERR,"%s : Whoops! we only had %d bytes but we are already unpacking up to %d bytes (buffer size %d) (dda loop %d)\n",__FUNCTION__, up_to_byte_input,numBytesIn,MAX_EVENT_BUFFER_SIZE,dda_mask_bit);
-	    return -1;
+	    return -ARA_DQ_ERR_OVERRUN;
 	  }
 	  if(up_to_byte_output>MAX_EVENT_BUFFER_SIZE) {
 	    ARA_LOG_MESSAGE(LOG_ERR,"%s : Whoops! we only have an outputBuffer of %d bytes but we are already unpacking up to %d bytes into it (dda loop %d)\n",__FUNCTION__, MAX_EVENT_BUFFER_SIZE,up_to_byte_output,dda_mask_bit);
-	    return -1;
+	    return -ARA_DQ_ERR_OUTPUT_OVERFLOW;
 	  }   
 	  
 
@@ -2863,7 +4111,7 @@ int unpackAtriEventV2(unsigned char *inputBuffer, unsigned char *outputBuffer, i
       //Didn't get the expected frame_number
       //      fprintf(stderr, "%s :  expected_frame_number %d frame_number %d frame_type %c\n", __FUNCTION__, expected_frame_number, frame_number, frame_type);
       ARA_LOG_MESSAGE(LOG_DEBUG, "%s :  expected_frame_number %d frame_number %d frame_type %c\n", __FUNCTION__, expected_frame_number, frame_number, frame_type);
-      return -1;
+      return -ARA_DQ_ERR_FRAME_SEQUENCE;
     }
     
   }//while(1)
@@ -2970,15 +4218,7 @@ int readAtriEvent(char *eventBuffer)
       if(numBytesRead>0) {
 	ARA_LOG_MESSAGE(LOG_INFO,"Got frame %#x %#x\n",buffer[0],buffer[1]);
 	//Log the event
-	if(fpAtriEventLog!=NULL && theConfig.atriEventLog) {
-	  for (i=0;i<numBytesRead;i++) 
-	    {
-              fprintf(fpAtriEventLog,"%2.2x", buffer[i]); 
-              if (!((i+1)%16) || (i+1==numBytesRead)) fprintf(fpAtriEventLog, "\n"); 
-              else fprintf(fpAtriEventLog," ");      
-	    }
-	  fprintf(fpAtriEventLog,"\n");
-	}
+	atriTraceRecord(ATRI_TRACE_EVENT_IN,buffer[0],buffer[1],0,0,buffer,numBytesRead);
 
 	//	fprintf(stderr,"\nRead %d bytes from event end point\n",numBytesRead);	 	  
 	//	fprintf(stderr,"expectFrame %d, expectStack %d, expectFrameByte %#x\n",expectFrame,expectStack,expectFrameByte); 
@@ -3326,116 +4566,265 @@ int setSurfaceThresholds(int fAtriSockFd, uint16_t *thresholds)
 }
 
 
-int doThresholdScan(int fAtriSockFd)
+static int waitForScanPpsEdge(int fAtriSockFd, uint32_t *ppsCounter)
 {
-  //First kind of scan will be all channels together
-  FILE *fpThresholdScan;
-  char filename[FILENAME_MAX];
-  uint16_t thresholds[16]={0};
-  uint32_t ppsCounter;
-  uint32_t lastPpsCounter;
-  uint16_t l1Scalers[16];
-  uint16_t l1SurfaceScalers[4];
-  uint32_t value=0,i=0;
-  int j=0;
-  sprintf(filename,"%s/current/thresholdScan.run%6.6d.dat",theConfig.topDataDir,fCurrentRun);
-  fpThresholdScan=fopen(filename,"w");
-  for(i=0;i<theConfig.thresholdScanPoints;i++) {
-    value=theConfig.thresholdScanStep*i+theConfig.thresholdScanStartPoint;
-    if(value > 0xffff) break; //Stops us looping back through low nums
-    for(j=0;j<THRESHOLDS_PER_ATRI;j++) {
-      thresholds[j]=value;
+  //Polls the PPS counter until it changes, so the caller is at most
+  //THRESHOLD_SCAN_POLL_US (plus a wishbone read) after the edge
+  uint32_t startPps,pps;
+  int numPolls=0;
+  if(atriWishboneRead(fAtriSockFd,ATRI_WISH_PPSCNT,4,(uint8_t*)&startPps)<0) return -1;
+  do {
+    usleep(THRESHOLD_SCAN_POLL_US);
+    if(atriWishboneRead(fAtriSockFd,ATRI_WISH_PPSCNT,4,(uint8_t*)&pps)<0) return -1;
+    if(++numPolls*THRESHOLD_SCAN_POLL_US>THRESHOLD_SCAN_EDGE_TIMEOUT_US) {
+      ARA_LOG_MESSAGE(LOG_ERR,"%s: no PPS for %d ms, giving up\n",__FUNCTION__,THRESHOLD_SCAN_EDGE_TIMEOUT_US/1000);
+      return -1;
     }
-    setIceThresholds(fAtriSockFd,thresholds);
-    if(theConfig.setSurfaceThreshold)
-      setSurfaceThresholds(fAtriSockFd,thresholds);
+  } while(pps==startPps);
+  *ppsCounter=pps;
+  return 0;
+}
 
-    //Read out PPS counter
-    
-    //PPS counter
-    do{
-      usleep(10000);
-      atriWishboneRead(fAtriSockFd,ATRI_WISH_PPSCNT,4,(uint8_t*)&ppsCounter);
-    } while(ppsCounter-lastPpsCounter==0);
-    
-    lastPpsCounter=ppsCounter;
-    usleep(100000);
+static uint16_t thresholdScanDacValue(int index)
+{
+  return theConfig.thresholdScanStep*index+theConfig.thresholdScanStartPoint;
+}
 
-    //Read out scalers -- not sure this formatting works
-    atriWishboneRead(fAtriSockFd,ATRI_WISH_SCAL_L1_START,32,(uint8_t*)l1Scalers);
+static int setThresholdScanStep(int fAtriSockFd, const int32_t *stepIndex, uint32_t scanMask, uint16_t *dacValues)
+{
+  //Scanned channels move to their point for this step, the others keep
+  //their parked values
+  int ch,retVal=0;
+  for(ch=0;ch<THRESHOLD_SCAN_NUM_CHANNELS;ch++) {
+    if((scanMask&(1<<ch)) && stepIndex[ch]>=0)
+      dacValues[ch]=thresholdScanDacValue(stepIndex[ch]);
+  }
+  if(setIceThresholds(fAtriSockFd,dacValues)<0) retVal=-1;
+  if(theConfig.setSurfaceThreshold && setSurfaceThresholds(fAtriSockFd,&dacValues[THRESHOLDS_PER_ATRI])<0) retVal=-1;
+  return retVal;
+}
 
-    //Read out surface scalers -- not sure this formatting works
-    atriWishboneRead(fAtriSockFd,ATRI_WISH_SURF_SCAL_L1_START,8,(uint8_t*)l1SurfaceScalers);
+static int runThresholdScanSteps(int fAtriSockFd, const int32_t *plan, int numSteps, int numPoints, uint32_t scanMask,
+				 uint16_t *dacValues, int32_t *scalers, uint32_t *ppsCounters, FILE *fpRaw)
+{
+  //Measures numSteps plan steps of THRESHOLD_SCAN_NUM_CHANNELS indices,
+  //one step per second. Unscanned channels are stored with the first
+  //scanned channel that has a point in the step.
+  uint16_t l1Scalers[THRESHOLDS_PER_ATRI];
+  uint16_t l1SurfaceScalers[ANTS_PER_TDA];
+  uint32_t ppsCounter,ppsAfterRead;
+  const int32_t *stepIndex;
+  int step,ch,index,refIndex;
+
+  if(numSteps<=0) return 0;
+  if(waitForScanPpsEdge(fAtriSockFd,&ppsCounter)<0) return -1;
+  setThresholdScanStep(fAtriSockFd,plan,scanMask,dacValues);
+  for(step=0;step<numSteps;step++) {
+    stepIndex=&plan[step*THRESHOLD_SCAN_NUM_CHANNELS];
+    if(waitForScanPpsEdge(fAtriSockFd,&ppsCounter)<0) return -1;
+    //The scalers latched at this edge cover the whole of this step, so
+    //the next one can start straight away
+    if(step+1<numSteps)
+      setThresholdScanStep(fAtriSockFd,stepIndex+THRESHOLD_SCAN_NUM_CHANNELS,scanMask,dacValues);
+    usleep(THRESHOLD_SCAN_READ_DELAY_US);
+    atriWishboneRead(fAtriSockFd,ATRI_WISH_SCAL_L1_START,2*THRESHOLDS_PER_ATRI,(uint8_t*)l1Scalers);
+    atriWishboneRead(fAtriSockFd,ATRI_WISH_SURF_SCAL_L1_START,2*ANTS_PER_TDA,(uint8_t*)l1SurfaceScalers);
+    if(atriWishboneRead(fAtriSockFd,ATRI_WISH_PPSCNT,4,(uint8_t*)&ppsAfterRead)<0) return -1;
+    if(ppsAfterRead!=ppsCounter) {
+      //We fell behind and the scalers may already be from the next step,
+      //so start this step again from a fresh edge
+      ARA_LOG_MESSAGE(LOG_WARNING,"%s: late reading step %d, repeating it\n",__FUNCTION__,step);
+      if(waitForScanPpsEdge(fAtriSockFd,&ppsCounter)<0) return -1;
+      setThresholdScanStep(fAtriSockFd,stepIndex,scanMask,dacValues);
+      step--;
+      continue;
+    }
 
-    fprintf(fpThresholdScan,"%u %d ",ppsCounter,value);
-    for(j=0;j<THRESHOLDS_PER_ATRI;j++) 
-      fprintf(fpThresholdScan,"%d ",l1Scalers[j]);
-    for(j=0;j<ANTS_PER_TDA;j++) 
-      fprintf(fpThresholdScan,"%d ",l1SurfaceScalers[j]);
-    fprintf(fpThresholdScan,"\n");
+    refIndex=-1;
+    for(ch=0;ch<THRESHOLD_SCAN_NUM_CHANNELS;ch++) {
+      if((scanMask&(1<<ch)) && stepIndex[ch]>=0) {
+	refIndex=stepIndex[ch];
+	break;
+      }
+    }
+    if(fpRaw) fprintf(fpRaw,"%u ",ppsCounter);
+    for(ch=0;ch<THRESHOLD_SCAN_NUM_CHANNELS;ch++) {
+      index=(scanMask&(1<<ch)) ? stepIndex[ch] : refIndex;
+      if(fpRaw) fprintf(fpRaw,"%d %d ",index>=0 ? (int)thresholdScanDacValue(index) : -1,
+			ch<THRESHOLDS_PER_ATRI ? l1Scalers[ch] : l1SurfaceScalers[ch-THRESHOLDS_PER_ATRI]);
+      if(index<0) continue;
+      scalers[ch*numPoints+index]=ch<THRESHOLDS_PER_ATRI ? l1Scalers[ch] : l1SurfaceScalers[ch-THRESHOLDS_PER_ATRI];
+      ppsCounters[ch*numPoints+index]=ppsCounter;
+    }
+    if(fpRaw) fprintf(fpRaw,"\n");
   }
-  fclose(fpThresholdScan);
-  if(theConfig.linkForXfer)
-    makeLink(filename,theConfig.linkDir);
-
   return 0;
 }
 
-
-int doThresholdScanSingleChannel(int fAtriSockFd)
+static int isFlatScanInterval(int32_t first, int32_t last)
 {
-  //First kind of scan will be all channels together
-  FILE *fpThresholdScan;
-  uint32_t channel=theConfig.thresholdScanSingleChannelNum;
-  char filename[FILENAME_MAX];
-  uint16_t thresholds[16]={0};
-  uint32_t ppsCounter;
-  uint16_t l1Scalers[16];
-  uint16_t l1SurfaceScalers[4];
-  uint32_t value=0,i=0;
-  int j=0;
+  //Scalers are counts, so the ends agree if they are within a few sigma
+  double diff=abs(first-last);
+  return diff<=THRESHOLD_SCAN_FLAT_SIGMA*sqrt((double)first+last)+1;
+}
 
-  //set the other thresholds as usual
-  setIceThresholds(fAtriSockFd,theConfig.thresholdValues);
 
-  sprintf(filename,"%s/current/thresholdScanSingleChannel.run%6.6d.dat",theConfig.topDataDir,fCurrentRun);
+int doGatedThresholdScan(int fAtriSockFd, uint32_t scanMask, const char *fileTag)
+{
+  //Threshold scan over the thresholdScanStartPoint/Step/Points grid in two
+  //passes. The coarse pass measures every thresholdScanCoarseStride-th point
+  //for all the scanned channels together. The fine pass then only measures
+  //the points between coarse points that differ, which is where each
+  //channel's curve actually changes. As the channels turn on at different
+  //DAC values, each fine step sets every channel to its own next point.
+  //Points skipped in the flat parts are filled in from the coarse points.
+  FILE *fpThresholdScan,*fpRaw;
+  char filename[FILENAME_MAX];
+  char rawFilename[FILENAME_MAX];
+  uint16_t dacValues[THRESHOLD_SCAN_NUM_CHANNELS];
+  int32_t *scalers,*plan;
+  uint32_t *ppsCounters;
+  int numPoints,stride,numCoarse,numFine,numNeeded,maxNeeded;
+  int ch,index,step,first,last,lastMeasured,nextMeasured;
+  uint32_t rowPps,interpolatedMask;
+  int retVal=0;
+  double value;
+  struct timeval startTime,endTime;
+
+  numPoints=theConfig.thresholdScanPoints;
+  if(theConfig.thresholdScanStep>0 && theConfig.thresholdScanStartPoint+(numPoints-1)*theConfig.thresholdScanStep>0xffff)
+    numPoints=(0xffff-theConfig.thresholdScanStartPoint)/theConfig.thresholdScanStep+1; //Stops us looping back through low nums
+  if(numPoints<=0) return 0;
+  stride=theConfig.thresholdScanCoarseStride;
+  if(stride<1) stride=1;
+  numCoarse=(numPoints-1)/stride+1;
+  if((numCoarse-1)*stride!=numPoints-1) numCoarse++; //Always include the last point
+
+  scalers=malloc(sizeof(int32_t)*THRESHOLD_SCAN_NUM_CHANNELS*numPoints);
+  ppsCounters=malloc(sizeof(uint32_t)*THRESHOLD_SCAN_NUM_CHANNELS*numPoints);
+  plan=malloc(sizeof(int32_t)*THRESHOLD_SCAN_NUM_CHANNELS*(numPoints>numCoarse ? numPoints : numCoarse));
+  if(!scalers || !ppsCounters || !plan) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't allocate scan of %d points\n",__FUNCTION__,numPoints);
+    free(scalers);
+    free(ppsCounters);
+    free(plan);
+    return -1;
+  }
+  for(index=0;index<THRESHOLD_SCAN_NUM_CHANNELS*numPoints;index++) {
+    scalers[index]=-1;
+    ppsCounters[index]=0;
+  }
+  //Unscanned channels sit at their configured values
+  memcpy(dacValues,theConfig.thresholdValues,sizeof(uint16_t)*THRESHOLDS_PER_ATRI);
+  memcpy(&dacValues[THRESHOLDS_PER_ATRI],theConfig.surfaceThresholdValues,sizeof(uint16_t)*ANTS_PER_TDA);
+
+  sprintf(rawFilename,"%s/current/%sRaw.run%6.6d.dat",theConfig.topDataDir,fileTag,fCurrentRun);
+  fpRaw=fopen(rawFilename,"w");
+  gettimeofday(&startTime,NULL);
+
+  //Coarse pass
+  for(step=0;step<numCoarse;step++) {
+    index=step*stride;
+    if(index>numPoints-1) index=numPoints-1;
+    for(ch=0;ch<THRESHOLD_SCAN_NUM_CHANNELS;ch++)
+      plan[step*THRESHOLD_SCAN_NUM_CHANNELS+ch]=(scanMask&(1<<ch)) ? index : -1;
+  }
+  retVal=runThresholdScanSteps(fAtriSockFd,plan,numCoarse,numPoints,scanMask,dacValues,scalers,ppsCounters,fpRaw);
+
+  //Fine pass, each channel gets the points inside its non flat intervals
+  numFine=0;
+  if(retVal==0 && stride>1) {
+    maxNeeded=0;
+    for(index=0;index<THRESHOLD_SCAN_NUM_CHANNELS*numPoints;index++) plan[index]=-1;
+    for(ch=0;ch<THRESHOLD_SCAN_NUM_CHANNELS;ch++) {
+      if(!(scanMask&(1<<ch))) continue;
+      numNeeded=0;
+      for(first=0;first<numPoints-1;first=last) {
+	last=first+stride;
+	if(last>numPoints-1) last=numPoints-1;
+	if(isFlatScanInterval(scalers[ch*numPoints+first],scalers[ch*numPoints+last])) continue;
+	for(index=first+1;index<last;index++)
+	  plan[(numNeeded++)*THRESHOLD_SCAN_NUM_CHANNELS+ch]=index;
+      }
+      if(numNeeded>maxNeeded) maxNeeded=numNeeded;
+    }
+    numFine=maxNeeded;
+    retVal=runThresholdScanSteps(fAtriSockFd,plan,numFine,numPoints,scanMask,dacValues,scalers,ppsCounters,fpRaw);
+  }
+  if(fpRaw) fclose(fpRaw);
+  gettimeofday(&endTime,NULL);
+  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: %s of %d points took %d coarse and %d fine steps (%ld s)\n",
+		  fileTag,numPoints,numCoarse,numFine,(long)(endTime.tv_sec-startTime.tv_sec));
+
+  //Rebuild every channel's curve on the full grid, in the same format as
+  //the old one point per step scans. The pps column is the latest second
+  //that measured any channel at that value, 0 if all were filled in. The
+  //extra last column is the mask of channels whose scaler at that value
+  //was interpolated rather than measured (unscanned channels included).
+  sprintf(filename,"%s/current/%s.run%6.6d.dat",theConfig.topDataDir,fileTag,fCurrentRun);
   fpThresholdScan=fopen(filename,"w");
-  for(i=0;i<theConfig.thresholdScanPoints;i++) {
-    value=theConfig.thresholdScanStep*i+theConfig.thresholdScanStartPoint;
-    if(value > 0xffff) break; //Stops us looping back through low nums
-    for(j=0;j<THRESHOLDS_PER_ATRI;j++) {
-      if(j==channel) thresholds[j]=value;
-      else thresholds[j]=theConfig.thresholdValues[j];
+  if(!fpThresholdScan) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't open %s\n",__FUNCTION__,filename);
+    retVal=-1;
+  }
+  for(index=0;fpThresholdScan && index<numPoints;index++) {
+    rowPps=0;
+    for(ch=0;ch<THRESHOLD_SCAN_NUM_CHANNELS;ch++)
+      if(ppsCounters[ch*numPoints+index]>rowPps) rowPps=ppsCounters[ch*numPoints+index];
+    fprintf(fpThresholdScan,"%u %d ",rowPps,(int)thresholdScanDacValue(index));
+    interpolatedMask=0;
+    for(ch=0;ch<THRESHOLD_SCAN_NUM_CHANNELS;ch++) {
+      int32_t *chanScalers=&scalers[ch*numPoints];
+      value=chanScalers[index];
+      if(chanScalers[index]<0) {
+	interpolatedMask|=1u<<ch;
+	//Linear between the measured points either side
+	for(lastMeasured=index-1;lastMeasured>=0 && chanScalers[lastMeasured]<0;lastMeasured--);
+	for(nextMeasured=index+1;nextMeasured<numPoints && chanScalers[nextMeasured]<0;nextMeasured++);
+	if(lastMeasured>=0 && nextMeasured<numPoints)
+	  value=chanScalers[lastMeasured]+(chanScalers[nextMeasured]-chanScalers[lastMeasured])*
+	    ((double)(index-lastMeasured))/(nextMeasured-lastMeasured);
+	else if(lastMeasured>=0) value=chanScalers[lastMeasured];
+	else if(nextMeasured<numPoints) value=chanScalers[nextMeasured];
+	else value=0;
+      }
+      fprintf(fpThresholdScan,"%d ",(int)rint(value));
     }
-    setIceThresholds(fAtriSockFd,thresholds);
-    if(theConfig.setSurfaceThreshold)
-      setSurfaceThresholds(fAtriSockFd,thresholds);
-
-    sleep(2);
+    fprintf(fpThresholdScan,"0x%x\n",interpolatedMask);
+  }
+  if(fpThresholdScan) {
+    fclose(fpThresholdScan);
+    if(theConfig.linkForXfer)
+      makeLink(filename,theConfig.linkDir);
+  }
+  if(fpRaw && theConfig.linkForXfer)
+    makeLink(rawFilename,theConfig.linkDir);
+  free(scalers);
+  free(ppsCounters);
+  free(plan);
+  return retVal;
+}
 
-    //Read out PPS counter
-    
-    //PPS counter
-    atriWishboneRead(fAtriSockFd,ATRI_WISH_PPSCNT,4,(uint8_t*)&ppsCounter);
 
-    //Read out scalers -- not sure this formatting works
-    atriWishboneRead(fAtriSockFd,ATRI_WISH_SCAL_L1_START,32,(uint8_t*)l1Scalers);
+int doThresholdScan(int fAtriSockFd)
+{
+  //All channels together, and the surface too if we set its thresholds
+  uint32_t scanMask=(1<<THRESHOLDS_PER_ATRI)-1;
+  if(theConfig.setSurfaceThreshold)
+    scanMask|=((1<<ANTS_PER_TDA)-1)<<THRESHOLDS_PER_ATRI;
+  return doGatedThresholdScan(fAtriSockFd,scanMask,"thresholdScan");
+}
 
-    //Read out surface scalers -- not sure this formatting works
-    atriWishboneRead(fAtriSockFd,ATRI_WISH_SURF_SCAL_L1_START,8,(uint8_t*)l1SurfaceScalers);
 
-    fprintf(fpThresholdScan,"%u %d ",ppsCounter,value);
-    for(j=0;j<THRESHOLDS_PER_ATRI;j++) 
-      fprintf(fpThresholdScan,"%d ",l1Scalers[j]);
-    for(j=0;j<ANTS_PER_TDA;j++) 
-      fprintf(fpThresholdScan,"%d ",l1SurfaceScalers[j]);
-    fprintf(fpThresholdScan,"\n");
+int doThresholdScanSingleChannel(int fAtriSockFd)
+{
+  //The other thresholds stay at their configured values
+  uint32_t channel=theConfig.thresholdScanSingleChannelNum;
+  if(channel>=THRESHOLDS_PER_ATRI) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: no channel %u\n",__FUNCTION__,channel);
+    return -1;
   }
-  fclose(fpThresholdScan);
-  if(theConfig.linkForXfer)
-    makeLink(filename,theConfig.linkDir);
-
-  return 0;
+  return doGatedThresholdScan(fAtriSockFd,1<<channel,"thresholdScanSingleChannel");
 }
 
 
@@ -3452,9 +4841,540 @@ int countTriggers(AraStationEventBlockHeader_t *blkHeader)
   return numTriggers;
 }
 
-int pedIndex(int dda, int block, int chan, int sample)
+static int startPedestalAccumulator(AraPedestalAccumulator_t *pedAcc)
+{
+  int numThreads=theConfig.pedestalNumThreads;
+  if(araPedestalInit(pedAcc,numThreads,MAX_EVENT_BUFFER_SIZE)<0) return -1;
+  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Accumulating pedestals with %d worker threads\n",pedAcc->numThreads);
+  return 0;
+}
+
+
+static int finishPedestalAccumulator(AraPedestalAccumulator_t *pedAcc, FILE *fpPedestals, FILE *fpPedestalsRMS)
+{
+  //Writes the text files and, if wanted, the binary pedestal file
+  AraPedestalSet_t pedSet;
+  char filename[FILENAME_MAX];
+  struct timeval nowTime;
+  int retVal;
+  araPedestalWait(pedAcc);
+  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Pedestals from %u events (%u bad)\n",pedAcc->numEvents,pedAcc->numBadEvents);
+  retVal=araPedestalWriteText(pedAcc,fpPedestals,fpPedestalsRMS);
+  if(theConfig.pedestalWriteBinary) {
+    gettimeofday(&nowTime,NULL);
+    sprintf(filename,"%s/current/pedestals.run%6.6d.ped",theConfig.topDataDir,fCurrentRun);
+    if(araPedestalSetFromAccumulator(&pedSet,pedAcc,fCurrentRun,nowTime.tv_sec)==0) {
+      if(araPedestalSetWriteBinary(&pedSet,filename)<0) retVal=-1;
+      else if(theConfig.linkForXfer) makeLink(filename,theConfig.linkDir);
+      //The pedestal tracker of the following runs measures its drift against
+      //this. Written to a temporary file and renamed, so a run starting now
+      //sees either the old reference or the new one
+      sprintf(filename,"%s/%s",theConfig.pedsReferenceDir,PED_TRACK_REFERENCE_FILE);
+      makeDirectories(theConfig.pedsReferenceDir);
+      if(araPedestalSetWriteBinary(&pedSet,filename)<0) retVal=-1;
+      araPedestalSetFree(&pedSet);
+    }
+    else retVal=-1;
+  }
+  araPedestalFree(pedAcc);
+  return retVal;
+}
+
+
+int loadPedestalReference()
+{
+  //The pedestals of the last pedestal run, for the tracker and the filter,
+  //freed when the run stops
+  char filename[FILENAME_MAX];
+  sprintf(filename,"%s/%s",theConfig.pedsReferenceDir,PED_TRACK_REFERENCE_FILE);
+  if(access(filename,R_OK)==0 && araPedestalSetLoadBinary(&fPedReference,filename,1)==0) {
+    fHavePedReference=1;
+    return 0;
+  }
+  fHavePedReference=0;
+  ARA_LOG_MESSAGE(LOG_WARNING,"ARAAcqd: No reference pedestals in %s\n",theConfig.pedsReferenceDir);
+  return -1;
+}
+
+
+int startPedestalTracker()
+{
+  //Follows the pedestals with the soft (CPU) trigger events of a normal
+  //run, which are forced triggers and so see only the baseline
+  if(araPedestalInitTracker(&fPedTracker,1,MAX_EVENT_BUFFER_SIZE,theConfig.pedestalTrackShift)<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"ARAAcqd: Can't start the pedestal tracker\n");
+    return -1;
+  }
+  fPedTrackerActive=1;
+  fPedTrackSnapshotNum=0;
+  gettimeofday(&fNextPedTrackSnapshot,NULL);
+  fNextPedTrackSnapshot.tv_sec+=(int)theConfig.pedestalTrackSnapshotPeriodS;
+  if(fHavePedReference) {
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Tracking pedestals against those of run %u\n",fPedReference.header.runNumber);
+  }
+  else {
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Tracking pedestals, no reference pedestals to compare with\n");
+  }
+  return 0;
+}
+
+
+static void snapshotPedestalTracker(struct timeval *nowTime)
+{
+  //Writes the tracked pedestals to the pedestal store and their drift
+  //from the reference to the drift file
+  AraPedestalSet_t pedSet;
+  AraPedestalDiff_t pedDiff;
+  char filename[FILENAME_MAX];
+  FILE *fpDrift;
+  int logLevel,newDriftFile;
+  araPedestalWait(&fPedTracker);
+  if(fPedTracker.numEvents==0) return;
+  if(araPedestalSetFromAccumulator(&pedSet,&fPedTracker,fCurrentRun,nowTime->tv_sec)<0) return;
+  sprintf(filename,"%s/pedestalTrack.run%6.6d.%3.3d.ped",theConfig.pedsTopDir,fCurrentRun,fPedTrackSnapshotNum++);
+  if(araPedestalSetWriteBinary(&pedSet,filename)==0 && theConfig.linkForXfer)
+    makeLink(filename,theConfig.linkDir);
+
+  if(fHavePedReference) {
+    araPedestalSetDiff(&pedSet,&fPedReference,theConfig.pedestalTrackDriftWarn,&pedDiff);
+    sprintf(filename,"%s/pedestalDrift.run%6.6d.dat",theConfig.pedsTopDir,fCurrentRun);
+    newDriftFile=access(filename,F_OK)!=0;
+    fpDrift=fopen(filename,"a");
+    if(fpDrift) {
+      if(newDriftFile && theConfig.linkForXfer) makeLink(filename,theConfig.linkDir);
+      fprintf(fpDrift,"%ld %u %u %.3f %.3f %.3f %u\n",(long)nowTime->tv_sec,fPedTracker.numEvents,pedSet.header.minCount,
+	      pedDiff.meanMeanDiff,pedDiff.rmsMeanDiff,pedDiff.maxMeanDiff,pedDiff.numMeanOver);
+      fclose(fpDrift);
+    }
+    logLevel=pedDiff.rmsMeanDiff>theConfig.pedestalTrackDriftWarn ? LOG_WARNING : LOG_INFO;
+    ARA_LOG_MESSAGE(logLevel,"ARAAcqd: Pedestals have drifted by %.2f (rms %.2f, max %.2f at dda %d block %d chan %d) ADC counts since run %u\n",
+		    pedDiff.meanMeanDiff,pedDiff.rmsMeanDiff,pedDiff.maxMeanDiff,
+		    pedDiff.maxDda,pedDiff.maxBlock,pedDiff.maxChan,fPedReference.header.runNumber);
+  }
+  araPedestalSetFree(&pedSet);
+}
+
+
+void trackPedestalEvent(int numBytes)
+{
+  //Only forced triggers, anything that might have a pulse in it would bias
+  //the tracker. The header has no room for the external trigger bit
+  struct timeval nowTime;
+  int dda,numStacks=0;
+  if(!fEventHeader->triggerInfo[triggerL4_CPU] || fEventHeader->triggerInfo[triggerL4_RF0] ||
+     fEventHeader->triggerInfo[triggerL4_RF1] || fEventHeader->triggerInfo[triggerL4_CAL])
+    return;
+  //The header counts one block per DDA per readout
+  for(dda=0;dda<DDA_PER_ATRI;dda++)
+    if(theConfig.stackEnabled[dda]) numStacks++;
+  if(numStacks==0) return;
+  araPedestalAddEvent(&fPedTracker,fEventWriteBuffer,numBytes,fEventHeader->numReadoutBlocks/numStacks,-1,1,theConfig.stackEnabled);
+
+  gettimeofday(&nowTime,NULL);
+  if(timercmp(&nowTime,&fNextPedTrackSnapshot,>)) {
+    snapshotPedestalTracker(&nowTime);
+    fNextPedTrackSnapshot=nowTime;
+    fNextPedTrackSnapshot.tv_sec+=(int)theConfig.pedestalTrackSnapshotPeriodS;
+  }
+}
+
+
+void stopPedestalTracker()
+{
+  struct timeval nowTime;
+  gettimeofday(&nowTime,NULL);
+  snapshotPedestalTracker(&nowTime);
+  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Tracked pedestals with %u soft trigger events (%u bad, %u dropped)\n",
+		  fPedTracker.numEvents,fPedTracker.numBadEvents,fPedTracker.numDropped);
+  araPedestalFree(&fPedTracker);
+  fPedTrackerActive=0;
+}
+
+
+int startFilter()
+{
+  AraFilterConfig_t filterConfig;
+  memset(&filterConfig,0,sizeof(filterConfig));
+  filterConfig.snrThreshold=theConfig.filterSnrThreshold;
+  filterConfig.minHitChannels=theConfig.filterMinHitChannels;
+  filterConfig.minHitStrings=theConfig.filterMinHitStrings;
+  filterConfig.coincidenceWindow=theConfig.filterCoincidenceWindow;
+  filterConfig.calTimeStampMin=theConfig.filterCalTimeStampMin;
+  filterConfig.calTimeStampMax=theConfig.filterCalTimeStampMax;
+  filterConfig.numCwLines=theConfig.filterNumCwLines;
+  memcpy(filterConfig.cwFrequency,theConfig.filterCwFrequency,sizeof(filterConfig.cwFrequency));
+  filterConfig.cwFraction=theConfig.filterCwFraction;
+  filterConfig.cwMinChannels=theConfig.filterCwMinChannels;
+  filterConfig.budgetUs=theConfig.filterBudgetUs;
+  filterConfig.pedestals=fHavePedReference ? &fPedReference : NULL;
+  if(araFilterInit(&fFilter,&filterConfig,theConfig.filterNumThreads,MAX_EVENT_BUFFER_SIZE)<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"ARAAcqd: Can't start the filter, writing every event\n");
+    return -1;
+  }
+  fFilterActive=1;
+  fFilterNumPrescaled=0;
+  fFilterNumDropped=0;
+  fRoiConfig.blocksBefore=theConfig.roiBlocksBefore;
+  fRoiConfig.blocksAfter=theConfig.roiBlocksAfter;
+  fRoiConfig.aroundPeak=theConfig.roiAroundPeak;
+  fRoiNumEvents=0;
+  fRoiBytesIn=0;
+  fRoiBytesOut=0;
+  memset(fFilterManifest,0,sizeof(fFilterManifest));
+  if(fHavePedReference) {
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Filtering with %d threads and the pedestals of run %u\n",
+		    theConfig.filterNumThreads,fPedReference.header.runNumber);
+  }
+  else {
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Filtering with %d threads and no pedestals, subtracting block means\n",
+		    theConfig.filterNumThreads);
+  }
+  return 0;
+}
+
+
+static void writeFilterManifestLine(int stream)
+{
+  char filename[FILENAME_MAX];
+  FILE *fpManifest;
+  FilterManifestFile_t *manifest=&fFilterManifest[stream];
+  int priority,bestPriority=ARA_FILTER_NUM_PRIORITIES;
+  if(!manifest->fileName[0]) return;
+  for(priority=ARA_FILTER_NUM_PRIORITIES-1;priority>=0;priority--)
+    if(manifest->numPriority[priority]) bestPriority=priority;
+  sprintf(filename,"%s/filterManifest.run%6.6d.dat",theConfig.runLogDir,fCurrentRun);
+  fpManifest=fopen(filename,"a");
+  if(!fpManifest) {
+    ARA_LOG_MESSAGE(LOG_ERR,"ARAAcqd: Can't open %s\n",filename);
+    return;
+  }
+  fprintf(fpManifest,"%s %u",manifest->fileName,manifest->numEvents);
+  for(priority=0;priority<ARA_FILTER_NUM_PRIORITIES;priority++)
+    fprintf(fpManifest," %u",manifest->numPriority[priority]);
+  fprintf(fpManifest," %d\n",bestPriority);
+  fclose(fpManifest);
+}
+
+
+static ARAWriterStruct_t *getEventStreamWriter(int stream)
+{
+  return stream==eventStreamMain ? &eventWriter : &eventStreamWriter[stream];
+}
+
+
+int getEventStream(uint8_t *event)
 {
-  return sample+(chan*SAMPLES_PER_BLOCK)+(block*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK)+(dda*BLOCKS_PER_DDA*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK);
+  //Which stream an event is written to, see EventStream_t. The filterFlag
+  //is only there with the filter on, otherwise gHdr.reserved is 0xfefe
+  AraStationEventHeader_t *theHeader=(AraStationEventHeader_t*)event;
+  uint16_t filterFlag=fFilterActive ? theHeader->gHdr.reserved : 0;
+  if(theConfig.eventStreamEnable[eventStreamPed] && (theConfig.pedestalMode || fInPedestalMode))
+    return eventStreamPed;
+  if(theConfig.eventStreamEnable[eventStreamCal] &&
+     (theHeader->triggerInfo[triggerL4_CAL] || (filterFlag&ARA_FILTER_FLAG_CALPULSER)))
+    return eventStreamCal;
+  if(theConfig.eventStreamEnable[eventStreamSoft] && theHeader->triggerInfo[triggerL4_CPU] &&
+     !theHeader->triggerInfo[triggerL4_RF0] && !theHeader->triggerInfo[triggerL4_RF1])
+    return eventStreamSoft;
+  if(theConfig.eventStreamEnable[eventStreamPriority] && (filterFlag&ARA_FILTER_FLAG_FILTERED) &&
+     araFilterPriority(filterFlag)<=theConfig.priorityStreamMaxPriority)
+    return eventStreamPriority;
+  return eventStreamMain;
+}
+
+
+int suppressEventBlocks(uint8_t *event, int numBytes, int stream)
+{
+  //Filtered events worse than roiKeepMaxPriority only keep the blocks round
+  //the trigger and their peaks. The event is left alone, the copy goes in
+  //fRoiBuffer; returns its bytes, or 0 to write the event as it is
+  AtriGenericHeader_t *gHdr=(AtriGenericHeader_t*)event;
+  uint16_t filterFlag=gHdr->reserved;
+  int roiBytes;
+  if(!fFilterActive || !theConfig.roiEnable || stream==eventStreamPed) return 0;
+  if(!(filterFlag&ARA_FILTER_FLAG_FILTERED) || araFilterPriority(filterFlag)<=theConfig.roiKeepMaxPriority) return 0;
+  roiBytes=araRoiSuppress(&fRoiConfig,event,numBytes,fRoiBuffer,MAX_EVENT_BUFFER_SIZE);
+  if(roiBytes<=0) return 0;
+  fillGenericHeader(fRoiBuffer,ARA_EVENT_TYPE,roiBytes);
+  ((AtriGenericHeader_t*)fRoiBuffer)->reserved=filterFlag;
+  fRoiNumEvents++;
+  fRoiBytesIn+=numBytes;
+  fRoiBytesOut+=roiBytes;
+  return roiBytes;
+}
+
+
+int storeEvent(uint8_t *event, int numBytes, int stream)
+{
+  //Writes an event to its stream and keeps the run log up to date as the
+  //main event files roll over
+  AraStationEventHeader_t *theHeader=(AraStationEventHeader_t*)event;
+  int new_file_flag = 0;
+  int roiBytes=suppressEventBlocks(event,numBytes,stream);
+  if(roiBytes>0) {
+    event=fRoiBuffer;
+    numBytes=roiBytes;
+  }
+  int retVal = writeBuffer( getEventStreamWriter(stream), (char*)event, numBytes, &(new_file_flag));
+  if( retVal != numBytes ){
+    ARA_LOG_MESSAGE(LOG_WARNING,"Error writing event %d\n",retVal);
+    numBadEvents++;
+  }
+  else {
+    numGoodEvents++;
+    fEventStreamNumEvents[stream]++;
+  }
+  //jpd runInfo
+  if(new_file_flag != 0 && stream==eventStreamMain){ 
+    recordCloseEventFile( &(runInfo) , theHeader->eventNumber+1 ); 
+    updateRunLogFile( &(runInfo) ); 
+    recordOpenEventFile( &(runInfo) ,  theHeader->eventNumber+1, eventWriter.startTime.tv_sec , eventWriter.startTime.tv_usec ); 
+  } 
+  return new_file_flag;
+}
+
+
+void writeEventSummary(uint8_t *event, int numBytes, int written)
+{
+  //Summaries are written for every event read, in order, whether or not
+  //the event itself was
+  AraEventSummary_t summary;
+  int new_file_flag = 0;
+  araEventSummaryFill(&summary,event,numBytes,fHavePedReference ? &fPedReference : NULL);
+  if(fFilterActive) summary.filterFlag=((AtriGenericHeader_t*)event)->reserved;
+  if(written) summary.flags|=ARA_EVENT_SUMMARY_WRITTEN;
+  fillGenericHeader(&summary,ARA_EVENT_SUMMARY_TYPE,sizeof(AraEventSummary_t));
+  if(writeBuffer(&eventSummaryWriter,(char*)&summary,sizeof(AraEventSummary_t),&new_file_flag)!=sizeof(AraEventSummary_t))
+    ARA_LOG_MESSAGE(LOG_WARNING,"Error writing the summary of event %u\n",summary.eventNumber);
+}
+
+
+void writeFilteredEvents(int wait)
+{
+  //Writes the filtered events that are ready, with wait set blocking until
+  //the oldest one is. Priorities above filterWriteMaxPriority are prescaled,
+  //except bad events which are always written so the problem can be seen
+  uint8_t *event;
+  int numBytes;
+  const AraFilterFeatures_t *features;
+  int priority,stream;
+  while(araFilterNextEvent(&fFilter,wait,&event,&numBytes,&features)) {
+    wait=0;
+    priority=araFilterPriority(features->filterFlag);
+    if(priority>theConfig.filterWriteMaxPriority && priority!=ARA_FILTER_PRIORITY_BAD &&
+       (theConfig.filterLowPriorityPrescale<=0 ||
+	(fFilterNumPrescaled++)%theConfig.filterLowPriorityPrescale!=0)) {
+      //Only the summary of this one is kept
+      if(theConfig.enableEventSummary) writeEventSummary(event,numBytes,0);
+      fFilterNumDropped++;
+      numGoodEvents++; //Read fine, just not written
+      araFilterReleaseEvent(&fFilter);
+      continue;
+    }
+    stream=getEventStream(event);
+    if(storeEvent(event,numBytes,stream)) {
+      writeFilterManifestLine(stream);
+      memset(&fFilterManifest[stream],0,sizeof(FilterManifestFile_t));
+      strncpy(fFilterManifest[stream].fileName,getEventStreamWriter(stream)->currentFileName,FILENAME_MAX-1);
+    }
+    if(theConfig.enableEventSummary) writeEventSummary(event,numBytes,1);
+    fFilterManifest[stream].numEvents++;
+    fFilterManifest[stream].numPriority[priority]++;
+    araFilterReleaseEvent(&fFilter);
+  }
+}
+
+
+void stopFilter()
+{
+  int priority,stream;
+  while(araFilterNumQueued(&fFilter)>0) writeFilteredEvents(1);
+  for(stream=0;stream<NUM_EVENT_STREAMS;stream++) writeFilterManifestLine(stream);
+
+  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Filtered %u events (%u written, %u prescaled away), %u over budget, cpu mean %.1f us max %u us\n",
+		  fFilter.numEvents,fFilter.numEvents-fFilterNumDropped,fFilterNumDropped,fFilter.numOverBudget,
+		  fFilter.numEvents ? fFilter.sumCpuUs/fFilter.numEvents : 0,fFilter.maxCpuUs);
+  for(priority=0;priority<ARA_FILTER_NUM_PRIORITIES;priority++)
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Filter priority %d: %u events\n",priority,fFilter.numPriority[priority]);
+  if(theConfig.roiEnable) {
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Region of interest suppression took %u events from %llu to %llu bytes\n",
+		    fRoiNumEvents,(unsigned long long)fRoiBytesIn,(unsigned long long)fRoiBytesOut);
+  }
+  araFilterFree(&fFilter);
+  fFilterActive=0;
+}
+
+
+void startDq()
+{
+  AraDqConfig_t dqConfig;
+  memset(&dqConfig,0,sizeof(dqConfig));
+  dqConfig.sampleHistPrescale=theConfig.dqSampleHistPrescale;
+  dqConfig.stuckFractionAlarm=theConfig.dqStuckFractionAlarm;
+  dqConfig.deadRangeAlarm=theConfig.dqDeadRangeAlarm;
+  dqConfig.railFractionAlarm=theConfig.dqRailFractionAlarm;
+  dqConfig.errorAlarm=theConfig.dqErrorAlarm>0 ? theConfig.dqErrorAlarm : 0;
+  dqConfig.eventGapAlarm=theConfig.dqEventGapAlarm>0 ? theConfig.dqEventGapAlarm : 0;
+  dqConfig.timeJumpAlarm=theConfig.dqTimeJumpAlarm>0 ? theConfig.dqTimeJumpAlarm : 0;
+  dqConfig.blockSequenceAlarm=theConfig.dqBlockSequenceAlarm>0 ? theConfig.dqBlockSequenceAlarm : 0;
+  if(theConfig.dqPeriodS<1) theConfig.dqPeriodS=1;
+
+  gettimeofday(&fNextDqPublish,NULL);
+  araDqInit(&fDq,&dqConfig,fNextDqPublish.tv_sec);
+  fNextDqPublish.tv_sec+=(int)theConfig.dqPeriodS;
+  makeDirectories(theConfig.dqHkTopDir);
+  initWriter(&dqHkWriter,
+	     fCurrentRun,
+	     theConfig.compressionLevel,
+	     theConfig.filesPerDir,
+	     theConfig.hkPerFile,
+	     DQ_HK_FILE_HEAD,
+	     theConfig.dqHkTopDir,
+	     theConfig.linkForXfer?theConfig.linkDir:NULL);
+  fDqActive=1;
+}
+
+
+void publishDq(struct timeval *nowTime)
+{
+  //Writes out the period's counters and warns about any alarms
+  AraDqHk_t record;
+  uint32_t alarmMask,numErrors=0,numSequence;
+  int new_file_flag = 0;
+  int errorClass,dda;
+  alarmMask=araDqPublish(&fDq,&record,nowTime->tv_sec,nowTime->tv_usec);
+  fillGenericHeader(&record,ARA_DQ_HK_TYPE,sizeof(AraDqHk_t));
+  if(writeBuffer(&dqHkWriter,(char*)&record,sizeof(AraDqHk_t),&new_file_flag)!=sizeof(AraDqHk_t))
+    ARA_LOG_MESSAGE(LOG_WARNING,"Error writing the data quality record\n");
+  fNextDqPublish=*nowTime;
+  fNextDqPublish.tv_sec+=(int)theConfig.dqPeriodS;
+  if(!alarmMask) return;
+
+  numSequence=record.numDdaMismatches;
+  for(dda=0;dda<DDA_PER_ATRI;dda++) numSequence+=record.numBlockSequenceErrors[dda];
+  for(errorClass=0;errorClass<ARA_DQ_NUM_ERROR_CLASSES;errorClass++) {
+    numErrors+=record.numErrors[errorClass];
+    if(record.numErrors[errorClass])
+      ARA_LOG_MESSAGE(LOG_WARNING,"ARAAcqd: DQ %u %s errors\n",record.numErrors[errorClass],araDqErrorAsString(errorClass));
+  }
+  ARA_LOG_MESSAGE(LOG_WARNING,"ARAAcqd: DQ alarm (%s) in %u events: %u errors, %u events missed, %u pps jumps, %u timeStamps backwards, %u blocks out of sequence, channels stuck 0x%08x dead 0x%08x on the rail 0x%08x\n",
+		  araDqAlarmAsString(alarmMask),record.numEvents,numErrors,record.numEventsMissed,
+		  record.numPpsJumps,record.numTimeStampBackwards,numSequence,
+		  record.stuckChannelMask,record.deadChannelMask,record.railChannelMask);
+}
+
+
+void stopDq()
+{
+  struct timeval nowTime;
+  gettimeofday(&nowTime,NULL);
+  publishDq(&nowTime);
+  closeWriter(&dqHkWriter);
+  fDqActive=0;
+}
+
+
+static void initPedestalTriggerPipe(PedestalTriggerPipe_t *pipe, int numWanted, uint8_t pedestalEnable)
+{
+  memset(pipe,0,sizeof(PedestalTriggerPipe_t));
+  pipe->maxInFlight=theConfig.pedestalMaxInFlight;
+  pipe->numWanted=numWanted;
+  pipe->pedestalEnable=pedestalEnable;
+}
+
+
+static long pedestalPipeUsSince(struct timeval *nowTime, struct timeval *thenTime)
+{
+  return (nowTime->tv_sec-thenTime->tv_sec)*1000000L+(nowTime->tv_usec-thenTime->tv_usec);
+}
+
+
+static int readPipelinedPedestalEvent(PedestalTriggerPipe_t *pipe, int fAtriSockFd)
+{
+  //Tops the outstanding triggers up and returns the unpacked size of the
+  //next event in fEventWriteBuffer, 0 once numWanted events have been
+  //read, or -1 on a read error
+  struct timeval nowTime;
+  long sinceTriggerUs;
+  int retVal;
+  while(1) {
+    gettimeofday(&nowTime,NULL);
+    if(pipe->draining && pedestalPipeUsSince(&nowTime,&pipe->drainUntil)>=0)
+      pipe->draining=0;
+    while(!pipe->draining && pipe->numInFlight<pipe->maxInFlight &&
+	  (pipe->numWanted<0 || pipe->numInFlight<pipe->numWanted)) {
+      if(pipe->numInFlight>0) {
+	//The last trigger may still be digitising
+	sinceTriggerUs=pedestalPipeUsSince(&nowTime,&pipe->lastTrigger);
+	if(sinceTriggerUs<theConfig.pedestalTriggerSpacingUs) break;
+      }
+      if(pipe->pedestalEnable)
+	atriWishboneWrite(fAtriSockFd,ATRI_WISH_IRSPEDEN,1,&pipe->pedestalEnable);
+      if(sendSoftwareTrigger(fAtriSockFd)<0) {
+	ARA_LOG_MESSAGE(LOG_ERR,"Error sending pedestal trigger\n");
+	return -1;
+      }
+      gettimeofday(&nowTime,NULL);
+      pipe->lastTrigger=nowTime;
+      if(pipe->numInFlight==0) pipe->lastProgress=nowTime;
+      pipe->numInFlight++;
+      pipe->numSent++;
+    }
+    if(pipe->numInFlight==0 && !pipe->draining) return 0;
+
+    retVal=readAtriEventV2(fEventReadBuffer);
+    if(retVal<0) {
+      ARA_LOG_MESSAGE(LOG_ERR,"Error reading event\n");
+      return -1;
+    }
+    gettimeofday(&nowTime,NULL);
+    if(retVal==0) {
+      if(pipe->numInFlight==0) continue; //Draining
+      //The ATRI doesn't queue triggers that arrive while it is busy, so
+      //give up on the outstanding ones. Anything from them that still
+      //turns up is thrown away before any more are sent, so it can't be
+      //counted in place of a new one (or end up in the next block)
+      if(pedestalPipeUsSince(&nowTime,&pipe->lastProgress)>PED_TRIGGER_TIMEOUT_US) {
+	ARA_LOG_MESSAGE(LOG_WARNING,"%s: no event for %d us, resending %d triggers\n",__FUNCTION__,
+			PED_TRIGGER_TIMEOUT_US,pipe->numInFlight);
+	pipe->numLost+=pipe->numInFlight;
+	pipe->numInFlight=0;
+	pipe->draining=1;
+	pipe->drainUntil=nowTime;
+	pipe->drainUntil.tv_usec+=PED_TRIGGER_DRAIN_US;
+	pipe->drainUntil.tv_sec+=pipe->drainUntil.tv_usec/1000000;
+	pipe->drainUntil.tv_usec%=1000000;
+      }
+      continue;
+    }
+    if(pipe->numInFlight==0) {
+      pipe->numLate++;
+      continue;
+    }
+    pipe->lastProgress=nowTime;
+    pipe->numInFlight--;
+    retVal=unpackAtriEventV2(fEventReadBuffer,fEventWriteBuffer,retVal);
+    if(retVal<0) {
+      ARA_LOG_MESSAGE(LOG_ERR,"Error unpacking event\n");
+      pipe->numBad++;
+      continue;
+    }
+    pipe->numRead++;
+    if(pipe->numWanted>0) pipe->numWanted--;
+    return retVal;
+  }
+}
+
+
+static void logPedestalTriggerPipe(PedestalTriggerPipe_t *pipe, struct timeval *startTime)
+{
+  struct timeval nowTime;
+  double seconds;
+  gettimeofday(&nowTime,NULL);
+  seconds=(nowTime.tv_sec-startTime->tv_sec)+(nowTime.tv_usec-startTime->tv_usec)*1e-6;
+  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Pedestal run read %u events from %u triggers (%u lost, %u late, %u bad) in %.1f s, %.1f Hz with %d in flight\n",
+		  pipe->numRead,pipe->numSent,pipe->numLost,pipe->numLate,pipe->numBad,seconds,
+		  seconds>0 ? pipe->numRead/seconds : 0,pipe->maxInFlight);
 }
 
 
@@ -3471,35 +5391,24 @@ int doPedestalRun(int fAtriSockFd,int fFx2SockFd)
   fpPedestalsRMS=fopen(filenameWidth,"w");
 
 
-  float *pedMean=malloc(sizeof(float)*DDA_PER_ATRI*BLOCKS_PER_DDA*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK);
-  //  fprintf(stderr,"pedMean %ld\n",(long)pedMean);
-  float *pedMeanSq=malloc(sizeof(float)*DDA_PER_ATRI*BLOCKS_PER_DDA*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK);
-  //  fprintf(stderr,"pedMeanSq %ld\n",(long)pedMeanSq);
-  
-  //  float ****pedMean = (float ****) pedMean;
-  //  float ****pedMeanSq = (float ****) pedMeanSq;
+  //The sums are 64 bit integers, accumulated by DDA in worker threads
+  AraPedestalAccumulator_t pedAcc;
+  if(startPedestalAccumulator(&pedAcc)<0) {
+    fclose(fpPedestals);
+    fclose(fpPedestalsRMS);
+    return -1;
+  }
 
 
   int numBytesRead=0;
+  int eventBytes=0;
   uint16_t block=0;
-  int event=0,dda=0,sample=0,chan=0;//,i=0;
+  int event=0;
   uint8_t pedestalMode=1;
 
-
-  //  int sillyDouble=0;
-
-  //Zero the arrays
-  for(dda=0;dda<DDA_PER_ATRI;dda++) {
-    for(block=0;block<BLOCKS_PER_DDA;block++) {
-      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
-	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
-	  pedMean[pedIndex(dda,block,chan,sample)]=0;
-	  pedMeanSq[pedIndex(dda,block,chan,sample)]=0;
-	}
-      }
-    }
-  }
-
+
+  //  int sillyDouble=0;
+
   
   // One of the thing s we have to do is to disable the clocks
   // Register 10: Output buffer power.
@@ -3508,9 +5417,6 @@ int doPedestalRun(int fAtriSockFd,int fFx2SockFd)
   
 
   //  int i=0;
-  int eventByte=0;
-  //  AraStationEventBlockHeader_t *blkHeader;
-  AraStationEventBlockChannel_t *blkChannel;
   struct timeval nowTime;
 
 
@@ -3526,39 +5432,23 @@ int doPedestalRun(int fAtriSockFd,int fFx2SockFd)
   int retVal;//=atriWishboneWrite(fAtriSockFd,ATRI_WISH_IRSPED,2,(uint8_t*)&block);
   //  retVal=atriWishboneWrite(fAtriSockFd,ATRI_WISH_IRSPEDEN,1,&pedestalMode);
   
-  //Will change this at some point
+  //Each block's triggers are pipelined, and every one of its events is
+  //read before the next block is selected so none can land in the wrong one
+  PedestalTriggerPipe_t pipe;
+  struct timeval startTime;
+  gettimeofday(&startTime,NULL);
+  initPedestalTriggerPipe(&pipe,0,0x3);
   for(block=0;block<BLOCKS_PER_DDA;block++) {
   //  for(block=0;block<10;block++) {
     retVal=atriWishboneWrite(fAtriSockFd,ATRI_WISH_IRSPED,2,(uint8_t*)&block); 
-    usleep(50000);
     fprintf(stderr,"Starting pedestals for block %d\n",block);
+    pipe.numWanted=theConfig.pedestalSamples;
     for(event=0;event<theConfig.pedestalSamples;event++) {
               
-      pedestalMode=0x3;
-      retVal=atriWishboneWrite(fAtriSockFd,ATRI_WISH_IRSPEDEN,1,&pedestalMode);
-      usleep(5000);
-
       //sendSoftwareTriggerWithInfo(fAtriSockFd, softTrigger_PED);
-      sendSoftwareTrigger(fAtriSockFd);
-
-      //      for(sillyDouble=0;sillyDouble<2;sillyDouble++) {
-      retVal=0;
-      do {
-	retVal=readAtriEventV2(fEventReadBuffer);	
-	if(retVal<0) {
-	  ARA_LOG_MESSAGE(LOG_ERR,"Error reading event\n");
-	  break;
-	}
-	else if(retVal>0) {
-	  retVal=unpackAtriEventV2(fEventReadBuffer, fEventWriteBuffer,retVal);	
-	  if(retVal<0) {
-	    ARA_LOG_MESSAGE(LOG_ERR,"Error unpacking event\n");
-	    break;
-	  }
-	}
-	
-      } while(retVal<1);
-      eventByte=sizeof(AraStationEventHeader_t);
+      retVal=readPipelinedPedestalEvent(&pipe,fAtriSockFd);
+      if(retVal<1) break;
+      eventBytes=retVal;
 
       //RJN no idea what this bit of code was for
       /* fprintf(stderr,"Press a key to continue\n"); */
@@ -3584,35 +5474,15 @@ int doPedestalRun(int fAtriSockFd,int fFx2SockFd)
 	
 	// Store event
 	int new_file_flag = 0;
-	retVal = writeBuffer( &eventWriter, (char*)fEventWriteBuffer, numBytesRead , &(new_file_flag) );
+	retVal = writeBuffer( getEventStreamWriter(getEventStream(fEventWriteBuffer)), (char*)fEventWriteBuffer, numBytesRead , &(new_file_flag) );
 	if( retVal != numBytesRead )
 	  syslog(LOG_WARNING,"Failed to write event\n");
       }
 
       
-      //Now do the pedestal calculation
-      for(dda=0;dda<DDA_PER_ATRI;dda++) {
-	
-	//	blkHeader=(AraStationEventBlockHeader_t*)&fEventWriteBuffer[eventByte];
-	eventByte+=sizeof(AraStationEventBlockHeader_t);
-	//	fprintf(stderr,"%#x ",blkHeader->irsBlockNumber);
-	
-	
-	for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
-	  blkChannel=(AraStationEventBlockChannel_t*)&fEventWriteBuffer[eventByte];
-	  //	  fprintf(stderr,"dda %d chan %d startByte %d\n",dda,chan,eventByte);
-	  eventByte+=sizeof(AraStationEventBlockChannel_t);
-	  for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {	
-	    //	    if(sample<2) {
-	    //	      fprintf(stderr,"dda %d chan %d sample %d value %d\n",dda,chan,sample,blkChannel->samples[sample]);
-	    //	    }
-
-	    pedMean[pedIndex(dda,block,chan,sample)]+=(blkChannel->samples[sample]);
-	    pedMeanSq[pedIndex(dda,block,chan,sample)]+=(blkChannel->samples[sample]*blkChannel->samples[sample]);
-	    
-	  }
-	}
-      }
+      //Now do the pedestal calculation, every DDA has the one block we asked for
+      if(eventBytes>0)
+	araPedestalAddEvent(&pedAcc,fEventWriteBuffer,eventBytes,1,block,0,NULL);
       //      fprintf(stderr,"\n");
       
       
@@ -3621,11 +5491,14 @@ int doPedestalRun(int fAtriSockFd,int fFx2SockFd)
 
 
     }
+    //Only after a read error, whatever is left isn't wanted in the next block
+    pipe.numLost+=pipe.numInFlight;
+    pipe.numInFlight=0;
     pedestalMode=0x0;
     retVal=atriWishboneWrite(fAtriSockFd,ATRI_WISH_IRSPEDEN,1,&pedestalMode);
-    usleep(50000);
 
   }
+  logPedestalTriggerPipe(&pipe,&startTime);
 
 
 
@@ -3656,33 +5529,7 @@ int doPedestalRun(int fAtriSockFd,int fFx2SockFd)
     
   
   ///Now print out some stuff
-
-  int mean;
-  int rms;
-  for(dda=0;dda<DDA_PER_ATRI;dda++) {
-    for(block=0;block<BLOCKS_PER_DDA;block++) {
-      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
-	fprintf(fpPedestals,"%d %d %d",dda,block,chan);
-	fprintf(fpPedestalsRMS,"%d %d %d",dda,block,chan);
-	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
-	  pedMean[pedIndex(dda,block,chan,sample)]/=theConfig.pedestalSamples;
-	  pedMeanSq[pedIndex(dda,block,chan,sample)]/=theConfig.pedestalSamples;
-	  
-	  mean=rint(pedMean[pedIndex(dda,block,chan,sample)]);
-	  rms=rint(sqrt(pedMeanSq[pedIndex(dda,block,chan,sample)]-pedMean[pedIndex(dda,block,chan,sample)]*pedMean[pedIndex(dda,block,chan,sample)]));
-	  if(rms<0) rms=0;
-	  //	  if(block<1 && sample<5 && chan<1) {
-	  //	    fprintf(stderr,"Chan(%d %d %d %d -- %d) -- Mean %d, RMS %d\n",dda,block,chan,sample,pedIndex(dda,block,chan,sample),mean,rms);
-	  //	  }
-	  fprintf(fpPedestals," %d",mean);
-	  fprintf(fpPedestalsRMS," %d",rms);
-	}
-	fprintf(fpPedestals,"\n");
-	fprintf(fpPedestalsRMS,"\n");
-      }
-    }
-  }
-
+  finishPedestalAccumulator(&pedAcc,fpPedestals,fpPedestalsRMS);
 
   fclose(fpPedestals);
   fclose(fpPedestalsRMS);
@@ -3691,9 +5538,6 @@ int doPedestalRun(int fAtriSockFd,int fFx2SockFd)
     makeLink(filenameWidth,theConfig.linkDir);
   }
 
-
-  free(pedMeanSq);
-  free(pedMean);
   
   // Register 10: Output buffer power.
   writeToI2CRegister(fFx2SockFd,0xd0,0x0A,0x0);
@@ -3702,71 +5546,6 @@ int doPedestalRun(int fAtriSockFd,int fFx2SockFd)
 }
 
 
-int updateWilkinsonVdly(int fAtriSockFd,AraEventHk_t *eventPtr)
-{
-  if(!theConfig.enableVdlyServo) return 0;
-
-  // Cleaned up a bit. The Wilkinson goal is now in nanoseconds.
-  // wilkinsonToNanoseconds() converts it. 
-
-  //MHz equals  4096*wilkinsonCounter./(69636*10*1e-9)
-  //wilkinsonCounter = 5.9Mhz
-  //50 Mhz is 0.6V
-  //dacCounts 2.5V /65535
-  //50MHz is 15728 dac counts
-  //5Mhz is 1573 dacCounts
-  
-  //For now we will just do a sleazy adjust
-  static uint32_t lastPPSUpdate=0;
-  //  int retVal;
-  //  uint8_t enableWilkinsonMonitor=0x0F;;
-  static int lastVals[DDA_PER_ATRI]={0};
-  static int stuckCount[DDA_PER_ATRI]={0};
-
-
-
-  if(eventPtr->ppsCounter<lastPPSUpdate+4)
-    return 0;
-  lastPPSUpdate=eventPtr->ppsCounter;
-  int tempNum=0;
-  int stack=0;
-  for(stack=D1;stack<=D4;stack++) {    
-    unsigned int wilkCounterNs = 
-      atriConvertWilkCounterToNs(eventPtr->wilkinsonCounter[stack]);
-    int diff = (wilkCounterNs - theConfig.wilkinsonGoal);
-    // Wilkinson counter's resolution is a little more than 1 ns, and
-    // its standard deviation is about +/-2 counts so we'll guardband 
-    // by about 10 ns.
-    if((diff > 10) || (diff < -10)) {
-      tempNum=wilkCounterNs;
-      if(tempNum>0)  {
-	// We're comparing ns here: so if it's too *low*, the value needs to
-	// go *down*. If it's too high, the value needs to go *up*.
-	// Rough guess is about 32767 DAC counts for 6830 ns. So that's
-	// 5 DAC counts per ns.
-	currentVdly[stack]+=5*(tempNum-theConfig.wilkinsonGoal);
-	setIRSVdlyDACValue(fAtriSockFd,stack,currentVdly[stack]);
-	ARA_LOG_MESSAGE(LOG_DEBUG,"Setting dda %d vdly to %d\n",stack,currentVdly[stack]);      
-	// The stuck detection stuff isn't needed anymore: the counter is
-	// free running.
-	if(lastVals[stack]==eventPtr->wilkinsonCounter[stack]) {
-	  stuckCount[stack]++;
-	}
-	lastVals[stack]=eventPtr->wilkinsonCounter[stack];
-      }
-    }
-    else {
-      stuckCount[stack]=0;
-      lastVals[stack]=eventPtr->wilkinsonCounter[stack];
-    }
-  }
-  
-  return 1;
-}
-
-
-
-
 int doPedestalRunNotPedestalMode(int fAtriSockFd,int fFx2SockFd)
 {
   //  This  is a pedestal run will loop over all the blocks reading out pedestals
@@ -3780,37 +5559,23 @@ int doPedestalRunNotPedestalMode(int fAtriSockFd,int fFx2SockFd)
   fpPedestalsRMS=fopen(filenameWidth,"w");
 
 
-  float *pedMean=malloc(sizeof(float)*DDA_PER_ATRI*BLOCKS_PER_DDA*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK);
-  //  fprintf(stderr,"pedMean %ld\n",(long)pedMean);
-  float *pedMeanSq=malloc(sizeof(float)*DDA_PER_ATRI*BLOCKS_PER_DDA*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK);
-  //  fprintf(stderr,"pedMeanSq %ld\n",(long)pedMeanSq);
-  uint16_t *pedCount=malloc(sizeof(uint16_t)*DDA_PER_ATRI*BLOCKS_PER_DDA*RFCHAN_PER_DDA*SAMPLES_PER_BLOCK);
-  
-  //  float ****pedMean = (float ****) pedMean;
-  //  float ****pedMeanSq = (float ****) pedMeanSq;
+  //The sums are 64 bit integers, accumulated by DDA in worker threads
+  AraPedestalAccumulator_t pedAcc;
+  if(startPedestalAccumulator(&pedAcc)<0) {
+    fclose(fpPedestals);
+    fclose(fpPedestalsRMS);
+    return -1;
+  }
 
 
   int numBytesRead=0;
+  int eventBytes=0;
   uint16_t block=0;
-  int realDda;
-  int dda=0,sample=0,chan=0;//,i=0;
+  int dda=0,chan=0;
 
 
   //  int sillyDouble=0;
 
-  //Zero the arrays
-  for(dda=0;dda<DDA_PER_ATRI;dda++) {
-    for(block=0;block<BLOCKS_PER_DDA;block++) {
-      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
-	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
-	  pedMean[pedIndex(dda,block,chan,sample)]=0;
-	  pedMeanSq[pedIndex(dda,block,chan,sample)]=0;
-	  pedCount[pedIndex(dda,block,chan,sample)]=0;
-	}
-      }
-    }
-  }
-
   
   // One of the thing s we have to do is to disable the clocks
   // Register 10: Output buffer power.
@@ -3819,9 +5584,6 @@ int doPedestalRunNotPedestalMode(int fAtriSockFd,int fFx2SockFd)
   
 
   //  int i=0;
-  int eventByte=0;
-  AraStationEventBlockHeader_t *blkHeader;
-  AraStationEventBlockChannel_t *blkChannel;
   struct timeval nowTime;
 
 
@@ -3830,52 +5592,27 @@ int doPedestalRunNotPedestalMode(int fAtriSockFd,int fFx2SockFd)
   }
   
 
-  int retVal,blockReadout;
-  int gotBlock[512]={0};
-  int count=0;
-  int sentTrigger=0;
+  int retVal;
   int loopNum=0;
   int notDone=1;
-  while(notDone && loopNum<2*512*theConfig.pedestalSamples) {   
-    if(loopNum%100==0) {
-      fprintf(stderr,"Loop number %d\n",loopNum);
-      dda=0;
-      chan=0;
-      sample=0;
-      for(block=0;block<BLOCKS_PER_DDA;block++) {
-	fprintf(stderr,"%d ",pedCount[pedIndex(dda,block,chan,sample)]);
-	
-      }
-      fprintf(stderr,"\n");
+  //Triggers are pipelined until every block has enough events, then the
+  //ones still in flight are read and accumulated too
+  PedestalTriggerPipe_t pipe;
+  struct timeval startTime;
+  gettimeofday(&startTime,NULL);
+  initPedestalTriggerPipe(&pipe,-1,0);
+  while(1) {   
+
+    //retVal = sendSoftwareTriggerWithInfo(fAtriSockFd, softTrigger_PED);
+    retVal=readPipelinedPedestalEvent(&pipe,fAtriSockFd);
+    if(retVal<0) {
+      araPedestalFree(&pedAcc);
+      fclose(fpPedestals);
+      fclose(fpPedestalsRMS);
+      return -1;
     }
-
-
-    retVal=0;
-    sentTrigger=0;
-    count=0;
-    do {
-      retVal=readAtriEventV2(fEventReadBuffer);	
-      if(retVal<0) {
-	  ARA_LOG_MESSAGE(LOG_ERR,"Error reading event\n");
-	  //	  break;
-	  return -1;
-      }
-      if(retVal>0) {
-	retVal=unpackAtriEventV2(fEventReadBuffer, fEventWriteBuffer,retVal);
-	if(retVal<0){
-	  ARA_LOG_MESSAGE(LOG_ERR,"Error unpacking event\n");
-	  break;
-	}
-      }
-      count++;
-      if(count>10 || sentTrigger==0) {
-	//retVal = sendSoftwareTriggerWithInfo(fAtriSockFd, softTrigger_PED);
-	retVal = sendSoftwareTrigger(fAtriSockFd);
-
-	sentTrigger=1;
-      }
-    } while(retVal<1);
-    eventByte=sizeof(AraStationEventHeader_t);
+    if(retVal==0) break;
+    eventBytes=retVal;
     
     if(theConfig.pedestalDebugMode) {
       numBytesRead=retVal;
@@ -3890,117 +5627,53 @@ int doPedestalRunNotPedestalMode(int fAtriSockFd,int fFx2SockFd)
       fillGenericHeader(fEventHeader,ARA_EVENT_TYPE,numBytesRead);  
       // Store event
       int new_file_flag = 0;
-      retVal = writeBuffer( &eventWriter, (char*)fEventWriteBuffer, numBytesRead , &(new_file_flag) );
+      retVal = writeBuffer( getEventStreamWriter(getEventStream(fEventWriteBuffer)), (char*)fEventWriteBuffer, numBytesRead , &(new_file_flag) );
       if( retVal != numBytesRead )
 	syslog(LOG_WARNING,"Failed to write event\n");
     }
     
     
-    //Now do the pedestal calculation
-    for(blockReadout=0;blockReadout<theConfig.pedestalNumTriggerBlocks;blockReadout++) {
-      for(dda=0;dda<DDA_PER_ATRI;dda++) {
-	if (theConfig.stackEnabled[dda]) {		
-	  blkHeader=(AraStationEventBlockHeader_t*)&fEventWriteBuffer[eventByte];
-	  eventByte+=sizeof(AraStationEventBlockHeader_t);
-	  //	  fprintf(stderr,"block number %#x\n",(blkHeader->irsBlockNumber)&0x1ff);
-	  //	  fprintf(stderr, "%s : block number %i\n", __FUNCTION__, (blkHeader->irsBlockNumber)&0x1ff);
-	  block=(blkHeader->irsBlockNumber)&0x1ff;
-	  if(blockReadout>0) gotBlock[block]++;
-	  realDda= (blkHeader->channelMask&0x300)>>8;
-	  if(realDda!=dda  ) {
-	    ARA_LOG_MESSAGE(LOG_ERR,"Didn't get the right dda: %d %d\n",dda,realDda);
+    //Now do the pedestal calculation, the first block of each readout is
+    //the one the trigger landed in so it is skipped
+    araPedestalAddEvent(&pedAcc,fEventWriteBuffer,eventBytes,theConfig.pedestalNumTriggerBlocks,-1,1,theConfig.stackEnabled);
+    loopNum++;
+    if(loopNum>=2*512*theConfig.pedestalSamples) pipe.numWanted=0;
+
+    //Only look at the counts once the workers have caught up, which
+    //overshoots by at most a queue's worth of events
+    if(loopNum%ARA_PED_QUEUE_DEPTH || !notDone) continue;
+    araPedestalWait(&pedAcc);
+    if(loopNum%(8*ARA_PED_QUEUE_DEPTH)==0) {
+      fprintf(stderr,"Loop number %d\n",loopNum);
+      for(block=0;block<BLOCKS_PER_DDA;block++)
+	fprintf(stderr,"%d ",araPedestalGetCount(&pedAcc,0,block,0));
+      fprintf(stderr,"\n");
+    }
+    notDone=0;
+    for(dda=0;dda<DDA_PER_ATRI && !notDone;dda++) {
+      if(!theConfig.stackEnabled[dda]) continue;
+      for(block=0;block<BLOCKS_PER_DDA && !notDone;block++) {
+	for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+	  if(araPedestalGetCount(&pedAcc,dda,block,chan)<theConfig.pedestalSamples) {
+	    notDone=1;
 	    break;
 	  }
-	  else {
-	    for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
-	      blkChannel=(AraStationEventBlockChannel_t*)&fEventWriteBuffer[eventByte];
-	      //	      fprintf(stderr,"dda %d chan %d startByte %d",dda,chan,eventByte);
-	      eventByte+=sizeof(AraStationEventBlockChannel_t);
-	      //	      float block_mean=0;
-	      if(blockReadout>0){
-		for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {	
-		  //		block_mean+=(blkChannel->samples[sample])/SAMPLES_PER_BLOCK;
-		  pedMean[pedIndex(dda,block,chan,sample)]+=(blkChannel->samples[sample]);
-		  pedMeanSq[pedIndex(dda,block,chan,sample)]+=(blkChannel->samples[sample]*blkChannel->samples[sample]);
-		  pedCount[pedIndex(dda,block,chan,sample)]++;
-		}
-		//	      fprintf(stderr," block_mean %f\n", block_mean);
-	      }//blockReadout>0
-	    }
-	  }       
-	  }
-	}	 
-      }
-      notDone=0;
-      for(dda=0;dda<DDA_PER_ATRI;dda++) {
-	if (theConfig.stackEnabled[dda]) {	      
-	  if(notDone) break;
-	  for(block=0;block<BLOCKS_PER_DDA;block++) {
-	    if(notDone) break;
-	    for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
-	      if(notDone) break;
-	      sample=0;
-	      if(pedCount[pedIndex(dda,block,chan,sample)]<theConfig.pedestalSamples) {
-		notDone=1;
-		break;
-	      }	    
-	    }
-	  }
-	}
-	
-      } 
-      loopNum++;
-  }//while (notDone)
-  
-  ///Now print out some stuff
-  int mean;
-  int rms;
-  for(dda=0;dda<DDA_PER_ATRI;dda++) {
-    for(block=0;block<BLOCKS_PER_DDA;block++) {
-      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
-	fprintf(fpPedestals,"%d %d %d",dda,block,chan);
-	fprintf(fpPedestalsRMS,"%d %d %d",dda,block,chan);
-	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++) {
-	  if(pedCount[pedIndex(dda,block,chan,sample)]) {
-	    /* if(block==0 && chan==0 && sample<2) { */
-	    /*   fprintf(stderr,"%d %d %d %d %f %f %d %d\n",dda,block,chan,sample, */
-	    /* 	      pedMean[pedIndex(dda,block,chan,sample)], */
-	    /* 	      pedMeanSq[pedIndex(dda,block,chan,sample)], */
-	    /* 	      pedCount[pedIndex(dda,block,chan,sample)], */
-	    /* 	      pedIndex(dda,block,chan,sample)); */
-	    /* } */
-	    
-	    
-	    pedMean[pedIndex(dda,block,chan,sample)]/=pedCount[pedIndex(dda,block,chan,sample)];
-	    pedMeanSq[pedIndex(dda,block,chan,sample)]/=pedCount[pedIndex(dda,block,chan,sample)];
-	  
-	    mean=rint(pedMean[pedIndex(dda,block,chan,sample)]);
-	    rms=rint(sqrt(pedMeanSq[pedIndex(dda,block,chan,sample)]-pedMean[pedIndex(dda,block,chan,sample)]*pedMean[pedIndex(dda,block,chan,sample)]));
-	  }
-	  else {
-	    mean=2000;
-	    rms=0;
-	  }
-	  if(rms<0) rms=0;
-	  fprintf(fpPedestals," %d",mean);
-	  fprintf(fpPedestalsRMS," %d",rms);
 	}
-	fprintf(fpPedestals,"\n");
-	fprintf(fpPedestalsRMS,"\n");
       }
     }
-  }
-
+    if(!notDone) pipe.numWanted=0;
+  }//while (events to read)
+  logPedestalTriggerPipe(&pipe,&startTime);
+  
+  ///Now print out some stuff
+  finishPedestalAccumulator(&pedAcc,fpPedestals,fpPedestalsRMS);
 
   fclose(fpPedestals);
   fclose(fpPedestalsRMS);
   if(theConfig.linkForXfer) {
     makeLink(filename,theConfig.linkDir);
-    makeLink(filename,theConfig.linkDir);
+    makeLink(filenameWidth,theConfig.linkDir);
   }
-
-  free(pedMeanSq);
-  free(pedMean);
   
   // Register 10: Output buffer power.
   writeToI2CRegister(fFx2SockFd,0xd0,0x0A,0x0);
@@ -4009,178 +5682,93 @@ int doPedestalRunNotPedestalMode(int fAtriSockFd,int fFx2SockFd)
 }
 
 
-int updateThresholdsUsingPID(int fAtriSockFd,AraEventHk_t *eventHkPtr)
+static int antServoActuator(AraServo_t *servo, void *context, const uint16_t *outputs)
 {
-  static int lastPpsNumber=0;
-  static DacPidStruct_t thePids[NUM_L1_SCALERS];
-  static int firstTime=1;
-  uint16_t nextThresholds[NUM_L1_SCALERS];
-  int error,value,change,proposed;
-  float pTerm, dTerm, iTerm;
-  int chanGoal;
-
-  //Only update if thresholds have had effect
-  if(lastPpsNumber>0 && (lastPpsNumber+2)>eventHkPtr->ppsCounter)
-    return 0;
-  
-  /* for(tda=0;tda<TDA_PER_ATRI;tda++) { */
-  /*   for(ant=0;ant<ANTS_PER_TDA;ant++) { */
-  uint8_t l1num=0;
-  for(l1num=0;l1num<16;l1num++){//FIXME
-
-      if(firstTime) {
-	thePids[l1num].iState=0;
-	thePids[l1num].dState=0;
-      }
-
-      chanGoal=theConfig.scalerGoalValues[l1num];
-      value=eventHkPtr->l1Scaler[l1num];
-      error=chanGoal-value;
-                 
-      // Proportional term
-      pTerm = theConfig.scalerPGain * error;
-      
-      // Calculate integral with limiting factors
-      thePids[l1num].iState+=error;
-
-      if (thePids[l1num].iState > theConfig.scalerIMax) 
-	thePids[l1num].iState = theConfig.scalerIMax;
-      else if (thePids[l1num].iState < theConfig.scalerIMin) 
-	thePids[l1num].iState = theConfig.scalerIMin;
-      
-      // Integral and Derivative Terms
-      iTerm = theConfig.scalerIGain * (float)(thePids[l1num].iState);  	
-      if(!firstTime) {
-	dTerm = theConfig.scalerDGain * (float)(value -thePids[l1num].dState);
-      }
-      else {
-	dTerm=0;
-      }
-      thePids[l1num].dState = value;
-      
-      //Put them together		   
-      change = (int) (pTerm + iTerm - dTerm);
-      proposed=currentThresholds[l1num]+change;
-
-      if(proposed<0) proposed=0;
-
-      if(proposed<65535) 
-	nextThresholds[l1num]=proposed;
-      else 
-	nextThresholds[l1num]=65535;
-
-      
-      if(l1num==0) {
-	ARA_LOG_MESSAGE(LOG_DEBUG,"PID PPS %d\n",eventHkPtr->ppsCounter);
-	ARA_LOG_MESSAGE(LOG_DEBUG,"Status %d %d %d\n",value,chanGoal,error);
-	ARA_LOG_MESSAGE(LOG_DEBUG,"PID %f %f %f\n",pTerm,iTerm,-1*dTerm);
-	ARA_LOG_MESSAGE(LOG_DEBUG,"Outcome %d %d %d\n",currentThresholds[l1num],nextThresholds[l1num],change);
-      }
-
-      //		printf("%d %d\n",thePids[l1num].dState,
-      //		       thePids[l1num].iState);
-      //		printf("%d %d %f %f %f\n",change,
-      //		       thresholdArray[tdaIndex[tda]-1][ant],
-	  //		       pTerm,iTerm,dTerm);
-  
-
-    //    }
-
-
-  }
+  uint16_t nextThresholds[THRESHOLDS_PER_ATRI];
+  memcpy(nextThresholds,outputs,sizeof(nextThresholds));
+  return setIceThresholds(*(int*)context,nextThresholds)<0 ? -1 : 0;
+}
 
+static int surfaceServoActuator(AraServo_t *servo, void *context, const uint16_t *outputs)
+{
+  uint16_t nextThresholds[ANTS_PER_TDA];
+  memcpy(nextThresholds,outputs,sizeof(nextThresholds));
+  return setSurfaceThresholds(*(int*)context,nextThresholds)<0 ? -1 : 0;
+}
 
-  lastPpsNumber=eventHkPtr->ppsCounter;
-  
-  if(firstTime) {
-    firstTime=0;
-    return 0;
+static int vdlyServoActuator(AraServo_t *servo, void *context, const uint16_t *outputs)
+{
+  int stack,retVal=0;
+  for(stack=D1;stack<=D4;stack++) {
+    if(outputs[stack]==currentVdly[stack]) continue;
+    currentVdly[stack]=outputs[stack];
+    if(setIRSVdlyDACValue(*(int*)context,stack,currentVdly[stack])<0) retVal=-1;
+    ARA_LOG_MESSAGE(LOG_DEBUG,"Setting dda %d vdly to %d\n",stack,currentVdly[stack]);
   }
-  setIceThresholds(fAtriSockFd,(uint16_t*)&nextThresholds[0]);
-
-  return 1;
+  return retVal;
 }
 
-
-int updateSurfaceThresholdsUsingPID(int fAtriSockFd,AraEventHk_t *eventHkPtr)
+static int rateServoActuator(AraServo_t *servo, void *context, const uint16_t *outputs)
 {
-  static int lastPpsNumber=0;
-  static DacPidStruct_t thePids[ANTS_PER_TDA];
-  static int firstTime=1;
-  uint16_t nextThresholds[ANTS_PER_TDA];
-  int ant,error,value,change,proposed;
-  float pTerm, dTerm, iTerm;
-  int chanGoal;
-
-  //Only update if thresholds have had effect
-  if(lastPpsNumber>0 && (lastPpsNumber+2)>eventHkPtr->ppsCounter)
-    return 0;
-  
-  for(ant=0;ant<ANTS_PER_TDA;ant++) {
-    if(firstTime) {
-      thePids[ant].iState=0;
-      thePids[ant].dState=0;
-    }
-    
-    chanGoal=theConfig.surfaceGoalValues[ant];
-    value=eventHkPtr->l1ScalerSurface[ant]; 
-    error=chanGoal-value;
-    
-    // Proportional term
-    pTerm = theConfig.scalerPGain * error;
-    
-    // Calculate integral with limiting factors
-    thePids[ant].iState+=error;
-    
-    if (thePids[ant].iState > theConfig.scalerIMax) 
-	thePids[ant].iState = theConfig.scalerIMax;
-      else if (thePids[ant].iState < theConfig.scalerIMin) 
-	thePids[ant].iState = theConfig.scalerIMin;
-      
-      // Integral and Derivative Terms
-      iTerm = theConfig.scalerIGain * (float)(thePids[ant].iState);  	
-      if(!firstTime) {
-	dTerm = theConfig.scalerDGain * (float)(value -thePids[ant].dState);
-      }
-      else {
-	dTerm=0;
-      }
-      thePids[ant].dState = value;
-      
-      //Put them together		   
-      change = (int) (pTerm + iTerm - dTerm);
-      proposed=currentSurfaceThresholds[ant]+change;
-      if(proposed<65535) 
-	nextThresholds[ant]=proposed;
-      else 
-	nextThresholds[ant]=65535;
+  fScalerGoalScale=outputs[0];
+  araServoScaleGoals(&fAntServo,theConfig.scalerGoalValues,fScalerGoalScale);
+  ARA_LOG_MESSAGE(LOG_DEBUG,"Rate servo -- L4 rate %.2f Hz, scaler goals now %.3f of the configured values\n",
+		  servo->measured[0],((float)fScalerGoalScale)/ARA_SERVO_RATE_SCALE_UNIT);
+  return 0;
+}
 
-      
-      if(ant==0) {
-	ARA_LOG_MESSAGE(LOG_DEBUG,"PID PPS %d\n",eventHkPtr->ppsCounter);
-	ARA_LOG_MESSAGE(LOG_DEBUG,"Status %d %d %d\n",value,chanGoal,error);
-	ARA_LOG_MESSAGE(LOG_DEBUG,"PID %f %f %f\n",pTerm,iTerm,-1*dTerm);
-	ARA_LOG_MESSAGE(LOG_DEBUG,"Outcome %d %d %d\n",currentSurfaceThresholds[ant],nextThresholds[ant],change);
-      }
 
-      //		printf("%d %d\n",thePids[ant].dState,
-      //		       thePids[ant].iState);
-      //		printf("%d %d %f %f %f\n",change,
-      //		       thresholdArray[tdaIndex-1][ant],
-	  //		       pTerm,iTerm,dTerm);
-  }
-   
+void initServos()
+{
+  //Called when the run is prepared, so every run starts with fresh
+  //integrators and picks up any new goals or gains
+  AraServoGains_t gains;
+  gains.pGain=theConfig.vdlyPGain;
+  gains.iGain=theConfig.vdlyIGain;
+  gains.dGain=theConfig.vdlyDGain;
+  gains.iMax=theConfig.vdlyIMax;
+  gains.iMin=theConfig.vdlyIMin;
+  araServoInitVdly(&fVdlyServo,theConfig.wilkinsonGoal,theConfig.stackEnabled,
+		   theConfig.vdlyUsePid ? &gains : NULL,vdlyServoActuator,currentVdly);
+  fVdlyServo.maxStep=theConfig.vdlyMaxStep;
+
+  gains.pGain=theConfig.scalerPGain;
+  gains.iGain=theConfig.scalerIGain;
+  gains.dGain=theConfig.scalerDGain;
+  gains.iMax=theConfig.scalerIMax;
+  gains.iMin=theConfig.scalerIMin;
+  araServoInitAnt(&fAntServo,theConfig.scalerGoalValues,&gains,theConfig.scalerGainScale,
+		  antServoActuator,currentThresholds);
+  fAntServo.maxStep=theConfig.scalerMaxStep;
+  araServoInitSurface(&fSurfaceServo,theConfig.surfaceGoalValues,&gains,
+		      surfaceServoActuator,currentSurfaceThresholds);
+  fSurfaceServo.maxStep=theConfig.scalerMaxStep;
+
+  gains.pGain=theConfig.ratePGain;
+  gains.iGain=theConfig.rateIGain;
+  gains.dGain=theConfig.rateDGain;
+  gains.iMax=theConfig.rateIMax;
+  gains.iMin=theConfig.rateIMin;
+  fScalerGoalScale=ARA_SERVO_RATE_SCALE_UNIT;
+  araServoInitRate(&fRateServo,theConfig.rateGoalHz,&gains,theConfig.rateGoalScaleMin,theConfig.rateGoalScaleMax,
+		   rateServoActuator,&fScalerGoalScale);
+  fRateServo.maxStep=(int)(theConfig.rateGoalScaleStep*ARA_SERVO_RATE_SCALE_UNIT);
+  memset(&fRateInput,0,sizeof(AraServoRateInput_t));
+  if(theConfig.enableRateServo && !theConfig.enableAntServo)
+    ARA_LOG_MESSAGE(LOG_WARNING,"enableRateServo has no effect without enableAntServo\n");
+}
 
 
-  lastPpsNumber=eventHkPtr->ppsCounter;
-  
-  if(firstTime) {
-    firstTime=0;
-    return 0;
+void logServoStats()
+{
+  if(theConfig.enableVdlyServo) araServoLogStats(&fVdlyServo);
+  if(theConfig.enableAntServo) araServoLogStats(&fAntServo);
+  if(theConfig.enableSurfaceServo) araServoLogStats(&fSurfaceServo);
+  if(theConfig.enableRateServo && theConfig.enableAntServo) {
+    araServoLogStats(&fRateServo);
+    ARA_LOG_MESSAGE(LOG_INFO,"Rate servo -- last L4 rate %.2f Hz, scaler goals at %.3f of the configured values\n",
+		    fRateServo.measured[0],((float)fScalerGoalScale)/ARA_SERVO_RATE_SCALE_UNIT);
   }
-  setSurfaceThresholds(fAtriSockFd,nextThresholds);
-
-  return 1;
 }
 
 
@@ -4214,115 +5802,242 @@ void *libusbPollThreadHandler(void *ptr)
 }
 
 
+static int readWilkinsonCounters(int fAtriSockFd, uint16_t *wilkinsonCounter)
+{
+  //All four counters (and delays) come back in a single wishbone read
+  uint8_t data[16];
+  int stack;
+  if(atriWishboneRead(fAtriSockFd,ATRI_WISH_D1WILK,16,data)<0) return -1;
+  for(stack=D1;stack<=D4;stack++)
+    copyTwoBytes(&(data[4*stack]),(uint16_t*)&wilkinsonCounter[stack]);
+  return 0;
+}
+
+static int setVdlyScanPoint(int fAtriSockFd, uint16_t vdly)
+{
+  int stack,retVal=0;
+  for(stack=D1;stack<=D4;stack++){
+    if(!theConfig.stackEnabled[stack]) continue;
+    if(setIRSVdlyDACValue(fAtriSockFd,stack,vdly)<0) retVal=-1;
+  }
+  return retVal;
+}
+
+int measureVdlyScanSettleTime(int fAtriSockFd, uint16_t fromVdly, uint16_t toVdly)
+{
+  //Returns how many us after a Vdly change from fromVdly to toVdly every
+  //enabled stack's counter has moved and then held steady for
+  //VDLY_SCAN_STABLE_READS reads, or VDLY_SCAN_MAX_SETTLE_US if that
+  //doesn't happen
+  uint16_t startCounter[DDA_PER_ATRI],lastCounter[DDA_PER_ATRI],counter[DDA_PER_ATRI];
+  int numStable[DDA_PER_ATRI]={0};
+  long stableSinceUs[DDA_PER_ATRI]={0};
+  struct timeval startTime,nowTime;
+  long elapsedUs=0,settleUs;
+  int stack,allSettled;
+
+  setVdlyScanPoint(fAtriSockFd,fromVdly);
+  usleep(VDLY_SCAN_MAX_SETTLE_US);
+  if(readWilkinsonCounters(fAtriSockFd,startCounter)<0) return VDLY_SCAN_MAX_SETTLE_US;
+  memcpy(lastCounter,startCounter,sizeof(lastCounter));
+
+  setVdlyScanPoint(fAtriSockFd,toVdly);
+  gettimeofday(&startTime,NULL);
+  do {
+    usleep(VDLY_SCAN_POLL_US);
+    if(readWilkinsonCounters(fAtriSockFd,counter)<0) return VDLY_SCAN_MAX_SETTLE_US;
+    gettimeofday(&nowTime,NULL);
+    elapsedUs=(nowTime.tv_sec-startTime.tv_sec)*1000000L+(nowTime.tv_usec-startTime.tv_usec);
+    allSettled=1;
+    for(stack=D1;stack<=D4;stack++){
+      if(!theConfig.stackEnabled[stack]) continue;
+      if(abs(counter[stack]-startCounter[stack])<=VDLY_SCAN_TOLERANCE) {
+	//Not moved yet
+	numStable[stack]=0;
+      }
+      else if(numStable[stack]==0 || abs(counter[stack]-lastCounter[stack])>VDLY_SCAN_TOLERANCE) {
+	numStable[stack]=1;
+	stableSinceUs[stack]=elapsedUs;
+      }
+      else numStable[stack]++;
+      lastCounter[stack]=counter[stack];
+      if(numStable[stack]<VDLY_SCAN_STABLE_READS) allSettled=0;
+    }
+  } while(!allSettled && elapsedUs<VDLY_SCAN_MAX_SETTLE_US);
+
+  if(!allSettled) {
+    ARA_LOG_MESSAGE(LOG_WARNING,"%s: Wilkinson counters didn't settle after a Vdly change from %u to %u, using %d ms\n",
+		    __FUNCTION__,fromVdly,toVdly,VDLY_SCAN_MAX_SETTLE_US/1000);
+    return VDLY_SCAN_MAX_SETTLE_US;
+  }
+  settleUs=0;
+  for(stack=D1;stack<=D4;stack++){
+    if(theConfig.stackEnabled[stack] && stableSinceUs[stack]>settleUs)
+      settleUs=stableSinceUs[stack];
+  }
+  return settleUs;
+}
+
+
 int doVdlyScan(int fAtriSockFd){
+  //Steps all the enabled stacks through Vdly together, then fits each
+  //stack's Wilkinson time against Vdly
+  uint32_t vdlyStep = VDLY_SCAN_MAX/VDLY_SCAN_NUM_POINTS;
+  uint32_t vdlyCurrent;
+  uint16_t wilkinsonCounter[DDA_PER_ATRI];
+  double sumX[DDA_PER_ATRI]={0},sumY[DDA_PER_ATRI]={0},sumXX[DDA_PER_ATRI]={0},sumXY[DDA_PER_ATRI]={0},sumYY[DDA_PER_ATRI]={0};
+  int numFit[DDA_PER_ATRI]={0};
+  double slope,intercept,rms,goalVdly;
+  char filename[FILENAME_MAX],fitFilename[FILENAME_MAX];
+  FILE *fpScan,*fpFit;
+  struct timeval startTime,endTime;
+  int stack,numPoints=0;
+  long settleUs,pointWaitUs;
+  unsigned int wilkNs;
 
   fprintf(stderr, "%s : starting scan\n", __FUNCTION__);
+  gettimeofday(&startTime,NULL);
 
-  uint32_t vdlyMax = 0xffff;
-  uint32_t vdlyStep = vdlyMax/100;
-  uint32_t vdlyCurrent =0;
-  uint8_t data[64];  
-  uint16_t wilkinsonCounter[DDA_PER_ATRI];
+  //Measure with the biggest step, the scan's own steps are much smaller
+  settleUs=measureVdlyScanSettleTime(fAtriSockFd,VDLY_SCAN_MAX-(VDLY_SCAN_MAX%vdlyStep),0);
+  pointWaitUs=VDLY_SCAN_SETTLE_MARGIN*settleUs;
+  if(pointWaitUs<VDLY_SCAN_MIN_SETTLE_US) pointWaitUs=VDLY_SCAN_MIN_SETTLE_US;
+  if(pointWaitUs>VDLY_SCAN_MAX_SETTLE_US) pointWaitUs=VDLY_SCAN_MAX_SETTLE_US;
+  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Wilkinson counters settle in %ld us, waiting %ld us per Vdly point\n",settleUs,pointWaitUs);
+
+  sprintf(filename,"%s/current/vdlyScan.run%6.6d.dat",theConfig.topDataDir,fCurrentRun);
+  fpScan=fopen(filename,"w");
+  if(!fpScan)
+    ARA_LOG_MESSAGE(LOG_ERR,"%s: can't open %s\n",__FUNCTION__,filename);
 
   fprintf(stderr, "vdly\twilk[0]\twilk[1]\twilk[2]\twilk[3]\n");
-  while(vdlyCurrent < vdlyMax)
+  if(fpScan) fprintf(fpScan, "vdly\twilk[0]\twilk[1]\twilk[2]\twilk[3]\n");
+  for(vdlyCurrent=0;vdlyCurrent<VDLY_SCAN_MAX;vdlyCurrent+=vdlyStep)
     {
-      int stack=0;
-      for(stack=D1;stack<=D4;stack++){
-	if(!theConfig.stackEnabled[stack]) continue;
-	setIRSVdlyDACValue(fAtriSockFd,stack,vdlyCurrent);
-	sleep(1);
-	atriWishboneRead(fAtriSockFd,ATRI_WISH_D1WILK,16,data);   	copyTwoBytes(&(data[4*stack]),(uint16_t*)&wilkinsonCounter[stack]);      
-	
+      //measureVdlyScanSettleTime left us at 0, which has had plenty of time
+      if(vdlyCurrent>0) {
+	setVdlyScanPoint(fAtriSockFd,vdlyCurrent);
+	usleep(pointWaitUs);
+      }
+      if(readWilkinsonCounters(fAtriSockFd,wilkinsonCounter)<0) {
+	ARA_LOG_MESSAGE(LOG_ERR,"%s: can't read the Wilkinson counters at Vdly %u\n",__FUNCTION__,vdlyCurrent);
+	continue;
       }
+      numPoints++;
       fprintf(stderr, "\n%u\t", vdlyCurrent);
+      if(fpScan) fprintf(fpScan, "\n%u\t", vdlyCurrent);
       for(stack=D1;stack<=D4;stack++){
 	if(!theConfig.stackEnabled[stack]) continue;
-	fprintf(stderr, "%u\t", atriConvertWilkCounterToNs(wilkinsonCounter[stack]));
-
-      }      
-      vdlyCurrent+=vdlyStep;
+	wilkNs=atriConvertWilkCounterToNs(wilkinsonCounter[stack]);
+	fprintf(stderr, "%u\t", wilkNs);
+	if(fpScan) fprintf(fpScan, "%u\t", wilkNs);
+	//A zero counter means the Wilkinson isn't running at this Vdly
+	if(wilkinsonCounter[stack]==0) continue;
+	numFit[stack]++;
+	sumX[stack]+=vdlyCurrent;
+	sumY[stack]+=wilkNs;
+	sumXX[stack]+=(double)vdlyCurrent*vdlyCurrent;
+	sumXY[stack]+=(double)vdlyCurrent*wilkNs;
+	sumYY[stack]+=(double)wilkNs*wilkNs;
+      }
     }
   fprintf(stderr, "\nfinished vdlyScan\n");
-  
-  
-  
-  return 0;
-  
-}
-int updateWilkinsonVdlyUsingPID(int fAtriSockFd,AraEventHk_t *eventHkPtr){
-  static int lastPpsNumber=0;
-  static DacPidStruct_t vdlyPIDs[DDA_PER_ATRI];
-  static int firstTime=1;
-  //  static int nextVals[DDA_PER_ATRI];
-  static int iVals[DDA_PER_ATRI][SERVO_INT_PERIOD]={{0}};
-  static int iCounter=0;
-  int stack,error,value,change,proposed;
-  float pTerm, dTerm, iTerm;
-  int goal=theConfig.wilkinsonGoal;
-
-  if(lastPpsNumber>0 && (lastPpsNumber)>eventHkPtr->ppsCounter)
-    return 0;
+  if(fpScan) {
+    fprintf(fpScan, "\n");
+    fclose(fpScan);
+  }
+
+  //Straight line fits, wilkNs = intercept + slope*vdly
+  sprintf(fitFilename,"%s/current/vdlyScanFit.run%6.6d.dat",theConfig.topDataDir,fCurrentRun);
+  fpFit=fopen(fitFilename,"w");
+  if(fpFit) fprintf(fpFit,"stack\tpoints\tslope\tintercept\trms\tvdlyForGoal\n");
   for(stack=D1;stack<=D4;stack++){
     if(!theConfig.stackEnabled[stack]) continue;
-    if(firstTime) {
-      vdlyPIDs[stack].iState=0;
-      vdlyPIDs[stack].dState=0;
-      setIRSVdlyDACValue(fAtriSockFd,stack,currentVdly[stack]);
-      //      fprintf(stderr,"Setting dda %d vdly to %d\n",stack,currentVdly[stack]);   
+    double denom=numFit[stack]*sumXX[stack]-sumX[stack]*sumX[stack];
+    if(numFit[stack]<2 || denom==0) {
+      ARA_LOG_MESSAGE(LOG_WARNING,"%s: only %d usable points for %s, no fit\n",__FUNCTION__,numFit[stack],atriDaughterStackStrings[stack]);
+      continue;
     }
-    value = atriConvertWilkCounterToNs(eventHkPtr->wilkinsonCounter[stack]);
+    slope=(numFit[stack]*sumXY[stack]-sumX[stack]*sumY[stack])/denom;
+    intercept=(sumY[stack]-slope*sumX[stack])/numFit[stack];
+    rms=(sumYY[stack]-2*intercept*sumY[stack]-2*slope*sumXY[stack]+numFit[stack]*intercept*intercept
+	 +2*intercept*slope*sumX[stack]+slope*slope*sumXX[stack])/numFit[stack];
+    rms=rms>0 ? sqrt(rms) : 0;
+    goalVdly=slope!=0 ? (theConfig.wilkinsonGoal-intercept)/slope : -1;
+    ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: %s Wilkinson %.6g ns per Vdly count + %.1f ns (rms %.1f ns, %d points), goal %d ns at Vdly %.0f\n",
+		    atriDaughterStackStrings[stack],slope,intercept,rms,numFit[stack],theConfig.wilkinsonGoal,goalVdly);
+    if(fpFit) fprintf(fpFit,"%d\t%d\t%g\t%g\t%g\t%.0f\n",stack,numFit[stack],slope,intercept,rms,goalVdly);
+  }
+  if(fpFit) fclose(fpFit);
+  if(theConfig.linkForXfer) {
+    if(fpScan) makeLink(filename,theConfig.linkDir);
+    if(fpFit) makeLink(fitFilename,theConfig.linkDir);
+  }
 
-    error=goal-value;
-    
-    // Proportional term
-    pTerm = theConfig.vdlyPGain * error;
-    
-    // Calculate integral with limiting factors
-    vdlyPIDs[stack].iState-=iVals[stack][iCounter%SERVO_INT_PERIOD];
-    vdlyPIDs[stack].iState+=error;
-    iVals[stack][iCounter%SERVO_INT_PERIOD]=error;
-    iCounter++;
-    
-    if (vdlyPIDs[stack].iState > theConfig.vdlyIMax)
-      vdlyPIDs[stack].iState = theConfig.vdlyIMax;
-    else if (vdlyPIDs[stack].iState < theConfig.vdlyIMin)
-      vdlyPIDs[stack].iState = theConfig.vdlyIMin;
-    
-    // Integral and Derivative Terms
-    iTerm = theConfig.vdlyIGain * (float)(vdlyPIDs[stack].iState);
-    if(!firstTime) {
-      dTerm = theConfig.vdlyDGain * (float)(value -vdlyPIDs[stack].dState);
-    }
-    else {
-      dTerm=0;
-    }
-    vdlyPIDs[stack].dState = value;
-    
-    //Put them together
-    change = (int) (pTerm + iTerm - dTerm);
-    proposed=currentVdly[stack]+change;
-    //fprintf(stderr, "vdly - proposed %i change %i pTerm %f iTerm %f dTerm %f wilkinsonNs %i\n", proposed, change, pTerm, iTerm, dTerm, value);    
-    if(proposed<20000) proposed=20000;
-
-    if(!firstTime){
-      if(proposed<65533){
-	currentVdly[stack] = proposed;
-	setIRSVdlyDACValue(fAtriSockFd,stack,currentVdly[stack]);
-	//	fprintf(stderr,"Setting dda %d vdly to %d\n",stack,currentVdly[stack]);      
-      }
-      else{
-	currentVdly[stack] = 65533;
-	setIRSVdlyDACValue(fAtriSockFd,stack,currentVdly[stack]);
-	//	fprintf(stderr,"Setting dda %d vdly to %d\n",stack,currentVdly[stack]);      
-	
-      }
-    }
-  }//stack
-  
-  lastPpsNumber=eventHkPtr->ppsCounter;
-  firstTime=0;
+  //Put the stacks back where the run would have started them
+  for(stack=D1;stack<=D4;stack++){
+    if(!theConfig.stackEnabled[stack]) continue;
+    setIRSVdlyDACValue(fAtriSockFd,stack,theConfig.initialVdly[stack]);
+  }
+  gettimeofday(&endTime,NULL);
+  ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd: Vdly scan of %d points took %ld s\n",numPoints,(long)(endTime.tv_sec-startTime.tv_sec));
   return 0;
+  
+}
+
+
+void fillMonitorStatus(AraMonitorStatus_t *status)
+{
+  //Only copies what ARAAcqd already has, nothing here talks to the ATRI
+  AtriControlQueueStats_t queueStats[ATRI_CONTROL_NUM_PRIORITIES];
+  SoftTriggerStats_t softTrigStats[NUM_SOFT_TRIG_SOURCES];
+  int i;
+
+  memset(status,0,sizeof(AraMonitorStatus_t));
+  status->runNumber=fCurrentRun;
+  status->programState=fProgramState;
+  status->nextEventNumber=fCurrentEvent;
+  status->eventRateHz=fStatusGoodEvents*theConfig.eventRateReportRateHz;
+  status->numGoodEvents=fStatusGoodEvents;
+  status->numBadEvents=fStatusBadEvents;
+  status->lastSoftwareTrigger=lastSoftwareTrigger;
+  status->lastEventRead=lastEventRead;
+  memcpy(status->thresholdDac,currentThresholds,sizeof(status->thresholdDac));
+  memcpy(status->surfaceThresholdDac,currentSurfaceThresholds,sizeof(status->surfaceThresholdDac));
+  memcpy(status->vdlyDac,currentVdly,sizeof(status->vdlyDac));
+  memcpy(status->vadjDac,currentVadj,sizeof(status->vadjDac));
+
+  getAtriControlQueueStats(queueStats);
+  for(i=0;i<ATRI_CONTROL_NUM_PRIORITIES;i++) {
+    status->controlQueue[i].numPackets=queueStats[i].numPackets;
+    status->controlQueue[i].depth=queueStats[i].depth;
+    status->controlQueue[i].maxDepth=queueStats[i].maxDepth;
+    if(queueStats[i].numPackets)
+      status->controlQueue[i].meanLatencyUs=queueStats[i].totalLatencyUs/queueStats[i].numPackets;
+    status->controlQueue[i].maxLatencyUs=queueStats[i].maxLatencyUs;
+  }
+
+  getSoftTriggerStats(softTrigStats);
+  for(i=0;i<NUM_SOFT_TRIG_SOURCES && i<ARA_MONITOR_NUM_SOFT_TRIG_SOURCES;i++) {
+    status->softTrig[i].numSent=softTrigStats[i].numSent;
+    status->softTrig[i].numFailed=softTrigStats[i].numFailed;
+    status->softTrig[i].numLate=softTrigStats[i].numLate;
+    status->softTrig[i].numSkipped=softTrigStats[i].numSkipped;
+    if(softTrigStats[i].numSent)
+      status->softTrig[i].meanJitterUs=softTrigStats[i].sumJitterUs/softTrigStats[i].numSent;
+    status->softTrig[i].maxJitterUs=softTrigStats[i].maxJitterUs;
+  }
+
+  //Read without the task locks, one of them is held by our own task and
+  //a torn counter is harmless here
+  for(i=0;i<NUM_HK_TASKS && i<ARA_MONITOR_MAX_HK_TASKS;i++) {
+    strncpy(status->hkTasks[i].name,fHkTasks[i].name ? fHkTasks[i].name : "",ARA_MONITOR_TASK_NAME_LENGTH-1);
+    status->hkTasks[i].numRuns=fHkTasks[i].numRuns;
+    status->hkTasks[i].numOverruns=fHkTasks[i].numOverruns;
+    status->hkTasks[i].maxRunTimeUs=fHkTasks[i].maxRunTimeUs;
+    status->hkTasks[i].maxLatencyUs=fHkTasks[i].maxLatencyUs;
+    status->numHkTasks++;
+  }
 }
 
 
@@ -4334,8 +6049,11 @@ void writeHelpfulTempFile()
   //Add the current time
   fprintf(outFile,"Date: %s\n",ctime(&rawTime));  
   fprintf(outFile,"Run: %d\n",fCurrentRun);
-  fprintf(outFile,"Good event rate - %0.2f Hz\n",numGoodEvents*theConfig.eventRateReportRateHz);
-  fprintf(outFile,"Good Events %d, Bad Events %d\n",numGoodEvents,numBadEvents);
+  fprintf(outFile,"Good event rate - %0.2f Hz\n",fStatusGoodEvents*theConfig.eventRateReportRateHz);
+  fprintf(outFile,"Good Events %d, Bad Events %d\n",fStatusGoodEvents,fStatusBadEvents);
+  if(theConfig.enableRateServo)
+    fprintf(outFile,"Rate servo L4 rate %0.2f Hz, scaler goal scale %0.3f\n",
+	    fRateServo.measured[0],((float)fScalerGoalScale)/ARA_SERVO_RATE_SCALE_UNIT);
   fprintf(outFile,"Last software trigger sent %d seconds ago\n",(int)(rawTime-lastSoftwareTrigger));
   fprintf(outFile,"Last event readout %d seconds ago\n",(int)(rawTime-lastEventRead));
   fprintf(outFile,"Next software event number %d\n",fCurrentEvent);
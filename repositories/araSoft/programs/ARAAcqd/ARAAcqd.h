@@ -6,7 +6,7 @@
   ii) A thread which monitors the unix domain atri_contol and adds requests to the pending queue
   iii) A thread which reads out the event data
   iv) The run control thread which monitors a seperate unix domain socket for sending and receiving run control packets
-  v) A thread which reads out the housekeeping data
+  v) A thread which reads out the housekeeping data, with one thread per periodic task (event hk, sensor hk, servos, status file, monitor shared memory)
 
   July 2011 rjn@hep.ucl.ac.uk
 */
@@ -17,24 +17,43 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "araSoft.h"
 #include "araCom.h"
 #include "araAtriStructures.h"
 #include "araRunControlLib/araRunControlLib.h"
+#include "araMonitorLib/araMonitor.h"
+#include "araServoLib/araServo.h"
+#include "araFilterLib/araFilter.h"
+
+//The event streams, each with its own writer so the transfer can move
+//them at different priorities. An event goes to the first enabled stream
+//in this order that it qualifies for, otherwise to the main one
+typedef enum {
+  eventStreamMain=0, ///< eventWriter, the RF triggers and everything not routed elsewhere
+  eventStreamPed=1, ///< Events read during pedestal runs
+  eventStreamCal=2, ///< Calpulser triggers, or events the filter flags as the calpulser
+  eventStreamSoft=3, ///< Software (minimum bias) triggers without an RF trigger
+  eventStreamPriority=4, ///< Filter priority priorityStreamMaxPriority or better
+  NUM_EVENT_STREAMS
+} EventStream_t;
+
+//The program state and the thread flags the threads wait on only change
+//through setProgramState and setProgramFlag, which wake the waiters
+#define PROGRAM_STATE_WAIT_MS 1000 ///< Longest wait before rechecking, for the signal handlers that can't wake the waits
+#define EVENT_WAIT_MAX_SPURIOUS 100 ///< Wakeups in a row with no data before the PCIe device is no longer polled
 
 #define ARAACQD_VER_MAJOR 1
 #define ARAACQD_VER_MINOR 6
 #define ARAACQD_VER_REV   2084
 
-#define SERVO_INT_PERIOD 10
-
 typedef struct {
   // Verbosity
   int printToScreen;
   int logLevel;
-  int atriControlLog;
-  int atriEventLog;
+  int atriControlLog; ///< Trace control packets and vendor requests in the atriTrace ring
+  int atriEventLog; ///< Trace event end point reads in the atriTrace ring
   int enableEventRateReport;
   float eventRateReportRateHz;
   // Output files
@@ -42,7 +61,11 @@ typedef struct {
   char eventTopDir[FILENAME_MAX];
   char sensorHkTopDir[FILENAME_MAX];
   char eventHkTopDir[FILENAME_MAX];
+  char softTrigHkTopDir[FILENAME_MAX];
+  char eventSummaryTopDir[FILENAME_MAX];
+  char dqHkTopDir[FILENAME_MAX];
   char pedsTopDir[FILENAME_MAX];
+  char pedsReferenceDir[FILENAME_MAX]; ///< Outside current, the reference pedestals have to outlive the run
   char linkDir[FILENAME_MAX];
   char runLogDir[FILENAME_MAX];
   char runNumFile[FILENAME_MAX];
@@ -50,6 +73,7 @@ typedef struct {
   int filesPerDir;
   int eventsPerFile;
   int hkPerFile;
+  int summariesPerFile;
   int compressionLevel;
   // Run config
   int doAtriInitialisation;
@@ -58,12 +82,30 @@ typedef struct {
   int enableHkRead;
   float eventHkReadRateHz; 
   int sensorHkReadPeriod;
+  int ppsEdgePrediction; ///< Read the event hk just after the predicted PPS edge rather than polling at eventHkReadRateHz
+  float statusFilePeriodS; ///< How often /tmp/araacqd.status is rewritten
+  int enableMonitorShm; ///< Publish the live state in the araMonitorLib shared memory segment
+  float monitorPeriodS; ///< How often the run status in the segment is updated
+  int hkRealtimePriority; ///< Run the housekeeping tasks with SCHED_FIFO priorities
+  int enableRollover; ///< Roll over to the next run without reinitialising the hardware if the config is unchanged
   int pedestalMode;
   int pedestalNumTriggerBlocks;
   int pedestalSamples;
   int pedestalDebugMode;
+  int pedestalNumThreads; ///< Pedestal accumulation worker threads, 0 does it in the readout thread
+  int pedestalWriteBinary; ///< Also write pedestals.runNNNNNN.ped, see araPedestalFile.h
+  int pedestalMaxInFlight; ///< Soft triggers outstanding at once during pedestal runs
+  int pedestalTriggerSpacingUs; ///< Least time between pedestal run soft triggers
+  int pedestalTrack; ///< Track the pedestals with the soft trigger events of normal runs
+  int pedestalTrackShift; ///< Tracker time constant, 2^pedestalTrackShift events per channel block
+  float pedestalTrackSnapshotPeriodS; ///< How often the tracked pedestals are written to the pedestal store
+  float pedestalTrackDriftWarn; ///< Warn when the rms drift from the reference pedestals is above this (ADC counts)
   int vdlyScan;
   int enablePcieReadout;
+  int eventWaitMaxMs; ///< Longest the main thread sleeps in poll() on the PCIe device when there are no events
+  int atriRegisterShadow; ///< Cache the ATRI configuration registers and skip unchanged writes
+  int atriRegisterVerify; ///< Read back the cached registers after the run is set up
+  int enableEventSummary; ///< Write an AraEventSummary_t for every event
   // Thresholds
   int thresholdScan;
   int thresholdScanSingleChannel;
@@ -71,6 +113,7 @@ typedef struct {
   int thresholdScanStartPoint;
   int thresholdScanStep;
   int thresholdScanPoints;
+  int thresholdScanCoarseStride; ///< Coarse pass spacing in scan points, 1 measures every point of every channel
   int setThreshold;
   int useGlobalThreshold;
   int globalThreshold;
@@ -98,6 +141,8 @@ typedef struct {
 
   float softTriggerRateHz;
   float randTriggerRateHz;
+  int softTriggerMode; ///< SoftTriggerMode_t
+  int softTriggerPpsOffsetUs; ///< Offset from the start of the second in PPS locked mode
   
   int enableTriggerWindow;
   int triggerWindowSize;
@@ -117,6 +162,8 @@ typedef struct {
   float vdlyDGain;
   float vdlyIMax;
   float vdlyIMin;
+  int vdlyUsePid; ///< Use the PID gains above rather than the fixed gain proportional servo
+  int vdlyMaxStep; ///< Largest Vdly change per update, 0 for no limit
   int enableAntServo;
   uint16_t scalerGoalValues[THRESHOLDS_PER_ATRI];
   float scalerPGain;
@@ -124,38 +171,258 @@ typedef struct {
   float scalerDGain;
   float scalerIMax;
   float scalerIMin;
-  int enableRateServo; 
+  float scalerGainScale[THRESHOLDS_PER_ATRI]; ///< Per channel multiplier of the scaler gains
+  int scalerMaxStep; ///< Largest threshold change per update, 0 for no limit
+  int enableRateServo; ///< Scale the scaler goals to hold the L4 RF0 rate at rateGoalHz
   float servoCalcPeriodS; 
-  float servoCalcDelayS;
+  float servoCalcDelayS; ///< Seconds of L4 rate averaged for each rate servo update
   float rateGoalHz;
   float ratePGain;
   float rateIGain;
   float rateDGain;
   float rateIMax;
   float rateIMin;
+  float rateGoalScaleMin; ///< Limits of the scaler goal scale set by the rate servo
+  float rateGoalScaleMax;
+  float rateGoalScaleStep; ///< Largest change of the scale in one update
   int enableSurfaceServo;
   uint16_t surfaceGoalValues[ANTS_PER_TDA];
   int stackEnabled[DDA_PER_ATRI];
   int numEnabledStacks;
+  // Filter
+  int enableFilter; ///< Run the L5 software filter, see araFilter.h
+  int filterNumThreads; ///< Filter worker threads, 0 filters in the readout thread
+  float filterSnrThreshold;
+  int filterMinHitChannels;
+  int filterMinHitStrings;
+  int filterCoincidenceWindow; ///< Samples
+  uint32_t filterCalTimeStampMin; ///< timeStamp window the calpulser fires in, binary (not gray coded) counts
+  uint32_t filterCalTimeStampMax;
+  int filterNumCwLines;
+  float filterCwFrequency[ARA_FILTER_MAX_CW_LINES]; ///< Cycles per sample
+  float filterCwFraction;
+  int filterCwMinChannels;
+  int filterBudgetUs; ///< CPU time per event, 0 for no limit
+  int filterWriteMaxPriority; ///< Events of this priority or better are all written
+  int filterLowPriorityPrescale; ///< One in this many of the others (bad events excepted) are written, 0 for none
+  int roiEnable; ///< Summarise the blocks away from the region of interest of filtered events, see araRoi.h
+  int roiKeepMaxPriority; ///< Events of this priority or better keep every block
+  int roiBlocksBefore; ///< Readouts kept before the trigger or peak block
+  int roiBlocksAfter; ///< Readouts kept after it
+  int roiAroundPeak; ///< Keep the window round each channel's peak block as well as the trigger block
+  // Data quality
+  int enableDq; ///< Keep the online data quality counters and write them to the dqHk stream, see araDq.h
+  float dqPeriodS; ///< How often the counters are written out and the alarms checked
+  int dqSampleHistPrescale; ///< The sample occupancy histogram is filled for one in this many events
+  float dqStuckFractionAlarm; ///< Fraction of a channel's blocks with one repeated value to alarm at
+  float dqDeadRangeAlarm; ///< Mean block range (ADC counts) of a channel to alarm below
+  float dqRailFractionAlarm; ///< Fraction of a channel's samples at 0 or 4095 to alarm at
+  int dqErrorAlarm; ///< Read and unpack errors in a period to alarm at, 0 never
+  int dqEventGapAlarm; ///< Missed eventIds in a period to alarm at, 0 never
+  int dqTimeJumpAlarm; ///< PPS jumps and backwards timeStamps in a period to alarm at, 0 never
+  int dqBlockSequenceAlarm; ///< Out of sequence blocks and DDA mismatches in a period to alarm at, 0 never
+  // Event streams, the main one is eventTopDir with the output section's settings
+  int eventStreamEnable[NUM_EVENT_STREAMS];
+  int eventStreamEventsPerFile[NUM_EVENT_STREAMS];
+  int eventStreamCompression[NUM_EVENT_STREAMS];
+  char eventStreamTopDir[NUM_EVENT_STREAMS][FILENAME_MAX];
+  char eventStreamLinkDir[NUM_EVENT_STREAMS][FILENAME_MAX];
+  int priorityStreamMaxPriority; ///< Filter priorities up to this go to the priority stream
 } ARAAcqdConfig_t;
 
 
+//How the soft (forced) triggers are scheduled, random triggers are always Poisson
+typedef enum {
+  softTriggerModeFixedPeriod=0, ///< Every 1/softTriggerRateHz
+  softTriggerModePpsLocked=1 ///< Fixed slots within each second of system time, plus softTriggerPpsOffsetUs
+} SoftTriggerMode_t;
+
+//Index into the soft trigger stats
+enum {
+  SOFT_TRIG_SOURCE_FORCED=0,
+  SOFT_TRIG_SOURCE_RANDOM=1,
+  NUM_SOFT_TRIG_SOURCES
+};
+
+#define SOFT_TRIG_TIME_BUFFER_SIZE 4096 ///< Trigger times waiting for the housekeeping thread
+
+//Timing of the soft triggers, jitter is how late each one was sent
+typedef struct {
+  unsigned int numSent;
+  unsigned int numFailed;
+  unsigned int numLate; ///< Sent more than half a period late
+  unsigned int numSkipped; ///< Whole periods dropped to catch up
+  double sumJitterUs;
+  double sumJitterSqUs;
+  double maxJitterUs;
+} SoftTriggerStats_t;
+
+//The housekeeping is split into tasks, each with its own thread woken at
+//absolute deadlines so a slow sensor read can't shift the event hk
+enum {
+  HK_TASK_EVENT_HK=0,
+  HK_TASK_SENSOR_HK,
+  HK_TASK_VDLY_SERVO,
+  HK_TASK_ANT_SERVO,
+  HK_TASK_SURFACE_SERVO,
+  HK_TASK_STATUS_FILE,
+  HK_TASK_MONITOR,
+  NUM_HK_TASKS
+};
+
+#define HK_TASK_MAX_SLEEP_NS 100000000LL ///< Longest sleep before rechecking the program state
+#define EVENT_HK_SECOND_OFFSET_NS 50000000LL ///< Event hk deadlines sit this far after each second
+
+typedef struct hkTask HkTask_t;
+struct hkTask {
+  const char *name;
+  int (*runTask)(HkTask_t *task);
+  int64_t (*nextDeadlineNs)(HkTask_t *task, int64_t nowNs); ///< If set replaces the fixed period
+  int priority; ///< SCHED_FIFO priority if hkRealtimePriority is set
+  int controlPriority; ///< AtriControlPriority_t of the task's ATRI connection
+  int needsFx2; ///< Also open a FX2 control connection
+  int alignToSecond; ///< Deadlines fixed within each second of CLOCK_REALTIME, otherwise CLOCK_MONOTONIC from the run start
+  float periodS; ///< Set when the run is prepared, 0 disables the task
+  int fAtriSockFd;
+  int fFx2SockFd;
+  unsigned int lastEventHkNumber; ///< Last event hk used by a servo task
+  pthread_t thread;
+  pthread_mutex_t runMutex; ///< Held while the task runs
+  //Stats for the current run, protected by runMutex
+  unsigned int numRuns;
+  unsigned int numOverruns; ///< Runs that finished after the next deadline
+  unsigned int numPeriodsSkipped;
+  double maxRunTimeUs;
+  double maxLatencyUs; ///< Latest start after a deadline
+};
+
+//The threshold scans measure one point per PPS second: the next DAC values
+//are set as soon as the PPS counter changes, so the scalers latched at the
+//following edge only ever see one set of thresholds
+#define THRESHOLD_SCAN_NUM_CHANNELS (THRESHOLDS_PER_ATRI+ANTS_PER_TDA) ///< Ice then surface
+#define THRESHOLD_SCAN_POLL_US 5000 ///< PPS counter poll interval while waiting for an edge
+#define THRESHOLD_SCAN_READ_DELAY_US 100000 ///< The scalers are read this long after the edge
+#define THRESHOLD_SCAN_EDGE_TIMEOUT_US 2500000 ///< No PPS for this long aborts the scan
+#define THRESHOLD_SCAN_FLAT_SIGMA 3 ///< Coarse intervals whose ends agree within this many sigma are not scanned finely
+
+//The Vdly scan steps all the stacks together. How long the Wilkinson
+//counters take to follow a Vdly change is measured at the start of the
+//scan, and each point then waits that long rather than a full second
+#define VDLY_SCAN_MAX 0xffff
+#define VDLY_SCAN_NUM_POINTS 100
+#define VDLY_SCAN_POLL_US 2000 ///< Counter poll interval while measuring the settling time
+#define VDLY_SCAN_MIN_SETTLE_US 10000
+#define VDLY_SCAN_MAX_SETTLE_US 1000000 ///< The old fixed wait, also the limit on the measurement
+#define VDLY_SCAN_STABLE_READS 3 ///< Consecutive reads that must agree for a counter to count as settled
+#define VDLY_SCAN_TOLERANCE 6 ///< Raw counts (about 2 ns) that still agree
+#define VDLY_SCAN_SETTLE_MARGIN 2 ///< Each point waits this many times the measured settling time
+
+//Reference pedestals in topDataDir/peds, written by every pedestal run
+#define PED_TRACK_REFERENCE_FILE "pedestalReference.ped"
+
+//Pedestal runs keep up to pedestalMaxInFlight soft triggers outstanding,
+//sending the next as soon as an event comes back. The ATRI only has
+//averaged buffer space registers, so what is in the FIFO is counted here.
+//It doesn't queue a trigger that arrives while it is still digitising, so
+//triggers are never sent closer than pedestalTriggerSpacingUs
+#define PED_TRIGGER_TIMEOUT_US 200000 ///< No event for this long and the outstanding triggers are given up
+#define PED_TRIGGER_DRAIN_US 200000 ///< After giving up, events arriving for this long are late ones and are thrown away
+
+typedef struct {
+  int maxInFlight;
+  int numInFlight; ///< Triggers sent whose events haven't been read
+  int numWanted; ///< Events still to trigger and read, -1 for no limit
+  int draining; ///< Gave up on some triggers, no new ones until drainUntil
+  uint8_t pedestalEnable; ///< Written to IRSPEDEN before each trigger if non zero
+  struct timeval lastProgress; ///< Last event read, or the first trigger into an empty pipeline
+  struct timeval lastTrigger;
+  struct timeval drainUntil;
+  //Stats
+  unsigned int numSent;
+  unsigned int numRead;
+  unsigned int numLost;
+  unsigned int numLate; ///< Events from given up triggers, not used
+  unsigned int numBad;
+} PedestalTriggerPipe_t;
+
+//With the filter on, runLogDir/filterManifest.runNNNNNN.dat gets a line per
+//event file: the file, the events in it, how many of each priority and
+//the best priority. It stays on the station with the run logs, the
+//priorityEvent stream is what gets the interesting events north first
+typedef struct {
+  char fileName[FILENAME_MAX]; ///< Empty until the first event is written
+  unsigned int numEvents;
+  unsigned int numPriority[ARA_FILTER_NUM_PRIORITIES];
+} FilterManifestFile_t;
+
+//Predicts the PPS edges on CLOCK_REALTIME from the times the ATRI PPS
+//counter is seen to change, so the event hk only needs a read either side
+//of each edge rather than polling
+#define PPS_EDGE_GUARD_NS 2000000LL ///< Reads sit this far either side of the predicted edge
+#define PPS_EDGE_POLL_NS 2000000LL ///< Poll interval while looking for an edge
+#define PPS_EDGE_MAX_BRACKET_NS 10000000LL ///< Widest old/new read interval used to measure an edge
+#define PPS_EDGE_LOCK_TOLERANCE_NS 20000000LL ///< Edges further than this from the prediction lose the lock
+#define PPS_EDGE_FILTER_WEIGHT 0.25
+
 typedef struct {
-    int dState;  // Last position input
-    int iState;  // Integrator state
-} DacPidStruct_t;
+  int havePps;
+  int locked;
+  int64_t edgePhaseNs; ///< Predicted edge position within each second
+  uint32_t lastPpsCounter; ///< Counter at the last read
+  int64_t lastOldReadNs; ///< Time of the last read that saw lastPpsCounter
+  int haveEdge;
+  int lastEdgeMeasured; ///< The last edge time came from a narrow bracket
+  int64_t lastEdgeNs;
+  uint32_t lastEdgePps;
+  int64_t nextReadNs;
+  //Stats for the current run
+  unsigned int numReads;
+  unsigned int numEdges;
+  unsigned int numSkippedSeconds;
+  unsigned int numExtraPps;
+  unsigned int numMissingPps;
+  unsigned int numLockLost;
+} PpsEdgeTracker_t;
 
 
 int readConfigFile(const char* configFileName,ARAAcqdConfig_t* theConfig);
+uint32_t getConfigFilesHash(const char *configFileName);
+int canRollover(const char *configFileName);
+void openRunOutputs();
+void startRunLog(const char *configFileName);
+void closeRunOutputs();
 void sigUsr1Handler(int sig); 
 void sigUsr2Handler(int sig);
+void initProgramState(AraProgramStatus_t state);
+void setProgramState(AraProgramStatus_t state);
+int changeProgramState(AraProgramStatus_t fromState, AraProgramStatus_t toState);
+void setProgramFlag(int *flag, int value);
+void waitProgramStateCond();
+void pokeProgramStateFd();
+void waitForEventData();
 void error(const char *msg);
 int runControlSocketHandler();
 void *atriControlSocketHandler(void *ptr);
 void *fx2ControlUsbHandlder(void *ptr);
 void *araHkThreadHandler(void *ptr);
+void *softTriggerThreadHandler(void *ptr);
+void initHkTasks();
+void *hkTaskThreadHandler(void *ptr);
+void resetHkTaskStats();
+void logHkTaskStats();
+int64_t eventHkNextDeadline(HkTask_t *task, int64_t nowNs);
+void resetPpsEdgeTracker(PpsEdgeTracker_t *tracker);
+int pollPpsEdge(int fAtriSockFd, PpsEdgeTracker_t *tracker, uint32_t *flags);
+int readPpsCounters(int fAtriSockFd, uint32_t *ppsCounter, uint32_t *clockCounter);
+void getSoftTriggerStats(SoftTriggerStats_t *stats); ///< Copies NUM_SOFT_TRIG_SOURCES entries
+void resetSoftTriggerStats();
+int fillSoftTriggerHk(AraSoftTriggerHk_t *softTrigHkPtr, struct timeval *currTime);
+int writeSoftTriggerHk(struct timeval *currTime);
+void openHkWriters();
+void closeHkWriters();
 void sendProgramReply(int newsockfd ,AraProgramControl_t requestedState);
 int checkDeltaT(struct timeval *currTime, struct timeval *lastTime, float deltaT);
+uint32_t getAtriTraceMask(ARAAcqdConfig_t *theConfig);
 
 int initialiseAtri(int fFx2SockFd,int fAtriSockFd,ARAAcqdConfig_t *theConfig);
 int initialiseAtriClocks(int fFx2SockFd,ARAAcqdConfig_t *theConfig);
@@ -181,22 +448,36 @@ int setIceThresholds(int fAtriSockFd, uint16_t *thresholds);
 int doThresholdScan(int fAtriSockFd);
 int doPedestalRun(int fAtriSockFd,int fFx2SockFd);
 int doPedestalRunNotPedestalMode(int fAtriSockFd,int fFx2SockFd);
+int loadPedestalReference();
+int startPedestalTracker();
+void trackPedestalEvent(int numBytes);
+void stopPedestalTracker();
+int startFilter();
+int getEventStream(uint8_t *event);
+int suppressEventBlocks(uint8_t *event, int numBytes, int stream);
+int storeEvent(uint8_t *event, int numBytes, int stream);
+void writeEventSummary(uint8_t *event, int numBytes, int written);
+void writeFilteredEvents(int wait);
+void stopFilter();
+void startDq();
+void publishDq(struct timeval *nowTime);
+void stopDq();
 int countTriggers(AraStationEventBlockHeader_t *blkHeader) ;
-int pedIndex(int dda, int block, int chan, int sample);
 
-int updateWilkinsonVdly(int fAtriSockFd,AraEventHk_t *eventPtr);
-int updateWilkinsonVdlyUsingPID(int fAtriSockFd,AraEventHk_t *eventPtr);
-int updateThresholdsUsingPID(int fAtriSockFd,AraEventHk_t *eventHkPtr); 
+void initServos();
+void logServoStats();
 
 int setSurfaceThresholds(int fAtriSockFd, uint16_t *thresholds);
-int updateSurfaceThresholdsUsingPID(int fAtriSockFd,AraEventHk_t *eventHkPtr); 
 
 int doThresholdScan(int fAtriSockFd);
 int doThresholdScanSingleChannel(int fAtriSockFd);
+int doGatedThresholdScan(int fAtriSockFd, uint32_t scanMask, const char *fileTag);
 
 int doVdlyScan(int fAtriSockFd);
+int measureVdlyScanSettleTime(int fAtriSockFd, uint16_t fromVdly, uint16_t toVdly);
 
 void writeHelpfulTempFile();
+void fillMonitorStatus(AraMonitorStatus_t *status);
 
 //int setThresholds(const ARAacqdConfig_t* theConfig);
 //int doThresholdScan(const ARAacqdConfig_t* theConfig);
@@ -0,0 +1,198 @@
+/*! \file ARAHkStored.c
+  \brief Keeps hours of housekeeping history in memory so it can be looked at without unpacking the hk files.
+    
+  ARAHkStored picks up each new event and sensor housekeeping record from the ARAAcqd monitor shared memory, adds it to a fixed size araHkStoreLib store and answers range and aggregate queries on ARA_HK_STORE_SOCKET. It never touches the ATRI or the disk, and keeps going (with a gap in the history) if ARAAcqd is restarted.
+*/
+
+#include "araSoft.h"
+#include "utilLib/util.h"
+#include "araMonitorLib/araMonitor.h"
+#include "araHkStoreLib/araHkStore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <libgen.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define HK_STORE_POLL_MS 100 ///< How often the shared memory is checked for new records
+#define HK_STORE_MAX_CLIENTS 8
+
+//About an hour of raw data, a day of minutes and a month of hours for typical scalers
+static const int fChunksPerTier[ARA_HK_NUM_TIERS]={32,16,8};
+
+int fExitProgram=0;
+
+void signalHandler(int sig)
+{
+  ARA_LOG_MESSAGE(LOG_ERR,"ARAHkStored got signal %d\n",sig);
+  fExitProgram=1;
+}
+
+int openQuerySocket()
+{
+  struct sockaddr_un u_addr;
+  int len;
+  int sockfd=socket(AF_UNIX,SOCK_STREAM,0);
+  if(sockfd<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"socket -- %s\n",strerror(errno));
+    return -1;
+  }
+  u_addr.sun_family=AF_UNIX;
+  strcpy(u_addr.sun_path,ARA_HK_STORE_SOCKET);
+  unlink(u_addr.sun_path);
+  len=strlen(u_addr.sun_path)+sizeof(u_addr.sun_family);
+  if(bind(sockfd,(struct sockaddr *)&u_addr,len)<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"bind -- %s\n",strerror(errno));
+    close(sockfd);
+    return -1;
+  }
+  if(listen(sockfd,5)) {
+    ARA_LOG_MESSAGE(LOG_ERR,"listen -- %s\n",strerror(errno));
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+
+int main(int argc, char **argv)
+{
+  AraHkStore_t theStore;
+  AraMonitorSegment_t *segment=NULL;
+  AraEventHk_t eventHk;
+  AraSensorHk_t sensorHk;
+  AraHkQuery_t queries[HK_STORE_MAX_CLIENTS+1];
+  int queryBytes[HK_STORE_MAX_CLIENTS+1];
+  struct pollfd fds[HK_STORE_MAX_CLIENTS+1];
+  int32_t segmentPid=0;
+  uint32_t lastEventHkUpdates=0,lastSensorHkUpdates=0;
+  time_t nextAttach=0;
+  int nfds,iter,pollVal,numBytes,newsockfd,numUpdates;
+  int retVal;
+  char* progName = basename(argv[0]);
+
+  printToScreen=LOG_INFO;
+  retVal=checkPidFile(ARA_HK_STORED_PID_FILE);
+  if(retVal) {
+    ARA_LOG_MESSAGE(LOG_ERR,"%s already running (%d)\nRemove pidFile to over ride (%s)\n",progName,retVal,ARA_HK_STORED_PID_FILE);
+    exit(1);
+  }
+  if(writePidFile(ARA_HK_STORED_PID_FILE))
+    exit(1);
+
+  signal(SIGUSR2, signalHandler);
+  signal(SIGTERM, signalHandler);
+  signal(SIGINT, signalHandler);
+  signal(SIGPIPE, SIG_IGN);
+
+  if(araHkStoreInit(&theStore,fChunksPerTier)<0) {
+    ARA_LOG_MESSAGE(LOG_ERR,"Can't allocate the hk store\n");
+    unlink(ARA_HK_STORED_PID_FILE);
+    exit(1);
+  }
+  ARA_LOG_MESSAGE(LOG_INFO,"%s: %d series, %lu bytes\n",progName,theStore.numSeries,(unsigned long)theStore.numBytes);
+
+  fds[0].fd=openQuerySocket();
+  if(fds[0].fd<0) {
+    araHkStoreFree(&theStore);
+    unlink(ARA_HK_STORED_PID_FILE);
+    exit(1);
+  }
+  fds[0].events=POLLIN;
+  nfds=1;
+
+  while(!fExitProgram) {
+    for(iter=0;iter<nfds;iter++) fds[iter].revents=0;
+    pollVal=poll(fds,nfds,HK_STORE_POLL_MS);
+    if(pollVal<0 && errno!=EINTR) {
+      ARA_LOG_MESSAGE(LOG_ERR,"Error calling poll: %s\n",strerror(errno));
+      break;
+    }
+    if(pollVal>0) {
+      if(fds[0].revents & POLLIN) {
+	newsockfd=accept(fds[0].fd,NULL,NULL);
+	if(newsockfd>=0) {
+	  if(nfds<=HK_STORE_MAX_CLIENTS) {
+	    fds[nfds].fd=newsockfd;
+	    fds[nfds].events=POLLIN;
+	    fds[nfds].revents=0;
+	    queryBytes[nfds]=0;
+	    nfds++;
+	  }
+	  else close(newsockfd);
+	}
+      }
+      for(iter=nfds-1;iter>0;iter--) {
+	if(!(fds[iter].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+	//Only take what is there, a client that sends half a query mustn't
+	//hold up the others or the updates from ARAAcqd
+	numBytes=recv(fds[iter].fd,((char*)&queries[iter])+queryBytes[iter],
+		      sizeof(AraHkQuery_t)-queryBytes[iter],MSG_DONTWAIT);
+	if(numBytes<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR))
+	  continue;
+	if(numBytes>0) {
+	  queryBytes[iter]+=numBytes;
+	  if(queryBytes[iter]<(int)sizeof(AraHkQuery_t)) continue;
+	  queryBytes[iter]=0;
+	  if(araHkStoreServeQuery(&theStore,fds[iter].fd,&queries[iter])==0)
+	    continue;
+	}
+	//Closed (or broken), drop the connection
+	close(fds[iter].fd);
+	fds[iter]=fds[nfds-1];
+	queries[iter]=queries[nfds-1];
+	queryBytes[iter]=queryBytes[nfds-1];
+	nfds--;
+      }
+    }
+
+    //Now see if ARAAcqd has anything new
+    if(!segment) {
+      if(time(NULL)<nextAttach) continue;
+      nextAttach=time(NULL)+1;
+      segment=araMonitorAttach(ARA_MONITOR_SHM_NAME);
+      if(!segment) continue;
+      segmentPid=segment->pid;
+      lastEventHkUpdates=0;
+      lastSensorHkUpdates=0;
+      ARA_LOG_MESSAGE(LOG_INFO,"%s: attached to ARAAcqd (pid %d)\n",progName,segmentPid);
+    }
+    if(segment->magic!=ARA_MONITOR_MAGIC || segment->pid!=segmentPid) {
+      //ARAAcqd has gone away or been restarted
+      araMonitorDetach(segment);
+      segment=NULL;
+      continue;
+    }
+    if(segment->eventHkLock.numUpdates!=lastEventHkUpdates) {
+      numUpdates=araMonitorGetEventHk(segment,&eventHk);
+      if(numUpdates>0) {
+	araHkStoreAddEventHk(&theStore,&eventHk);
+	lastEventHkUpdates=numUpdates;
+      }
+    }
+    if(segment->sensorHkLock.numUpdates!=lastSensorHkUpdates) {
+      numUpdates=araMonitorGetSensorHk(segment,&sensorHk);
+      if(numUpdates>0) {
+	araHkStoreAddSensorHk(&theStore,&sensorHk);
+	lastSensorHkUpdates=numUpdates;
+      }
+    }
+  }
+
+  for(iter=0;iter<nfds;iter++) close(fds[iter].fd);
+  unlink(ARA_HK_STORE_SOCKET);
+  if(segment) araMonitorDetach(segment);
+  ARA_LOG_MESSAGE(LOG_INFO,"%s: stored %u event hk and %u sensor hk (%u points rejected)\n",
+		  progName,theStore.numEventHk,theStore.numSensorHk,theStore.numRejected);
+  araHkStoreFree(&theStore);
+  unlink(ARA_HK_STORED_PID_FILE);
+  return 0;
+}
@@ -163,6 +163,17 @@ int main(int argc, char *argv[])
       }      
     }
 
+    if(needToStart && theConfig.rolloverRuns && fAcqdStatus==ARA_PROG_RUNNING &&
+       runsSincePedestalRun<theConfig.pedestalRunEveryNRuns) {
+      //ARAAcqd says if it can keep the hardware running, if not it's a
+      //normal stop and start
+      countAcqdIdle=0;
+      if(rolloverRun("Timed rollover by ARAd")==0) {
+	runsSincePedestalRun++;
+	needToStart=0;
+      }
+    }
+
     if(needToStart) {
       countAcqdIdle=0;
       retVal=stopRun("Stopped by ARAd");
@@ -421,6 +432,8 @@ int sendCommandToAcqd(AraProgramControl_t requestedState, AraProgramStatus_t des
     return -1;
   }
   fAcqdStatus=progResponse.currentStatus;
+  //Refused, ARAAcqd answers with what it wants done instead
+  if(progResponse.controlState!=requestedState) return 1;
   int lastStatus=0;
   int firstTime=1;
   while(progResponse.currentStatus!=desiredState) {
@@ -498,9 +511,8 @@ int startNewRun(char *logMessage, AraRunType_t runType)
   return retVal;
 }
 
-int stopRun(char *logMessage)
-{ 
-
+void writeRunStopFile(char *logMessage)
+{
   char filename[FILENAME_MAX];
   int retVal=0;
   sprintf(filename,"%s/runStop.run%6.6d.dat",theConfig.runLogDir,fCurrentRun);   
@@ -528,12 +540,31 @@ int stopRun(char *logMessage)
     fclose (pFile);
     if(theConfig.linkForXfer)
       makeLink(filename,theConfig.linkDir);
-
   }
+}
 
+int stopRun(char *logMessage)
+{ 
+  writeRunStopFile(logMessage);
   return sendCommandToAcqd(ARA_PROG_CONTROL_STOP,ARA_PROG_IDLE,fCurrentRun,ARA_RUN_TYPE_NA);
 }
 
+int rolloverRun(char *logMessage)
+{
+  //ARAAcqd closes the run's files and waits, with the hardware still
+  //running, for the START of the next run. The files have to be closed
+  //before makeNewRunDirs moves the current link
+  int retVal=sendCommandToAcqd(ARA_PROG_CONTROL_ROLLOVER,ARA_PROG_ROLLING_OVER,fCurrentRun,ARA_RUN_TYPE_NORMAL);
+  if(retVal!=0) {
+    if(retVal>0) ARA_LOG_MESSAGE(LOG_INFO,"ARAAcqd can't roll over run %d, stopping it\n",fCurrentRun);
+    return retVal;
+  }
+  writeRunStopFile(logMessage);
+  fCurrentRun=getNewRunNumber(theConfig.topDataDir);
+  makeNewRunDirs(logMessage);
+  return startNewRun(logMessage,ARA_RUN_TYPE_NORMAL);
+}
+
 
 int terminateProgram()
 { 
@@ -718,6 +749,7 @@ int readConfigFile(ARAdConfig_t *theConfigPtr)
     SET_INT(startRunOnStart,1);
     SET_INT(restartRunsEvery,3600);
     SET_INT(pedestalRunEveryNRuns,4);
+    SET_INT(rolloverRuns,0);
     SET_INT(startRunIfAcqdIdle,60);
     SET_INT(startAcqdIfNotRunning,120);
   }
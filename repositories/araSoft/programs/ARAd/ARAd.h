@@ -54,6 +54,7 @@ typedef struct {
   int startRunOnStart;
   int restartRunsEvery;
   int pedestalRunEveryNRuns; ///< Will take a pedestal run every Nth run
+  int rolloverRuns; ///< Timed normal runs roll over without reinitialising the hardware when ARAAcqd can
   int startRunIfAcqdIdle; ///< Starts a run if Acqd is idle
   int startAcqdIfNotRunning; ///< Starts a run if Acqd is idle
 } ARAdConfig_t;
@@ -68,6 +69,8 @@ int sendCommandToAcqd(AraProgramControl_t requestedState, AraProgramStatus_t des
 int prepareNewRun();
 int startNewRun(char *logMessage,AraRunType_t runType);
 int stopRun(char *logMessage);
+void writeRunStopFile(char *logMessage);
+int rolloverRun(char *logMessage);
 int terminateProgram();
 void updateAcqdStatus();
 void signalHandler();
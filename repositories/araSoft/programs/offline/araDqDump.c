@@ -0,0 +1,100 @@
+/*! \file araDqDump.c
+  \brief Prints the online data quality records ARAAcqd writes to the dqHk stream.
+
+  One line per record with the period, the number of events, the error, gap, time and block sequence counts and the alarms. With -c a line per channel that was read out follows with its blocks, stuck blocks, rail samples, mean block range and range histogram, and with -o its sample occupancy histogram. With -a only the records with alarms are printed.
+*/
+
+
+#include "araSoft.h"
+#include "araAtriStructures.h"
+#include "araDqLib/araDq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+
+void usage(char *argv0);
+
+
+int main(int argc, char **argv)
+{
+  AraDqHk_t record;
+  int opt,fileNum,channel,bin,dda,errorClass;
+  int printChannels=0,printOccupancy=0,onlyAlarms=0,numRecords=0,numPrinted=0;
+  uint32_t numSequence;
+  double meanRange;
+  gzFile infile;
+
+  while((opt=getopt(argc,argv,"coa"))!=-1) {
+    switch(opt) {
+    case 'c': printChannels=1; break;
+    case 'o': printOccupancy=1; break;
+    case 'a': onlyAlarms=1; break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if(optind>=argc) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  printf("# startUnixTime unixTime events errors eventIdGaps eventsMissed ppsJumps timeStampBackwards blockSequence alarms\n");
+  for(fileNum=optind;fileNum<argc;fileNum++) {
+    infile=gzopen(argv[fileNum],"rb");
+    if(!infile) {
+      fprintf(stderr,"Can't open %s\n",argv[fileNum]);
+      continue;
+    }
+    while(gzread(infile,&record,sizeof(AraDqHk_t))==sizeof(AraDqHk_t)) {
+      if(record.gHdr.typeId!=ARA_DQ_HK_TYPE) continue;
+      numRecords++;
+      if(onlyAlarms && !record.alarmMask) continue;
+      numPrinted++;
+      numSequence=record.numDdaMismatches;
+      for(dda=0;dda<DDA_PER_ATRI;dda++) numSequence+=record.numBlockSequenceErrors[dda];
+      printf("%u %llu %u ",record.startUnixTime,(unsigned long long)record.unixTime,record.numEvents);
+      for(errorClass=0;errorClass<ARA_DQ_NUM_ERROR_CLASSES;errorClass++)
+	printf("%s%u",errorClass ? "," : "",record.numErrors[errorClass]);
+      printf(" %u %u %u %u %u %s\n",record.numEventIdGaps,record.numEventsMissed,record.numPpsJumps,
+	     record.numTimeStampBackwards,numSequence,araDqAlarmAsString(record.alarmMask));
+      if(record.alarmMask&(ARA_DQ_ALARM_STUCK|ARA_DQ_ALARM_DEAD|ARA_DQ_ALARM_RAIL))
+	printf("  channels stuck 0x%08x dead 0x%08x rail 0x%08x\n",record.stuckChannelMask,
+	       record.deadChannelMask,record.railChannelMask);
+      if(!printChannels && !printOccupancy) continue;
+      for(channel=0;channel<ARA_DQ_NUM_CHANNELS;channel++) {
+	if(record.numBlocks[channel]==0) continue;
+	if(printChannels) {
+	  //The mean range from the histogram, taking the middle of each bin
+	  meanRange=0;
+	  for(bin=1;bin<ARA_DQ_RANGE_BINS;bin++)
+	    meanRange+=record.rangeHist[channel][bin]*1.5*(1<<(bin-1));
+	  printf("  %2d %u %u %u ~%.0f |",channel,record.numBlocks[channel],record.numStuckBlocks[channel],
+		 record.numRailSamples[channel],meanRange/record.numBlocks[channel]);
+	  for(bin=0;bin<ARA_DQ_RANGE_BINS;bin++) printf(" %u",record.rangeHist[channel][bin]);
+	  printf("\n");
+	}
+	if(printOccupancy && record.numHistEvents) {
+	  printf("  %2d occupancy |",channel);
+	  for(bin=0;bin<ARA_DQ_ADC_BINS;bin++) printf(" %u",record.adcHist[channel][bin]);
+	  printf("\n");
+	}
+      }
+    }
+    gzclose(infile);
+  }
+  printf("# %d of %d records\n",numPrinted,numRecords);
+  return 0;
+}
+
+
+void usage(char *argv0)
+{
+  printf("Usage:\n\t%s [options] <dqHk file> ...\n",argv0);
+  printf("\t-c also print the blocks, stuck blocks, rail samples, mean range and range histogram of each channel\n");
+  printf("\t-o also print the sample occupancy histogram of each channel\n");
+  printf("\t-a only print records with alarms\n");
+}
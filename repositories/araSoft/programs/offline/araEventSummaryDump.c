@@ -0,0 +1,78 @@
+/*! \file araEventSummaryDump.c
+  \brief Prints the event summaries ARAAcqd writes to the eventSummary stream.
+
+  One line per event with its number, time, triggers, filterFlag and whether the full event was written, followed with -c by a line per channel with the RMS, peak and where the peak is. With -n only the events whose largest channel peak is above a number of ADC counts are printed, which is a quick way of picking out events to send.
+*/
+
+
+#include "araSoft.h"
+#include "araAtriStructures.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+
+void usage(char *argv0);
+
+
+int main(int argc, char **argv)
+{
+  AraEventSummary_t summary;
+  int opt,fileNum,channel,maxPeak,printChannels=0,minPeak=0,numSummaries=0,numPrinted=0;
+  gzFile infile;
+
+  while((opt=getopt(argc,argv,"cn:"))!=-1) {
+    switch(opt) {
+    case 'c': printChannels=1; break;
+    case 'n': minPeak=atoi(optarg); break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if(optind>=argc) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  printf("# eventNumber unixTime unixTimeUs timeStamp triggerMask filterFlag written maxPeakChannel maxPeak\n");
+  for(fileNum=optind;fileNum<argc;fileNum++) {
+    infile=gzopen(argv[fileNum],"rb");
+    if(!infile) {
+      fprintf(stderr,"Can't open %s\n",argv[fileNum]);
+      continue;
+    }
+    while(gzread(infile,&summary,sizeof(AraEventSummary_t))==sizeof(AraEventSummary_t)) {
+      if(summary.gHdr.typeId!=ARA_EVENT_SUMMARY_TYPE) continue;
+      numSummaries++;
+      maxPeak=0;
+      for(channel=1;channel<DDA_PER_ATRI*RFCHAN_PER_DDA;channel++)
+	if(abs(summary.peak[channel])>abs(summary.peak[maxPeak])) maxPeak=channel;
+      if(abs(summary.peak[maxPeak])<minPeak) continue;
+      numPrinted++;
+      printf("%u %llu %u %u 0x%x 0x%04x %d %d %d%s\n",summary.eventNumber,(unsigned long long)summary.unixTime,
+	     summary.unixTimeUs,summary.timeStamp,summary.triggerMask,summary.filterFlag,
+	     (summary.flags&ARA_EVENT_SUMMARY_WRITTEN) ? 1 : 0,maxPeak,summary.peak[maxPeak],
+	     (summary.flags&ARA_EVENT_SUMMARY_BAD) ? " bad" : "");
+      if(!printChannels) continue;
+      for(channel=0;channel<DDA_PER_ATRI*RFCHAN_PER_DDA;channel++) {
+	if(summary.peakSample[channel]==ARA_EVENT_SUMMARY_NO_SAMPLE) continue;
+	printf("  %2d %.2f %d %u\n",channel,((float)summary.rms[channel])/ARA_EVENT_SUMMARY_RMS_SCALE,
+	       summary.peak[channel],summary.peakSample[channel]);
+      }
+    }
+    gzclose(infile);
+  }
+  printf("# %d of %d events\n",numPrinted,numSummaries);
+  return 0;
+}
+
+
+void usage(char *argv0)
+{
+  printf("Usage:\n\t%s [options] <eventSummary file> ...\n",argv0);
+  printf("\t-c also print the rms, peak and peak sample of each channel\n");
+  printf("\t-n <counts> only print events with a channel peaking at least this far from the mean\n");
+}
@@ -0,0 +1,169 @@
+/*! \file araFilterReplay.c
+  \brief Runs the ARAAcqd L5 filter over recorded event files, so thresholds, CW lines and the CPU budget can be tuned offline.
+
+  The events go through the same araFilterLib queue and worker threads ARAAcqd uses, configured from the filter section of the config file with any options on the command line on top. Each event is printed with its priority, flags and features, followed by how many events got each priority and the CPU time the filter took.
+*/
+
+
+#include "araSoft.h"
+#include "araAtriStructures.h"
+#include "araFilterLib/araFilter.h"
+#include "araPedestalLib/araPedestalFile.h"
+#include "configLib/configLib.h"
+#include "kvpLib/keyValuePair.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#define REPLAY_MAX_EVENT_BYTES 200000 ///< As ARAAcqd's MAX_EVENT_BUFFER_SIZE
+
+void usage(char *argv0);
+
+static int fQuiet=0;
+
+static void printFilteredEvents(AraFilter_t *filter, int wait)
+{
+  uint8_t *event;
+  int numBytes;
+  const AraFilterFeatures_t *features;
+  AraStationEventHeader_t *header;
+  while(araFilterNextEvent(filter,wait,&event,&numBytes,&features)) {
+    wait=0;
+    header=(AraStationEventHeader_t*)event;
+    if(!fQuiet)
+      printf("%u %d %s %d %d %d %d %u\n",header->eventNumber,araFilterPriority(features->filterFlag),
+	     araFilterFlagAsString(features->filterFlag),features->numHitChannels,features->numHitStrings,
+	     features->coincidenceSpread,features->numCwChannels,features->cpuUs);
+    araFilterReleaseEvent(filter);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  AraFilter_t theFilter;
+  AraFilterConfig_t config;
+  AraPedestalSet_t pedestals;
+  AtriGenericHeader_t *gHdr;
+  char *configFile=NULL;
+  char *pedestalFile=NULL;
+  int numThreads=-1,budgetUs=-1;
+  int opt,priority,fileNum,numRead,numEvents=0;
+  uint8_t *buffer;
+  struct timeval startTime,endTime;
+  double wallS;
+  gzFile infile;
+
+  while((opt=getopt(argc,argv,"c:t:b:p:q"))!=-1) {
+    switch(opt) {
+    case 'c': configFile=optarg; break;
+    case 't': numThreads=atoi(optarg); break;
+    case 'b': budgetUs=atoi(optarg); break;
+    case 'p': pedestalFile=optarg; break;
+    case 'q': fQuiet=1; break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if(optind>=argc) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  //The filter as ARAAcqd would have it
+  kvpReset();
+  if(configFile) {
+    if(configLoadFullPath(configFile,"filter")!=CONFIG_E_OK) {
+      fprintf(stderr,"Problem reading %s\n",configFile);
+      return -1;
+    }
+  }
+  else if(configLoad(ARA_ACQD_CONFIG_FILE,"filter")!=CONFIG_E_OK) {
+    fprintf(stderr,"Problem reading %s\n",ARA_ACQD_CONFIG_FILE);
+    return -1;
+  }
+  memset(&config,0,sizeof(config));
+  config.snrThreshold=kvpGetFloat("filterSnrThreshold",6);
+  config.minHitChannels=kvpGetInt("filterMinHitChannels",3);
+  config.minHitStrings=kvpGetInt("filterMinHitStrings",2);
+  config.coincidenceWindow=kvpGetInt("filterCoincidenceWindow",640);
+  config.calTimeStampMin=kvpGetInt("filterCalTimeStampMin",0);
+  config.calTimeStampMax=kvpGetInt("filterCalTimeStampMax",0);
+  config.numCwLines=ARA_FILTER_MAX_CW_LINES;
+  if(kvpGetFloatArray("filterCwFrequency",config.cwFrequency,&config.numCwLines)!=KVP_E_OK)
+    config.numCwLines=0;
+  config.cwFraction=kvpGetFloat("filterCwFraction",0.5);
+  config.cwMinChannels=kvpGetInt("filterCwMinChannels",4);
+  config.budgetUs=budgetUs>=0 ? budgetUs : kvpGetInt("filterBudgetUs",0);
+  if(numThreads<0) numThreads=kvpGetInt("filterNumThreads",0);
+  if(numThreads>ARA_FILTER_MAX_THREADS) numThreads=ARA_FILTER_MAX_THREADS;
+  if(pedestalFile) {
+    if(araPedestalSetLoad(&pedestals,pedestalFile,NULL)<0) {
+      fprintf(stderr,"Can't load the pedestals from %s\n",pedestalFile);
+      return -1;
+    }
+    config.pedestals=&pedestals;
+  }
+
+  buffer=malloc(REPLAY_MAX_EVENT_BYTES);
+  if(!buffer || araFilterInit(&theFilter,&config,numThreads,REPLAY_MAX_EVENT_BYTES)<0) {
+    fprintf(stderr,"Can't start the filter\n");
+    return -1;
+  }
+  gHdr=(AtriGenericHeader_t*)buffer;
+
+  if(!fQuiet)
+    printf("# eventNumber priority flags hitChannels hitStrings coincidenceSpread cwChannels cpuUs\n");
+  gettimeofday(&startTime,NULL);
+  for(fileNum=optind;fileNum<argc;fileNum++) {
+    infile=gzopen(argv[fileNum],"rb");
+    if(!infile) {
+      fprintf(stderr,"Can't open %s\n",argv[fileNum]);
+      continue;
+    }
+    while(gzread(infile,gHdr,sizeof(AtriGenericHeader_t))==sizeof(AtriGenericHeader_t)) {
+      if(gHdr->numBytes<sizeof(AtriGenericHeader_t) || gHdr->numBytes>REPLAY_MAX_EVENT_BYTES) {
+	fprintf(stderr,"Bad record of %u bytes in %s\n",gHdr->numBytes,argv[fileNum]);
+	break;
+      }
+      numRead=gHdr->numBytes-sizeof(AtriGenericHeader_t);
+      if(gzread(infile,buffer+sizeof(AtriGenericHeader_t),numRead)!=numRead) break;
+      if(gHdr->typeId!=ARA_EVENT_TYPE) continue;
+      //Only this thread releases events, so make room before adding
+      if(araFilterNumQueued(&theFilter)>=ARA_FILTER_QUEUE_DEPTH) printFilteredEvents(&theFilter,1);
+      if(araFilterAddEvent(&theFilter,buffer,gHdr->numBytes)==0) numEvents++;
+      printFilteredEvents(&theFilter,0);
+    }
+    gzclose(infile);
+  }
+  while(araFilterNumQueued(&theFilter)>0) printFilteredEvents(&theFilter,1);
+  gettimeofday(&endTime,NULL);
+  wallS=(endTime.tv_sec-startTime.tv_sec)+1e-6*(endTime.tv_usec-startTime.tv_usec);
+
+  printf("# %d events, %d threads, budget %d us, %s\n",numEvents,numThreads,config.budgetUs,
+	 pedestalFile ? "pedestal subtracted" : "block means subtracted");
+  for(priority=0;priority<ARA_FILTER_NUM_PRIORITIES;priority++)
+    printf("# priority %d: %u events\n",priority,theFilter.numPriority[priority]);
+  printf("# %u over budget, cpu mean %.1f us max %u us, %.1f events/s\n",theFilter.numOverBudget,
+	 theFilter.numEvents ? theFilter.sumCpuUs/theFilter.numEvents : 0,theFilter.maxCpuUs,
+	 wallS>0 ? numEvents/wallS : 0);
+  araFilterFree(&theFilter);
+  if(pedestalFile) araPedestalSetFree(&pedestals);
+  free(buffer);
+  return 0;
+}
+
+
+void usage(char *argv0)
+{
+  printf("Usage:\n\t%s [options] <event file> ...\n",argv0);
+  printf("\t-c <file> config file (default %s)\n",ARA_ACQD_CONFIG_FILE);
+  printf("\t-t <threads> override the number of filter threads\n");
+  printf("\t-b <us> override the CPU budget per event, 0 for no limit\n");
+  printf("\t-p <file> pedestals to subtract, binary or text (default subtract the block means)\n");
+  printf("\t-q only print the summary\n");
+}
@@ -0,0 +1,151 @@
+/*! \file araPedestalThreadCheck.c
+  \brief Checks that araPedestalLib gives the same sums for any number of worker threads.
+
+  The same synthetic events are fed to accumulators and trackers with every
+  number of workers from 0 to ARA_PED_MAX_THREADS and their contents are
+  compared bit for bit with the 0 thread ones. Some events have a block
+  header for the wrong DDA or are cut short, so the bad event handling is
+  checked too. Exits with 0 if everything matches and 1 if not.
+*/
+
+
+#include "araSoft.h"
+#include "araPedestalLib/araPedestal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+
+void usage(char *argv0);
+
+#define CHECK_MAX_READOUT_BLOCKS 8
+#define CHECK_MAX_EVENT_BYTES (sizeof(AraStationEventHeader_t)+CHECK_MAX_READOUT_BLOCKS*DDA_PER_ATRI*\
+			       (sizeof(AraStationEventBlockHeader_t)+RFCHAN_PER_DDA*sizeof(AraStationEventBlockChannel_t)))
+#define CHECK_TRACK_SHIFT 4
+
+static int makeEvent(uint8_t *buffer, int *numReadoutBlocks, const int *stackEnabled)
+{
+  //Fills buffer with an unpacked event of random blocks and samples and
+  //returns its size. About one event in 32 has a block header for the
+  //wrong DDA somewhere, which should stop every shard there, and one in 32
+  //is truncated.
+  AraStationEventBlockHeader_t *blkHeader;
+  AraStationEventBlockChannel_t *chanPtr;
+  int uptoByte=sizeof(AraStationEventHeader_t);
+  int readout,dda,chan,sample,badDda;
+  int badType=rand()%32;
+  int badReadout,badDdaNum;
+
+  memset(buffer,0,sizeof(AraStationEventHeader_t));
+  *numReadoutBlocks=1+rand()%CHECK_MAX_READOUT_BLOCKS;
+  badReadout=rand()%(*numReadoutBlocks);
+  badDdaNum=rand()%DDA_PER_ATRI;
+  for(readout=0;readout<*numReadoutBlocks;readout++) {
+    for(dda=0;dda<DDA_PER_ATRI;dda++) {
+      if(!stackEnabled[dda]) continue;
+      blkHeader=(AraStationEventBlockHeader_t*)&buffer[uptoByte];
+      blkHeader->irsBlockNumber=rand()%BLOCKS_PER_DDA;
+      badDda=(badType==0 && readout==badReadout && dda==badDdaNum);
+      blkHeader->channelMask=0xff | (((badDda ? dda+1 : dda)%DDA_PER_ATRI)<<8);
+      uptoByte+=sizeof(AraStationEventBlockHeader_t);
+      for(chan=0;chan<RFCHAN_PER_DDA;chan++) {
+	chanPtr=(AraStationEventBlockChannel_t*)&buffer[uptoByte];
+	for(sample=0;sample<SAMPLES_PER_BLOCK;sample++)
+	  chanPtr->samples[sample]=1500+dda*100+rand()%1000;
+	uptoByte+=sizeof(AraStationEventBlockChannel_t);
+      }
+    }
+  }
+  if(badType==1) uptoByte-=sizeof(AraStationEventBlockChannel_t)/2;
+  return uptoByte;
+}
+
+static int compareAccumulators(AraPedestalAccumulator_t *ref, AraPedestalAccumulator_t *acc, const char *what, int numThreads)
+{
+  int numDiff=0;
+  if(ref->sum && memcmp(ref->sum,acc->sum,sizeof(uint64_t)*ARA_PED_NUM_CELLS)) numDiff++;
+  if(ref->sumSq && memcmp(ref->sumSq,acc->sumSq,sizeof(uint64_t)*ARA_PED_NUM_CELLS)) numDiff++;
+  if(ref->trackMean && memcmp(ref->trackMean,acc->trackMean,sizeof(int32_t)*ARA_PED_NUM_CELLS)) numDiff++;
+  if(ref->trackVar && memcmp(ref->trackVar,acc->trackVar,sizeof(uint32_t)*ARA_PED_NUM_CELLS)) numDiff++;
+  if(memcmp(ref->count,acc->count,sizeof(uint32_t)*ARA_PED_NUM_CHANNEL_BLOCKS)) numDiff++;
+  if(ref->numEvents!=acc->numEvents || ref->numBadEvents!=acc->numBadEvents) numDiff++;
+  printf("%s with %d threads: %u events, %u bad, %s\n",what,numThreads,acc->numEvents,acc->numBadEvents,
+	 numDiff ? "DIFFERENT" : "identical");
+  return numDiff;
+}
+
+static int checkThreads(int numEvents, unsigned int seed, int tracker)
+{
+  //Runs the same events through every thread count and compares them
+  //with 0 threads. Trackers drop events when their queue is full, so they
+  //are waited on after each event to keep the inputs the same.
+  AraPedestalAccumulator_t ref,acc;
+  AraPedestalAccumulator_t *thisAcc;
+  const char *what=tracker ? "Tracker" : "Accumulator";
+  uint8_t *buffer;
+  int stackEnabled[DDA_PER_ATRI]={1,1,1,1};
+  int numThreads,event,numBytes,numReadoutBlocks,retVal;
+  int numDiff=0;
+
+  buffer=malloc(CHECK_MAX_EVENT_BYTES);
+  if(!buffer) return -1;
+  for(numThreads=0;numThreads<=ARA_PED_MAX_THREADS;numThreads++) {
+    thisAcc=numThreads ? &acc : &ref;
+    if(tracker) retVal=araPedestalInitTracker(thisAcc,numThreads,CHECK_MAX_EVENT_BYTES,CHECK_TRACK_SHIFT);
+    else retVal=araPedestalInit(thisAcc,numThreads,CHECK_MAX_EVENT_BYTES);
+    if(retVal<0) {
+      if(numThreads) araPedestalFree(&ref);
+      free(buffer);
+      return -1;
+    }
+    srand(seed);
+    for(event=0;event<numEvents;event++) {
+      //A missing DDA now and then, as with a dead stack
+      stackEnabled[event%DDA_PER_ATRI]=(event%97)!=0;
+      numBytes=makeEvent(buffer,&numReadoutBlocks,stackEnabled);
+      araPedestalAddEvent(thisAcc,buffer,numBytes,numReadoutBlocks,-1,event%2,stackEnabled);
+      if(tracker) araPedestalWait(thisAcc);
+    }
+    araPedestalWait(thisAcc);
+    if(numThreads) {
+      numDiff+=compareAccumulators(&ref,&acc,what,numThreads);
+      araPedestalFree(&acc);
+    }
+  }
+  araPedestalFree(&ref);
+  free(buffer);
+  return numDiff;
+}
+
+
+int main(int argc, char **argv)
+{
+  int numEvents=2000;
+  unsigned int seed=1;
+  int numDiff,retVal;
+  printToScreen=LOG_INFO;
+  if(argc>1 && (argv[1][0]<'0' || argv[1][0]>'9')) {
+    usage(argv[0]);
+    return -1;
+  }
+  if(argc>1) numEvents=atoi(argv[1]);
+  if(argc>2) seed=strtoul(argv[2],NULL,10);
+
+  numDiff=0;
+  retVal=checkThreads(numEvents,seed,0);
+  if(retVal<0) return -1;
+  numDiff+=retVal;
+  retVal=checkThreads(numEvents,seed,1);
+  if(retVal<0) return -1;
+  numDiff+=retVal;
+  return numDiff ? 1 : 0;
+}
+
+
+void usage(char *argv0)
+{
+  fprintf(stderr,"Usage:\n");
+  fprintf(stderr,"\t%s [num events, default 2000] [random seed, default 1]\n",argv0);
+  fprintf(stderr,"Exits with 1 if any number of threads gives different sums to 0 threads\n");
+}
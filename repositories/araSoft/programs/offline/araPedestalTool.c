@@ -0,0 +1,127 @@
+/*! \file araPedestalTool.c
+  \brief Converts pedestal sets between the binary (.ped) and legacy text formats, prints their headers and compares them.
+
+  Wherever a pedestal set is read either format is accepted, text files being given as the values file optionally followed by the widths file.
+*/
+
+
+#include "araSoft.h"
+#include "araPedestalLib/araPedestalFile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <syslog.h>
+
+
+void usage(char *argv0);
+
+static double msSince(struct timeval *startTime)
+{
+  struct timeval nowTime;
+  gettimeofday(&nowTime,NULL);
+  return (nowTime.tv_sec-startTime->tv_sec)*1e3+(nowTime.tv_usec-startTime->tv_usec)*1e-3;
+}
+
+static int printInfo(const char *filename)
+{
+  AraPedestalSet_t pedSet;
+  struct timeval startTime;
+  time_t takenTime;
+  double loadMs;
+  gettimeofday(&startTime,NULL);
+  if(araPedestalSetLoadBinary(&pedSet,filename,1)<0) return -1;
+  loadMs=msSince(&startTime);
+  takenTime=pedSet.header.unixTime;
+  printf("%s: station %d run %u, %u events (at least %u per channel block)\n",filename,
+	 pedSet.header.stationId,pedSet.header.runNumber,pedSet.header.numEvents,pedSet.header.minCount);
+  printf("Taken %s",ctime(&takenTime));
+  printf("%d x %d x %d x %d cells, %d fractional bits, checksum %#010x (verified in %.2f ms)\n",
+	 pedSet.header.numDda,pedSet.header.numBlocks,pedSet.header.numChans,pedSet.header.numSamples,
+	 pedSet.header.fracBits,pedSet.header.checksum,loadMs);
+  araPedestalSetFree(&pedSet);
+  return 0;
+}
+
+static int toBinary(const char *meanFilename, const char *rmsFilename, const char *outFilename, uint32_t runNumber)
+{
+  AraPedestalSet_t pedSet;
+  if(rmsFilename && strcmp(rmsFilename,"-")==0) rmsFilename=NULL;
+  if(araPedestalSetReadText(&pedSet,meanFilename,rmsFilename,runNumber)<0) return -1;
+  if(araPedestalSetWriteBinary(&pedSet,outFilename)<0) {
+    araPedestalSetFree(&pedSet);
+    return -1;
+  }
+  araPedestalSetFree(&pedSet);
+  return 0;
+}
+
+static int toText(const char *filename, const char *meanFilename, const char *rmsFilename)
+{
+  AraPedestalSet_t pedSet;
+  FILE *fpMean=NULL,*fpRms=NULL;
+  int retVal=0;
+  if(araPedestalSetLoadBinary(&pedSet,filename,1)<0) return -1;
+  fpMean=fopen(meanFilename,"w");
+  if(rmsFilename) fpRms=fopen(rmsFilename,"w");
+  if(!fpMean || (rmsFilename && !fpRms)) {
+    fprintf(stderr,"Can't open the output files\n");
+    retVal=-1;
+  }
+  else if(araPedestalSetWriteText(&pedSet,fpMean,fpRms)<0) retVal=-1;
+  if(fpMean && fclose(fpMean)) retVal=-1;
+  if(fpRms && fclose(fpRms)) retVal=-1;
+  araPedestalSetFree(&pedSet);
+  return retVal;
+}
+
+static int diff(const char *filenameA, const char *filenameB, double threshold)
+{
+  AraPedestalSet_t pedSetA,pedSetB;
+  AraPedestalDiff_t pedDiff;
+  if(araPedestalSetLoad(&pedSetA,filenameA,NULL)<0) return -1;
+  if(araPedestalSetLoad(&pedSetB,filenameB,NULL)<0) {
+    araPedestalSetFree(&pedSetA);
+    return -1;
+  }
+  araPedestalSetDiff(&pedSetA,&pedSetB,threshold,&pedDiff);
+  printf("Mean difference %.3f, rms %.3f ADC counts\n",pedDiff.meanMeanDiff,pedDiff.rmsMeanDiff);
+  printf("Largest %.3f at dda %d block %d chan %d sample %d\n",pedDiff.maxMeanDiff,
+	 pedDiff.maxDda,pedDiff.maxBlock,pedDiff.maxChan,pedDiff.maxSample);
+  printf("%u of %u cells differ by more than %.1f\n",pedDiff.numMeanOver,pedDiff.numCells,threshold);
+  araPedestalSetFree(&pedSetA);
+  araPedestalSetFree(&pedSetB);
+  return pedDiff.numMeanOver ? 1 : 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  printToScreen=LOG_INFO; //So load and format errors are seen
+  if(argc<3) {
+    usage(argv[0]);
+    return -1;
+  }
+  if(strcmp(argv[1],"info")==0)
+    return printInfo(argv[2]);
+  if(strcmp(argv[1],"tobin")==0 && argc>=5)
+    return toBinary(argv[2],argv[3],argv[4],argc>5 ? strtoul(argv[5],NULL,10) : 0);
+  if(strcmp(argv[1],"totext")==0 && argc>=4)
+    return toText(argv[2],argv[3],argc>4 ? argv[4] : NULL);
+  if(strcmp(argv[1],"diff")==0 && argc>=4)
+    return diff(argv[2],argv[3],argc>4 ? atof(argv[4]) : 2);
+  usage(argv[0]);
+  return -1;
+}
+
+
+void usage(char *argv0)
+{
+  fprintf(stderr,"Usage:\n");
+  fprintf(stderr,"\t%s info <pedestals.ped>\n",argv0);
+  fprintf(stderr,"\t%s tobin <pedestalValues.dat> <pedestalWidths.dat|-> <pedestals.ped> [run]\n",argv0);
+  fprintf(stderr,"\t%s totext <pedestals.ped> <pedestalValues.dat> [pedestalWidths.dat]\n",argv0);
+  fprintf(stderr,"\t%s diff <pedestalsA> <pedestalsB> [threshold ADC counts, default 2]\n",argv0);
+  fprintf(stderr,"diff exits with 1 if any cell differs by more than the threshold\n");
+}
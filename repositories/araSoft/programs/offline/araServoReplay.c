@@ -0,0 +1,233 @@
+/*! \file araServoReplay.c
+  \brief Runs one of the ARAAcqd servos against recorded event hk files, so goals, gains and limits can be tuned offline.
+
+  The servo is the same araServoLib servo ARAAcqd runs, fed with each recorded AraEventHk_t in turn, with the DAC values it would have set kept locally instead of being written to the ATRI. By default the replay is open loop (the measurements are exactly as recorded). With -k the measurements are corrected by a linear plant model, slope times the difference between the replayed and recorded DAC values, which closes the loop well enough to compare gains.
+*/
+
+
+#include "araSoft.h"
+#include "araAtriStructures.h"
+#include "araServoLib/araServo.h"
+#include "configLib/configLib.h"
+#include "kvpLib/keyValuePair.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <zlib.h>
+
+
+void usage(char *argv0);
+
+//Replay state, shared with the sensor and actuator
+static AraServoSensor_t fRealSensor;
+static float fPlantSlope=0;
+static uint16_t fRecordedDac[ARA_SERVO_MAX_CHANNELS];
+static uint16_t fReplayedDac[ARA_SERVO_MAX_CHANNELS];
+static AraServo_t *fAntServo=NULL; ///< Has its goals scaled by the rate servo
+static uint16_t fBaseGoals[ARA_SERVO_MAX_CHANNELS];
+static uint16_t fGoalScale=ARA_SERVO_RATE_SCALE_UNIT;
+
+static int replaySensor(AraServo_t *servo, const void *input, uint32_t *stamp, float *measured)
+{
+  int ch;
+  if(fRealSensor(servo,input,stamp,measured)<0) return -1;
+  for(ch=0;ch<servo->numChannels;ch++)
+    measured[ch]+=fPlantSlope*((int)fReplayedDac[ch]-(int)fRecordedDac[ch]);
+  return 0;
+}
+
+static int replayActuator(AraServo_t *servo, void *context, const uint16_t *outputs)
+{
+  memcpy(fReplayedDac,outputs,servo->numChannels*sizeof(uint16_t));
+  return 0;
+}
+
+static int rateActuator(AraServo_t *servo, void *context, const uint16_t *outputs)
+{
+  fGoalScale=outputs[0];
+  araServoScaleGoals(fAntServo,fBaseGoals,fGoalScale);
+  printf("# rate %.2f Hz, goal scale %.3f\n",servo->measured[0],((float)fGoalScale)/ARA_SERVO_RATE_SCALE_UNIT);
+  return 0;
+}
+
+static void getRecordedDac(const char *servoName, const AraEventHk_t *eventHk, uint16_t *dac)
+{
+  if(strcmp(servoName,"vdly")==0)
+    memcpy(dac,eventHk->vdlyDac,DDA_PER_ATRI*sizeof(uint16_t));
+  else if(strcmp(servoName,"surface")==0)
+    memcpy(dac,eventHk->surfaceThresholdDac,ANTS_PER_TDA*sizeof(uint16_t));
+  else
+    memcpy(dac,eventHk->thresholdDac,THRESHOLDS_PER_ATRI*sizeof(uint16_t));
+}
+
+
+int main(int argc, char **argv)
+{
+  AraServo_t theServo;
+  AraServo_t rateServo;
+  AraServoRateInput_t rateInput;
+  AraServoGains_t gains;
+  AraEventHk_t eventHk;
+  uint16_t goals[ARA_SERVO_MAX_CHANNELS];
+  float gainScale[THRESHOLDS_PER_ATRI];
+  int stackEnabled[DDA_PER_ATRI];
+  char *servoName="ant";
+  char *configFile=NULL;
+  float pGain=NAN,iGain=NAN,dGain=NAN,error;
+  int maxStep=-1,printChannel=-1,quiet=0,useRateServo=0,rateWindow=0;
+  int opt,ch,tempNum,fileNum,numRecords=0,numSet=0,first=1;
+  double sumErrorSq[ARA_SERVO_MAX_CHANNELS]={0};
+  unsigned int numErrors[ARA_SERVO_MAX_CHANNELS]={0};
+  gzFile infile;
+
+  while((opt=getopt(argc,argv,"s:c:p:i:d:m:k:n:qr"))!=-1) {
+    switch(opt) {
+    case 's': servoName=optarg; break;
+    case 'c': configFile=optarg; break;
+    case 'p': pGain=atof(optarg); break;
+    case 'i': iGain=atof(optarg); break;
+    case 'd': dGain=atof(optarg); break;
+    case 'm': maxStep=atoi(optarg); break;
+    case 'k': fPlantSlope=atof(optarg); break;
+    case 'n': printChannel=atoi(optarg); break;
+    case 'q': quiet=1; break;
+    case 'r': useRateServo=1; break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if(optind>=argc || (strcmp(servoName,"ant") && strcmp(servoName,"surface") && strcmp(servoName,"vdly"))) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  //Goals and gains as ARAAcqd would have them
+  kvpReset();
+  if(configFile) {
+    if(configLoadFullPath(configFile,"acq")!=CONFIG_E_OK || configLoadFullPath(configFile,"servo")!=CONFIG_E_OK) {
+      fprintf(stderr,"Problem reading %s\n",configFile);
+      return -1;
+    }
+  }
+  else if(configLoad(ARA_ACQD_CONFIG_FILE,"acq")!=CONFIG_E_OK || configLoad(ARA_ACQD_CONFIG_FILE,"servo")!=CONFIG_E_OK) {
+    fprintf(stderr,"Problem reading %s\n",ARA_ACQD_CONFIG_FILE);
+    return -1;
+  }
+  for(ch=0;ch<DDA_PER_ATRI;ch++) stackEnabled[ch]=1;
+  tempNum=DDA_PER_ATRI;
+  kvpGetIntArray("stackEnabled",stackEnabled,&tempNum);
+  for(ch=0;ch<THRESHOLDS_PER_ATRI;ch++) gainScale[ch]=1;
+  tempNum=THRESHOLDS_PER_ATRI;
+  kvpGetFloatArray("scalerGainScale",gainScale,&tempNum);
+
+  if(strcmp(servoName,"vdly")==0) {
+    gains.pGain=isnan(pGain) ? kvpGetFloat("vdlyPGain",0.5) : pGain;
+    gains.iGain=isnan(iGain) ? kvpGetFloat("vdlyIGain",0.01) : iGain;
+    gains.dGain=isnan(dGain) ? kvpGetFloat("vdlyDGain",0) : dGain;
+    gains.iMax=kvpGetFloat("vdlyIMax",100);
+    gains.iMin=kvpGetFloat("vdlyIMin",-100);
+    araServoInitVdly(&theServo,kvpGetInt("wilkinsonGoal",62000),stackEnabled,
+		     kvpGetInt("vdlyUsePid",0) ? &gains : NULL,replayActuator,fReplayedDac);
+    theServo.maxStep=maxStep>=0 ? maxStep : kvpGetInt("vdlyMaxStep",0);
+  }
+  else {
+    gains.pGain=isnan(pGain) ? kvpGetFloat("scalerPGain",0.5) : pGain;
+    gains.iGain=isnan(iGain) ? kvpGetFloat("scalerIGain",0.01) : iGain;
+    gains.dGain=isnan(dGain) ? kvpGetFloat("scalerDGain",0) : dGain;
+    gains.iMax=kvpGetFloat("scalerIMax",100);
+    gains.iMin=kvpGetFloat("scalerIMin",-100);
+    memset(goals,0,sizeof(goals));
+    if(strcmp(servoName,"surface")==0) {
+      tempNum=ANTS_PER_TDA;
+      kvpGetUnsignedShortArray("surfaceGoalValues",goals,&tempNum);
+      araServoInitSurface(&theServo,goals,&gains,replayActuator,fReplayedDac);
+    }
+    else {
+      tempNum=THRESHOLDS_PER_ATRI;
+      kvpGetUnsignedShortArray("scalerGoalValues",goals,&tempNum);
+      araServoInitAnt(&theServo,goals,&gains,gainScale,replayActuator,fReplayedDac);
+    }
+    theServo.maxStep=maxStep>=0 ? maxStep : kvpGetInt("scalerMaxStep",0);
+  }
+  if(useRateServo && strcmp(servoName,"ant")==0) {
+    //The rate servo as configured, moving the goals of the replayed ant servo
+    fAntServo=&theServo;
+    memcpy(fBaseGoals,goals,sizeof(fBaseGoals));
+    gains.pGain=kvpGetFloat("ratePGain",20);
+    gains.iGain=kvpGetFloat("rateIGain",2);
+    gains.dGain=kvpGetFloat("rateDGain",0);
+    gains.iMax=kvpGetFloat("rateIMax",50);
+    gains.iMin=kvpGetFloat("rateIMin",-50);
+    araServoInitRate(&rateServo,kvpGetFloat("rateGoalHz",5),&gains,kvpGetFloat("rateGoalScaleMin",0.25),
+		     kvpGetFloat("rateGoalScaleMax",4),rateActuator,&fGoalScale);
+    rateServo.maxStep=(int)(kvpGetFloat("rateGoalScaleStep",0.1)*ARA_SERVO_RATE_SCALE_UNIT);
+    rateWindow=(int)kvpGetFloat("servoCalcDelayS",10);
+    memset(&rateInput,0,sizeof(AraServoRateInput_t));
+  }
+  fRealSensor=theServo.sensor;
+  theServo.sensor=replaySensor;
+
+  if(!quiet)
+    printf("# ppsCounter channel measured goal recordedDac replayedDac\n");
+  for(fileNum=optind;fileNum<argc;fileNum++) {
+    infile=gzopen(argv[fileNum],"rb");
+    if(!infile) {
+      fprintf(stderr,"Can't open %s\n",argv[fileNum]);
+      continue;
+    }
+    while(gzread(infile,&eventHk,sizeof(AraEventHk_t))==sizeof(AraEventHk_t)) {
+      if(eventHk.gHdr.typeId!=ARA_EVENT_HK_TYPE) continue;
+      numRecords++;
+      getRecordedDac(servoName,&eventHk,fRecordedDac);
+      //Start from whatever the DAQ had set
+      if(first) {
+	memcpy(fReplayedDac,fRecordedDac,sizeof(fRecordedDac));
+	first=0;
+      }
+      if(fAntServo && araServoAccumulateRate(&rateInput,&eventHk,rateWindow))
+	araServoUpdate(&rateServo,&rateInput,NULL);
+      if(araServoUpdate(&theServo,&eventHk,NULL)>0) numSet++;
+      for(ch=0;ch<theServo.numChannels;ch++) {
+	if(!theServo.enabled[ch] || isnan(theServo.measured[ch])) continue;
+	error=theServo.goal[ch]-theServo.measured[ch];
+	sumErrorSq[ch]+=error*error;
+	numErrors[ch]++;
+	if(quiet || (printChannel>=0 && ch!=printChannel)) continue;
+	printf("%u %d %.1f %.1f %u %u\n",eventHk.ppsCounter,ch,theServo.measured[ch],theServo.goal[ch],
+	       fRecordedDac[ch],fReplayedDac[ch]);
+      }
+    }
+    gzclose(infile);
+  }
+
+  printf("# %s servo, %d event hk, %d updates set new values (P %g I %g D %g, max step %d, plant slope %g)\n",
+	 servoName,numRecords,numSet,theServo.pGain[0],theServo.iGain[0],theServo.dGain[0],
+	 theServo.maxStep,fPlantSlope);
+  printf("# %u skipped, %u saturated, %u rate limited, %u windup held\n",theServo.numSkipped,
+	 theServo.numSaturated,theServo.numRateLimited,theServo.numWindupHeld);
+  if(fAntServo)
+    printf("# rate servo, %u updates, final goal scale %.3f (the L4 rate is always as recorded)\n",
+	   rateServo.numUpdates,((float)fGoalScale)/ARA_SERVO_RATE_SCALE_UNIT);
+  for(ch=0;ch<theServo.numChannels;ch++) {
+    if(!numErrors[ch]) continue;
+    printf("# channel %2d rms error %.2f\n",ch,sqrt(sumErrorSq[ch]/numErrors[ch]));
+  }
+  return 0;
+}
+
+
+void usage(char *argv0)
+{
+  printf("Usage:\n\t%s [options] <eventHk file> ...\n",argv0);
+  printf("\t-s <ant|surface|vdly> servo to replay (default ant)\n");
+  printf("\t-c <file> config file (default %s)\n",ARA_ACQD_CONFIG_FILE);
+  printf("\t-p <gain> -i <gain> -d <gain> override the configured gains\n");
+  printf("\t-m <step> override the largest DAC change per update\n");
+  printf("\t-k <slope> plant model, measured units per DAC count (default 0, open loop)\n");
+  printf("\t-n <channel> only print one channel\n");
+  printf("\t-q only print the summary\n");
+  printf("\t-r also run the rate servo, moving the ant servo goals (ant servo only)\n");
+}
@@ -0,0 +1,96 @@
+/*! \file atriTraceDecode.c
+  \brief This command line program prints the contents of an atriTrace dump (as written by ARAAcqd on SIGUSR1, at the end of a run or on a crash) in a human readable form.
+*/
+
+
+#include "atriControlLib/atriTrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+void usage(char *argv0);
+
+
+int main(int argc, char **argv)
+{
+  AtriTraceFileHeader_t header;
+  AtriTraceEntry_t entry;
+  FILE *fpTrace;
+  uint64_t firstTimeStamp=0;
+  uint32_t entryNum;
+  int i,printPayload=1;
+  double relTime,absTime;
+
+  if(argc<2) {
+    usage(argv[0]);
+    return -1;
+  }
+  if(argc>2 && strcmp(argv[2],"-q")==0) printPayload=0;
+
+  fpTrace=fopen(argv[1],"rb");
+  if(fpTrace==NULL) {
+    fprintf(stderr,"Can't open %s\n",argv[1]);
+    return -1;
+  }
+  if(fread(&header,sizeof(AtriTraceFileHeader_t),1,fpTrace)!=1) {
+    fprintf(stderr,"Can't read header from %s\n",argv[1]);
+    fclose(fpTrace);
+    return -1;
+  }
+  if(header.magic!=ATRI_TRACE_FILE_MAGIC) {
+    fprintf(stderr,"%s is not an atriTrace file (magic %#x)\n",argv[1],header.magic);
+    fclose(fpTrace);
+    return -1;
+  }
+  if(header.version!=ATRI_TRACE_FILE_VERSION || header.entrySize!=sizeof(AtriTraceEntry_t)) {
+    fprintf(stderr,"Unsupported atriTrace version %d (entry size %d)\n",header.version,header.entrySize);
+    fclose(fpTrace);
+    return -1;
+  }
+
+  time_t dumpTime=header.dumpUnixTime;
+  printf("Trace dumped at %s",ctime(&dumpTime));
+  printf("%u entries (of %u recorded), %.1f ticks/us\n",header.numEntries,header.totalRecorded,header.ticksPerUs);
+
+  for(entryNum=0;entryNum<header.numEntries;entryNum++) {
+    if(fread(&entry,sizeof(AtriTraceEntry_t),1,fpTrace)!=1) {
+      fprintf(stderr,"Trace truncated after %u entries\n",entryNum);
+      break;
+    }
+    if(entryNum==0) firstTimeStamp=entry.timeStamp;
+
+    //Convert the time stamps to microseconds if we have a calibration
+    if(header.ticksPerUs>0) {
+      relTime=((int64_t)(entry.timeStamp-firstTimeStamp))/header.ticksPerUs;
+      absTime=header.dumpUnixTime+1e-6*header.dumpUnixTimeUs;
+      absTime-=1e-6*((int64_t)(header.dumpTimeStamp-entry.timeStamp))/header.ticksPerUs;
+      printf("%6u %14.3f %17.6f ",entryNum,relTime,absTime);
+    }
+    else {
+      printf("%6u %14llu ",entryNum,(unsigned long long)(entry.timeStamp-firstTimeStamp));
+    }
+    printf("%-7s loc %#4.2x num %#4.2x status %4d len %5d",
+	   atriTraceDirectionAsString(entry.direction),
+	   entry.location,entry.packetNumber,entry.status,entry.length);
+    if(entry.direction==ATRI_TRACE_VENDOR_REQUEST)
+      printf(" wValue %#6.4x wIndex %#6.4x",entry.aux>>16,entry.aux&0xffff);
+    printf("\n");
+    if(!printPayload) continue;
+    for(i=0;i<entry.numStored;i++) {
+      printf("%2.2x",entry.payload[i]);
+      if(!((i+1)%16) || (i+1==entry.numStored)) printf("\n");
+      else printf(" ");
+    }
+  }
+  fclose(fpTrace);
+  return 0;
+}
+
+
+void usage(char *argv0)
+{
+  printf("Usage:\n\t%s <atriTrace file> [-q]\n",argv0);
+  printf("\t-q only print the entry headers, not the payload\n");
+}
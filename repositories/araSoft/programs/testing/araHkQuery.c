@@ -0,0 +1,119 @@
+/*! \file araHkQuery.c
+  Asks ARAHkStored for the list of housekeeping series, the points of one
+  series or a summary of one series over a time range. Times are unix
+  seconds, or seconds before now if negative.
+*/
+
+
+#include "araHkStoreLib/araHkStore.h"
+#include <unistd.h>
+#include <libgen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+void usage(char *argv0);
+
+static int64_t parseTimeMs(const char *arg, int64_t nowMs)
+{
+  double value=atof(arg);
+  if(value<=0) return nowMs+(int64_t)(value*1000);
+  return (int64_t)(value*1000);
+}
+
+int main(int argc, char **argv)
+{
+  AraHkQuery_t query;
+  AraHkQueryReply_t reply;
+  AraHkPoint_t *points=NULL;
+  struct timeval nowTime;
+  int64_t nowMs;
+  size_t bufferBytes;
+  void *buffer;
+  int fd,i,numRead;
+  char *progName=basename(argv[0]);
+
+  if(argc<2) {
+    usage(progName);
+    exit(1);
+  }
+  gettimeofday(&nowTime,NULL);
+  nowMs=((int64_t)nowTime.tv_sec)*1000+nowTime.tv_usec/1000;
+
+  memset(&query,0,sizeof(AraHkQuery_t));
+  query.tier=-1;
+  query.maxPoints=ARA_HK_MAX_QUERY_POINTS;
+  if(strcmp(argv[1],"list")==0) {
+    query.command=ARA_HK_QUERY_LIST;
+  }
+  else if(strcmp(argv[1],"range")==0 || strcmp(argv[1],"agg")==0) {
+    if(argc<3) {
+      usage(progName);
+      exit(1);
+    }
+    query.command=strcmp(argv[1],"range")==0 ? ARA_HK_QUERY_RANGE : ARA_HK_QUERY_AGGREGATE;
+    strncpy(query.series,argv[2],ARA_HK_SERIES_NAME_LENGTH-1);
+    query.startTimeMs=parseTimeMs(argc>3 ? argv[3] : "-600",nowMs);
+    query.endTimeMs=argc>4 ? parseTimeMs(argv[4],nowMs) : nowMs;
+    if(argc>5) query.tier=atoi(argv[5]);
+  }
+  else {
+    usage(progName);
+    exit(1);
+  }
+
+  fd=araHkStoreConnect();
+  if(fd<0) {
+    fprintf(stderr,"%s: can't connect to ARAHkStored on %s\n",progName,ARA_HK_STORE_SOCKET);
+    exit(1);
+  }
+  bufferBytes=ARA_HK_MAX_QUERY_POINTS*sizeof(AraHkPoint_t);
+  buffer=malloc(bufferBytes);
+  if(!buffer) {
+    close(fd);
+    exit(1);
+  }
+  numRead=araHkStoreQuery(fd,&query,&reply,buffer,bufferBytes);
+  close(fd);
+  if(numRead<0 || reply.status<0) {
+    fprintf(stderr,"%s: query failed (%d)\n",progName,numRead<0 ? numRead : reply.status);
+    free(buffer);
+    exit(1);
+  }
+
+  switch(query.command) {
+  case ARA_HK_QUERY_LIST:
+    for(i=0;i<numRead;i++)
+      printf("%s\n",((char*)buffer)+i*ARA_HK_SERIES_NAME_LENGTH);
+    break;
+  case ARA_HK_QUERY_RANGE:
+    points=(AraHkPoint_t*)buffer;
+    printf("# %s tier %d, %u points\n",query.series,reply.tier,reply.numPoints);
+    for(i=0;i<numRead;i++) {
+      if(reply.tier==ARA_HK_TIER_RAW)
+	printf("%.3f %g\n",points[i].timeMs/1000.,points[i].value);
+      else
+	printf("%.3f %g %g %g\n",points[i].timeMs/1000.,points[i].value,points[i].min,points[i].max);
+    }
+    break;
+  case ARA_HK_QUERY_AGGREGATE:
+    printf("%s tier %d: count %u mean %g min %g max %g\n",query.series,reply.tier,
+	   reply.count,reply.mean,reply.min,reply.max);
+    break;
+  }
+  free(buffer);
+  return 0;
+}
+
+
+void usage(char *argv0)
+{
+  printf("Usage:\n\t%s list\n",argv0);
+  printf("\t%s range <series> [start] [end] [tier]\n",argv0);
+  printf("\t%s agg <series> [start] [end] [tier]\n",argv0);
+  printf("\tstart and end are unix seconds or seconds before now if negative (default -600 to now)\n");
+  printf("\ttier 0 raw, 1 minute, 2 hour, default is the finest tier covering start\n");
+}
@@ -0,0 +1,112 @@
+/*! \file araMonitorStatus.c
+  Prints the live ARAAcqd state from the shared memory segment, without
+  any traffic to the ATRI. With -w it keeps printing once a second.
+*/
+
+
+#include "araSoft.h"
+#include "araMonitorLib/araMonitor.h"
+#include <unistd.h>
+#include <libgen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *priorityNames[ATRI_CONTROL_NUM_PRIORITIES]={"critical","normal","bulk"};
+static const char *softTrigNames[ARA_MONITOR_NUM_SOFT_TRIG_SOURCES]={"forced","random"};
+
+void printStatus(AraMonitorSegment_t *segment)
+{
+  AraMonitorStatus_t status;
+  AraEventHk_t eventHk;
+  AraSensorHk_t sensorHk;
+  time_t timeNow=time(NULL);
+  int numUpdates,i;
+
+  numUpdates=araMonitorGetStatus(segment,&status);
+  if(numUpdates<0) {
+    fprintf(stderr,"Could not get a consistent copy of the status\n");
+  }
+  else if(numUpdates>0) {
+    printf("Run %d, state %d, next event %u, last status update %d s ago\n",
+	   status.runNumber,status.programState,status.nextEventNumber,
+	   (int)(timeNow-segment->statusLock.updateUnixTime));
+    printf("Event rate %.2f Hz (%u good, %u bad)\n",status.eventRateHz,status.numGoodEvents,status.numBadEvents);
+    printf("Last software trigger %d s ago, last event read %d s ago\n",
+	   (int)(timeNow-status.lastSoftwareTrigger),(int)(timeNow-status.lastEventRead));
+    printf("Vdly");
+    for(i=0;i<DDA_PER_ATRI;i++) printf(" %u",status.vdlyDac[i]);
+    printf("\nVadj");
+    for(i=0;i<DDA_PER_ATRI;i++) printf(" %u",status.vadjDac[i]);
+    printf("\nThresholds");
+    for(i=0;i<NUM_L1_SCALERS;i++) printf(" %u",status.thresholdDac[i]);
+    printf("\nSurface thresholds");
+    for(i=0;i<ANTS_PER_TDA;i++) printf(" %u",status.surfaceThresholdDac[i]);
+    printf("\n");
+    for(i=0;i<ATRI_CONTROL_NUM_PRIORITIES;i++) {
+      printf("Control queue %-8s %u packets, depth %u (max %u), latency %.1f us (max %.1f us)\n",
+	     priorityNames[i],status.controlQueue[i].numPackets,status.controlQueue[i].depth,
+	     status.controlQueue[i].maxDepth,status.controlQueue[i].meanLatencyUs,status.controlQueue[i].maxLatencyUs);
+    }
+    for(i=0;i<ARA_MONITOR_NUM_SOFT_TRIG_SOURCES;i++) {
+      printf("Soft triggers %-6s %u sent, %u failed, %u late, %u skipped, jitter %.1f us (max %.1f us)\n",
+	     softTrigNames[i],status.softTrig[i].numSent,status.softTrig[i].numFailed,
+	     status.softTrig[i].numLate,status.softTrig[i].numSkipped,
+	     status.softTrig[i].meanJitterUs,status.softTrig[i].maxJitterUs);
+    }
+    for(i=0;i<status.numHkTasks && i<ARA_MONITOR_MAX_HK_TASKS;i++) {
+      printf("Hk task %-12s %u runs, %u overruns, max run time %.1f ms, max latency %.1f ms\n",
+	     status.hkTasks[i].name,status.hkTasks[i].numRuns,status.hkTasks[i].numOverruns,
+	     status.hkTasks[i].maxRunTimeUs/1000.,status.hkTasks[i].maxLatencyUs/1000.);
+    }
+  }
+
+  numUpdates=araMonitorGetEventHk(segment,&eventHk);
+  if(numUpdates>0) {
+    printf("Event hk: PPS %u, clock counter %u, flags %#x\n",eventHk.ppsCounter,eventHk.clockCounter,eventHk.gHdr.alsoReserved);
+    printf("Wilkinson counters");
+    for(i=0;i<DDA_PER_ATRI;i++) printf(" %u",eventHk.wilkinsonCounter[i]);
+    printf("\nL1 scalers");
+    for(i=0;i<NUM_L1_SCALERS;i++) printf(" %u",eventHk.l1Scaler[i]);
+    printf("\nDeadtime dig %u buff %u total %u\n",eventHk.digDeadTime,eventHk.buffDeadTime,eventHk.totalDeadTime);
+  }
+
+  numUpdates=araMonitorGetSensorHk(segment,&sensorHk);
+  if(numUpdates>0) {
+    printf("Sensor hk: ATRI voltage %#x current %#x, %d s old\n",sensorHk.atriVoltage,sensorHk.atriCurrent,
+	   (int)(timeNow-sensorHk.unixTime));
+  }
+}
+
+int main(int argc, char **argv)
+{
+  AraMonitorSegment_t *segment;
+  int watch=0;
+
+  if(argc>1) {
+    if(strcmp(argv[1],"-w")==0) watch=1;
+    else {
+      fprintf(stderr,"Usage:\n\t%s [-w]\n",basename(argv[0]));
+      exit(1);
+    }
+  }
+
+  segment=araMonitorAttach(ARA_MONITOR_SHM_NAME);
+  if(!segment) {
+    fprintf(stderr,"%s : could not attach to %s, is ARAAcqd running?\n",argv[0],ARA_MONITOR_SHM_NAME);
+    exit(1);
+  }
+
+  do {
+    printStatus(segment);
+    if(watch) {
+      printf("\n");
+      sleep(1);
+    }
+  } while(watch);
+
+  araMonitorDetach(segment);
+  return 0;
+}
@@ -0,0 +1,81 @@
+/*! \file fx2I2CBatchTiming.c
+  Times the ATRI current/voltage read used by ARAAcqd's sensor housekeeping,
+  first as four separate FX2 I2C requests and then as a single batch.
+*/
+
+
+#include "araSoft.h"
+#include "fx2ComLib/fx2Com.h"
+#include <unistd.h>
+#include <libgen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static double timeDiffUs(struct timeval *start, struct timeval *end)
+{
+  return (end->tv_sec-start->tv_sec)*1e6 + (end->tv_usec-start->tv_usec);
+}
+
+int main(int argc, char **argv)
+{
+  struct timeval startTime,endTime;
+  Fx2I2CBatch_t batch;
+  uint8_t data[2];
+  uint8_t current=0,voltage=0;
+  int numLoops=100;
+  int loop,currentOp,voltageOp;
+  double sequentialUs,batchUs;
+
+  if(argc>1) numLoops=atoi(argv[1]);
+  if(numLoops<=0) {
+    fprintf(stderr,"Usage:\n\t%s [number of loops]\n",basename(argv[0]));
+    exit(1);
+  }
+
+  int fFx2SockFd=openConnectionToFx2ControlSocket();
+  if(!fFx2SockFd) {
+    fprintf(stderr,"%s : could not open fx2_control socket!\n",argv[0]);
+    exit(1);
+  }
+
+  gettimeofday(&startTime,NULL);
+  for(loop=0;loop<numLoops;loop++) {
+    data[0]=0x4;
+    writeToI2C(fFx2SockFd,0x96,1,data);
+    readFromI2C(fFx2SockFd,0x97,1,data);
+    current=data[0];
+    data[0]=0x5;
+    writeToI2C(fFx2SockFd,0x96,1,data);
+    readFromI2C(fFx2SockFd,0x97,1,data);
+    voltage=data[0];
+  }
+  gettimeofday(&endTime,NULL);
+  sequentialUs=timeDiffUs(&startTime,&endTime)/numLoops;
+  printf("Sequential: current %#x voltage %#x, %.1f us per read\n",current,voltage,sequentialUs);
+
+  gettimeofday(&startTime,NULL);
+  for(loop=0;loop<numLoops;loop++) {
+    fx2I2CBatchInit(&batch);
+    data[0]=0x4;
+    currentOp=fx2I2CBatchAddWriteRead(&batch,0x96,1,data,1);
+    data[0]=0x5;
+    voltageOp=fx2I2CBatchAddWriteRead(&batch,0x96,1,data,1);
+    if(fx2I2CBatchExecute(fFx2SockFd,&batch)<0) {
+      fprintf(stderr,"Batch failed on loop %d\n",loop);
+      break;
+    }
+    current=batch.ops[currentOp].data[0];
+    voltage=batch.ops[voltageOp].data[0];
+  }
+  gettimeofday(&endTime,NULL);
+  batchUs=timeDiffUs(&startTime,&endTime)/numLoops;
+  printf("Batched:    current %#x voltage %#x, %.1f us per read\n",current,voltage,batchUs);
+  if(batchUs>0)
+    printf("Speed up %.2f\n",sequentialUs/batchUs);
+
+  closeConnectionToFx2ControlSocket(fFx2SockFd);
+  return 0;
+}
@@ -122,6 +122,11 @@ safeecho "(`date`) : -----------------------------------------------------------
 
 export SLEEPTIME=60
 
+#      A - item tags pushed in a pass of their own before the rest, so the priority events and the
+#          event summaries still get north first when the link can't keep up with everything
+
+export PRIORITY_TAGS="priorityEv evSummary"
+
 #  3 - specify the local directory in which the event and hk data are stored by the ARAAacqd DAQ
 #
 #      NOTE: the final slash on the directory name is important as it affects the copy behavior of rsync.  If the
@@ -243,20 +248,32 @@ while [ 1 ]; do
   export RSYNC_INCLUDE_LIST=${DATAPUSH_LOGFILE_DIRECTORY}/rsync_include_list.${NOW_TIMESTAMP}.txt
   if [ ! -e ${RSYNC_INCLUDE_LIST} ]; then # -e files exists / ! -e file does not exist
      touch ${RSYNC_INCLUDE_LIST}.absolute_pathnames
+     touch ${RSYNC_INCLUDE_LIST}.priority.absolute_pathnames
   fi
   safeecho "(`date`) : [RSYNC_STARTUP] NOW_TIMESTAMP            = ${NOW_TIMESTAMP}"
   safeecho "(`date`) : [RSYNC_STARTUP] RSYNC_INCLUDE_LIST       = ${RSYNC_INCLUDE_LIST}"
 
   for THIS_ITEM in EXCLUDE_LAST_FILE::ev::ev_::event                \
+                   EXCLUDE_LAST_FILE::pedEv::pedEv_::pedEvent       \
+                   EXCLUDE_LAST_FILE::calEv::calEv_::calEvent       \
+                   EXCLUDE_LAST_FILE::softEv::softEv_::softEvent    \
+                   EXCLUDE_LAST_FILE::priorityEv::priorityEv_::priorityEvent \
                    EXCLUDE_LAST_FILE::eventHk::eventHk_::eventHk    \
                    EXCLUDE_LAST_FILE::sensorHk::sensorHk_::sensorHk \
+                   EXCLUDE_LAST_FILE::softTrigHk::softTrigHk_::softTrigHk \
+                   EXCLUDE_LAST_FILE::evSummary::evSummary_::eventSummary \
+                   EXCLUDE_LAST_FILE::dqHk::dqHk_::dqHk             \
                    EXCLUDE_LAST_FILE::monitor::monitor::monitorHk      \
                    EXCLUDE_LAST_FILE::runStop::runStop::logs      \
                    EXCLUDE_LAST_FILE::configFile::configFile::logs      \
                    EXCLUDE_LAST_FILE::runStart::runStart::logs      \
                    EXCLUDE_LAST_FILE::atriLog::atriEvent.log::.     \
+                   EXCLUDE_LAST_FILE::atriTrace::atriTrace.run::logs \
 		   EXCLUDE_LAST_FILE::pedestalValues::pedestalValues::. \
 		   EXCLUDE_LAST_FILE::pedestalWidths::pedestalWidths::. \
+		   EXCLUDE_LAST_FILE::pedestals::pedestals.run::. \
+		   EXCLUDE_LAST_FILE::pedestalTrack::pedestalTrack.run::peds \
+		   EXCLUDE_LAST_FILE::pedestalDrift::pedestalDrift.run::peds \
   ; do
 
 
@@ -267,14 +284,19 @@ while [ 1 ]; do
 
       safeecho "(`date`) : **************************************** DataPush Making Include List For ${TAG_xx} Data Files ****************************************"
 
+      case " ${PRIORITY_TAGS} " in
+         *" ${TAG_xx} "*) export THIS_LIST=${RSYNC_INCLUDE_LIST}.priority ;;
+         *)               export THIS_LIST=${RSYNC_INCLUDE_LIST} ;;
+      esac
+
 #      printf "(`date`) : [RSYNC_STARTUP] [%8.8s] DIRECTORY_TAG_xx         = ${DIRECTORY_TAG_xx}\n" "${TAG_xx}"
 #      printf "(`date`) : [RSYNC_STARTUP] [%8.8s] TAG_xx                   = ${TAG_xx}\n"           "${TAG_xx}"
       if [ ${MODE} == "EXCLUDE_LAST_FILE" ]; then
         # printf "(`date`) : [RSYNC_STARTUP] [%8.8s]  -> EXECUTING : find ${LOCAL_ARADAQ_DIRECTORY} -name \"${FINDTAG_xx}*\" -not -type d -print | grep -v current | grep -v link | sort | head -n -1 >>${RSYNC_INCLUDE_LIST}\n" "${TAG_xx}"
-         find ${LOCAL_ARADAQ_DIRECTORY} -name "${FINDTAG_xx}*" -not -type d -print | grep -v current | grep -v link | sort | head -n -1 >>${RSYNC_INCLUDE_LIST}.absolute_pathnames
+         find ${LOCAL_ARADAQ_DIRECTORY} -name "${FINDTAG_xx}*" -not -type d -print | grep -v current | grep -v link | sort | head -n -1 >>${THIS_LIST}.absolute_pathnames
       else
          #printf "(`date`) : [RSYNC_STARTUP] [%8.8s]  -> EXECUTING : find ${LOCAL_ARADAQ_DIRECTORY} -name \"${FINDTAG_xx}*\" -not -type d -print | grep -v current | grep -v link | sort >>${RSYNC_INCLUDE_LIST}\n" "${TAG_xx}"
-         find ${LOCAL_ARADAQ_DIRECTORY} -name "${FINDTAG_xx}*" -not -type d -print | grep -v current | grep -v link | sort              >>${RSYNC_INCLUDE_LIST}.absolute_pathnames
+         find ${LOCAL_ARADAQ_DIRECTORY} -name "${FINDTAG_xx}*" -not -type d -print | grep -v current | grep -v link | sort              >>${THIS_LIST}.absolute_pathnames
       fi
 
 #      if [ ! -s ${RSYNC_INCLUDE_LIST}.absolute_pathnames ]; then
@@ -286,6 +308,7 @@ while [ 1 ]; do
   done
 
   sed -e "s|^${LOCAL_ARADAQ_DIRECTORY}||" ${RSYNC_INCLUDE_LIST}.absolute_pathnames >${RSYNC_INCLUDE_LIST}.relative_pathnames
+  sed -e "s|^${LOCAL_ARADAQ_DIRECTORY}||" ${RSYNC_INCLUDE_LIST}.priority.absolute_pathnames >${RSYNC_INCLUDE_LIST}.priority.relative_pathnames
 
 #  if [ ! -s ${RSYNC_INCLUDE_LIST}.relative_pathnames ]; then
  #    printf "(`date`) : [RSYNC_STARTUP] [%8.8s] FILE_COUNT (rel)         = empty file\n" "FINAL"
@@ -317,39 +340,46 @@ while [ 1 ]; do
      exit -1
   fi
 
-  if [ -s "${RSYNC_INCLUDE_LIST}.relative_pathnames" ]; then
+  # One rsync per list, the priority list first, as rsync sorts the files of a list by name
+  for THIS_LIST in ${RSYNC_INCLUDE_LIST}.priority ${RSYNC_INCLUDE_LIST} ; do
 
-     if [ "${DEBUG_MODE}" == "NO" ]; then
-        safeecho "(`date`) : [RSYNC_XFER] -> (delete mode) EXECUTING : ionice -c2 -n0 nice -n10 rsync -e 'ssh -c arcfour' --remove-source-files --files-from=${RSYNC_INCLUDE_LIST}.relative_pathnames -av ${LOCAL_ARADAQ_DIRECTORY} ${SERVER_ARCHIVE_DIRECTORY} >>${RSYNC_XFER_LOGFILE} 2>&1"
-        ionice -c2 -n0 nice -n10 rsync -e 'ssh -c arcfour' --remove-source-files --files-from=${RSYNC_INCLUDE_LIST}.relative_pathnames -av ${LOCAL_ARADAQ_DIRECTORY}/ ${SERVER_ARCHIVE_DIRECTORY} >>${RSYNC_XFER_LOGFILE} 2>&1 
-        export RSYNC_EXIT_CODE=$?
-     else
-        safeecho "(`date`) : [RSYNC_XFER] -> (debug mode) EXECUTING : ionice -c2 -n0 nice -n10 rsync -e 'ssh -c arcfour' --files-from=${RSYNC_INCLUDE_LIST}.relative_pathnames -av ${LOCAL_ARADAQ_DIRECTORY} ${SERVER_ARCHIVE_DIRECTORY} >>${RSYNC_XFER_LOGFILE} 2>&1"
-        ionice -c2 -n0 nice -n10 rsync -e 'ssh -c arcfour'                       --files-from=${RSYNC_INCLUDE_LIST}.relative_pathnames -av ${LOCAL_ARADAQ_DIRECTORY}/ ${SERVER_ARCHIVE_DIRECTORY} >>${RSYNC_XFER_LOGFILE} 2>&1 
-        export RSYNC_EXIT_CODE=$?
-     fi
+     if [ -s "${THIS_LIST}.relative_pathnames" ]; then
+
+        if [ "${DEBUG_MODE}" == "NO" ]; then
+           safeecho "(`date`) : [RSYNC_XFER] -> (delete mode) EXECUTING : ionice -c2 -n0 nice -n10 rsync -e 'ssh -c arcfour' --remove-source-files --files-from=${THIS_LIST}.relative_pathnames -av ${LOCAL_ARADAQ_DIRECTORY} ${SERVER_ARCHIVE_DIRECTORY} >>${RSYNC_XFER_LOGFILE} 2>&1"
+           ionice -c2 -n0 nice -n10 rsync -e 'ssh -c arcfour' --remove-source-files --files-from=${THIS_LIST}.relative_pathnames -av ${LOCAL_ARADAQ_DIRECTORY}/ ${SERVER_ARCHIVE_DIRECTORY} >>${RSYNC_XFER_LOGFILE} 2>&1 
+           export RSYNC_EXIT_CODE=$?
+        else
+           safeecho "(`date`) : [RSYNC_XFER] -> (debug mode) EXECUTING : ionice -c2 -n0 nice -n10 rsync -e 'ssh -c arcfour' --files-from=${THIS_LIST}.relative_pathnames -av ${LOCAL_ARADAQ_DIRECTORY} ${SERVER_ARCHIVE_DIRECTORY} >>${RSYNC_XFER_LOGFILE} 2>&1"
+           ionice -c2 -n0 nice -n10 rsync -e 'ssh -c arcfour'                       --files-from=${THIS_LIST}.relative_pathnames -av ${LOCAL_ARADAQ_DIRECTORY}/ ${SERVER_ARCHIVE_DIRECTORY} >>${RSYNC_XFER_LOGFILE} 2>&1 
+           export RSYNC_EXIT_CODE=$?
+        fi
 
-  else # end of IF-block for the file list has items in it, so do the rsync
+     else # end of IF-block for the file list has items in it, so do the rsync
 
-     if [ "${DEBUG_MODE}" == "NO" ]; then
-        safeecho "(`date`) : [RSYNC_XFER] -> (delete mode) EXECUTING : rsync not executed - file list is empty"
-        export RSYNC_EXIT_CODE=0
+        if [ "${DEBUG_MODE}" == "NO" ]; then
+           safeecho "(`date`) : [RSYNC_XFER] -> (delete mode) EXECUTING : rsync not executed - file list is empty"
+           export RSYNC_EXIT_CODE=0
+        else
+           safeecho "(`date`) : [RSYNC_XFER] -> (debug mode) EXECUTING : rsync not executed - file list is empty"
+           export RSYNC_EXIT_CODE=0
+        fi
+
+     fi  # end of IF-block for the file list was empty, so don't bother with the rsync
+
+     if [ ${RSYNC_EXIT_CODE} -eq 0 ]; then
+        safeecho "(`date`) : [RSYNC_XFER] RSYNC_EXIT_CODE = ${RSYNC_EXIT_CODE} <- DataPush okay"
      else
-        safeecho "(`date`) : [RSYNC_XFER] -> (debug mode) EXECUTING : rsync not executed - file list is empty"
-        export RSYNC_EXIT_CODE=0
+        echo "(`date`) : [RSYNC_XFER] RSYNC_EXIT_CODE = ${RSYNC_EXIT_CODE} <- PROBLEM: DataPush experienced an error"
      fi
 
-  fi  # end of IF-block for the file list was empty, so don't bother with the rsync
-
-  if [ ${RSYNC_EXIT_CODE} -eq 0 ]; then
-     safeecho "(`date`) : [RSYNC_XFER] RSYNC_EXIT_CODE = ${RSYNC_EXIT_CODE} <- DataPush okay"
-  else
-     echo "(`date`) : [RSYNC_XFER] RSYNC_EXIT_CODE = ${RSYNC_EXIT_CODE} <- PROBLEM: DataPush experienced an error"
-  fi
+  done
 
   if [ ${VERBOSE} -eq 0 ]; then
       rm ${RSYNC_INCLUDE_LIST}.absolute_pathnames
       rm ${RSYNC_INCLUDE_LIST}.relative_pathnames
+      rm ${RSYNC_INCLUDE_LIST}.priority.absolute_pathnames
+      rm ${RSYNC_INCLUDE_LIST}.priority.relative_pathnames
   fi
   
 
@@ -2,5 +2,6 @@
 
 nohup ${ARA_DAQ_DIR}/bin/ARAd > /home/ara/LogFiles/arad.log 2>&1 &
 nohup ${ARA_DAQ_DIR}/bin/ARAAcqd > /home/ara/LogFiles/acqd.log 2>&1 &
+nohup ${ARA_DAQ_DIR}/bin/ARAHkStored > /home/ara/LogFiles/hkstored.log 2>&1 &
 #nohup ./scripts/simpleDataPush.bash >datacopy.log 2>&1 &
 
@@ -1,5 +1,6 @@
 ARAdPID=`ps x | grep ARAd | grep -v grep | grep -v emacs | awk '{print $1}'`
 ARAAcqdPID=`(ps x | grep ARAAcqd | grep -v grep | grep -v emacs | awk '{print $1}')`
+ARAHkStoredPID=`(ps x | grep ARAHkStored | grep -v grep | grep -v emacs | awk '{print $1}')`
 
 if [ "$ARAdPID" = "" ] 
     then
@@ -17,4 +18,10 @@ else
     echo killed ARAAcqd
 fi
 
-
+if [ "$ARAHkStoredPID" = "" ] 
+    then
+    echo ARAHkStored not running
+else
+    killall ARAHkStored
+    echo killed ARAHkStored
+fi